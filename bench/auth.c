@@ -0,0 +1,50 @@
+/**
+ * @file bench/auth.c  Nonce validation benchmark
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+/* the module is built into the benchmark to reach its static helpers */
+#include "../modules/auth/auth.c"
+#include "bench.h"
+
+
+struct bench_auth {
+	char nonce[NONCE_MAX_SIZE + 1];
+	struct sa src;
+	time_t now;
+};
+
+
+static void op_nonce_validate(uint64_t i, void *arg)
+{
+	struct bench_auth *ba = arg;
+	(void)i;
+
+	bench_sink(nonce_validate(ba->nonce, ba->now, &ba->src) ? ba : NULL);
+}
+
+
+/**
+ * Run the auth benchmarks, which do not depend on a table size
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int bench_auth(void)
+{
+	struct bench_auth ba;
+
+	auth.secret       = rand_u64();
+	auth.nonce_expiry = NONCE_EXPIRY;
+
+	ba.now = time(NULL);
+	sa_set_str(&ba.src, "192.0.2.1", 3478);
+	(void)mknonce(ba.nonce, ba.now, &ba.src);
+
+	if (!nonce_validate(ba.nonce, ba.now, &ba.src))
+		return EPROTO;
+
+	bench_run("auth_nonce_validate", 0, 0, op_nonce_validate, &ba);
+
+	return 0;
+}
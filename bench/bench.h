@@ -0,0 +1,20 @@
+/**
+ * @file bench.h  Microbenchmark interface
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+
+/* runs one operation; i selects the entry, see bench_rand() */
+typedef void (bench_op_h)(uint64_t i, void *arg);
+
+int      bench_conf(const char *fmt, ...);
+void     bench_run(const char *name, uint32_t size, size_t bytes,
+		   bench_op_h *oph, void *arg);
+size_t   bench_heap(void);
+uint32_t bench_rand(uint64_t i, uint32_t n);
+void     bench_sink(const void *p);
+
+int bench_turn(uint32_t size);
+int bench_auth(void);
+int bench_db(uint32_t size);
@@ -0,0 +1,145 @@
+/**
+ * @file bench/db.c  Credential lookup benchmark
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+#include "bench.h"
+
+
+/*
+ * A fake database backend serves the accounts user0..userN-1, which
+ * the database thread loads into the credential table as usual.
+ */
+
+
+enum {
+	NAME_SIZE = 16,
+	SYNC_WAIT = 60000,   /* [ms] */
+};
+
+
+struct bench_db {
+	char (*namev)[NAME_SIZE];
+	uint32_t n;
+};
+
+
+static uint32_t accountc;
+
+
+static int account_cnt(const char *realm, uint32_t *n)
+{
+	(void)realm;
+
+	*n = accountc;
+
+	return 0;
+}
+
+
+static int account_all(const char *realm, restund_db_account_h *acch,
+		       void *arg)
+{
+	char name[NAME_SIZE], ha1[MD5_STR_SIZE];
+	uint8_t md5[MD5_SIZE];
+	uint32_t i;
+	int err;
+
+	for (i=0; i<accountc; i++) {
+
+		(void)re_snprintf(name, sizeof(name), "user%u", i);
+		err = md5_printf(md5, "%s:%s:secret", name, realm);
+		if (err)
+			return err;
+
+		(void)re_snprintf(ha1, sizeof(ha1), "%w", md5, sizeof(md5));
+
+		err = acch(name, ha1, arg);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+
+static struct restund_db bench_database = {
+	.cnth = account_cnt,
+	.allh = account_all,
+};
+
+
+static void op_get_ha1(uint64_t i, void *arg)
+{
+	struct bench_db *bd = arg;
+	uint8_t ha1[MD5_SIZE];
+
+	if (!restund_get_ha1(bd->namev[bench_rand(i, bd->n)], ha1))
+		bench_sink(bd);
+}
+
+
+/**
+ * Run the credential benchmarks with the given number of accounts
+ *
+ * @param size Number of accounts
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int bench_db(uint32_t size)
+{
+	struct bench_db bd;
+	uint8_t ha1[MD5_SIZE];
+	size_t heap, bytes;
+	uint32_t i, ms;
+	int err;
+
+	bd.n = size;
+	bd.namev = mem_alloc(size * sizeof(*bd.namev), NULL);
+	if (!bd.namev)
+		return ENOMEM;
+
+	for (i=0; i<size; i++)
+		(void)re_snprintf(bd.namev[i], NAME_SIZE, "user%u", i);
+
+	err = bench_conf("realm bench\n");
+	if (err)
+		goto out;
+
+	accountc = size;
+	restund_db_set_handler(&bench_database);
+
+	heap = bench_heap();
+
+	err = restund_db_init();
+	if (err)
+		goto out;
+
+	/* the first sync runs on the database thread */
+	for (ms=0; restund_get_ha1(bd.namev[size - 1], ha1); ms++) {
+
+		if (ms >= SYNC_WAIT) {
+			err = ETIMEDOUT;
+			goto out;
+		}
+
+		(void)usleep(1000);
+	}
+
+	bytes = (bench_heap() - heap) / size;
+
+	bench_run("db_get_ha1", size, bytes, op_get_ha1, &bd);
+
+ out:
+	restund_db_close();
+	restund_db_set_handler(NULL);
+	mem_deref(bd.namev);
+
+	return err;
+}
@@ -0,0 +1,346 @@
+/**
+ * @file bench/main.c  Microbenchmarks for the turn and auth hot paths
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+#include "bench.h"
+
+
+/*
+ * The benchmarks link the core and module sources directly. Every
+ * operation is repeated, doubling the count, until one run takes at
+ * least the minimum time; the last run is reported.
+ *
+ * Cache misses are counted in user space with a hardware performance
+ * counter where the kernel permits it. Memory per entry is the growth
+ * of the heap while the table was filled, divided by its size.
+ */
+
+
+enum {
+	MIN_TIME  = 200,       /* [ms] */
+	ITER_MIN  = 1024,
+	ITER_MAX  = 1 << 28,
+	SIZEC_MAX = 8,
+};
+
+
+static struct {
+	struct conf *conf;
+	uint64_t min_ns;
+	int perf_fd;
+	const char *filter;
+} bench = {
+	.perf_fd = -1,
+};
+
+static const void * volatile sink;
+
+
+struct conf *restund_conf(void)
+{
+	return bench.conf;
+}
+
+
+int bench_conf(const char *fmt, ...)
+{
+	struct conf *conf;
+	char *buf = NULL;
+	va_list ap;
+	int err;
+
+	va_start(ap, fmt);
+	err = re_vsdprintf(&buf, fmt, ap);
+	va_end(ap);
+
+	if (err)
+		return err;
+
+	err = conf_alloc_buf(&conf, (uint8_t *)buf, strlen(buf));
+	mem_deref(buf);
+	if (err)
+		return err;
+
+	mem_deref(bench.conf);
+	bench.conf = conf;
+
+	return 0;
+}
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+#ifdef __linux__
+static int perf_open(void)
+{
+	struct perf_event_attr pe;
+
+	memset(&pe, 0, sizeof(pe));
+
+	pe.type           = PERF_TYPE_HARDWARE;
+	pe.size           = sizeof(pe);
+	pe.config         = PERF_COUNT_HW_CACHE_MISSES;
+	pe.disabled       = 1;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv     = 1;
+
+	return (int)syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+
+static void perf_start(void)
+{
+	if (bench.perf_fd < 0)
+		return;
+
+	(void)ioctl(bench.perf_fd, PERF_EVENT_IOC_RESET, 0);
+	(void)ioctl(bench.perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+
+static int perf_stop(uint64_t *misses)
+{
+	if (bench.perf_fd < 0)
+		return ENOSYS;
+
+	(void)ioctl(bench.perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+	if (read(bench.perf_fd, misses, sizeof(*misses)) != sizeof(*misses))
+		return EIO;
+
+	return 0;
+}
+#else
+static int perf_open(void)
+{
+	return -1;
+}
+
+
+static void perf_start(void)
+{
+}
+
+
+static int perf_stop(uint64_t *misses)
+{
+	(void)misses;
+
+	return ENOSYS;
+}
+#endif
+
+
+/**
+ * Measure and print the cost of an operation
+ *
+ * @param name  Benchmark name
+ * @param size  Number of entries in the table, or 0
+ * @param bytes Memory per entry, or 0
+ * @param oph   Operation handler
+ * @param arg   Handler argument
+ */
+void bench_run(const char *name, uint32_t size, size_t bytes,
+	       bench_op_h *oph, void *arg)
+{
+	uint64_t iter, i, t, misses = 0;
+	char sz[16] = "-", by[16] = "-", mi[16] = "-";
+	int err;
+
+	if (bench.filter && strncmp(name, bench.filter,
+				    strlen(bench.filter)))
+		return;
+
+	for (iter = ITER_MIN;; iter *= 2) {
+
+		t = now_ns();
+		perf_start();
+
+		for (i=0; i<iter; i++)
+			oph(i, arg);
+
+		err = perf_stop(&misses);
+		t = now_ns() - t;
+
+		if (t >= bench.min_ns || iter >= ITER_MAX)
+			break;
+	}
+
+	if (size)
+		(void)re_snprintf(sz, sizeof(sz), "%u", size);
+	if (bytes)
+		(void)re_snprintf(by, sizeof(by), "%zu", bytes);
+	if (!err)
+		(void)snprintf(mi, sizeof(mi), "%.2f",
+			       (double)misses / (double)iter);
+
+	(void)printf("%-24s %8s %10.1f %10s %10s\n", name, sz,
+		     (double)t / (double)iter, mi, by);
+	(void)fflush(stdout);
+}
+
+
+/* bytes in use on the heap */
+size_t bench_heap(void)
+{
+#ifdef __GLIBC__
+	return mallinfo2().uordblks;
+#else
+	return 0;
+#endif
+}
+
+
+/* pseudo-random index in [0, n), without touching memory */
+uint32_t bench_rand(uint64_t i, uint32_t n)
+{
+	uint64_t z = i + 0x9e3779b97f4a7c15ULL;
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	z =  z ^ (z >> 31);
+
+	return n ? (uint32_t)(z % n) : 0;
+}
+
+
+/* keeps the result of an operation alive */
+void bench_sink(const void *p)
+{
+	sink = p;
+}
+
+
+static void usage(void)
+{
+	(void)fprintf(stderr,
+		      "usage: restund-bench [-h] [-n size].. [-t ms]"
+		      " [prefix]\n"
+		      "\t-n <size>  Table size, repeatable"
+		      " (1000, 100000, 1000000)\n"
+		      "\t-t <ms>    Minimum time per benchmark (%u)\n",
+		      MIN_TIME);
+}
+
+
+int main(int argc, char *argv[])
+{
+	uint32_t sizev[SIZEC_MAX] = {1000, 100000, 1000000};
+	uint32_t sizec = 0, min_ms = MIN_TIME, i;
+	int err;
+
+	for (;;) {
+
+		const int c = getopt(argc, argv, "hn:t:");
+		if (0 > c)
+			break;
+
+		switch (c) {
+
+		case 'n':
+			if (sizec >= SIZEC_MAX) {
+				usage();
+				return -2;
+			}
+			sizev[sizec++] = (uint32_t)atoi(optarg);
+			break;
+
+		case 't':
+			min_ms = (uint32_t)atoi(optarg);
+			break;
+
+		case '?':
+		case 'h':
+		default:
+			usage();
+			return -2;
+		}
+	}
+
+	if (!sizec)
+		sizec = 3;
+
+	if (optind < argc)
+		bench.filter = argv[optind];
+
+	bench.min_ns = (uint64_t)min_ms * 1000000;
+
+#ifdef __GLIBC__
+	/* heap statistics of all threads in one arena */
+	(void)mallopt(M_ARENA_MAX, 1);
+#endif
+
+	err = libre_init();
+	if (err)
+		return err;
+
+	err = bench_conf("realm bench\n");
+	if (err)
+		goto out;
+
+	err  = restund_ctr_init();
+	err |= restund_prof_init();
+	err |= restund_hist_init();
+	err |= restund_stun_init();
+	if (err)
+		goto out;
+
+	bench.perf_fd = perf_open();
+
+	(void)printf("%-24s %8s %10s %10s %10s\n", "benchmark", "size",
+		     "ns/op", "misses/op", "bytes/ent");
+
+	for (i=0; i<sizec && !err; i++)
+		err = bench_turn(sizev[i]);
+
+	if (!err)
+		err = bench_auth();
+
+	for (i=0; i<sizec && !err; i++)
+		err = bench_db(sizev[i]);
+
+	if (err)
+		(void)re_fprintf(stderr, "restund-bench: %m\n", err);
+
+ out:
+	if (bench.perf_fd >= 0)
+		(void)close(bench.perf_fd);
+
+	restund_stun_close();
+	restund_hist_close();
+	restund_prof_close();
+	restund_ctr_close();
+	bench.conf = mem_deref(bench.conf);
+
+	libre_close();
+
+	return err;
+}
@@ -0,0 +1,362 @@
+/**
+ * @file pcap.c  Capture file reader
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <re.h>
+#include "pcap.h"
+
+
+/*
+ * Reads the classic pcap format (microsecond or nanosecond timestamps,
+ * either byte order) as written by tcpdump and wireshark. The frames
+ * are decoded down to the UDP or TCP payload. IP fragments, IPv6
+ * extension headers and other protocols are skipped.
+ */
+
+
+enum {
+	PCAP_MAGIC_US  = 0xa1b2c3d4,
+	PCAP_MAGIC_NS  = 0xa1b23c4d,
+	PCAP_HDR_SIZE  = 24,
+	PCAP_REC_SIZE  = 16,
+	PCAP_SNAP_MAX  = 262144,
+};
+
+enum {
+	LINK_NULL      = 0,
+	LINK_EN10MB    = 1,
+	LINK_RAW       = 101,
+	LINK_LOOP      = 108,
+	LINK_LINUX_SLL = 113,
+	LINK_IPV4      = 228,
+	LINK_IPV6      = 229,
+	LINK_LINUX_SLL2 = 276,
+};
+
+enum {
+	ETHTYPE_IPV4 = 0x0800,
+	ETHTYPE_IPV6 = 0x86dd,
+	ETHTYPE_VLAN = 0x8100,
+	ETHTYPE_QINQ = 0x88a8,
+};
+
+struct pcap {
+	FILE *f;
+	uint8_t *buf;
+	uint32_t link;
+	bool swap;
+	bool nsec;
+};
+
+
+static void destructor(void *arg)
+{
+	struct pcap *pcap = arg;
+
+	if (pcap->f)
+		(void)fclose(pcap->f);
+	mem_deref(pcap->buf);
+}
+
+
+static uint32_t rd32(const struct pcap *pcap, const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	if (pcap->swap)
+		v = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000)
+			| (v << 24);
+
+	return v;
+}
+
+
+static uint16_t be16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+
+/**
+ * Open a capture file
+ *
+ * @param pcapp Pointer to allocated reader
+ * @param path  Path of the capture file
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int pcap_open(struct pcap **pcapp, const char *path)
+{
+	uint8_t hdr[PCAP_HDR_SIZE];
+	struct pcap *pcap;
+	uint32_t magic;
+	int err = 0;
+
+	if (!pcapp || !path)
+		return EINVAL;
+
+	pcap = mem_zalloc(sizeof(*pcap), destructor);
+	if (!pcap)
+		return ENOMEM;
+
+	pcap->f = fopen(path, "rb");
+	if (!pcap->f) {
+		err = errno;
+		goto out;
+	}
+
+	if (fread(hdr, sizeof(hdr), 1, pcap->f) != 1) {
+		err = EBADMSG;
+		goto out;
+	}
+
+	memcpy(&magic, hdr, sizeof(magic));
+
+	switch (magic) {
+
+	case PCAP_MAGIC_US:
+		break;
+
+	case PCAP_MAGIC_NS:
+		pcap->nsec = true;
+		break;
+
+	case 0xd4c3b2a1:
+		pcap->swap = true;
+		break;
+
+	case 0x4d3cb2a1:
+		pcap->swap = true;
+		pcap->nsec = true;
+		break;
+
+	default:
+		err = EPROTONOSUPPORT;
+		goto out;
+	}
+
+	pcap->link = rd32(pcap, &hdr[20]) & 0x0fffffff;
+
+	pcap->buf = mem_alloc(PCAP_SNAP_MAX, NULL);
+	if (!pcap->buf) {
+		err = ENOMEM;
+		goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(pcap);
+	else
+		*pcapp = pcap;
+
+	return err;
+}
+
+
+static int decode_transport(struct pcap_pkt *pkt, int proto,
+			    const uint8_t *p, size_t len)
+{
+	size_t hlen;
+
+	switch (proto) {
+
+	case IPPROTO_UDP:
+		if (len < 8)
+			return EBADMSG;
+
+		hlen = 8;
+		len  = MIN(len, (size_t)be16(&p[4]));
+		break;
+
+	case IPPROTO_TCP:
+		if (len < 20)
+			return EBADMSG;
+
+		hlen = (size_t)(p[12] >> 4) * 4;
+		break;
+
+	default:
+		return EPROTONOSUPPORT;
+	}
+
+	if (len < hlen)
+		return EBADMSG;
+
+	sa_set_port(&pkt->src, be16(&p[0]));
+	sa_set_port(&pkt->dst, be16(&p[2]));
+
+	pkt->proto = proto;
+	pkt->data  = p + hlen;
+	pkt->len   = len - hlen;
+
+	return 0;
+}
+
+
+static int decode_ipv4(struct pcap_pkt *pkt, const uint8_t *p, size_t len)
+{
+	uint32_t addr;
+	size_t hlen, tlen;
+
+	if (len < 20 || (p[0] >> 4) != 4)
+		return EBADMSG;
+
+	hlen = (size_t)(p[0] & 0x0f) * 4;
+	tlen = be16(&p[2]);
+
+	if (hlen < 20 || tlen < hlen || len < hlen)
+		return EBADMSG;
+
+	/* fragments, MF set or non-zero offset */
+	if (be16(&p[6]) & 0x3fff)
+		return EPROTONOSUPPORT;
+
+	memcpy(&addr, &p[12], 4);
+	sa_set_in(&pkt->src, ntohl(addr), 0);
+	memcpy(&addr, &p[16], 4);
+	sa_set_in(&pkt->dst, ntohl(addr), 0);
+
+	return decode_transport(pkt, p[9], p + hlen, MIN(len, tlen) - hlen);
+}
+
+
+static int decode_ipv6(struct pcap_pkt *pkt, const uint8_t *p, size_t len)
+{
+	size_t plen;
+
+	if (len < 40 || (p[0] >> 4) != 6)
+		return EBADMSG;
+
+	plen = be16(&p[4]);
+
+	sa_set_in6(&pkt->src, &p[8], 0);
+	sa_set_in6(&pkt->dst, &p[24], 0);
+
+	return decode_transport(pkt, p[6], p + 40, MIN(len - 40, plen));
+}
+
+
+static int decode_ip(struct pcap_pkt *pkt, uint16_t type,
+		     const uint8_t *p, size_t len)
+{
+	switch (type) {
+
+	case ETHTYPE_IPV4:
+		return decode_ipv4(pkt, p, len);
+
+	case ETHTYPE_IPV6:
+		return decode_ipv6(pkt, p, len);
+
+	default:
+		return EPROTONOSUPPORT;
+	}
+}
+
+
+static int decode_frame(const struct pcap *pcap, struct pcap_pkt *pkt,
+			const uint8_t *p, size_t len)
+{
+	uint16_t type;
+
+	switch (pcap->link) {
+
+	case LINK_EN10MB:
+		if (len < 14)
+			return EBADMSG;
+
+		type = be16(&p[12]);
+		p   += 14;
+		len -= 14;
+
+		while (type == ETHTYPE_VLAN || type == ETHTYPE_QINQ) {
+			if (len < 4)
+				return EBADMSG;
+
+			type = be16(&p[2]);
+			p   += 4;
+			len -= 4;
+		}
+
+		return decode_ip(pkt, type, p, len);
+
+	case LINK_NULL:
+	case LINK_LOOP:
+		/* the address family is not portable, use the IP version */
+		if (len < 5)
+			return EBADMSG;
+
+		return decode_ip(pkt, (p[4] >> 4) == 4 ? ETHTYPE_IPV4 :
+				 ETHTYPE_IPV6, p + 4, len - 4);
+
+	case LINK_RAW:
+	case LINK_IPV4:
+	case LINK_IPV6:
+		if (len < 1)
+			return EBADMSG;
+
+		return decode_ip(pkt, (p[0] >> 4) == 4 ? ETHTYPE_IPV4 :
+				 ETHTYPE_IPV6, p, len);
+
+	case LINK_LINUX_SLL:
+		if (len < 16)
+			return EBADMSG;
+
+		return decode_ip(pkt, be16(&p[14]), p + 16, len - 16);
+
+	case LINK_LINUX_SLL2:
+		if (len < 20)
+			return EBADMSG;
+
+		return decode_ip(pkt, be16(&p[0]), p + 20, len - 20);
+
+	default:
+		return EPROTONOSUPPORT;
+	}
+}
+
+
+/**
+ * Read the next packet from a capture file
+ *
+ * @param pcap Capture file reader
+ * @param pkt  Returned packet, valid until the next call
+ *
+ * @return 0 if success, ENODATA at the end of the file,
+ *         EPROTONOSUPPORT or EBADMSG for a frame that was skipped,
+ *         otherwise errorcode
+ */
+int pcap_read(struct pcap *pcap, struct pcap_pkt *pkt)
+{
+	uint8_t rec[PCAP_REC_SIZE];
+	uint32_t sec, frac, incl;
+
+	if (!pcap || !pkt)
+		return EINVAL;
+
+	if (fread(rec, sizeof(rec), 1, pcap->f) != 1)
+		return ferror(pcap->f) ? EIO : ENODATA;
+
+	sec  = rd32(pcap, &rec[0]);
+	frac = rd32(pcap, &rec[4]);
+	incl = rd32(pcap, &rec[8]);
+
+	if (incl > PCAP_SNAP_MAX)
+		return EBADMSG;
+
+	if (incl && fread(pcap->buf, incl, 1, pcap->f) != 1)
+		return ferror(pcap->f) ? EIO : ENODATA;
+
+	memset(pkt, 0, sizeof(*pkt));
+
+	pkt->ts = (uint64_t)sec * 1000000000
+		+ (pcap->nsec ? frac : (uint64_t)frac * 1000);
+
+	return decode_frame(pcap, pkt, pcap->buf, incl);
+}
@@ -0,0 +1,20 @@
+/**
+ * @file pcap.h  Capture file reader
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+
+struct pcap;
+
+struct pcap_pkt {
+	uint64_t ts;          /* capture time [ns] */
+	int proto;            /* IPPROTO_UDP or IPPROTO_TCP */
+	struct sa src;
+	struct sa dst;
+	const uint8_t *data;  /* transport payload */
+	size_t len;
+};
+
+int pcap_open(struct pcap **pcapp, const char *path);
+int pcap_read(struct pcap *pcap, struct pcap_pkt *pkt);
@@ -0,0 +1,684 @@
+/**
+ * @file bench/replay.c  Replay a packet capture through the TURN server
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <re.h>
+#include <restund.h>
+#include "../modules/turn/turn.h"
+#include "stund.h"
+#include "pcap.h"
+#include "sim.h"
+
+
+/*
+ * Client packets (to the server port) are passed to
+ * restund_process_msg() and peer packets (to a relay address seen in
+ * an Allocate response of the capture) to the relay socket handler of
+ * the matching allocation, in capture order and without a network.
+ *
+ * The server runs on the simulator transport, which counts and
+ * discards every packet sent since no simulated host is bound. The
+ * clock of the server is the capture clock, so permissions and
+ * channels expire as they did in the capture. Timers of the main loop
+ * are polled after every packet.
+ *
+ * The processing time of every packet is recorded per packet type,
+ * and can be saved and compared with an earlier run.
+ */
+
+
+enum {
+	SERVER_PORT = 3478,
+	RUNS_MAX = 100,
+	RELAY_HASH_SIZE = 1024,
+	THRESHOLD = 20,         /* [%] */
+	HEADROOM = 4,
+};
+
+enum replay_type {
+	RT_BINDING = 0,
+	RT_ALLOCATE,
+	RT_REFRESH,
+	RT_CREATEPERM,
+	RT_CHANBIND,
+	RT_SEND,
+	RT_STUN,
+	RT_CHANDATA,
+	RT_OTHER,
+	RT_RELAY,
+	RT_MAX
+};
+
+enum replay_ctr {
+	RC_TX_CLIENT = 0,
+	RC_TX_PEER,
+	RC_CAP_CLIENT,
+	RC_CAP_PEER,
+	RC_NO_ALLOC,
+	RC_SKIPPED,
+	RC_MAX
+};
+
+struct relay {
+	struct le he;
+	struct sa rel;
+	struct sa cli;
+	struct sa srv;
+};
+
+struct result {
+	uint64_t count;
+	uint64_t mean;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t max;
+};
+
+
+static const char *typev[RT_MAX] = {
+	"binding", "allocate", "refresh", "createperm", "chanbind",
+	"send", "stun_other", "channel_data", "other", "relay",
+};
+
+static const char *ctrv[RC_MAX] = {
+	"tx_client", "tx_peer", "capture_client", "capture_peer",
+	"relay_no_alloc", "skipped",
+};
+
+
+static struct {
+	struct conf *conf;
+	struct hash *relays;
+	struct sim_sock *ss;
+	struct mbuf *mb;
+	struct restund_hist histv[RT_MAX];
+	struct result resv[RT_MAX];
+	uint64_t ctrv[RC_MAX];
+	uint64_t now;           /* capture clock [ns] */
+	uint64_t first;
+	uint64_t pktc;
+	uint16_t port;
+} replay;
+
+
+extern const struct mod_export exports_binding;
+extern const struct mod_export exports_turn;
+
+
+struct conf *restund_conf(void)
+{
+	return replay.conf;
+}
+
+
+static bool alloc_cmp_handler(struct le *le, void *arg)
+{
+	const struct allocation *al = le->data;
+	const struct relay *r = arg;
+
+	return al->proto == IPPROTO_UDP &&
+		sa_cmp(&al->cli_addr, &r->cli, SA_ALL) &&
+		sa_cmp(&al->srv_addr, &r->srv, SA_ALL);
+}
+
+
+static struct allocation *alloc_lookup(const struct sa *cli,
+				       const struct sa *srv)
+{
+	struct relay r;
+
+	r.cli = *cli;
+	r.srv = *srv;
+
+	return list_ledata(hash_lookup(turndp()->ht_alloc,
+				       sa_hash(cli, SA_ALL),
+				       alloc_cmp_handler, &r));
+}
+
+
+static bool relay_cmp_handler(struct le *le, void *arg)
+{
+	const struct relay *r = le->data;
+
+	return sa_cmp(&r->rel, arg, SA_ALL);
+}
+
+
+static struct relay *relay_lookup(const struct sa *rel)
+{
+	return list_ledata(hash_lookup(replay.relays, sa_hash(rel, SA_ALL),
+				       relay_cmp_handler, (void *)rel));
+}
+
+
+static void relay_destructor(void *arg)
+{
+	struct relay *r = arg;
+
+	hash_unlink(&r->he);
+}
+
+
+static bool is_stun(const uint8_t *p, size_t len)
+{
+	return len >= STUN_HEADER_SIZE && !(p[0] & 0xc0) &&
+		p[4] == 0x21 && p[5] == 0x12 && p[6] == 0xa4 && p[7] == 0x42;
+}
+
+
+static enum replay_type client_type(const uint8_t *p, size_t len)
+{
+	uint16_t type, met;
+
+	if (len >= 4 && (p[0] & 0xc0) == 0x40)
+		return RT_CHANDATA;
+
+	if (!is_stun(p, len))
+		return RT_OTHER;
+
+	type = (uint16_t)(p[0] << 8 | p[1]);
+	met  = (type & 0x000f) | ((type & 0x00e0) >> 1) |
+		((type & 0x3e00) >> 2);
+
+	/* indications other than Send are not expected from clients */
+	if (type & 0x0100)
+		return RT_STUN;
+
+	if (type & 0x0010)
+		return met == STUN_METHOD_SEND ? RT_SEND : RT_STUN;
+
+	switch (met) {
+
+	case STUN_METHOD_BINDING:    return RT_BINDING;
+	case STUN_METHOD_ALLOCATE:   return RT_ALLOCATE;
+	case STUN_METHOD_REFRESH:    return RT_REFRESH;
+	case STUN_METHOD_CREATEPERM: return RT_CREATEPERM;
+	case STUN_METHOD_CHANBIND:   return RT_CHANBIND;
+	default:                     return RT_STUN;
+	}
+}
+
+
+/* learn the relay address from an Allocate success response */
+static void server_packet(const struct pcap_pkt *pkt)
+{
+	struct stun_unknown_attr ua;
+	struct stun_msg *msg = NULL;
+	struct stun_attr *attr;
+	struct relay *r;
+	struct mbuf *mb = replay.mb;
+
+	++replay.ctrv[RC_CAP_CLIENT];
+
+	if (!is_stun(pkt->data, pkt->len) ||
+	    pkt->data[0] != 0x01 || pkt->data[1] != 0x03)
+		return;
+
+	mbuf_rewind(mb);
+	if (mbuf_write_mem(mb, pkt->data, pkt->len))
+		return;
+	mb->pos = 0;
+
+	if (stun_msg_decode(&msg, mb, &ua))
+		return;
+
+	attr = stun_msg_attr(msg, STUN_ATTR_XOR_RELAY_ADDR);
+	if (!attr)
+		goto out;
+
+	r = relay_lookup(&attr->v.xor_relay_addr);
+	if (!r) {
+		r = mem_zalloc(sizeof(*r), relay_destructor);
+		if (!r)
+			goto out;
+
+		r->rel = attr->v.xor_relay_addr;
+		hash_append(replay.relays, sa_hash(&r->rel, SA_ALL),
+			    &r->he, r);
+	}
+
+	r->cli = pkt->dst;
+	r->srv = pkt->src;
+
+ out:
+	mem_deref(msg);
+}
+
+
+static void client_packet(const struct pcap_pkt *pkt)
+{
+	const enum replay_type type = client_type(pkt->data, pkt->len);
+	struct mbuf *mb = replay.mb;
+	uint64_t t;
+
+	mbuf_rewind(mb);
+	if (mbuf_write_mem(mb, pkt->data, pkt->len))
+		return;
+	mb->pos = 0;
+
+	t = restund_hist_clock();
+	restund_process_msg(IPPROTO_UDP, replay.ss, &pkt->src, &pkt->dst,
+			    mb);
+	restund_hist_add(&replay.histv[type], restund_hist_clock() - t);
+}
+
+
+static void peer_packet(const struct pcap_pkt *pkt, const struct relay *r)
+{
+	struct mbuf *mb = replay.mb;
+	struct allocation *al;
+	uint64_t t;
+
+	al = alloc_lookup(&r->cli, &r->srv);
+	if (!al) {
+		++replay.ctrv[RC_NO_ALLOC];
+		return;
+	}
+
+	mbuf_rewind(mb);
+	mb->pos = mb->end = HEADROOM;
+	if (mbuf_write_mem(mb, pkt->data, pkt->len))
+		return;
+	mb->pos = HEADROOM;
+
+	t = restund_hist_clock();
+	sim_sock_deliver(al->rel_us, &pkt->src, mb);
+	restund_hist_add(&replay.histv[RT_RELAY], restund_hist_clock() - t);
+}
+
+
+static void packet(const struct pcap_pkt *pkt)
+{
+	const struct relay *r;
+
+	if (pkt->proto != IPPROTO_UDP) {
+		++replay.ctrv[RC_SKIPPED];
+		return;
+	}
+
+	if (sa_port(&pkt->dst) == replay.port)
+		client_packet(pkt);
+	else if (sa_port(&pkt->src) == replay.port)
+		server_packet(pkt);
+	else if ((r = relay_lookup(&pkt->dst)))
+		peer_packet(pkt, r);
+	else if (relay_lookup(&pkt->src))
+		++replay.ctrv[RC_CAP_PEER];
+	else
+		++replay.ctrv[RC_SKIPPED];
+}
+
+
+static int run(const char *path)
+{
+	const struct sim_conf simc = {0};
+	const struct sim_stats *stats;
+	struct pcap_pkt pkt;
+	struct pcap *pcap;
+	struct sa laddr;
+	int err, i;
+
+	memset(replay.histv, 0, sizeof(replay.histv));
+	memset(replay.ctrv, 0, sizeof(replay.ctrv));
+	replay.pktc = 0;
+
+	err = pcap_open(&pcap, path);
+	if (err) {
+		(void)re_fprintf(stderr, "restund-replay: %s: %m\n",
+				 path, err);
+		return err;
+	}
+
+	err = hash_alloc(&replay.relays, RELAY_HASH_SIZE);
+	if (err)
+		goto out;
+
+	err = sim_init(&simc);
+	if (err)
+		goto out;
+
+	sa_set_str(&laddr, "127.0.0.1", replay.port);
+
+	err = sim_sock_alloc(&replay.ss, SIM_SERVER, &laddr, NULL, NULL);
+	if (err)
+		goto out;
+
+	err = exports_binding.init();
+	if (!err)
+		err = exports_turn.init();
+	if (err)
+		goto out;
+
+	for (;;) {
+
+		err = pcap_read(pcap, &pkt);
+		if (err == ENODATA) {
+			err = 0;
+			break;
+		}
+		else if (err == EPROTONOSUPPORT || err == EBADMSG) {
+			++replay.ctrv[RC_SKIPPED];
+			continue;
+		}
+		else if (err)
+			break;
+
+		if (!replay.first)
+			replay.first = pkt.ts;
+
+		replay.now = pkt.ts;
+		sim_clock_set(pkt.ts);
+		++replay.pktc;
+
+		packet(&pkt);
+
+		tmr_poll(re_tmrl_get());
+	}
+
+	stats = sim_stats();
+	replay.ctrv[RC_TX_CLIENT] = stats->txc[SIM_SERVER];
+	replay.ctrv[RC_TX_PEER]   = stats->txc[SIM_RELAY];
+
+	for (i=0; i<RT_MAX; i++) {
+
+		const struct restund_hist *h = &replay.histv[i];
+		struct result *res = &replay.resv[i];
+		uint64_t mean;
+
+		if (!h->count)
+			continue;
+
+		mean = h->sum / h->count;
+		if (res->count && mean >= res->mean)
+			continue;
+
+		res->count = h->count;
+		res->mean  = mean;
+		res->p50   = restund_hist_quantile(h, 0.5);
+		res->p99   = restund_hist_quantile(h, 0.99);
+		res->max   = h->max;
+	}
+
+ out:
+	(void)exports_turn.close();
+	(void)exports_binding.close();
+	hash_flush(replay.relays);
+	replay.relays = mem_deref(replay.relays);
+	replay.ss = mem_deref(replay.ss);
+	sim_close();
+	mem_deref(pcap);
+
+	return err;
+}
+
+
+static void report(void)
+{
+	int i;
+
+	(void)printf("# %llu packets, %.3f seconds of capture\n",
+		     (unsigned long long)replay.pktc,
+		     (double)(replay.now - replay.first) / 1e9);
+	(void)printf("%-16s %10s %10s %10s %10s %10s\n", "type", "count",
+		     "mean_ns", "p50_ns", "p99_ns", "max_ns");
+
+	for (i=0; i<RT_MAX; i++) {
+
+		const struct result *res = &replay.resv[i];
+
+		if (!res->count)
+			continue;
+
+		(void)printf("%-16s %10llu %10llu %10llu %10llu %10llu\n",
+			     typev[i], (unsigned long long)res->count,
+			     (unsigned long long)res->mean,
+			     (unsigned long long)res->p50,
+			     (unsigned long long)res->p99,
+			     (unsigned long long)res->max);
+	}
+
+	for (i=0; i<RC_MAX; i++) {
+		(void)printf("%-16s %10llu\n", ctrv[i],
+			     (unsigned long long)replay.ctrv[i]);
+	}
+}
+
+
+static int save(const char *path)
+{
+	FILE *f;
+	int i;
+
+	f = fopen(path, "w");
+	if (!f)
+		return errno;
+
+	for (i=0; i<RT_MAX; i++) {
+		(void)fprintf(f, "%s %llu %llu\n", typev[i],
+			      (unsigned long long)replay.resv[i].count,
+			      (unsigned long long)replay.resv[i].mean);
+	}
+
+	for (i=0; i<RC_MAX; i++) {
+		(void)fprintf(f, "%s %llu 0\n", ctrv[i],
+			      (unsigned long long)replay.ctrv[i]);
+	}
+
+	return fclose(f) ? errno : 0;
+}
+
+
+static bool lookup(const char *name, uint64_t *count, uint64_t *mean)
+{
+	int i;
+
+	for (i=0; i<RT_MAX; i++) {
+		if (!strcmp(name, typev[i])) {
+			*count = replay.resv[i].count;
+			*mean  = replay.resv[i].mean;
+			return true;
+		}
+	}
+
+	for (i=0; i<RC_MAX; i++) {
+		if (!strcmp(name, ctrv[i])) {
+			*count = replay.ctrv[i];
+			*mean  = 0;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/* counts the differences from the baseline in *nregp */
+static int compare(const char *path, unsigned threshold, int *nregp)
+{
+	unsigned long long bcount, bmean;
+	uint64_t count, mean;
+	char name[32];
+	int nreg = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return errno;
+
+	while (fscanf(f, "%31s %llu %llu", name, &bcount, &bmean) == 3) {
+
+		if (!lookup(name, &count, &mean))
+			continue;
+
+		if (count != bcount) {
+			(void)printf("changed:    %s count %llu, baseline"
+				     " %llu\n", name,
+				     (unsigned long long)count, bcount);
+			++nreg;
+		}
+
+		if (bmean && mean * 100 > bmean * (100 + threshold)) {
+			(void)printf("regression: %s mean %llu ns, baseline"
+				     " %llu ns (+%llu%%)\n", name,
+				     (unsigned long long)mean, bmean,
+				     (unsigned long long)
+				     ((mean - bmean) * 100 / bmean));
+			++nreg;
+		}
+	}
+
+	(void)fclose(f);
+
+	*nregp = nreg;
+
+	return 0;
+}
+
+
+static void usage(void)
+{
+	(void)fprintf(stderr,
+		      "usage: restund-replay [-h] [-c conf] [-p port]"
+		      " [-n runs] [-o file] [-b file] [-x pct]"
+		      " <capture>\n"
+		      "\t-c <conf>  Configuration file for the modules\n"
+		      "\t-p <port>  Server port in the capture (%u)\n"
+		      "\t-n <runs>  Replay the capture runs times,"
+		      " report the best\n"
+		      "\t-o <file>  Save the results as a baseline\n"
+		      "\t-b <file>  Compare with a saved baseline\n"
+		      "\t-x <pct>   Regression threshold (%u%%)\n",
+		      SERVER_PORT, THRESHOLD);
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *confpath = NULL, *out = NULL, *base = NULL;
+	unsigned runs = 1, threshold = THRESHOLD, i;
+	int err, nreg = 0;
+
+	replay.port = SERVER_PORT;
+
+	for (;;) {
+
+		const int c = getopt(argc, argv, "hc:p:n:o:b:x:");
+		if (0 > c)
+			break;
+
+		switch (c) {
+
+		case 'c':
+			confpath = optarg;
+			break;
+
+		case 'p':
+			replay.port = (uint16_t)atoi(optarg);
+			break;
+
+		case 'n':
+			runs = (unsigned)atoi(optarg);
+			break;
+
+		case 'o':
+			out = optarg;
+			break;
+
+		case 'b':
+			base = optarg;
+			break;
+
+		case 'x':
+			threshold = (unsigned)atoi(optarg);
+			break;
+
+		case '?':
+		case 'h':
+		default:
+			usage();
+			return -2;
+		}
+	}
+
+	if (optind >= argc || !runs || runs > RUNS_MAX) {
+		usage();
+		return -2;
+	}
+
+	err = libre_init();
+	if (err)
+		return err;
+
+	if (confpath) {
+		err = conf_alloc(&replay.conf, confpath);
+	}
+	else {
+		static const char defconf[] = "turn_relay_addr 127.0.0.1\n";
+
+		err = conf_alloc_buf(&replay.conf, (const uint8_t *)defconf,
+				     sizeof(defconf) - 1);
+	}
+	if (err) {
+		(void)re_fprintf(stderr, "restund-replay: config: %m\n", err);
+		goto out;
+	}
+
+	replay.mb = mbuf_alloc(2048);
+	if (!replay.mb) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err  = restund_ctr_init();
+	err |= restund_prof_init();
+	err |= restund_hist_init();
+	err |= restund_stun_init();
+	if (err)
+		goto out;
+
+	for (i=0; i<runs && !err; i++)
+		err = run(argv[optind]);
+
+	if (err)
+		goto out;
+
+	report();
+
+	if (out) {
+		err = save(out);
+		if (err) {
+			(void)re_fprintf(stderr, "restund-replay: %s: %m\n",
+					 out, err);
+			goto out;
+		}
+	}
+
+	if (base) {
+		err = compare(base, threshold, &nreg);
+		if (err) {
+			(void)re_fprintf(stderr, "restund-replay: %s: %m\n",
+					 base, err);
+			goto out;
+		}
+	}
+
+ out:
+	restund_stun_close();
+	restund_hist_close();
+	restund_prof_close();
+	restund_ctr_close();
+	replay.mb   = mem_deref(replay.mb);
+	replay.conf = mem_deref(replay.conf);
+
+	libre_close();
+
+	/* exit status 1 signals a regression */
+	return err ? err : (nreg ? 1 : 0);
+}
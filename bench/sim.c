@@ -0,0 +1,534 @@
+/**
+ * @file sim.c  Deterministic network simulator
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+#include "sim.h"
+
+
+/*
+ * An in-memory UDP network with a virtual clock, installed as the
+ * server transport. Every packet sent becomes an event which is
+ * delivered to the socket bound to the destination address, after
+ * the configured latency and jitter, unless it is lost. Events run in
+ * time order, ties in the order they were created, and all random
+ * choices come from one seeded generator, so a run is reproducible.
+ *
+ * Packets to an address without a socket are dropped when sent. The
+ * server's main loop timers (allocation lifetimes) keep running on
+ * the process clock.
+ */
+
+
+enum {
+	SOCK_HASH_SIZE = 4096,
+	HEAP_MIN       = 1024,
+	PRESZ          = 4,      /* room for a ChannelData header */
+	PORT_MIN       = 49152,
+	EPOCH          = 1600000000,
+};
+
+struct sim_sock {
+	struct le he;
+	struct sa local;
+	enum sim_kind kind;
+	udp_recv_h *recvh;
+	void *arg;
+};
+
+struct sim_ev {
+	uint64_t t;
+	uint64_t seq;
+	struct sa src;
+	struct sa dst;
+	struct mbuf *mb;         /* packet, or NULL for a timer */
+	sim_tmr_h *th;
+	void *arg;
+};
+
+
+static struct {
+	struct sim_conf conf;
+	struct hash *socks;
+	struct sim_ev **heap;
+	size_t heapc;
+	size_t heapsz;
+	uint64_t now;            /* [ns] */
+	uint64_t seq;
+	uint64_t rnd;
+	uint16_t port;
+	struct sim_stats stats;
+	bool init;
+} sim;
+
+
+static uint64_t rand64(void)
+{
+	uint64_t z = (sim.rnd += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+	return z ^ (z >> 31);
+}
+
+
+uint32_t sim_rand(void)
+{
+	return (uint32_t)(rand64() >> 32);
+}
+
+
+static bool ev_before(const struct sim_ev *a, const struct sim_ev *b)
+{
+	return a->t < b->t || (a->t == b->t && a->seq < b->seq);
+}
+
+
+static int heap_push(struct sim_ev *ev)
+{
+	size_t i;
+
+	if (sim.heapc == sim.heapsz) {
+
+		const size_t sz = sim.heapsz ? sim.heapsz * 2 : HEAP_MIN;
+		struct sim_ev **heap;
+
+		heap = mem_reallocarray(sim.heap, sz, sizeof(*heap), NULL);
+		if (!heap)
+			return ENOMEM;
+
+		sim.heap   = heap;
+		sim.heapsz = sz;
+	}
+
+	for (i = sim.heapc++; i > 0; i = (i - 1) / 2) {
+
+		struct sim_ev *parent = sim.heap[(i - 1) / 2];
+
+		if (!ev_before(ev, parent))
+			break;
+
+		sim.heap[i] = parent;
+	}
+
+	sim.heap[i] = ev;
+
+	return 0;
+}
+
+
+static struct sim_ev *heap_pop(void)
+{
+	struct sim_ev *top, *last;
+	size_t i = 0, c;
+
+	if (!sim.heapc)
+		return NULL;
+
+	top  = sim.heap[0];
+	last = sim.heap[--sim.heapc];
+
+	while ((c = 2 * i + 1) < sim.heapc) {
+
+		if (c + 1 < sim.heapc && ev_before(sim.heap[c + 1],
+						   sim.heap[c]))
+			++c;
+
+		if (!ev_before(sim.heap[c], last))
+			break;
+
+		sim.heap[i] = sim.heap[c];
+		i = c;
+	}
+
+	if (sim.heapc)
+		sim.heap[i] = last;
+
+	return top;
+}
+
+
+static void ev_destructor(void *arg)
+{
+	struct sim_ev *ev = arg;
+
+	mem_deref(ev->mb);
+}
+
+
+static int ev_schedule(uint64_t delay, struct sim_ev *ev)
+{
+	int err;
+
+	ev->t   = sim.now + delay;
+	ev->seq = sim.seq++;
+
+	err = heap_push(ev);
+	if (err)
+		mem_deref(ev);
+
+	return err;
+}
+
+
+static bool sock_cmp_handler(struct le *le, void *arg)
+{
+	const struct sim_sock *ss = le->data;
+
+	return sa_cmp(&ss->local, arg, SA_ALL);
+}
+
+
+static struct sim_sock *sock_find(const struct sa *addr)
+{
+	return list_ledata(hash_lookup(sim.socks, sa_hash(addr, SA_ALL),
+				       sock_cmp_handler, (void *)addr));
+}
+
+
+static void sock_destructor(void *arg)
+{
+	struct sim_sock *ss = arg;
+
+	hash_unlink(&ss->he);
+}
+
+
+/**
+ * Bind a simulated UDP socket
+ *
+ * @param ssp   Pointer to allocated socket
+ * @param kind  Kind of socket
+ * @param local Local address, port 0 for the next free port
+ * @param recvh Receive handler, not used for SIM_SERVER
+ * @param arg   Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int sim_sock_alloc(struct sim_sock **ssp, enum sim_kind kind,
+		   const struct sa *local, udp_recv_h *recvh, void *arg)
+{
+	struct sim_sock *ss;
+	uint32_t i;
+
+	if (!ssp || !local || !sim.init)
+		return EINVAL;
+
+	ss = mem_zalloc(sizeof(*ss), sock_destructor);
+	if (!ss)
+		return ENOMEM;
+
+	ss->local = *local;
+	ss->kind  = kind;
+	ss->recvh = recvh;
+	ss->arg   = arg;
+
+	for (i=0; !sa_port(local) && i<65536 - PORT_MIN; i++) {
+
+		sa_set_port(&ss->local, sim.port);
+
+		sim.port = sim.port == 65535 ? PORT_MIN : sim.port + 1;
+
+		if (!sock_find(&ss->local))
+			break;
+	}
+
+	if (sock_find(&ss->local)) {
+		mem_deref(ss);
+		return EADDRINUSE;
+	}
+
+	hash_append(sim.socks, sa_hash(&ss->local, SA_ALL), &ss->he, ss);
+
+	*ssp = ss;
+
+	return 0;
+}
+
+
+const struct sa *sim_sock_local(const struct sim_sock *ss)
+{
+	return ss ? &ss->local : NULL;
+}
+
+
+/**
+ * Pass a packet to a socket, as if it was received now
+ *
+ * @param ss  Receiving socket
+ * @param src Source address
+ * @param mb  Packet, with PRESZ bytes of headroom before pos for
+ *            relay sockets
+ */
+void sim_sock_deliver(struct sim_sock *ss, const struct sa *src,
+		      struct mbuf *mb)
+{
+	if (!ss || !src || !mb)
+		return;
+
+	++sim.stats.rxc[ss->kind];
+
+	if (ss->kind == SIM_SERVER)
+		restund_process_msg(IPPROTO_UDP, ss, src, &ss->local, mb);
+	else if (ss->recvh)
+		ss->recvh(src, mb, ss->arg);
+}
+
+
+/**
+ * Send a packet from a simulated socket
+ *
+ * @param ss  Sending socket
+ * @param dst Destination address
+ * @param mb  Packet, from the current position
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int sim_send(struct sim_sock *ss, const struct sa *dst, struct mbuf *mb)
+{
+	const size_t len = mbuf_get_left(mb);
+	struct sim_ev *ev;
+	uint64_t delay;
+
+	if (!ss || !dst || !mb)
+		return EINVAL;
+
+	++sim.stats.txc[ss->kind];
+
+	if (!sock_find(dst)) {
+		++sim.stats.unreachc;
+		return 0;
+	}
+
+	if (sim.conf.loss && sim_rand() % 1000000 < sim.conf.loss) {
+		++sim.stats.lostc;
+		return 0;
+	}
+
+	ev = mem_zalloc(sizeof(*ev), ev_destructor);
+	if (!ev)
+		return ENOMEM;
+
+	ev->src = ss->local;
+	ev->dst = *dst;
+	ev->mb  = mbuf_alloc(PRESZ + len);
+	if (!ev->mb) {
+		mem_deref(ev);
+		return ENOMEM;
+	}
+
+	ev->mb->pos = ev->mb->end = PRESZ;
+	(void)mbuf_write_mem(ev->mb, mbuf_buf(mb), len);
+	ev->mb->pos = PRESZ;
+
+	delay = (uint64_t)sim.conf.latency * 1000;
+
+	if (sim.conf.jitter)
+		delay += (uint64_t)(sim_rand() % sim.conf.jitter) * 1000;
+
+	if (sim.conf.reorder && sim_rand() % 1000000 < sim.conf.reorder) {
+		delay += (uint64_t)(sim_rand() %
+				    (4 * sim.conf.latency + 1)) * 1000;
+		++sim.stats.reorderc;
+	}
+
+	return ev_schedule(delay, ev);
+}
+
+
+/**
+ * Run a handler on the virtual clock
+ *
+ * @param delay Delay [ns]
+ * @param th    Timer handler
+ * @param arg   Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int sim_timer(uint64_t delay, sim_tmr_h *th, void *arg)
+{
+	struct sim_ev *ev;
+
+	if (!th)
+		return EINVAL;
+
+	ev = mem_zalloc(sizeof(*ev), ev_destructor);
+	if (!ev)
+		return ENOMEM;
+
+	ev->th  = th;
+	ev->arg = arg;
+
+	return ev_schedule(delay, ev);
+}
+
+
+/**
+ * Run the next event, if it is due before the given time
+ *
+ * @param until Virtual time [ns]
+ *
+ * @return true if an event was run
+ */
+bool sim_step(uint64_t until)
+{
+	struct sim_ev *ev;
+	struct sim_sock *ss;
+
+	if (!sim.heapc || sim.heap[0]->t > until)
+		return false;
+
+	ev = heap_pop();
+	sim.now = ev->t;
+	++sim.stats.evc;
+
+	if (ev->th) {
+		ev->th(ev->arg);
+	}
+	else if ((ss = sock_find(&ev->dst))) {
+		sim_sock_deliver(ss, &ev->src, ev->mb);
+	}
+	else {
+		++sim.stats.unreachc;
+	}
+
+	mem_deref(ev);
+
+	return true;
+}
+
+
+uint64_t sim_now(void)
+{
+	return sim.now;
+}
+
+
+/* set the virtual clock, e.g. to a capture timestamp [ns] */
+void sim_clock_set(uint64_t now)
+{
+	sim.now = now;
+}
+
+
+const struct sim_stats *sim_stats(void)
+{
+	return &sim.stats;
+}
+
+
+static int transp_listen(void **sockp, struct sa *local, uint32_t bufsz,
+			 udp_recv_h *recvh, void *arg)
+{
+	struct sim_sock *ss;
+	int err;
+	(void)bufsz;
+
+	err = sim_sock_alloc(&ss, SIM_RELAY, local, recvh, arg);
+	if (err)
+		return err;
+
+	*local = ss->local;
+	*sockp = ss;
+
+	return 0;
+}
+
+
+static void transp_handler(void *sock, udp_recv_h *recvh, void *arg)
+{
+	struct sim_sock *ss = sock;
+
+	ss->recvh = recvh;
+	ss->arg   = arg;
+}
+
+
+static int transp_send(int proto, void *sock, const struct sa *dst,
+		       struct mbuf *mb)
+{
+	if (proto != IPPROTO_UDP)
+		return EPROTONOSUPPORT;
+
+	return sim_send(sock, dst, mb);
+}
+
+
+static size_t transp_txqsz(int proto, void *sock)
+{
+	(void)proto;
+	(void)sock;
+
+	return 0;
+}
+
+
+static time_t transp_time(void)
+{
+	return (time_t)(sim.now / 1000000000);
+}
+
+
+static const struct restund_transp transp = {
+	.name     = "sim",
+	.listenh  = transp_listen,
+	.handlerh = transp_handler,
+	.sendh    = transp_send,
+	.txqszh   = transp_txqsz,
+	.timeh    = transp_time,
+};
+
+
+/**
+ * Start the simulator and install it as the server transport
+ *
+ * @param conf Network conditions
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int sim_init(const struct sim_conf *conf)
+{
+	int err;
+
+	if (!conf || sim.init)
+		return EINVAL;
+
+	memset(&sim, 0, sizeof(sim));
+
+	err = hash_alloc(&sim.socks, SOCK_HASH_SIZE);
+	if (err)
+		return err;
+
+	sim.conf = *conf;
+	sim.rnd  = conf->seed;
+	sim.now  = (uint64_t)EPOCH * 1000000000;
+	sim.port = PORT_MIN;
+	sim.init = true;
+
+	restund_transp_set(&transp);
+
+	return 0;
+}
+
+
+void sim_close(void)
+{
+	if (!sim.init)
+		return;
+
+	restund_transp_set(NULL);
+
+	while (sim.heapc)
+		mem_deref(heap_pop());
+
+	sim.heap = mem_deref(sim.heap);
+	hash_clear(sim.socks);
+	sim.socks = mem_deref(sim.socks);
+	sim.init = false;
+}
@@ -0,0 +1,49 @@
+/**
+ * @file sim.h  Deterministic network simulator
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+
+struct sim_conf {
+	uint64_t seed;
+	uint32_t latency;      /* one way [us] */
+	uint32_t jitter;       /* [us] */
+	uint32_t loss;         /* [ppm] */
+	uint32_t reorder;      /* [ppm], delayed by up to 4 x latency */
+};
+
+enum sim_kind {
+	SIM_HOST = 0,          /* simulated client or peer */
+	SIM_SERVER,            /* server listener */
+	SIM_RELAY,             /* relay socket opened by the server */
+	SIM_KIND_MAX
+};
+
+struct sim_stats {
+	uint64_t txc[SIM_KIND_MAX];
+	uint64_t rxc[SIM_KIND_MAX];
+	uint64_t lostc;
+	uint64_t reorderc;
+	uint64_t unreachc;
+	uint64_t evc;
+};
+
+struct sim_sock;
+
+typedef void (sim_tmr_h)(void *arg);
+
+int  sim_init(const struct sim_conf *conf);
+void sim_close(void);
+int  sim_sock_alloc(struct sim_sock **ssp, enum sim_kind kind,
+		    const struct sa *local, udp_recv_h *recvh, void *arg);
+const struct sa *sim_sock_local(const struct sim_sock *ss);
+void sim_sock_deliver(struct sim_sock *ss, const struct sa *src,
+		      struct mbuf *mb);
+int  sim_send(struct sim_sock *ss, const struct sa *dst, struct mbuf *mb);
+int  sim_timer(uint64_t delay, sim_tmr_h *th, void *arg);
+bool sim_step(uint64_t until);
+uint64_t sim_now(void);
+void sim_clock_set(uint64_t now);
+uint32_t sim_rand(void);
+const struct sim_stats *sim_stats(void);
@@ -0,0 +1,624 @@
+/**
+ * @file bench/simrun.c  Run simulated TURN clients against the server
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+#include "sim.h"
+
+
+/*
+ * Every client allocates a relay, creates a permission and binds a
+ * channel to one of the peers, then sends ChannelData packets which
+ * the peer echoes back through the relay. Requests are retransmitted
+ * like RFC 5389 over UDP. The round trip time of every echoed packet
+ * is measured on the virtual clock.
+ *
+ * With the same options and seed, two runs send the same packets at
+ * the same virtual times.
+ */
+
+
+enum {
+	SERVER_PORT = 3478,
+	CHAN_NUMB   = 0x4000,
+	RTO_INIT    = 500,      /* [ms] */
+	TX_MAX      = 7,
+	PEERS_MAX   = 60000,
+	PAYLOAD_MIN = 8,        /* send timestamp */
+	PAYLOAD_MAX = 1200,
+	NS_PER_MS   = 1000000,
+};
+
+enum state {
+	ST_IDLE = 0,
+	ST_ALLOCATE,
+	ST_CREATEPERM,
+	ST_CHANBIND,
+	ST_DATA,
+	ST_DONE,
+	ST_FAILED,
+};
+
+struct client {
+	struct sim_sock *ss;
+	const struct sa *peer;
+	struct sa relay;
+	enum state state;
+	uint8_t tid[STUN_TID_SIZE];
+	uint64_t due;           /* retransmission time [ns] */
+	uint32_t txc;
+	uint32_t sentc;
+};
+
+struct peer {
+	struct sim_sock *ss;
+};
+
+
+static struct {
+	struct conf *conf;
+	struct sim_sock *srv;
+	struct client *clientv;
+	struct peer *peerv;
+	struct mbuf *mb;
+	struct restund_hist rtt;
+	uint32_t clients;
+	uint32_t peers;
+	uint32_t packets;
+	uint32_t interval;      /* [ms] */
+	uint32_t ramp;          /* [ms] */
+	uint32_t size;
+	uint32_t okc;
+	uint32_t failv[ST_FAILED];
+	uint64_t rtxc;
+	uint64_t sentc;
+	uint64_t recvc;
+} simrun;
+
+
+extern const struct mod_export exports_binding;
+extern const struct mod_export exports_turn;
+
+
+struct conf *restund_conf(void)
+{
+	return simrun.conf;
+}
+
+
+static const char *state_name(enum state st)
+{
+	switch (st) {
+
+	case ST_ALLOCATE:   return "allocate";
+	case ST_CREATEPERM: return "createperm";
+	case ST_CHANBIND:   return "chanbind";
+	default:            return "?";
+	}
+}
+
+
+static int send_request(struct client *cl)
+{
+	const uint16_t numb = CHAN_NUMB;
+	const uint8_t proto = IPPROTO_UDP;
+	struct mbuf *mb = simrun.mb;
+	int err;
+
+	mbuf_rewind(mb);
+
+	switch (cl->state) {
+
+	case ST_ALLOCATE:
+		err = stun_msg_encode(mb, STUN_METHOD_ALLOCATE,
+				      STUN_CLASS_REQUEST, cl->tid, NULL,
+				      NULL, 0, false, 0, 1,
+				      STUN_ATTR_REQ_TRANSPORT, &proto);
+		break;
+
+	case ST_CREATEPERM:
+		err = stun_msg_encode(mb, STUN_METHOD_CREATEPERM,
+				      STUN_CLASS_REQUEST, cl->tid, NULL,
+				      NULL, 0, false, 0, 1,
+				      STUN_ATTR_XOR_PEER_ADDR, cl->peer);
+		break;
+
+	case ST_CHANBIND:
+		err = stun_msg_encode(mb, STUN_METHOD_CHANBIND,
+				      STUN_CLASS_REQUEST, cl->tid, NULL,
+				      NULL, 0, false, 0, 2,
+				      STUN_ATTR_CHANNEL_NUMBER, &numb,
+				      STUN_ATTR_XOR_PEER_ADDR, cl->peer);
+		break;
+
+	default:
+		return EINVAL;
+	}
+
+	if (err)
+		return err;
+
+	mb->pos = 0;
+
+	return sim_send(cl->ss, sim_sock_local(simrun.srv), mb);
+}
+
+
+static void fail(struct client *cl)
+{
+	if (cl->state < ST_FAILED)
+		++simrun.failv[cl->state];
+
+	cl->state = ST_FAILED;
+	cl->due   = 0;
+}
+
+
+static void rtx_handler(void *arg)
+{
+	struct client *cl = arg;
+	uint64_t rto;
+
+	/* superseded by a response */
+	if (cl->due != sim_now())
+		return;
+
+	if (cl->txc >= TX_MAX) {
+		fail(cl);
+		return;
+	}
+
+	if (cl->txc)
+		++simrun.rtxc;
+
+	rto = (uint64_t)RTO_INIT * NS_PER_MS << cl->txc;
+	++cl->txc;
+
+	cl->due = sim_now() + rto;
+
+	if (send_request(cl) || sim_timer(rto, rtx_handler, cl))
+		fail(cl);
+}
+
+
+static void request(struct client *cl, enum state st)
+{
+	uint32_t i;
+
+	cl->state = st;
+	cl->txc   = 0;
+	cl->due   = sim_now();
+
+	/* transaction IDs come from the simulator for repeatable runs */
+	for (i=0; i<sizeof(cl->tid); i+=4) {
+		const uint32_t v = sim_rand();
+		memcpy(&cl->tid[i], &v, 4);
+	}
+
+	rtx_handler(cl);
+}
+
+
+static void data_handler(void *arg)
+{
+	struct client *cl = arg;
+	struct mbuf *mb = simrun.mb;
+	const uint64_t now = sim_now();
+	int err;
+
+	if (cl->state != ST_DATA)
+		return;
+
+	if (cl->sentc >= simrun.packets) {
+		cl->state = ST_DONE;
+		return;
+	}
+
+	mbuf_rewind(mb);
+	err  = mbuf_write_u16(mb, htons(CHAN_NUMB));
+	err |= mbuf_write_u16(mb, htons(simrun.size));
+	err |= mbuf_write_mem(mb, (const uint8_t *)&now, sizeof(now));
+	err |= mbuf_fill(mb, 0x5a, simrun.size - sizeof(now));
+	if (err)
+		goto out;
+
+	mb->pos = 0;
+
+	err = sim_send(cl->ss, sim_sock_local(simrun.srv), mb);
+	if (err)
+		goto out;
+
+	++cl->sentc;
+	++simrun.sentc;
+
+	err = sim_timer((uint64_t)simrun.interval * NS_PER_MS,
+			data_handler, cl);
+
+ out:
+	if (err)
+		fail(cl);
+}
+
+
+static void chandata_recv(struct mbuf *mb)
+{
+	uint64_t ts;
+
+	if (mbuf_get_left(mb) < 4 + sizeof(ts))
+		return;
+
+	mb->pos += 4;
+	(void)mbuf_read_mem(mb, (uint8_t *)&ts, sizeof(ts));
+
+	restund_hist_add(&simrun.rtt, sim_now() - ts);
+	++simrun.recvc;
+}
+
+
+static void client_recv(const struct sa *src, struct mbuf *mb, void *arg)
+{
+	struct client *cl = arg;
+	struct stun_unknown_attr ua;
+	struct stun_msg *msg = NULL;
+	struct stun_attr *attr;
+	(void)src;
+
+	if (mbuf_get_left(mb) >= 4 && (mbuf_buf(mb)[0] & 0xc0) == 0x40) {
+		chandata_recv(mb);
+		return;
+	}
+
+	if (stun_msg_decode(&msg, mb, &ua))
+		return;
+
+	if (cl->state < ST_ALLOCATE || cl->state > ST_CHANBIND ||
+	    memcmp(stun_msg_tid(msg), cl->tid, sizeof(cl->tid)))
+		goto out;
+
+	/* retransmitted request answered twice */
+	if (!cl->due)
+		goto out;
+
+	cl->due = 0;
+
+	if (stun_msg_class(msg) != STUN_CLASS_SUCCESS_RESP) {
+		fail(cl);
+		goto out;
+	}
+
+	switch (cl->state) {
+
+	case ST_ALLOCATE:
+		attr = stun_msg_attr(msg, STUN_ATTR_XOR_RELAY_ADDR);
+		if (!attr) {
+			fail(cl);
+			break;
+		}
+
+		cl->relay = attr->v.xor_relay_addr;
+		request(cl, ST_CREATEPERM);
+		break;
+
+	case ST_CREATEPERM:
+		request(cl, ST_CHANBIND);
+		break;
+
+	case ST_CHANBIND:
+		++simrun.okc;
+		cl->state = ST_DATA;
+		data_handler(cl);
+		break;
+
+	default:
+		break;
+	}
+
+ out:
+	mem_deref(msg);
+}
+
+
+static void peer_recv(const struct sa *src, struct mbuf *mb, void *arg)
+{
+	struct peer *p = arg;
+
+	(void)sim_send(p->ss, src, mb);
+}
+
+
+static void start_handler(void *arg)
+{
+	request(arg, ST_ALLOCATE);
+}
+
+
+static int run(void)
+{
+	struct sa addr;
+	uint32_t i;
+	int err;
+
+	sa_set_str(&addr, "198.51.100.1", SERVER_PORT);
+
+	err = sim_sock_alloc(&simrun.srv, SIM_SERVER, &addr, NULL, NULL);
+	if (err)
+		return err;
+
+	for (i=0; i<simrun.peers; i++) {
+
+		struct peer *p = &simrun.peerv[i];
+
+		sa_set_in(&addr, 0xc0000201 + i % 254, 5000 + i / 254);
+
+		err = sim_sock_alloc(&p->ss, SIM_HOST, &addr, peer_recv, p);
+		if (err)
+			return err;
+	}
+
+	for (i=0; i<simrun.clients; i++) {
+
+		struct client *cl = &simrun.clientv[i];
+		const uint64_t start = (uint64_t)simrun.ramp * NS_PER_MS *
+			i / simrun.clients;
+
+		sa_set_in(&addr, 0x0a000001 + i, 40000);
+
+		err = sim_sock_alloc(&cl->ss, SIM_HOST, &addr, client_recv,
+				     cl);
+		if (err)
+			return err;
+
+		cl->peer = sim_sock_local(simrun.peerv[i % simrun.peers].ss);
+
+		err = sim_timer(start, start_handler, cl);
+		if (err)
+			return err;
+	}
+
+	while (sim_step(UINT64_MAX))
+		;
+
+	return 0;
+}
+
+
+static void report(uint64_t vstart, uint64_t wall)
+{
+	const struct sim_stats *stats = sim_stats();
+	const struct restund_hist *h = &simrun.rtt;
+	int i;
+
+	(void)printf("# %u clients, %u peers, %.3f s virtual,"
+		     " %.3f s wall\n", simrun.clients, simrun.peers,
+		     (double)(sim_now() - vstart) / 1e9, (double)wall / 1e9);
+
+	(void)printf("%-16s %10u\n", "alloc_ok", simrun.okc);
+
+	for (i=ST_ALLOCATE; i<=ST_CHANBIND; i++) {
+		(void)printf("fail_%-11s %10u\n", state_name(i),
+			     simrun.failv[i]);
+	}
+
+	(void)printf("%-16s %10llu\n", "retransmits",
+		     (unsigned long long)simrun.rtxc);
+	(void)printf("%-16s %10llu\n", "data_sent",
+		     (unsigned long long)simrun.sentc);
+	(void)printf("%-16s %10llu\n", "data_recv",
+		     (unsigned long long)simrun.recvc);
+	(void)printf("%-16s %10llu\n", "net_events",
+		     (unsigned long long)stats->evc);
+	(void)printf("%-16s %10llu\n", "net_lost",
+		     (unsigned long long)stats->lostc);
+	(void)printf("%-16s %10llu\n", "net_reordered",
+		     (unsigned long long)stats->reorderc);
+	(void)printf("%-16s %10llu\n", "net_unreachable",
+		     (unsigned long long)stats->unreachc);
+
+	if (!h->count)
+		return;
+
+	(void)printf("%-16s %10llu\n", "rtt_p50_us",
+		     (unsigned long long)restund_hist_quantile(h, 0.5) /
+		     1000);
+	(void)printf("%-16s %10llu\n", "rtt_p99_us",
+		     (unsigned long long)restund_hist_quantile(h, 0.99) /
+		     1000);
+	(void)printf("%-16s %10llu\n", "rtt_max_us",
+		     (unsigned long long)h->max / 1000);
+}
+
+
+static void usage(void)
+{
+	(void)fprintf(stderr,
+		      "usage: restund-sim [-h] [-c clients] [-p peers]"
+		      " [-k packets] [-i ms] [-s bytes] [-w ms]\n"
+		      "\t\t   [-d us] [-j us] [-l ppm] [-r ppm] [-S seed]\n"
+		      "\t-c <n>     Number of clients (100)\n"
+		      "\t-p <n>     Number of peers (10)\n"
+		      "\t-k <n>     ChannelData packets per client (50)\n"
+		      "\t-i <ms>    Packet interval (20)\n"
+		      "\t-s <bytes> Payload size (100)\n"
+		      "\t-w <ms>    Spread client start over (1000)\n"
+		      "\t-d <us>    One way latency (20000)\n"
+		      "\t-j <us>    Jitter (0)\n"
+		      "\t-l <ppm>   Packet loss (0)\n"
+		      "\t-r <ppm>   Packet reordering (0)\n"
+		      "\t-S <seed>  Random seed (1)\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct sim_conf simc = {
+		.seed    = 1,
+		.latency = 20000,
+	};
+	uint64_t vstart, wall;
+	char confbuf[128];
+	bool sim = false;
+	uint32_t i;
+	int err;
+
+	simrun.clients  = 100;
+	simrun.peers    = 10;
+	simrun.packets  = 50;
+	simrun.interval = 20;
+	simrun.size     = 100;
+	simrun.ramp     = 1000;
+
+	for (;;) {
+
+		const int c = getopt(argc, argv, "hc:p:k:i:s:w:d:j:l:r:S:");
+		if (0 > c)
+			break;
+
+		switch (c) {
+
+		case 'c':
+			simrun.clients = (uint32_t)atoi(optarg);
+			break;
+
+		case 'p':
+			simrun.peers = (uint32_t)atoi(optarg);
+			break;
+
+		case 'k':
+			simrun.packets = (uint32_t)atoi(optarg);
+			break;
+
+		case 'i':
+			simrun.interval = (uint32_t)atoi(optarg);
+			break;
+
+		case 's':
+			simrun.size = (uint32_t)atoi(optarg);
+			break;
+
+		case 'w':
+			simrun.ramp = (uint32_t)atoi(optarg);
+			break;
+
+		case 'd':
+			simc.latency = (uint32_t)atoi(optarg);
+			break;
+
+		case 'j':
+			simc.jitter = (uint32_t)atoi(optarg);
+			break;
+
+		case 'l':
+			simc.loss = (uint32_t)atoi(optarg);
+			break;
+
+		case 'r':
+			simc.reorder = (uint32_t)atoi(optarg);
+			break;
+
+		case 'S':
+			simc.seed = strtoull(optarg, NULL, 0);
+			break;
+
+		case '?':
+		case 'h':
+		default:
+			usage();
+			return -2;
+		}
+	}
+
+	if (!simrun.clients || !simrun.peers || simrun.peers > PEERS_MAX ||
+	    simrun.size < PAYLOAD_MIN || simrun.size > PAYLOAD_MAX) {
+		usage();
+		return -2;
+	}
+
+	err = libre_init();
+	if (err)
+		return err;
+
+	simrun.clientv = mem_zalloc(simrun.clients * sizeof(*simrun.clientv),
+				    NULL);
+	simrun.peerv   = mem_zalloc(simrun.peers * sizeof(*simrun.peerv),
+				    NULL);
+	simrun.mb      = mbuf_alloc(2048);
+	if (!simrun.clientv || !simrun.peerv || !simrun.mb) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	(void)re_snprintf(confbuf, sizeof(confbuf),
+			  "turn_relay_addr 203.0.113.1\n"
+			  "turn_max_allocations %u\n", simrun.clients);
+
+	err = conf_alloc_buf(&simrun.conf, (uint8_t *)confbuf,
+			     strlen(confbuf));
+	if (err)
+		goto out;
+
+	err  = restund_ctr_init();
+	err |= restund_prof_init();
+	err |= restund_hist_init();
+	err |= restund_stun_init();
+	if (err)
+		goto out;
+
+	/* the transport must be in place before the modules open sockets */
+	err = sim_init(&simc);
+	if (err)
+		goto out;
+
+	sim = true;
+
+	err = exports_binding.init();
+	if (!err)
+		err = exports_turn.init();
+	if (err)
+		goto out;
+
+	vstart = sim_now();
+	wall   = restund_hist_clock();
+
+	err = run();
+	if (err) {
+		(void)re_fprintf(stderr, "restund-sim: %m\n", err);
+		goto out;
+	}
+
+	report(vstart, restund_hist_clock() - wall);
+
+ out:
+	for (i=0; simrun.clientv && i<simrun.clients; i++)
+		mem_deref(simrun.clientv[i].ss);
+	for (i=0; simrun.peerv && i<simrun.peers; i++)
+		mem_deref(simrun.peerv[i].ss);
+
+	(void)exports_turn.close();
+	(void)exports_binding.close();
+	simrun.srv = mem_deref(simrun.srv);
+
+	if (sim)
+		sim_close();
+
+	restund_stun_close();
+	restund_hist_close();
+	restund_prof_close();
+	restund_ctr_close();
+	simrun.clientv = mem_deref(simrun.clientv);
+	simrun.peerv   = mem_deref(simrun.peerv);
+	simrun.mb      = mem_deref(simrun.mb);
+	simrun.conf    = mem_deref(simrun.conf);
+
+	libre_close();
+
+	/* exit status 1 signals clients that could not set up */
+	return err ? err : (simrun.okc < simrun.clients ? 1 : 0);
+}
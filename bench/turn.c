@@ -0,0 +1,325 @@
+/**
+ * @file bench/turn.c  TURN allocation table benchmarks
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+/* the module is built into the benchmark to reach its static lookups */
+#include "../modules/turn/turn.c"
+#include "stund.h"
+#include "bench.h"
+
+
+/*
+ * The table is filled with synthetic allocations, without a relay
+ * socket each, so that a million of them fit in one process. Every
+ * allocation gets one permission and one channel through a real
+ * ChannelBind request. Requests are answered on a loopback socket.
+ */
+
+
+enum {
+	CHAN_NUMB = 0x4000,
+	DATA_SIZE = 100,
+};
+
+
+struct bench_turn {
+	struct allocation **alv;
+	uint32_t n;
+	struct udp_sock *us;
+	struct sa srv;
+	struct mbuf *mb;
+	size_t end;
+};
+
+
+extern const struct mod_export exports_binding;
+
+
+static void cli_addr(struct sa *sa, uint32_t i)
+{
+	sa_set_in(sa, 0x7f010000 + (i >> 14), 1024 + (i & 0x3fff));
+}
+
+
+static void peer_addr(struct sa *sa, uint32_t i)
+{
+	sa_set_in(sa, 0xc0000201 + i % 254, 1024 + (i >> 8) % 60000);
+}
+
+
+static void al_destructor(void *arg)
+{
+	struct allocation *al = arg;
+
+	hash_flush(al->perms);
+	mem_deref(al->perms);
+	acct_alloc_close(al);
+	mem_deref(al->chans);
+	hash_unlink(&al->he);
+	hash_unlink(&al->uhe);
+	hash_unlink(&al->phe);
+	tmr_cancel(&al->tmr);
+	mem_deref(al->username);
+	turnd.allocc_cur--;
+}
+
+
+static int al_create(struct allocation **alp, const struct sa *srv,
+		     uint32_t i)
+{
+	struct allocation *al;
+	int err;
+
+	al = mem_zalloc(sizeof(*al), al_destructor);
+	if (!al)
+		return ENOMEM;
+
+	tmr_init(&al->tmr);
+	cli_addr(&al->cli_addr, i);
+	al->srv_addr = *srv;
+	al->rel_addr = turnd.rel_addr;
+	sa_set_port(&al->rel_addr, 1024 + i % 64000);
+	sa_init(&al->rsv_addr, AF_UNSPEC);
+	al->proto = IPPROTO_UDP;
+	turnd.allocc_cur++;
+
+	err = re_sdprintf(&al->username, "user%u", i);
+	if (err)
+		goto out;
+
+	err  = perm_hash_alloc(&al->perms, 16);
+	err |= chanlist_alloc(&al->chans, 16);
+	if (err)
+		goto out;
+
+	hash_append(turnd.ht_alloc, sa_hash(&al->cli_addr, SA_ALL),
+		    &al->he, al);
+	hash_append(turnd.ht_user, hash_joaat_str(al->username),
+		    &al->uhe, al);
+	hash_append(turnd.ht_port, sa_port(&al->rel_addr), &al->phe, al);
+
+ out:
+	if (err)
+		mem_deref(al);
+	else
+		*alp = al;
+
+	return err;
+}
+
+
+static int stun_encode(struct mbuf *mb, uint16_t met, const struct sa *peer)
+{
+	const uint16_t numb = CHAN_NUMB;
+	uint8_t tid[STUN_TID_SIZE];
+
+	rand_bytes(tid, sizeof(tid));
+	mbuf_rewind(mb);
+
+	if (met == STUN_METHOD_CHANBIND)
+		return stun_msg_encode(mb, met, STUN_CLASS_REQUEST, tid,
+				       NULL, NULL, 0, false, 0, 2,
+				       STUN_ATTR_CHANNEL_NUMBER, &numb,
+				       STUN_ATTR_XOR_PEER_ADDR, peer);
+
+	return stun_msg_encode(mb, met, STUN_CLASS_REQUEST, tid,
+			       NULL, NULL, 0, false, 0, 0);
+}
+
+
+static void process(struct bench_turn *bt, uint32_t i)
+{
+	struct sa cli;
+
+	cli_addr(&cli, i);
+
+	bt->mb->pos = 0;
+	bt->mb->end = bt->end;
+
+	restund_process_msg(IPPROTO_UDP, bt->us, &cli, &bt->srv, bt->mb);
+}
+
+
+static void op_alloc_find(uint64_t i, void *arg)
+{
+	struct bench_turn *bt = arg;
+	struct sa cli;
+
+	cli_addr(&cli, bench_rand(i, bt->n));
+
+	bench_sink(allocation_find(IPPROTO_UDP, &cli, &bt->srv));
+}
+
+
+static void op_perm_find(uint64_t i, void *arg)
+{
+	struct bench_turn *bt = arg;
+	const uint32_t j = bench_rand(i, bt->n);
+	struct sa peer;
+
+	peer_addr(&peer, j);
+
+	bench_sink(perm_find(bt->alv[j]->perms, &peer));
+}
+
+
+static void op_chan_numb_find(uint64_t i, void *arg)
+{
+	struct bench_turn *bt = arg;
+
+	bench_sink(chan_numb_find(bt->alv[bench_rand(i, bt->n)]->chans,
+				  CHAN_NUMB));
+}
+
+
+static void op_chan_peer_find(uint64_t i, void *arg)
+{
+	struct bench_turn *bt = arg;
+	const uint32_t j = bench_rand(i, bt->n);
+	struct sa peer;
+
+	peer_addr(&peer, j);
+
+	bench_sink(chan_peer_find(bt->alv[j]->chans, &peer));
+}
+
+
+static void op_process(uint64_t i, void *arg)
+{
+	struct bench_turn *bt = arg;
+
+	process(bt, bench_rand(i, bt->n));
+}
+
+
+static int run_process(struct bench_turn *bt, const char *name,
+		       uint16_t met)
+{
+	int err;
+
+	err = stun_encode(bt->mb, met, NULL);
+	if (err)
+		return err;
+
+	bt->end = bt->mb->end;
+	bench_run(name, bt->n, 0, op_process, bt);
+
+	return 0;
+}
+
+
+/**
+ * Run the TURN benchmarks on a table of the given size
+ *
+ * @param size Number of allocations
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int bench_turn(uint32_t size)
+{
+	struct bench_turn bt;
+	size_t heap, bytes_al, bytes_ch;
+	struct sa laddr, peer;
+	uint32_t i;
+	int err;
+
+	memset(&bt, 0, sizeof(bt));
+
+	bt.n = size;
+	sa_set_str(&bt.srv, "127.0.0.1", 3478);
+	sa_set_str(&laddr, "127.0.0.1", 0);
+
+	err = bench_conf("turn_relay_addr 127.0.0.1\n"
+			 "turn_max_allocations %u\n", size);
+	if (err)
+		return err;
+
+	err = exports_binding.init();
+	if (err)
+		return err;
+
+	err = exports_turn.init();
+	if (err)
+		goto out;
+
+	err = udp_listen(&bt.us, &laddr, NULL, NULL);
+	if (err)
+		goto out;
+
+	bt.mb  = mbuf_alloc(256);
+	bt.alv = mem_zalloc(size * sizeof(*bt.alv), NULL);
+	if (!bt.mb || !bt.alv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	heap = bench_heap();
+
+	for (i=0; i<size; i++) {
+		err = al_create(&bt.alv[i], &bt.srv, i);
+		if (err)
+			goto out;
+	}
+
+	bytes_al = (bench_heap() - heap) / size;
+	heap = bench_heap();
+
+	for (i=0; i<size; i++) {
+
+		peer_addr(&peer, i);
+
+		err = stun_encode(bt.mb, STUN_METHOD_CHANBIND, &peer);
+		if (err)
+			goto out;
+
+		bt.end = bt.mb->end;
+		process(&bt, i);
+	}
+
+	bytes_ch = (bench_heap() - heap) / size;
+
+	if (!chan_numb_find(bt.alv[size - 1]->chans, CHAN_NUMB)) {
+		(void)re_fprintf(stderr, "turn: channel bind failed\n");
+		err = EPROTO;
+		goto out;
+	}
+
+	bench_run("turn_alloc_find", size, bytes_al, op_alloc_find, &bt);
+	bench_run("turn_perm_find", size, 0, op_perm_find, &bt);
+	bench_run("turn_chan_numb_find", size, bytes_ch,
+		  op_chan_numb_find, &bt);
+	bench_run("turn_chan_peer_find", size, 0, op_chan_peer_find, &bt);
+
+	err = run_process(&bt, "stun_binding", STUN_METHOD_BINDING);
+	if (!err)
+		err = run_process(&bt, "turn_refresh", STUN_METHOD_REFRESH);
+	if (err)
+		goto out;
+
+	/* ChannelData, the relay socket is missing so nothing is sent */
+	mbuf_rewind(bt.mb);
+	err  = mbuf_write_u16(bt.mb, htons(CHAN_NUMB));
+	err |= mbuf_write_u16(bt.mb, htons(DATA_SIZE));
+	err |= mbuf_fill(bt.mb, 0x5a, DATA_SIZE);
+	if (err)
+		goto out;
+
+	bt.end = bt.mb->end;
+	bench_run("turn_channel_data", size, 0, op_process, &bt);
+
+ out:
+	if (bt.alv) {
+		for (i=0; i<size; i++)
+			mem_deref(bt.alv[i]);
+	}
+
+	mem_deref(bt.alv);
+	mem_deref(bt.mb);
+	mem_deref(bt.us);
+	(void)exports_turn.close();
+	(void)exports_binding.close();
+
+	return err;
+}
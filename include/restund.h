@@ -8,19 +8,117 @@
 
 /* cmd */
 
+struct restund_cmdpage {
+	struct pl params;   /* "key=value" pairs separated by '&' or ' ' */
+	uint32_t cursor;    /* where to resume, 0 for the first page */
+	uint32_t limit;     /* maximum number of entries to print */
+	bool done;          /* set by the handler after the last entry */
+};
+
 typedef void(restund_cmd_h)(struct mbuf *mb);
+typedef void(restund_cmd_page_h)(struct mbuf *mb,
+				 struct restund_cmdpage *pg);
+typedef int(restund_cmd_json_h)(struct mbuf *mb,
+				struct restund_cmdpage *pg);
+typedef int(restund_cmd_post_h)(struct mbuf *mb, const struct pl *params);
 
 struct restund_cmdsub {
 	struct le le;
 	restund_cmd_h *cmdh;
 	const char *cmd;
+	restund_cmd_page_h *pageh;   /* optional, for long listings */
+	restund_cmd_json_h *jsonh;   /* optional, prints one JSON value */
+	restund_cmd_post_h *posth;   /* optional, changes server state */
 };
 
 void restund_cmd(const struct pl *cmd, struct mbuf *mb);
+int  restund_cmd_page(const struct pl *cmd, struct mbuf *mb,
+		      struct restund_cmdpage *pg);
+bool restund_cmd_paged(const struct pl *cmd);
+int  restund_cmd_param(const struct pl *params, const char *name,
+		       struct pl *val);
+int  restund_cmd_json(const struct pl *cmd, struct mbuf *mb,
+		      struct restund_cmdpage *pg);
+int  restund_cmd_post(const struct pl *cmd, struct mbuf *mb,
+		      const struct pl *params);
 void restund_cmd_subscribe(struct restund_cmdsub *cs);
 void restund_cmd_unsubscribe(struct restund_cmdsub *cs);
 
 
+/* sharded counters */
+
+struct restund_ctr {
+	struct le le;
+	const char *name;
+	uint32_t n;             /* number of counters in the set */
+
+	/* private */
+	void *mem;
+	void *shardv;
+	uint64_t *basev;
+	uint32_t stride;
+};
+
+int      restund_ctr_register(struct restund_ctr *ctr);
+void     restund_ctr_unregister(struct restund_ctr *ctr);
+void     restund_ctr_add(struct restund_ctr *ctr, uint32_t i, uint64_t v);
+uint64_t restund_ctr_get(const struct restund_ctr *ctr, uint32_t i);
+uint64_t restund_ctr_total(const struct restund_ctr *ctr, uint32_t i);
+void     restund_ctr_reset(struct restund_ctr *ctr);
+
+
+/* metrics */
+
+enum restund_metric_type {
+	RESTUND_METRIC_COUNTER = 0,
+	RESTUND_METRIC_GAUGE,
+};
+
+typedef uint64_t(restund_metric_h)(void);
+
+struct restund_metric {
+	struct le le;
+	const char *name;
+	const char *help;
+	const char *labels;     /* e.g. "code=\"400\"" or NULL */
+	enum restund_metric_type type;
+	const uint64_t *u64;    /* value is read from one of these */
+	const uint32_t *u32;
+	const struct restund_ctr *ctr;
+	uint32_t ctri;          /* index into ctr */
+	restund_metric_h *valh;
+};
+
+void restund_metric_register(struct restund_metric *mv, size_t n);
+void restund_metric_unregister(struct restund_metric *mv, size_t n);
+int  restund_metrics_encode(struct mbuf *mb);
+int  restund_metrics_encode_json(struct mbuf *mb);
+
+
+/* histogram */
+
+enum {
+	RESTUND_HIST_SUB  = 16,  /* sub-buckets per power of two */
+	RESTUND_HIST_BITS = 40,  /* values up to 2^40 */
+	RESTUND_HIST_SIZE = RESTUND_HIST_SUB * (RESTUND_HIST_BITS - 3),
+};
+
+struct restund_hist {
+	struct le le;
+	const char *name;
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t bucketv[RESTUND_HIST_SIZE];
+};
+
+void     restund_hist_register(struct restund_hist *h, const char *name);
+void     restund_hist_unregister(struct restund_hist *h);
+void     restund_hist_add(struct restund_hist *h, uint64_t val);
+uint64_t restund_hist_quantile(const struct restund_hist *h, double q);
+uint64_t restund_hist_clock(void);
+
+
 /* log */
 
 enum {
@@ -71,6 +169,7 @@ typedef bool(restund_stun_raw_h)(int proto,
 
 struct restund_stun {
 	struct le le;
+	const char *name;          /* shown by the profile command */
 	restund_stun_msg_h *reqh;
 	restund_stun_msg_h *indh;
 	restund_stun_raw_h *rawh;
@@ -80,6 +179,51 @@ void restund_stun_register_handler(struct restund_stun *stun);
 void restund_stun_unregister_handler(struct restund_stun *stun);
 
 
+/* transport */
+
+typedef int(restund_udp_listen_h)(void **sockp, struct sa *local,
+				  uint32_t bufsz, udp_recv_h *recvh,
+				  void *arg);
+typedef void(restund_udp_handler_h)(void *sock, udp_recv_h *recvh,
+				    void *arg);
+typedef int(restund_send_h)(int proto, void *sock, const struct sa *dst,
+			    struct mbuf *mb);
+typedef size_t(restund_txqsz_h)(int proto, void *sock);
+typedef time_t(restund_time_h)(void);
+
+struct restund_transp {
+	const char *name;
+	restund_udp_listen_h *listenh;
+	restund_udp_handler_h *handlerh;
+	restund_send_h *sendh;
+	restund_txqsz_h *txqszh;
+	restund_time_h *timeh;
+};
+
+void   restund_transp_set(const struct restund_transp *tp);
+int    restund_udp_listen(void **sockp, struct sa *local, uint32_t bufsz,
+			  udp_recv_h *recvh, void *arg);
+void   restund_udp_handler_set(void *sock, udp_recv_h *recvh, void *arg);
+int    restund_udp_fd(void *sock, int af);
+int    restund_send(int proto, void *sock, const struct sa *dst,
+		    struct mbuf *mb);
+size_t restund_txqsz(int proto, void *sock);
+time_t restund_time(void);
+int    restund_stun_reply(int proto, void *sock, const struct sa *dst,
+			  size_t presz, const struct stun_msg *req,
+			  const uint8_t *key, size_t keylen, bool fp,
+			  uint32_t attrc, ...);
+int    restund_stun_ereply(int proto, void *sock, const struct sa *dst,
+			   size_t presz, const struct stun_msg *req,
+			   uint16_t scode, const char *reason,
+			   const uint8_t *key, size_t keylen, bool fp,
+			   uint32_t attrc, ...);
+int    restund_stun_indication(int proto, void *sock, const struct sa *dst,
+			       size_t presz, uint16_t method,
+			       const uint8_t *key, size_t keylen, bool fp,
+			       uint32_t attrc, ...);
+
+
 /* database */
 struct restund_trafstat {
 	uint64_t pktc_tx;
@@ -88,6 +232,16 @@ struct restund_trafstat {
 	uint64_t bytc_rx;
 };
 
+struct restund_traffic {
+	struct restund_trafstat ts;
+	struct sa cli;
+	struct sa relay;
+	struct sa peer;
+	time_t start;
+	time_t end;
+	char username[513];  /* STUN USERNAME is at most 512 bytes */
+};
+
 
 typedef int(restund_db_auth_h)(const char *username, uint8_t *ha1);
 typedef int(restund_db_account_h)(const char *username, const char *ha1,
@@ -102,12 +256,15 @@ typedef int(restund_db_traffic_log_h)(const char *username,
 				      const char *realm,
 				      time_t start, time_t end,
 				      const struct restund_trafstat *ts);
+typedef int(restund_db_traffic_batch_h)(const struct restund_traffic *trfv,
+					uint32_t n, const char *realm);
 
 struct restund_db {
 	struct le le;
 	restund_db_account_all_h *allh;
 	restund_db_account_cnt_h *cnth;
 	restund_db_traffic_log_h *tlogh;
+	restund_db_traffic_batch_h *tlogbh;
 };
 
 int  restund_log_traffic(const char *username, const struct sa *cli,
@@ -130,6 +287,15 @@ struct tcp_sock *restund_tcp_socket(struct sa *sa, const struct sa *orig,
 struct dtls_sock *restund_dtls_socket(struct sa *sa, const struct sa *orig,
 				      bool ch_ip, bool ch_port);
 
+typedef bool(restund_udp_apply_h)(struct udp_sock *us,
+				  const struct sa *addr, void *arg);
+typedef bool(restund_udp_fast_h)(const struct sa *src, struct mbuf *mb,
+				 void *arg);
+
+struct udp_sock *restund_udp_apply(restund_udp_apply_h *ah, void *arg);
+void restund_udp_fast_set(struct udp_sock *us, restund_udp_fast_h *fasth,
+			  void *arg);
+
 bool restund_addr_is_blocked(const struct sa *sa);
 
 /*
@@ -22,10 +22,16 @@ static struct {
 	uint64_t secret;
 } auth;
 
-static struct {
-	uint64_t req_no_mi;
-	uint64_t req_mi;
-} authstats;
+enum {
+	AUTH_REQ_NO_MI = 0,
+	AUTH_REQ_MI,
+	AUTH_CTR_MAX
+};
+
+static struct restund_ctr authstats = {
+	.name = "auth",
+	.n    = AUTH_CTR_MAX,
+};
 
 
 static const char *mknonce(char *nonce, time_t now, const struct sa *src)
@@ -95,7 +101,7 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 			    const struct stun_msg *msg)
 {
 	struct stun_attr *mi, *user, *realm, *nonce;
-	const time_t now = time(NULL);
+	const time_t now = restund_time();
 	char nstr[NONCE_MAX_SIZE + 1];
 	int err;
 	(void)dst;
@@ -108,48 +114,49 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 	realm = stun_msg_attr(msg, STUN_ATTR_REALM);
 	nonce = stun_msg_attr(msg, STUN_ATTR_NONCE);
 
-	if (mi) {
-		++authstats.req_mi;
-	}
-	else {
-		++authstats.req_no_mi;
-	}
+	restund_ctr_add(&authstats, mi ? AUTH_REQ_MI : AUTH_REQ_NO_MI, 1);
 
 	if (!mi) {
-		err = stun_ereply(proto, sock, src, 0, msg,
-				  401, "Unauthorized",
-				  NULL, 0, ctx->fp, 3,
-				  STUN_ATTR_REALM, restund_realm(),
-				  STUN_ATTR_NONCE, mknonce(nstr, now, src),
-				  STUN_ATTR_SOFTWARE, restund_software);
+		err = restund_stun_ereply(proto, sock, src, 0, msg,
+					  401, "Unauthorized",
+					  NULL, 0, ctx->fp, 3,
+					  STUN_ATTR_REALM, restund_realm(),
+					  STUN_ATTR_NONCE,
+					  mknonce(nstr, now, src),
+					  STUN_ATTR_SOFTWARE,
+					  restund_software);
 		goto unauth;
 	}
 
 	if (!user || !realm || !nonce) {
-		err = stun_ereply(proto, sock, src, 0, msg,
-				  400, "Bad Request",
-				  NULL, 0, ctx->fp, 1,
-				  STUN_ATTR_SOFTWARE, restund_software);
+		err = restund_stun_ereply(proto, sock, src, 0, msg,
+					  400, "Bad Request",
+					  NULL, 0, ctx->fp, 1,
+					  STUN_ATTR_SOFTWARE,
+					  restund_software);
 		goto unauth;
 	}
 
 	if (!nonce_validate(nonce->v.nonce, now, src)) {
-		err = stun_ereply(proto, sock, src, 0, msg,
-				  438, "Stale Nonce",
-				  NULL, 0, ctx->fp, 3,
-				  STUN_ATTR_REALM, restund_realm(),
-				  STUN_ATTR_NONCE, mknonce(nstr, now, src),
-				  STUN_ATTR_SOFTWARE, restund_software);
+		err = restund_stun_ereply(proto, sock, src, 0, msg,
+					  438, "Stale Nonce",
+					  NULL, 0, ctx->fp, 3,
+					  STUN_ATTR_REALM, restund_realm(),
+					  STUN_ATTR_NONCE,
+					  mknonce(nstr, now, src),
+					  STUN_ATTR_SOFTWARE,
+					  restund_software);
 		goto unauth;
 	}
 
 	ctx->key = mem_alloc(MD5_SIZE, NULL);
 	if (!ctx->key) {
 		restund_warning("auth: can't to allocate memory for MI key\n");
-		err = stun_ereply(proto, sock, src, 0, msg,
-				  500, "Server Error",
-				  NULL, 0, ctx->fp, 1,
-				  STUN_ATTR_SOFTWARE, restund_software);
+		err = restund_stun_ereply(proto, sock, src, 0, msg,
+					  500, "Server Error",
+					  NULL, 0, ctx->fp, 1,
+					  STUN_ATTR_SOFTWARE,
+					  restund_software);
 		goto unauth;
 	}
 
@@ -158,24 +165,28 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 	if (restund_get_ha1(user->v.username, ctx->key)) {
 		restund_info("auth: unknown user '%s' (%j)\n",
 			     user->v.username, src);
-		err = stun_ereply(proto, sock, src, 0, msg,
-				  401, "Unauthorized",
-				  NULL, 0, ctx->fp, 3,
-				  STUN_ATTR_REALM, restund_realm(),
-				  STUN_ATTR_NONCE, mknonce(nstr, now, src),
-				  STUN_ATTR_SOFTWARE, restund_software);
+		err = restund_stun_ereply(proto, sock, src, 0, msg,
+					  401, "Unauthorized",
+					  NULL, 0, ctx->fp, 3,
+					  STUN_ATTR_REALM, restund_realm(),
+					  STUN_ATTR_NONCE,
+					  mknonce(nstr, now, src),
+					  STUN_ATTR_SOFTWARE,
+					  restund_software);
 		goto unauth;
 	}
 
 	if (stun_msg_chk_mi(msg, ctx->key, ctx->keylen)) {
 		restund_info("auth: bad password for user '%s' (%j)\n",
 			     user->v.username, src);
-		err = stun_ereply(proto, sock, src, 0, msg,
-				  401, "Unauthorized",
-				  NULL, 0, ctx->fp, 3,
-				  STUN_ATTR_REALM, restund_realm(),
-				  STUN_ATTR_NONCE, mknonce(nstr, now, src),
-				  STUN_ATTR_SOFTWARE, restund_software);
+		err = restund_stun_ereply(proto, sock, src, 0, msg,
+					  401, "Unauthorized",
+					  NULL, 0, ctx->fp, 3,
+					  STUN_ATTR_REALM, restund_realm(),
+					  STUN_ATTR_NONCE,
+					  mknonce(nstr, now, src),
+					  STUN_ATTR_SOFTWARE,
+					  restund_software);
 		goto unauth;
 	}
 
@@ -191,25 +202,56 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 
 
 static struct restund_stun stun = {
+	.name = "auth",
 	.reqh = request_handler
 };
 
 
 static void stats_handler(struct mbuf *mb)
 {
-	(void)mbuf_printf(mb, "auth_req_mi %llu\n",    authstats.req_mi);
-	(void)mbuf_printf(mb, "auth_req_no_mi %llu\n", authstats.req_no_mi);
+	(void)mbuf_printf(mb, "auth_req_mi %llu\n",
+			  restund_ctr_get(&authstats, AUTH_REQ_MI));
+	(void)mbuf_printf(mb, "auth_req_no_mi %llu\n",
+			  restund_ctr_get(&authstats, AUTH_REQ_NO_MI));
+}
+
+
+static int stats_json(struct mbuf *mb, struct restund_cmdpage *pg)
+{
+	(void)pg;
+
+	return mbuf_printf(mb, "{\"auth_req_mi\":%llu,"
+			   "\"auth_req_no_mi\":%llu}",
+			   restund_ctr_get(&authstats, AUTH_REQ_MI),
+			   restund_ctr_get(&authstats, AUTH_REQ_NO_MI));
 }
 
 
 static struct restund_cmdsub cmd_authstats = {
-	.cmdh = stats_handler,
-	.cmd  = "authstats",
+	.cmdh  = stats_handler,
+	.cmd   = "authstats",
+	.jsonh = stats_json,
+};
+
+
+static struct restund_metric metricv[] = {
+	{ .name = "restund_auth_requests", .labels = "integrity=\"yes\"",
+	  .help = "Requests checked by the auth module",
+	  .ctr = &authstats, .ctri = AUTH_REQ_MI },
+	{ .name = "restund_auth_requests", .labels = "integrity=\"no\"",
+	  .help = "Requests checked by the auth module",
+	  .ctr = &authstats, .ctri = AUTH_REQ_NO_MI },
 };
 
 
 static int module_init(void)
 {
+	int err;
+
+	err = restund_ctr_register(&authstats);
+	if (err)
+		return err;
+
 	auth.nonce_expiry = NONCE_EXPIRY;
 	auth.secret = rand_u64();
 
@@ -218,6 +260,7 @@ static int module_init(void)
 	restund_stun_register_handler(&stun);
 
 	restund_cmd_subscribe(&cmd_authstats);
+	restund_metric_register(metricv, RE_ARRAY_SIZE(metricv));
 
 	restund_debug("auth: module loaded (nonce_expiry=%us)\n",
 		      auth.nonce_expiry);
@@ -228,8 +271,10 @@ static int module_init(void)
 
 static int module_close(void)
 {
+	restund_metric_unregister(metricv, RE_ARRAY_SIZE(metricv));
 	restund_cmd_unsubscribe(&cmd_authstats);
 	restund_stun_unregister_handler(&stun);
+	restund_ctr_unregister(&authstats);
 
 	restund_debug("auth: module closed\n");
 
@@ -6,6 +6,7 @@
 
 #include <re.h>
 #include <restund.h>
+#include "binding.h"
 
 
 /*
@@ -14,9 +15,34 @@
  *     1.2.3.4:3478
  *     5.6.7.8:3478
  *     5.6.7.8:3479
+ *
+ * With binding_fastpath, plain Binding requests on the udp_listen
+ * sockets are answered before the STUN decoder and the module chain
+ * (see fast.c). The responses of one pass of the main loop are sent
+ * together from a zero timer. They are not counted by the stat
+ * module.
  */
 
 
+struct fast_lstnr {
+	struct le le;
+	struct udp_sock *us;
+	struct binding_tmpl tmpl;
+	struct tmr tmr;
+	struct binding_pkt pktv[BINDING_BATCH_MAX];
+	struct mbuf *mbv[BINDING_BATCH_MAX];
+	unsigned n;
+};
+
+
+static struct list lstnrl;
+
+struct restund_ctr binding_ctr = {
+	.name = "binding",
+	.n    = BINDING_CTR_MAX,
+};
+
+
 static void *get_sock(struct sa *sa, int proto, const struct sa *orig,
 		      bool ch_ip, bool ch_port)
 {
@@ -51,11 +77,12 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 	restund_debug("binding: request from %J\n", src);
 
 	if (ctx->ua.typec > 0) {
-		err = stun_ereply(proto, sock, src, 0, msg,
-				  420, "Unknown Attribute",
-				  ctx->key, ctx->keylen, ctx->fp, 2,
-				  STUN_ATTR_UNKNOWN_ATTR, &ctx->ua,
-				  STUN_ATTR_SOFTWARE, restund_software);
+		err = restund_stun_ereply(proto, sock, src, 0, msg,
+					  420, "Unknown Attribute",
+					  ctx->key, ctx->keylen, ctx->fp, 2,
+					  STUN_ATTR_UNKNOWN_ATTR, &ctx->ua,
+					  STUN_ATTR_SOFTWARE,
+					  restund_software);
 		goto out;
 	}
 
@@ -83,14 +110,14 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 	   Binding Response.
 	 */
 
-	err = stun_reply(proto, sock, &peer, 0, msg,
-			 ctx->key, ctx->keylen, ctx->fp, 5,
-			 STUN_ATTR_XOR_MAPPED_ADDR, src,
-			 STUN_ATTR_MAPPED_ADDR, src,
-			 STUN_ATTR_OTHER_ADDR,
-			     sa_isset(&other, SA_ALL) ? &other : NULL,
-			 STUN_ATTR_RESP_ORIGIN, dst,
-			 STUN_ATTR_SOFTWARE, restund_software);
+	err = restund_stun_reply(proto, sock, &peer, 0, msg,
+				 ctx->key, ctx->keylen, ctx->fp, 5,
+				 STUN_ATTR_XOR_MAPPED_ADDR, src,
+				 STUN_ATTR_MAPPED_ADDR, src,
+				 STUN_ATTR_OTHER_ADDR,
+				     sa_isset(&other, SA_ALL) ? &other : NULL,
+				 STUN_ATTR_RESP_ORIGIN, dst,
+				 STUN_ATTR_SOFTWARE, restund_software);
 
  out:
 	if (err) {
@@ -101,24 +128,239 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 }
 
 
+static void flush(struct fast_lstnr *fl)
+{
+	unsigned i;
+	int err;
+
+	tmr_cancel(&fl->tmr);
+
+	if (!fl->n)
+		return;
+
+	err = binding_send(udp_sock_fd(fl->us, sa_af(&fl->tmpl.addr)),
+			   fl->pktv, fl->n);
+	if (err) {
+		restund_ctr_add(&binding_ctr, BINDING_TX_ERR, 1);
+		restund_warning("binding: send: %m\n", err);
+	}
+
+	for (i=0; i<fl->n; i++)
+		fl->mbv[i] = mem_deref(fl->mbv[i]);
+
+	fl->n = 0;
+}
+
+
+static void flush_handler(void *arg)
+{
+	flush(arg);
+}
+
+
+static bool fast_handler(const struct sa *src, struct mbuf *mb, void *arg)
+{
+	struct fast_lstnr *fl = arg;
+	struct binding_pkt *pkt;
+	struct binding_req req;
+	size_t len;
+	int err;
+
+	err = binding_parse(mbuf_buf(mb), mbuf_get_left(mb), &req);
+	if (err == EBADMSG)
+		return false;
+
+	/* NATBD requests and credentials take the module chain */
+	if (err || req.ch_ip || req.ch_port || req.resp_port)
+		goto slow;
+
+	len = binding_encode(mbuf_buf(mb), mb->size - mb->pos, src,
+			     &fl->tmpl);
+	if (!len)
+		goto slow;
+
+	pkt = &fl->pktv[fl->n];
+	pkt->buf = mbuf_buf(mb);
+	pkt->len = len;
+	pkt->dst = *src;
+	fl->mbv[fl->n++] = mem_ref(mb);
+
+	restund_ctr_add(&binding_ctr, BINDING_FAST_REQ, 1);
+
+	if (fl->n == BINDING_BATCH_MAX)
+		flush(fl);
+	else if (fl->n == 1)
+		tmr_start(&fl->tmr, 0, flush_handler, fl);
+
+	return true;
+
+ slow:
+	restund_ctr_add(&binding_ctr, BINDING_FAST_SLOW, 1);
+	return false;
+}
+
+
+static void lstnr_destructor(void *arg)
+{
+	struct fast_lstnr *fl = arg;
+
+	restund_udp_fast_set(fl->us, NULL, NULL);
+	flush(fl);
+	list_unlink(&fl->le);
+}
+
+
+static bool lstnr_handler(struct udp_sock *us, const struct sa *addr,
+			  void *arg)
+{
+	struct fast_lstnr *fl;
+	struct sa other;
+	int err;
+	(void)arg;
+
+	fl = mem_zalloc(sizeof(*fl), lstnr_destructor);
+	if (!fl)
+		return true;
+
+	/* OTHER-ADDRESS is looked up once per listener */
+	if (!restund_udp_socket(&other, addr, true, true))
+		sa_init(&other, AF_UNSPEC);
+
+	err = binding_tmpl_init(&fl->tmpl, addr, &other);
+	if (err) {
+		restund_warning("binding: fast path %J: %m\n", addr, err);
+		mem_deref(fl);
+		return false;
+	}
+
+	tmr_init(&fl->tmr);
+	fl->us = us;
+	list_append(&lstnrl, &fl->le, fl);
+	restund_udp_fast_set(us, fast_handler, fl);
+
+	restund_debug("binding: fast path on %J\n", addr);
+
+	return false;
+}
+
+
+static void print_stats(struct mbuf *mb)
+{
+	(void)mbuf_printf(mb, "fast_req %llu\n",
+			  restund_ctr_get(&binding_ctr, BINDING_FAST_REQ));
+	(void)mbuf_printf(mb, "fast_slow %llu\n",
+			  restund_ctr_get(&binding_ctr, BINDING_FAST_SLOW));
+	(void)mbuf_printf(mb, "worker_req %llu\n",
+			  restund_ctr_get(&binding_ctr, BINDING_WORKER_REQ));
+	(void)mbuf_printf(mb, "worker_drop %llu\n",
+			  restund_ctr_get(&binding_ctr,
+					  BINDING_WORKER_DROP));
+	(void)mbuf_printf(mb, "batches %llu\n",
+			  restund_ctr_get(&binding_ctr, BINDING_BATCH));
+	(void)mbuf_printf(mb, "tx_err %llu\n",
+			  restund_ctr_get(&binding_ctr, BINDING_TX_ERR));
+}
+
+
+static int stats_json(struct mbuf *mb, struct restund_cmdpage *pg)
+{
+	(void)pg;
+
+	return mbuf_printf(mb, "{\"fast_req\":%llu,\"fast_slow\":%llu,"
+			   "\"worker_req\":%llu,\"worker_drop\":%llu,"
+			   "\"batches\":%llu,\"tx_err\":%llu}",
+			   restund_ctr_get(&binding_ctr, BINDING_FAST_REQ),
+			   restund_ctr_get(&binding_ctr, BINDING_FAST_SLOW),
+			   restund_ctr_get(&binding_ctr, BINDING_WORKER_REQ),
+			   restund_ctr_get(&binding_ctr,
+					   BINDING_WORKER_DROP),
+			   restund_ctr_get(&binding_ctr, BINDING_BATCH),
+			   restund_ctr_get(&binding_ctr, BINDING_TX_ERR));
+}
+
+
 static struct restund_stun stun = {
+	.name = "binding",
 	.reqh = request_handler,
 };
 
 
+static struct restund_cmdsub cmd_binding = {
+	.cmdh  = print_stats,
+	.cmd   = "binding",
+	.jsonh = stats_json,
+};
+
+
+static struct restund_metric metricv[] = {
+	{ .name = "restund_binding_fast_requests", .labels = "path=\"loop\"",
+	  .help = "Binding requests answered by the fast path",
+	  .ctr = &binding_ctr, .ctri = BINDING_FAST_REQ },
+	{ .name = "restund_binding_fast_requests",
+	  .labels = "path=\"worker\"",
+	  .help = "Binding requests answered by the fast path",
+	  .ctr = &binding_ctr, .ctri = BINDING_WORKER_REQ },
+	{ .name = "restund_binding_fast_fallbacks",
+	  .help = "Binding requests passed on to the module chain",
+	  .ctr = &binding_ctr, .ctri = BINDING_FAST_SLOW },
+	{ .name = "restund_binding_worker_drops",
+	  .help = "Packets dropped by the Binding workers",
+	  .ctr = &binding_ctr, .ctri = BINDING_WORKER_DROP },
+	{ .name = "restund_binding_send_errors",
+	  .help = "Failed Binding response batches",
+	  .ctr = &binding_ctr, .ctri = BINDING_TX_ERR },
+};
+
+
 static int module_init(void)
 {
+	uint32_t workers = 0;
+	bool fast = false;
+	int err;
+
+	err = restund_ctr_register(&binding_ctr);
+	if (err)
+		return err;
+
 	restund_stun_register_handler(&stun);
 
+	(void)conf_get_bool(restund_conf(), "binding_fastpath", &fast);
+	(void)conf_get_u32(restund_conf(), "binding_workers", &workers);
+
+	list_init(&lstnrl);
+	if (fast)
+		(void)restund_udp_apply(lstnr_handler, NULL);
+
+	err = binding_worker_init(workers);
+	if (err) {
+		restund_warning("binding: workers: %m\n", err);
+		goto out;
+	}
+
+	restund_cmd_subscribe(&cmd_binding);
+	restund_metric_register(metricv, RE_ARRAY_SIZE(metricv));
+
 	restund_debug("binding: module loaded\n");
 
-	return 0;
+ out:
+	if (err) {
+		list_flush(&lstnrl);
+		restund_stun_unregister_handler(&stun);
+		restund_ctr_unregister(&binding_ctr);
+	}
+
+	return err;
 }
 
 
 static int module_close(void)
 {
+	restund_metric_unregister(metricv, RE_ARRAY_SIZE(metricv));
+	restund_cmd_unsubscribe(&cmd_binding);
+	binding_worker_close();
+	list_flush(&lstnrl);
 	restund_stun_unregister_handler(&stun);
+	restund_ctr_unregister(&binding_ctr);
 
 	restund_debug("binding: module closed\n");
 
@@ -0,0 +1,57 @@
+/**
+ * @file binding.h Internal Binding interface
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+enum binding_ctr {
+	BINDING_FAST_REQ = 0,   /* answered by the main loop fast path */
+	BINDING_FAST_SLOW,      /* passed on to the module chain */
+	BINDING_WORKER_REQ,     /* answered by a worker thread */
+	BINDING_WORKER_DROP,    /* not a Binding request the worker answers */
+	BINDING_BATCH,          /* sendmmsg() calls */
+	BINDING_TX_ERR,
+	BINDING_CTR_MAX
+};
+
+enum {
+	BINDING_TAIL_MAX  = 256,
+	BINDING_BATCH_MAX = 32,
+	BINDING_RESP_MAX  = STUN_HEADER_SIZE + 2 * 24 + BINDING_TAIL_MAX,
+};
+
+/* the response attributes that only depend on the listener address */
+struct binding_tmpl {
+	struct sa addr;
+	size_t tailc;
+	uint8_t tail[BINDING_TAIL_MAX];
+};
+
+struct binding_req {
+	bool ch_ip;
+	bool ch_port;
+	uint16_t resp_port;     /* RESPONSE-PORT, or 0 */
+};
+
+struct binding_pkt {
+	const uint8_t *buf;
+	size_t len;
+	struct sa dst;
+};
+
+extern struct restund_ctr binding_ctr;
+
+
+/* fast */
+int    binding_tmpl_init(struct binding_tmpl *tmpl, const struct sa *addr,
+			 const struct sa *other);
+int    binding_parse(const uint8_t *buf, size_t len,
+		     struct binding_req *req);
+size_t binding_encode(uint8_t *buf, size_t size, const struct sa *src,
+		      const struct binding_tmpl *tmpl);
+int    binding_send(int fd, const struct binding_pkt *pktv, unsigned n);
+
+
+/* worker */
+int  binding_worker_init(uint32_t workers);
+void binding_worker_close(void);
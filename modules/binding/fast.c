@@ -0,0 +1,274 @@
+/**
+ * @file fast.c  Stateless Binding responder
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE 1
+#endif
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <re.h>
+#include <restund.h>
+#include "binding.h"
+
+
+/*
+ * A Binding request without credentials is answered from the request
+ * buffer alone: the response is written over the request, keeping the
+ * transaction ID, and only the mapped addresses are encoded per
+ * request. OTHER-ADDRESS, RESPONSE-ORIGIN and SOFTWARE are encoded once
+ * per listener address. The attributes are the same, in the same
+ * order, as in the response of the module chain.
+ *
+ * Requests with comprehension-required attributes other than
+ * CHANGE-REQUEST and RESPONSE-PORT (credentials, unknown attributes)
+ * and RFC 3489 requests are left to the module chain.
+ */
+
+
+static inline uint16_t rd16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+
+static inline void wr16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+
+static size_t put_addr(uint8_t *p, uint16_t type, const struct sa *sa,
+		       const uint8_t *xor)
+{
+	const bool v6 = sa_af(sa) == AF_INET6;
+	const size_t alen = v6 ? 16 : 4;
+	uint16_t port = sa_port(sa);
+	uint8_t *addr = p + 8;
+	size_t i;
+
+	wr16(p, type);
+	wr16(p + 2, (uint16_t)(4 + alen));
+	p[4] = 0;
+	p[5] = v6 ? 0x02 : 0x01;
+
+	if (v6) {
+		sa_in6(sa, addr);
+	}
+	else {
+		const uint32_t a = sa_in(sa);
+
+		addr[0] = a >> 24;
+		addr[1] = (a >> 16) & 0xff;
+		addr[2] = (a >> 8) & 0xff;
+		addr[3] = a & 0xff;
+	}
+
+	/* xor is the magic cookie followed by the transaction ID */
+	if (xor) {
+		port ^= STUN_MAGIC_COOKIE >> 16;
+		for (i=0; i<alen; i++)
+			addr[i] ^= xor[i];
+	}
+
+	wr16(p + 6, port);
+
+	return 8 + alen;
+}
+
+
+/**
+ * Encode the attributes which only depend on the listener address
+ *
+ * @param tmpl  Template to fill in
+ * @param addr  Listener address, for RESPONSE-ORIGIN
+ * @param other Alternate address for OTHER-ADDRESS (optional)
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int binding_tmpl_init(struct binding_tmpl *tmpl, const struct sa *addr,
+		      const struct sa *other)
+{
+	const size_t swlen = str_len(restund_software);
+	struct sa laddr;
+	uint8_t *p;
+
+	if (!tmpl || !addr)
+		return EINVAL;
+
+	if (2 * 24 + 4 + swlen + 3 > sizeof(tmpl->tail))
+		return ENAMETOOLONG;
+
+	/* addr may point into the template */
+	laddr = *addr;
+	memset(tmpl, 0, sizeof(*tmpl));
+	tmpl->addr = laddr;
+	p = tmpl->tail;
+
+	if (other && sa_isset(other, SA_ALL))
+		p += put_addr(p, STUN_ATTR_OTHER_ADDR, other, NULL);
+
+	p += put_addr(p, STUN_ATTR_RESP_ORIGIN, &laddr, NULL);
+
+	wr16(p, STUN_ATTR_SOFTWARE);
+	wr16(p + 2, (uint16_t)swlen);
+	memcpy(p + 4, restund_software, swlen);
+	p += 4 + ((swlen + 3) & ~(size_t)3);
+
+	tmpl->tailc = p - tmpl->tail;
+
+	return 0;
+}
+
+
+/**
+ * Check if a packet is a Binding request for the fast path
+ *
+ * @param buf Packet
+ * @param len Packet length
+ * @param req Returns CHANGE-REQUEST and RESPONSE-PORT
+ *
+ * @return 0 if it can be answered, ENOTSUP if it is a Binding request
+ *         for the module chain, EBADMSG if it is not a Binding request
+ */
+int binding_parse(const uint8_t *buf, size_t len, struct binding_req *req)
+{
+	size_t pos;
+
+	if (!buf || !req || len < STUN_HEADER_SIZE)
+		return EBADMSG;
+
+	if (buf[0] != 0x00 || buf[1] != 0x01 || (len & 0x3) ||
+	    (size_t)STUN_HEADER_SIZE + rd16(buf + 2) != len)
+		return EBADMSG;
+
+	if (buf[4] != 0x21 || buf[5] != 0x12 ||
+	    buf[6] != 0xa4 || buf[7] != 0x42)
+		return ENOTSUP;
+
+	memset(req, 0, sizeof(*req));
+
+	for (pos = STUN_HEADER_SIZE; pos + 4 <= len;) {
+
+		const uint16_t type = rd16(buf + pos);
+		const uint16_t alen = rd16(buf + pos + 2);
+
+		pos += 4;
+		if (pos + alen > len)
+			return EBADMSG;
+
+		switch (type) {
+
+		case STUN_ATTR_CHANGE_REQ:
+			if (alen != 4)
+				return ENOTSUP;
+
+			req->ch_ip   = (buf[pos + 3] & 0x04) != 0;
+			req->ch_port = (buf[pos + 3] & 0x02) != 0;
+			break;
+
+		case STUN_ATTR_RESP_PORT:
+			if (alen != 4)
+				return ENOTSUP;
+
+			req->resp_port = rd16(buf + pos);
+			break;
+
+		default:
+			if (type < 0x8000)
+				return ENOTSUP;
+			break;
+		}
+
+		pos += (alen + 3) & ~0x3;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Write a Binding success response over its request
+ *
+ * @param buf  Request, with room for the response
+ * @param size Size of buf
+ * @param src  Source address of the request
+ * @param tmpl Listener template
+ *
+ * @return Length of the response, or 0 if it does not fit
+ */
+size_t binding_encode(uint8_t *buf, size_t size, const struct sa *src,
+		      const struct binding_tmpl *tmpl)
+{
+	uint8_t *p = buf + STUN_HEADER_SIZE;
+
+	if (size < STUN_HEADER_SIZE + 2 * 24 + tmpl->tailc)
+		return 0;
+
+	p += put_addr(p, STUN_ATTR_XOR_MAPPED_ADDR, src, buf + 4);
+	p += put_addr(p, STUN_ATTR_MAPPED_ADDR, src, NULL);
+	memcpy(p, tmpl->tail, tmpl->tailc);
+	p += tmpl->tailc;
+
+	wr16(buf, STUN_METHOD_BINDING | 0x0100);
+	wr16(buf + 2, (uint16_t)(p - buf - STUN_HEADER_SIZE));
+
+	return p - buf;
+}
+
+
+/**
+ * Send a batch of responses on a socket, with one system call on Linux
+ *
+ * @param fd   Socket
+ * @param pktv Responses
+ * @param n    Number of responses, at most BINDING_BATCH_MAX
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int binding_send(int fd, const struct binding_pkt *pktv, unsigned n)
+{
+#ifdef __linux__
+	struct mmsghdr msgv[BINDING_BATCH_MAX];
+	struct iovec iov[BINDING_BATCH_MAX];
+#endif
+	unsigned i = 0;
+
+	if (fd < 0 || !pktv || n > BINDING_BATCH_MAX)
+		return EINVAL;
+
+#ifdef __linux__
+	memset(msgv, 0, n * sizeof(*msgv));
+
+	for (i=0; i<n; i++) {
+		iov[i].iov_base = (void *)pktv[i].buf;
+		iov[i].iov_len  = pktv[i].len;
+		msgv[i].msg_hdr.msg_name    = (void *)&pktv[i].dst.u.sa;
+		msgv[i].msg_hdr.msg_namelen = pktv[i].dst.len;
+		msgv[i].msg_hdr.msg_iov     = &iov[i];
+		msgv[i].msg_hdr.msg_iovlen  = 1;
+	}
+
+	for (i=0; i<n;) {
+
+		const int r = sendmmsg(fd, msgv + i, n - i, 0);
+		if (r < 0)
+			return errno;
+
+		restund_ctr_add(&binding_ctr, BINDING_BATCH, 1);
+		i += (unsigned)r;
+	}
+#else
+	for (; i<n; i++) {
+		if (sendto(fd, (const void *)pktv[i].buf, pktv[i].len, 0,
+			   &pktv[i].dst.u.sa, pktv[i].dst.len) < 0)
+			return errno;
+	}
+#endif
+
+	return 0;
+}
@@ -0,0 +1,411 @@
+/**
+ * @file worker.c  Binding worker threads
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE 1
+#endif
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <re.h>
+#include <restund.h>
+#include "binding.h"
+
+
+/*
+ * Every worker thread opens its own socket on each binding_listen
+ * address with SO_REUSEPORT, so the kernel spreads the requests over
+ * the workers. A worker only answers Binding requests without
+ * credentials, and drops everything else: it shares no state with the
+ * main loop except the read-only templates and the counters.
+ *
+ * CHANGE-REQUEST is answered from the socket of the alternate address,
+ * which is chosen when the module is loaded.
+ */
+
+
+enum {
+	ADDR_MAX = 8,
+	BUF_SIZE = 2048,
+	POLL_MS  = 200,
+};
+
+struct worker {
+	pthread_t thread;
+	bool started;
+	int fdv[ADDR_MAX];
+	uint8_t bufv[BINDING_BATCH_MAX][BUF_SIZE];
+};
+
+
+static struct {
+	struct binding_tmpl tmplv[ADDR_MAX];
+	int altv[ADDR_MAX][4];  /* address index by CHANGE-REQUEST */
+	uint32_t addrc;
+	struct worker **workerv;
+	uint32_t workerc;
+	uint32_t sockbuf_size;
+	atomic_bool quit;
+} wk;
+
+
+static int alt_index(uint32_t i, bool ch_ip, bool ch_port)
+{
+	const struct sa *orig = &wk.tmplv[i].addr;
+	uint32_t j;
+
+	if (!ch_ip && !ch_port)
+		return (int)i;
+
+	for (j=0; j<wk.addrc; j++) {
+
+		const struct sa *addr = &wk.tmplv[j].addr;
+
+		if (ch_ip && sa_cmp(orig, addr, SA_ADDR))
+			continue;
+
+		if (ch_port && sa_port(orig) == sa_port(addr))
+			continue;
+
+		return (int)j;
+	}
+
+	return (int)i;
+}
+
+
+static int sock_open(int *fdp, const struct sa *addr)
+{
+	int fd, on = 1;
+	int err = 0;
+
+	fd = socket(sa_af(addr), SOCK_DGRAM, 0);
+	if (fd < 0)
+		return errno;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+	    bind(fd, &addr->u.sa, addr->len) < 0) {
+		err = errno;
+		(void)close(fd);
+		return err;
+	}
+
+	if (wk.sockbuf_size > 0) {
+		const int sz = (int)wk.sockbuf_size;
+
+		(void)setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+		(void)setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+	}
+
+	*fdp = fd;
+
+	return 0;
+}
+
+
+static unsigned recv_batch(struct worker *w, int fd, struct sa *srcv,
+			   size_t *lenv)
+{
+#ifdef __linux__
+	struct mmsghdr msgv[BINDING_BATCH_MAX];
+	struct iovec iov[BINDING_BATCH_MAX];
+	int r;
+#endif
+	unsigned i, n = 0;
+
+#ifdef __linux__
+	memset(msgv, 0, sizeof(msgv));
+
+	for (i=0; i<BINDING_BATCH_MAX; i++) {
+		iov[i].iov_base = w->bufv[i];
+		iov[i].iov_len  = BUF_SIZE;
+		msgv[i].msg_hdr.msg_name    = &srcv[i].u.sa;
+		msgv[i].msg_hdr.msg_namelen = sizeof(srcv[i].u);
+		msgv[i].msg_hdr.msg_iov     = &iov[i];
+		msgv[i].msg_hdr.msg_iovlen  = 1;
+	}
+
+	r = recvmmsg(fd, msgv, BINDING_BATCH_MAX, MSG_DONTWAIT, NULL);
+	if (r <= 0)
+		return 0;
+
+	for (i=0; i<(unsigned)r; i++) {
+		srcv[i].len = msgv[i].msg_hdr.msg_namelen;
+		lenv[i]     = msgv[i].msg_len;
+	}
+
+	n = (unsigned)r;
+#else
+	for (i=0; i<BINDING_BATCH_MAX; i++) {
+
+		socklen_t len = sizeof(srcv[i].u);
+		ssize_t r;
+
+		r = recvfrom(fd, w->bufv[i], BUF_SIZE, MSG_DONTWAIT,
+			     &srcv[i].u.sa, &len);
+		if (r < 0)
+			break;
+
+		srcv[i].len = len;
+		lenv[i]     = (size_t)r;
+		++n;
+	}
+#endif
+
+	return n;
+}
+
+
+static void serve(struct worker *w, uint32_t i)
+{
+	struct binding_pkt pktv[BINDING_BATCH_MAX];
+	struct sa srcv[BINDING_BATCH_MAX];
+	size_t lenv[BINDING_BATCH_MAX];
+	unsigned j, n, pktc = 0;
+	uint64_t dropc = 0;
+	int err;
+
+	n = recv_batch(w, w->fdv[i], srcv, lenv);
+
+	for (j=0; j<n; j++) {
+
+		struct binding_pkt *pkt = &pktv[pktc];
+		struct binding_req req;
+		int k;
+
+		if (binding_parse(w->bufv[j], lenv[j], &req)) {
+			++dropc;
+			continue;
+		}
+
+		k = wk.altv[i][req.ch_ip * 2 + req.ch_port];
+
+		pkt->buf = w->bufv[j];
+		pkt->len = binding_encode(w->bufv[j], BUF_SIZE, &srcv[j],
+					  &wk.tmplv[k]);
+		pkt->dst = srcv[j];
+
+		if (!pkt->len) {
+			++dropc;
+			continue;
+		}
+
+		if (req.resp_port)
+			sa_set_port(&pkt->dst, req.resp_port);
+
+		if ((uint32_t)k == i) {
+			++pktc;
+			continue;
+		}
+
+		/* CHANGE-REQUEST, sent from the alternate socket */
+		err = binding_send(w->fdv[k], pkt, 1);
+		if (err)
+			restund_ctr_add(&binding_ctr, BINDING_TX_ERR, 1);
+	}
+
+	if (pktc) {
+		err = binding_send(w->fdv[i], pktv, pktc);
+		if (err)
+			restund_ctr_add(&binding_ctr, BINDING_TX_ERR, 1);
+	}
+
+	restund_ctr_add(&binding_ctr, BINDING_WORKER_REQ, n - dropc);
+	if (dropc)
+		restund_ctr_add(&binding_ctr, BINDING_WORKER_DROP, dropc);
+}
+
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct pollfd pfdv[ADDR_MAX];
+	uint32_t i;
+
+	for (i=0; i<wk.addrc; i++) {
+		pfdv[i].fd     = w->fdv[i];
+		pfdv[i].events = POLLIN;
+	}
+
+	while (!atomic_load(&wk.quit)) {
+
+		if (poll(pfdv, wk.addrc, POLL_MS) <= 0)
+			continue;
+
+		for (i=0; i<wk.addrc; i++) {
+
+			if (pfdv[i].revents & POLLIN)
+				serve(w, i);
+		}
+	}
+
+	return NULL;
+}
+
+
+static void worker_destructor(void *arg)
+{
+	struct worker *w = arg;
+	uint32_t i;
+
+	if (w->started)
+		(void)pthread_join(w->thread, NULL);
+
+	for (i=0; i<wk.addrc; i++) {
+		if (w->fdv[i] >= 0)
+			(void)close(w->fdv[i]);
+	}
+}
+
+
+static int worker_alloc(struct worker **wp)
+{
+	struct worker *w;
+	uint32_t i;
+	int err = 0;
+
+	w = mem_zalloc(sizeof(*w), worker_destructor);
+	if (!w)
+		return ENOMEM;
+
+	for (i=0; i<ADDR_MAX; i++)
+		w->fdv[i] = -1;
+
+	for (i=0; i<wk.addrc; i++) {
+
+		err = sock_open(&w->fdv[i], &wk.tmplv[i].addr);
+		if (err) {
+			restund_warning("binding: worker listen %J: %m\n",
+					&wk.tmplv[i].addr, err);
+			goto out;
+		}
+	}
+
+	err = pthread_create(&w->thread, NULL, worker_thread, w);
+	if (err)
+		goto out;
+
+	w->started = true;
+
+ out:
+	if (err)
+		mem_deref(w);
+	else
+		*wp = w;
+
+	return err;
+}
+
+
+static int listen_handler(const struct pl *addrport, void *arg)
+{
+	struct sa addr;
+	int err;
+	(void)arg;
+
+	err = sa_decode(&addr, addrport->p, addrport->l);
+	if (err || sa_is_any(&addr) || !sa_port(&addr)) {
+		restund_warning("bad binding_listen directive: '%r'\n",
+				addrport);
+		return EINVAL;
+	}
+
+	if (wk.addrc >= ADDR_MAX) {
+		restund_warning("binding: max %u binding_listen addresses\n",
+				ADDR_MAX);
+		return EOVERFLOW;
+	}
+
+	wk.tmplv[wk.addrc++].addr = addr;
+
+	return 0;
+}
+
+
+/**
+ * Start the worker threads on the binding_listen addresses
+ *
+ * @param workers Number of worker threads, 0 for none
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int binding_worker_init(uint32_t workers)
+{
+	uint32_t i, j;
+	int err;
+
+	memset(&wk, 0, sizeof(wk));
+
+	if (!workers)
+		return 0;
+
+	(void)conf_get_u32(restund_conf(), "udp_sockbuf_size",
+			   &wk.sockbuf_size);
+
+	err = conf_apply(restund_conf(), "binding_listen", listen_handler,
+			 NULL);
+	if (err)
+		return err;
+
+	if (!wk.addrc) {
+		restund_warning("binding: binding_workers without"
+				" binding_listen\n");
+		return 0;
+	}
+
+	/* OTHER-ADDRESS and the CHANGE-REQUEST sockets, as for udp_listen */
+	for (i=0; i<wk.addrc; i++) {
+
+		const int other = alt_index(i, true, true);
+
+		for (j=0; j<4; j++)
+			wk.altv[i][j] = alt_index(i, j & 2, j & 1);
+
+		err = binding_tmpl_init(&wk.tmplv[i], &wk.tmplv[i].addr,
+					other != (int)i ?
+					&wk.tmplv[other].addr : NULL);
+		if (err)
+			return err;
+	}
+
+	wk.workerv = mem_zalloc(workers * sizeof(*wk.workerv), NULL);
+	if (!wk.workerv)
+		return ENOMEM;
+
+	wk.workerc = workers;
+
+	for (i=0; i<workers; i++) {
+
+		err = worker_alloc(&wk.workerv[i]);
+		if (err) {
+			binding_worker_close();
+			return err;
+		}
+	}
+
+	restund_info("binding: %u workers on %u addresses\n",
+		     workers, wk.addrc);
+
+	return 0;
+}
+
+
+void binding_worker_close(void)
+{
+	uint32_t i;
+
+	atomic_store(&wk.quit, true);
+
+	for (i=0; wk.workerv && i<wk.workerc; i++)
+		mem_deref(wk.workerv[i]);
+
+	wk.workerv = mem_deref(wk.workerv);
+	wk.workerc = 0;
+}
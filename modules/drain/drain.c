@@ -44,8 +44,9 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 	return false;
 
 unavailable:
-	err = stun_ereply(proto, sock, src, 0, msg, 508, "Draining", NULL, 0,
-			  ctx->fp, 1, STUN_ATTR_SOFTWARE, restund_software);
+	err = restund_stun_ereply(proto, sock, src, 0, msg, 508, "Draining",
+				  NULL, 0, ctx->fp, 1,
+				  STUN_ATTR_SOFTWARE, restund_software);
 
 	if (err) {
 		restund_warning("drain reply error: %m\n", err);
@@ -75,25 +76,59 @@ static void drain_disable(struct mbuf *mb)
 }
 
 
+static int drain_json(struct mbuf *mb, struct restund_cmdpage *pg)
+{
+	(void)pg;
+
+	return mbuf_printf(mb, "{\"draining\":%s}",
+			   is_draining ? "true" : "false");
+}
+
+
+static int drain_post(struct mbuf *mb, const struct pl *params, bool on)
+{
+	(void)params;
+
+	is_draining = on;
+
+	return drain_json(mb, NULL);
+}
+
+
+static int drain_enable_post(struct mbuf *mb, const struct pl *params)
+{
+	return drain_post(mb, params, true);
+}
+
+
+static int drain_disable_post(struct mbuf *mb, const struct pl *params)
+{
+	return drain_post(mb, params, false);
+}
+
+
 static struct restund_cmdsub cmd_drain_print = {
-	.cmdh = drain_print,
-	.cmd  = "drain_state",
+	.cmdh  = drain_print,
+	.cmd   = "drain_state",
+	.jsonh = drain_json,
 };
 
 
 static struct restund_cmdsub cmd_drain_enable = {
-	.cmdh = drain_enable,
-	.cmd  = "drain_enable",
+	.cmdh  = drain_enable,
+	.cmd   = "drain_enable",
+	.posth = drain_enable_post,
 };
 
 
 static struct restund_cmdsub cmd_drain_disable = {
-	.cmdh = drain_disable,
-	.cmd  = "drain_disable",
+	.cmdh  = drain_disable,
+	.cmd   = "drain_disable",
+	.posth = drain_disable_post,
 };
 
 
-struct restund_stun stun = {.reqh = request_handler};
+struct restund_stun stun = {.name = "drain", .reqh = request_handler};
 
 static int module_init(void)
 {
@@ -4,7 +4,6 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
-#include <stdlib.h>
 #include <string.h>
 #include <mysql/mysql.h>
 #include <mysql/errmsg.h>
@@ -12,9 +11,60 @@
 #include <restund.h>
 
 
-#ifndef ER_NO_REFERENCED_ROW_2
-#define ER_NO_REFERENCED_ROW_2 1452
-#endif
+/*
+ * All queries use server-side prepared statements which are prepared
+ * once per connection. Account rows are streamed from the server one at
+ * a time instead of being buffered in the client.
+ *
+ * Traffic accounting is enabled by setting mysql_traffic_table. Each
+ * batch from the database thread is written in a single transaction as
+ * multi-row INSERTs of up to TLOG_ROWS rows. If the connection is lost
+ * the transaction is rolled back by the server, and the whole batch is
+ * retried once on a new connection. Table layout:
+ *
+ *     CREATE TABLE restund_traffic (
+ *         username VARCHAR(512) NOT NULL,
+ *         realm    VARCHAR(255) NOT NULL,
+ *         client   VARCHAR(64) NOT NULL,
+ *         relay    VARCHAR(64) NOT NULL,
+ *         peer     VARCHAR(64) NOT NULL,
+ *         start    BIGINT NOT NULL,
+ *         end      BIGINT NOT NULL,
+ *         pktc_tx  BIGINT UNSIGNED NOT NULL,
+ *         pktc_rx  BIGINT UNSIGNED NOT NULL,
+ *         bytc_tx  BIGINT UNSIGNED NOT NULL,
+ *         bytc_rx  BIGINT UNSIGNED NOT NULL);
+ */
+
+
+enum {
+	TLOG_ROWS = 32,
+	TLOG_COLS = 11,
+	NAME_SIZE = 256,
+	USER_SIZE = 513,   /* STUN USERNAME is at most 512 bytes */
+	HA1_SIZE  = 64,
+	ADDR_SIZE = 64,
+};
+
+enum tlog_col {
+	COL_CLI = 0,
+	COL_RELAY,
+	COL_PEER,
+	COL_ADDRC,
+};
+
+struct tlog_row {
+	char user[USER_SIZE];
+	unsigned long userlen;
+	char addr[COL_ADDRC][ADDR_SIZE];
+	unsigned long len[COL_ADDRC];
+	long long start;
+	long long end;
+	unsigned long long pktc_tx;
+	unsigned long long pktc_rx;
+	unsigned long long bytc_tx;
+	unsigned long long bytc_rx;
+};
 
 
 static struct {
@@ -22,11 +72,189 @@ static struct {
 	char user[128];
 	char pass[128];
 	char db[128];
+	char table[136];  /* quoted `db`.`table` */
 	MYSQL mysql;
+	bool connected;
 	uint32_t version;  /* SER Version, e.g. 1, 2 or 3 */
+	MYSQL_STMT *st_cnt;
+	MYSQL_STMT *st_all;
+	MYSQL_STMT *st_tlogv[TLOG_ROWS];  /* indexed by row count - 1 */
+	char realm[NAME_SIZE];
+	unsigned long realmlen;
+	char username[NAME_SIZE];
+	unsigned long usernamelen;
+	char ha1[HA1_SIZE];
+	unsigned long ha1len;
+	long long cnt;
+	struct tlog_row rowv[TLOG_ROWS];
+	MYSQL_BIND tlogv[TLOG_ROWS * TLOG_COLS];
 } my;
 
 
+static int myerr(unsigned int errnum)
+{
+	switch (errnum) {
+
+	case CR_SERVER_GONE_ERROR:
+	case CR_SERVER_LOST:
+		return ENOTCONN;
+
+	default:
+		return EIO;
+	}
+}
+
+
+static void bind_str(MYSQL_BIND *b, char *buf, size_t sz,
+		     unsigned long *len)
+{
+	memset(b, 0, sizeof(*b));
+
+	b->buffer_type   = MYSQL_TYPE_STRING;
+	b->buffer        = buf;
+	b->buffer_length = sz;
+	b->length        = len;
+}
+
+
+static void bind_int(MYSQL_BIND *b, void *val, bool is_unsigned)
+{
+	memset(b, 0, sizeof(*b));
+
+	b->buffer_type = MYSQL_TYPE_LONGLONG;
+	b->buffer      = val;
+	b->is_unsigned = is_unsigned;
+}
+
+
+static int prepare(MYSQL_STMT **stp, const char *sql, size_t len)
+{
+	MYSQL_STMT *st;
+
+	st = mysql_stmt_init(&my.mysql);
+	if (!st)
+		return ENOMEM;
+
+	if (mysql_stmt_prepare(st, sql, (unsigned long)len)) {
+		restund_error("mysql: prepare: %s\n", mysql_stmt_error(st));
+		mysql_stmt_close(st);
+		return EIO;
+	}
+
+	*stp = st;
+
+	return 0;
+}
+
+
+static int prepare_accounts(void)
+{
+	const char *sql_cnt, *sql_all;
+	MYSQL_BIND param, resv[2];
+	int err;
+
+	switch (my.version) {
+
+	case 2:
+		sql_cnt = "SELECT COUNT(*) "
+			  "FROM credentials WHERE realm = ?;";
+		sql_all = "SELECT auth_username, ha1 "
+			  "FROM credentials WHERE realm = ?;";
+		break;
+
+	default:
+		sql_cnt = "SELECT COUNT(*) "
+			  "FROM subscriber where domain = ?;";
+		sql_all = "SELECT username, ha1 "
+			  "FROM subscriber where domain = ?;";
+		break;
+	}
+
+	err  = prepare(&my.st_cnt, sql_cnt, strlen(sql_cnt));
+	err |= prepare(&my.st_all, sql_all, strlen(sql_all));
+	if (err)
+		return EIO;
+
+	bind_str(&param, my.realm, sizeof(my.realm), &my.realmlen);
+
+	bind_int(&resv[0], &my.cnt, false);
+
+	if (mysql_stmt_bind_param(my.st_cnt, &param) ||
+	    mysql_stmt_bind_result(my.st_cnt, resv))
+		return EIO;
+
+	/* leave room for the terminating zero */
+	bind_str(&resv[0], my.username, sizeof(my.username) - 1,
+		 &my.usernamelen);
+	bind_str(&resv[1], my.ha1, sizeof(my.ha1) - 1, &my.ha1len);
+
+	if (mysql_stmt_bind_param(my.st_all, &param) ||
+	    mysql_stmt_bind_result(my.st_all, resv))
+		return EIO;
+
+	return 0;
+}
+
+
+static int prepare_tlog(MYSQL_STMT **stp, uint32_t rows)
+{
+	struct mbuf *mb;
+	uint32_t i;
+	int err;
+
+	mb = mbuf_alloc(256 + rows * 40);
+	if (!mb)
+		return ENOMEM;
+
+	err = mbuf_printf(mb, "INSERT INTO %s (username, realm, client,"
+			  " relay, peer, start, end, pktc_tx, pktc_rx,"
+			  " bytc_tx, bytc_rx) VALUES ", my.table);
+
+	for (i=0; i<rows; i++) {
+		err |= mbuf_printf(mb, "%s(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)",
+				   i ? ", " : "");
+	}
+
+	err |= mbuf_write_u8(mb, ';');
+	if (err)
+		goto out;
+
+	err = prepare(stp, (const char *)mb->buf, mb->end);
+	if (err)
+		goto out;
+
+	if (mysql_stmt_bind_param(*stp, my.tlogv)) {
+		restund_error("mysql: bind: %s\n", mysql_stmt_error(*stp));
+		err = EIO;
+	}
+
+ out:
+	mem_deref(mb);
+
+	return err;
+}
+
+
+static void close_statements(void)
+{
+	uint32_t i;
+
+	for (i=0; i<TLOG_ROWS; i++) {
+		if (my.st_tlogv[i])
+			mysql_stmt_close(my.st_tlogv[i]);
+		my.st_tlogv[i] = NULL;
+	}
+
+	if (my.st_all)
+		mysql_stmt_close(my.st_all);
+	if (my.st_cnt)
+		mysql_stmt_close(my.st_cnt);
+
+	my.st_all = NULL;
+	my.st_cnt = NULL;
+}
+
+
 static int myconnect(void)
 {
 	mysql_init(&my.mysql);
@@ -39,161 +267,323 @@ static int myconnect(void)
 		      mysql_get_server_info(&my.mysql),
 		      mysql_get_host_info(&my.mysql));
 
+	if (prepare_accounts()) {
+		close_statements();
+		return EIO;
+	}
+
+	my.connected = true;
+
 	return 0;
 }
 
 
-static int query(MYSQL_RES **res, const char *fmt, ...)
+static int reconnect(void)
 {
-	bool failed = false;
-	char qstr[1024];
-	va_list ap;
 	int err;
 
-	va_start(ap, fmt);
-	err = re_vsnprintf(qstr, sizeof(qstr), fmt, ap);
-	va_end(ap);
+	close_statements();
+	mysql_close(&my.mysql);
+
+	my.connected = false;
+
+	err = myconnect();
+	if (err)
+		restund_error("mysql: %s\n", mysql_error(&my.mysql));
+
+	return err;
+}
 
-	if (err < 0)
-		return -1;
+
+static int set_realm(const char *realm)
+{
+	if (!my.connected && reconnect())
+		return ENOTCONN;
+
+	str_ncpy(my.realm, realm, sizeof(my.realm));
+	my.realmlen = (unsigned long)strlen(my.realm);
+
+	return 0;
+}
+
+
+static int accounts_getall(const char *realm, restund_db_account_h *acch,
+			   void *arg)
+{
+	bool retried = false;
+	int rc, err = 0;
+
+	if (!realm || !acch)
+		return EINVAL;
 
  retry:
-	if (!mysql_query(&my.mysql, qstr)) {
-		if (res) {
-			*res = mysql_store_result(&my.mysql);
-			if (!(*res))
-				return ENOMEM;
+	err = set_realm(realm);
+	if (err)
+		return err;
+
+	if (mysql_stmt_execute(my.st_all)) {
+
+		restund_warning("mysql: unable to select accounts: %s\n",
+				mysql_stmt_error(my.st_all));
+
+		err = myerr(mysql_stmt_errno(my.st_all));
+		if (err == ENOTCONN && !retried && !reconnect()) {
+			retried = true;
+			goto retry;
 		}
 
-		return 0;
+		return err;
 	}
 
-	if (failed)
-		return -1;
+	/* rows are streamed, a lost connection is not retried from here
+	   since some accounts have already been passed to the handler */
+	while (!err) {
 
-	switch (mysql_errno(&my.mysql)) {
+		my.usernamelen = 0;
+		my.ha1len = 0;
 
-	case CR_SERVER_GONE_ERROR:
-	case CR_SERVER_LOST:
-		failed = true;
-		mysql_close(&my.mysql);
+		rc = mysql_stmt_fetch(my.st_all);
+		if (rc == MYSQL_NO_DATA)
+			break;
 
-		err = myconnect();
-		if (err) {
-			restund_error("mysql: %s\n", mysql_error(&my.mysql));
+		if (rc == MYSQL_DATA_TRUNCATED) {
+			restund_warning("mysql: skipping account with"
+					" oversized username or ha1\n");
+			continue;
+		}
+
+		if (rc) {
+			restund_warning("mysql: unable to fetch accounts:"
+					" %s\n", mysql_stmt_error(my.st_all));
+			err = myerr(mysql_stmt_errno(my.st_all));
 			break;
 		}
 
-		goto retry;
+		my.username[MIN(my.usernamelen, sizeof(my.username)-1)] = 0;
+		my.ha1[MIN(my.ha1len, sizeof(my.ha1)-1)] = 0;
 
-	default:
-		err = -1;
-		break;
+		err = acch(my.username, my.ha1, arg);
 	}
 
+	mysql_stmt_free_result(my.st_all);
+
+	if (err == ENOTCONN)
+		my.connected = false;
+
 	return err;
 }
 
 
-static int accounts_getall(const char *realm, restund_db_account_h *acch,
-			   void *arg)
+static int accounts_count(const char *realm, uint32_t *n)
 {
-	MYSQL_RES *res;
-	int err = 0;
+	bool retried = false;
+	int rc, err = 0;
 
-	if (!realm || !acch)
+	if (!realm || !n)
 		return EINVAL;
 
-	switch (my.version) {
+ retry:
+	err = set_realm(realm);
+	if (err)
+		return err;
 
-	case 2:
-		err = query(&res,
-			    "SELECT auth_username, ha1 "
-			    "FROM credentials WHERE realm = '%s';",
-			    realm);
-		break;
+	if (mysql_stmt_execute(my.st_cnt)) {
 
-	default:
-		err = query(&res,
-			    "SELECT username, ha1 "
-			    "FROM subscriber where domain = '%s';",
-			    realm);
-		break;
-	}
+		restund_warning("mysql: unable to select nr of accounts: %s\n",
+				mysql_stmt_error(my.st_cnt));
+
+		err = myerr(mysql_stmt_errno(my.st_cnt));
+		if (err == ENOTCONN && !retried && !reconnect()) {
+			retried = true;
+			goto retry;
+		}
 
-	if (err) {
-		restund_warning("mysql: unable to select accounts: %s\n",
-				mysql_error(&my.mysql));
 		return err;
 	}
 
-	for (;!err;) {
-		MYSQL_ROW row;
+	rc = mysql_stmt_fetch(my.st_cnt);
+	if (rc == 0)
+		*n = (uint32_t)my.cnt;
+	else if (rc == MYSQL_NO_DATA)
+		err = ENOENT;
+	else
+		err = myerr(mysql_stmt_errno(my.st_cnt));
 
-		row = mysql_fetch_row(res);
-		if (!row)
-			break;
+	mysql_stmt_free_result(my.st_cnt);
 
-		err = acch(row[0] ? row[0] : "", row[1] ? row[1] : "", arg);
-	}
-
-	mysql_free_result(res);
+	if (err == ENOTCONN)
+		my.connected = false;
 
 	return err;
 }
 
 
-static int accounts_count(const char *realm, uint32_t *n)
+static void tlog_fill(struct tlog_row *row, const struct restund_traffic *trf)
 {
-	MYSQL_RES *res;
-	MYSQL_ROW row;
-	int err = 0;
+	str_ncpy(row->user, trf->username, sizeof(row->user));
+	(void)re_snprintf(row->addr[COL_CLI],   ADDR_SIZE, "%J", &trf->cli);
+	(void)re_snprintf(row->addr[COL_RELAY], ADDR_SIZE, "%J", &trf->relay);
+	(void)re_snprintf(row->addr[COL_PEER],  ADDR_SIZE, "%J", &trf->peer);
+
+	row->userlen        = (unsigned long)strlen(row->user);
+	row->len[COL_CLI]   = (unsigned long)strlen(row->addr[COL_CLI]);
+	row->len[COL_RELAY] = (unsigned long)strlen(row->addr[COL_RELAY]);
+	row->len[COL_PEER]  = (unsigned long)strlen(row->addr[COL_PEER]);
+
+	row->start   = (long long)trf->start;
+	row->end     = (long long)trf->end;
+	row->pktc_tx = trf->ts.pktc_tx;
+	row->pktc_rx = trf->ts.pktc_rx;
+	row->bytc_tx = trf->ts.bytc_tx;
+	row->bytc_rx = trf->ts.bytc_rx;
+}
 
-	if (!realm || !n)
-		return EINVAL;
 
-	switch (my.version) {
+static int tlog_insert(const struct restund_traffic *trfv, uint32_t n)
+{
+	MYSQL_STMT **stp = &my.st_tlogv[n - 1];
+	uint32_t i;
+	int err;
 
-	case 2:
-		err = query(&res,
-			    "SELECT COUNT(*) "
-			    "FROM credentials WHERE realm = '%s';",
-			    realm);
-		break;
+	if (!*stp) {
+		err = prepare_tlog(stp, n);
+		if (err)
+			return err;
+	}
 
-	default:
-		err = query(&res,
-			    "SELECT COUNT(*) "
-			    "FROM subscriber where domain = '%s';",
-			    realm);
-		break;
+	for (i=0; i<n; i++)
+		tlog_fill(&my.rowv[i], &trfv[i]);
+
+	if (mysql_stmt_execute(*stp)) {
+		restund_warning("mysql: unable to insert traffic: %s\n",
+				mysql_stmt_error(*stp));
+		return myerr(mysql_stmt_errno(*stp));
 	}
 
-	if (err) {
-		restund_warning("mysql: unable to select nr of accounts: %s\n",
-				mysql_error(&my.mysql));
+	return 0;
+}
+
+
+static int traffic_log(const struct restund_traffic *trfv, uint32_t n,
+		       const char *realm)
+{
+	bool retried = false;
+	uint32_t i, rows;
+	int err;
+
+	if (!trfv || !realm)
+		return EINVAL;
+
+ retry:
+	err = set_realm(realm);
+	if (err)
 		return err;
+
+	if (mysql_query(&my.mysql, "START TRANSACTION;")) {
+		err = myerr(mysql_errno(&my.mysql));
+		goto out;
 	}
 
-	row = mysql_fetch_row(res);
-	if (row)
-		*n = atoi(row[0]);
-	else
-		err = ENOENT;
+	for (i=0; i<n && !err; i+=rows) {
+		rows = MIN(n - i, (uint32_t)TLOG_ROWS);
+		err = tlog_insert(&trfv[i], rows);
+	}
 
-	mysql_free_result(res);
+	if (!err && mysql_commit(&my.mysql))
+		err = myerr(mysql_errno(&my.mysql));
+
+ out:
+	if (err == ENOTCONN) {
+		/* the server has rolled back, replay the whole batch */
+		if (!retried) {
+			retried = true;
+			if (!reconnect())
+				goto retry;
+		}
+		my.connected = false;
+	}
+	else if (err) {
+		(void)mysql_rollback(&my.mysql);
+	}
 
 	return err;
 }
 
 
+static bool ident_char(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		(c >= '0' && c <= '9') || c == '_';
+}
+
+
+/* [database.]table, quoted for the INSERT statement */
+static int table_set(const struct pl *name)
+{
+	const char *dot = NULL;
+	size_t i;
+
+	for (i=0; i<name->l; i++) {
+
+		if (name->p[i] == '.' && !dot)
+			dot = name->p + i;
+		else if (!ident_char(name->p[i]))
+			return EINVAL;
+	}
+
+	if (!name->l || dot == name->p || dot == name->p + name->l - 1)
+		return EINVAL;
+
+	if (name->l + 6 > sizeof(my.table))
+		return ENAMETOOLONG;
+
+	if (dot) {
+		(void)re_snprintf(my.table, sizeof(my.table), "`%b`.`%b`",
+				  name->p, (size_t)(dot - name->p),
+				  dot + 1, name->l - (dot - name->p) - 1);
+	}
+	else {
+		(void)re_snprintf(my.table, sizeof(my.table), "`%r`", name);
+	}
+
+	return 0;
+}
+
+
+static void tlog_bind(void)
+{
+	uint32_t i, j;
+
+	for (i=0; i<TLOG_ROWS; i++) {
+
+		struct tlog_row *row = &my.rowv[i];
+		MYSQL_BIND *b = &my.tlogv[i * TLOG_COLS];
+
+		bind_str(&b[0], row->user, sizeof(row->user), &row->userlen);
+		bind_str(&b[1], my.realm, sizeof(my.realm), &my.realmlen);
+
+		for (j=0; j<COL_ADDRC; j++)
+			bind_str(&b[2 + j], row->addr[j], ADDR_SIZE,
+				 &row->len[j]);
+
+		bind_int(&b[5],  &row->start,   false);
+		bind_int(&b[6],  &row->end,     false);
+		bind_int(&b[7],  &row->pktc_tx, true);
+		bind_int(&b[8],  &row->pktc_rx, true);
+		bind_int(&b[9],  &row->bytc_tx, true);
+		bind_int(&b[10], &row->bytc_rx, true);
+	}
+}
+
+
 static int module_init(void)
 {
 	static struct restund_db db = {
 		.allh  = accounts_getall,
 		.cnth  = accounts_count,
-		.tlogh = NULL,
 	};
+	struct pl table;
+	int err;
 
 	conf_get_str(restund_conf(), "mysql_host", my.host, sizeof(my.host));
 	conf_get_str(restund_conf(), "mysql_user", my.user, sizeof(my.user));
@@ -201,6 +591,19 @@ static int module_init(void)
 	conf_get_str(restund_conf(), "mysql_db",   my.db,   sizeof(my.db));
 	conf_get_u32(restund_conf(), "mysql_ser", &my.version);
 
+	if (!conf_get(restund_conf(), "mysql_traffic_table", &table)) {
+
+		err = table_set(&table);
+		if (err) {
+			restund_error("mysql: bad mysql_traffic_table '%r':"
+				      " %m\n", &table, err);
+			return err;
+		}
+
+		tlog_bind();
+		db.tlogbh = traffic_log;
+	}
+
 	if (myconnect()) {
 		restund_error("mysql: %s\n", mysql_error(&my.mysql));
 	}
@@ -213,8 +616,11 @@ static int module_init(void)
 
 static int module_close(void)
 {
+	close_statements();
 	mysql_close(&my.mysql);
 
+	my.connected = false;
+
 	restund_debug("mysql: module closed\n");
 
 	return 0;
@@ -66,7 +66,7 @@ static int auth_handler(const char *user, uint8_t *ha1)
 	if (err)
 		return err;
 
-	now = time(NULL);
+	now = restund_time();
 
 	if (expires < now) {
 		restund_debug("restauth: user '%s' expired %lli seconds ago\n",
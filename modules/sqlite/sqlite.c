@@ -0,0 +1,276 @@
+/**
+ * @file sqlite.c SQLite Database Backend
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <string.h>
+#include <sqlite3.h>
+#include <re.h>
+#include <restund.h>
+
+
+/*
+ * Embedded database backend for credentials and traffic accounting.
+ *
+ * All handlers are called from the database thread. Each batch of
+ * traffic records is inserted in a single transaction; if the batch
+ * fails it is rolled back and retried later by the database thread.
+ *
+ * Schema:
+ *
+ *     credentials (realm, username, ha1)
+ *     traffic     (username, realm, client, relay, peer, start, end,
+ *                  pktc_tx, pktc_rx, bytc_tx, bytc_rx)
+ */
+
+
+enum {
+	BUSY_TIMEOUT = 5000,
+};
+
+
+static struct {
+	char path[256];
+	sqlite3 *db;
+	sqlite3_stmt *st_cnt;
+	sqlite3_stmt *st_all;
+	sqlite3_stmt *st_tlog;
+} sq = {
+	.path = "/var/lib/restund/restund.db",
+};
+
+
+static const char schema[] =
+	"PRAGMA journal_mode=WAL;"
+	"PRAGMA synchronous=NORMAL;"
+	"CREATE TABLE IF NOT EXISTS credentials ("
+	" realm TEXT NOT NULL,"
+	" username TEXT NOT NULL,"
+	" ha1 TEXT NOT NULL,"
+	" PRIMARY KEY (realm, username));"
+	"CREATE TABLE IF NOT EXISTS traffic ("
+	" username TEXT NOT NULL,"
+	" realm TEXT NOT NULL,"
+	" client TEXT NOT NULL,"
+	" relay TEXT NOT NULL,"
+	" peer TEXT NOT NULL,"
+	" start INTEGER NOT NULL,"
+	" end INTEGER NOT NULL,"
+	" pktc_tx INTEGER NOT NULL,"
+	" pktc_rx INTEGER NOT NULL,"
+	" bytc_tx INTEGER NOT NULL,"
+	" bytc_rx INTEGER NOT NULL);";
+
+
+static int exec(const char *sql)
+{
+	char *errmsg = NULL;
+
+	if (SQLITE_OK != sqlite3_exec(sq.db, sql, NULL, NULL, &errmsg)) {
+		restund_warning("sqlite: %s\n", errmsg);
+		sqlite3_free(errmsg);
+		return EIO;
+	}
+
+	return 0;
+}
+
+
+static int prepare(sqlite3_stmt **stmtp, const char *sql)
+{
+	if (SQLITE_OK != sqlite3_prepare_v2(sq.db, sql, -1, stmtp, NULL)) {
+		restund_error("sqlite: prepare: %s\n", sqlite3_errmsg(sq.db));
+		return EIO;
+	}
+
+	return 0;
+}
+
+
+static int accounts_getall(const char *realm, restund_db_account_h *acch,
+			   void *arg)
+{
+	int err = 0, rc = SQLITE_DONE;
+
+	if (!realm || !acch)
+		return EINVAL;
+
+	sqlite3_bind_text(sq.st_all, 1, realm, -1, SQLITE_STATIC);
+
+	while (!err && SQLITE_ROW == (rc = sqlite3_step(sq.st_all))) {
+
+		const char *user = (const char *)
+			sqlite3_column_text(sq.st_all, 0);
+		const char *ha1  = (const char *)
+			sqlite3_column_text(sq.st_all, 1);
+
+		err = acch(user ? user : "", ha1 ? ha1 : "", arg);
+	}
+
+	if (!err && rc != SQLITE_DONE) {
+		restund_warning("sqlite: unable to select accounts: %s\n",
+				sqlite3_errmsg(sq.db));
+		err = EIO;
+	}
+
+	sqlite3_reset(sq.st_all);
+
+	return err;
+}
+
+
+static int accounts_count(const char *realm, uint32_t *n)
+{
+	int err = 0;
+
+	if (!realm || !n)
+		return EINVAL;
+
+	sqlite3_bind_text(sq.st_cnt, 1, realm, -1, SQLITE_STATIC);
+
+	if (SQLITE_ROW == sqlite3_step(sq.st_cnt)) {
+		*n = (uint32_t)sqlite3_column_int64(sq.st_cnt, 0);
+	}
+	else {
+		restund_warning("sqlite: unable to select nr of accounts:"
+				" %s\n", sqlite3_errmsg(sq.db));
+		err = EIO;
+	}
+
+	sqlite3_reset(sq.st_cnt);
+
+	return err;
+}
+
+
+static int traffic_insert(const struct restund_traffic *trf,
+			  const char *realm)
+{
+	char cstr[64], rstr[64], pstr[64];
+	sqlite3_stmt *st = sq.st_tlog;
+	int err = 0;
+
+	(void)re_snprintf(cstr, sizeof(cstr), "%J", &trf->cli);
+	(void)re_snprintf(rstr, sizeof(rstr), "%J", &trf->relay);
+	(void)re_snprintf(pstr, sizeof(pstr), "%J", &trf->peer);
+
+	sqlite3_bind_text(st,  1, trf->username, -1, SQLITE_STATIC);
+	sqlite3_bind_text(st,  2, realm, -1, SQLITE_STATIC);
+	sqlite3_bind_text(st,  3, cstr, -1, SQLITE_STATIC);
+	sqlite3_bind_text(st,  4, rstr, -1, SQLITE_STATIC);
+	sqlite3_bind_text(st,  5, pstr, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(st, 6, (sqlite3_int64)trf->start);
+	sqlite3_bind_int64(st, 7, (sqlite3_int64)trf->end);
+	sqlite3_bind_int64(st, 8, (sqlite3_int64)trf->ts.pktc_tx);
+	sqlite3_bind_int64(st, 9, (sqlite3_int64)trf->ts.pktc_rx);
+	sqlite3_bind_int64(st, 10, (sqlite3_int64)trf->ts.bytc_tx);
+	sqlite3_bind_int64(st, 11, (sqlite3_int64)trf->ts.bytc_rx);
+
+	if (SQLITE_DONE != sqlite3_step(st)) {
+		restund_warning("sqlite: unable to insert traffic: %s\n",
+				sqlite3_errmsg(sq.db));
+		err = EIO;
+	}
+
+	sqlite3_reset(st);
+
+	return err;
+}
+
+
+static int traffic_log(const struct restund_traffic *trfv, uint32_t n,
+		       const char *realm)
+{
+	uint32_t i;
+	int err;
+
+	err = exec("BEGIN;");
+	if (err)
+		return err;
+
+	for (i=0; i<n && !err; i++)
+		err = traffic_insert(&trfv[i], realm);
+
+	if (!err)
+		err = exec("COMMIT;");
+
+	if (err)
+		(void)exec("ROLLBACK;");
+
+	return err;
+}
+
+
+static int module_close(void)
+{
+	sqlite3_finalize(sq.st_tlog);
+	sqlite3_finalize(sq.st_all);
+	sqlite3_finalize(sq.st_cnt);
+	sqlite3_close(sq.db);
+
+	sq.st_tlog = NULL;
+	sq.st_all  = NULL;
+	sq.st_cnt  = NULL;
+	sq.db      = NULL;
+
+	restund_debug("sqlite: module closed\n");
+
+	return 0;
+}
+
+
+static int module_init(void)
+{
+	static struct restund_db db = {
+		.allh   = accounts_getall,
+		.cnth   = accounts_count,
+		.tlogbh = traffic_log,
+	};
+	int err;
+
+	conf_get_str(restund_conf(), "sqlite_path",
+		     sq.path, sizeof(sq.path));
+
+	if (SQLITE_OK != sqlite3_open(sq.path, &sq.db)) {
+		restund_error("sqlite: open '%s': %s\n", sq.path,
+			      sqlite3_errmsg(sq.db));
+		err = EIO;
+		goto out;
+	}
+
+	sqlite3_busy_timeout(sq.db, BUSY_TIMEOUT);
+
+	err = exec(schema);
+	if (err)
+		goto out;
+
+	err  = prepare(&sq.st_cnt,
+		       "SELECT COUNT(*) FROM credentials WHERE realm = ?;");
+	err |= prepare(&sq.st_all,
+		       "SELECT username, ha1 FROM credentials "
+		       "WHERE realm = ?;");
+	err |= prepare(&sq.st_tlog,
+		       "INSERT INTO traffic VALUES "
+		       "(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);");
+	if (err)
+		goto out;
+
+	restund_db_set_handler(&db);
+
+	restund_debug("sqlite: module loaded (%s)\n", sq.path);
+
+ out:
+	if (err)
+		(void)module_close();
+
+	return err;
+}
+
+
+const struct mod_export DECL_EXPORTS(sqlite) = {
+	.name = "sqlite",
+	.type = "database client",
+	.init = module_init,
+	.close = module_close,
+};
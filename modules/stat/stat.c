@@ -17,17 +17,24 @@
  */
 
 
-#define STAT_INC(var)         ++(stat.var)           /**< Stats inc */
+#define STAT_INC(i)   restund_ctr_add(&stat, (i), 1)  /**< Stats inc */
 
 
-static struct {
-	uint32_t n_bind_req;
-	uint32_t n_alloc_req;
-	uint32_t n_refresh_req;
-	uint32_t n_createperm_req;
-	uint32_t n_chanbind_req;
-	uint32_t n_unk_req;
-} stat;
+enum {
+	N_BIND_REQ = 0,
+	N_ALLOC_REQ,
+	N_REFRESH_REQ,
+	N_CREATEPERM_REQ,
+	N_CHANBIND_REQ,
+	N_UNK_REQ,
+	N_MAX
+};
+
+
+static struct restund_ctr stat = {
+	.name = "stat",
+	.n    = N_MAX,
+};
 
 
 static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
@@ -43,23 +50,23 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 	switch (stun_msg_method(msg)) {
 
 	case STUN_METHOD_BINDING:
-		STAT_INC(n_bind_req);
+		STAT_INC(N_BIND_REQ);
 		break;
 
 	case STUN_METHOD_ALLOCATE:
-		STAT_INC(n_alloc_req);
+		STAT_INC(N_ALLOC_REQ);
 		break;
 
 	case STUN_METHOD_REFRESH:
-		STAT_INC(n_refresh_req);
+		STAT_INC(N_REFRESH_REQ);
 		break;
 
 	case STUN_METHOD_CREATEPERM:
-		STAT_INC(n_createperm_req);
+		STAT_INC(N_CREATEPERM_REQ);
 		break;
 
 	case STUN_METHOD_CHANBIND:
-		STAT_INC(n_chanbind_req);
+		STAT_INC(N_CHANBIND_REQ);
 		break;
 
 	default:
@@ -67,7 +74,7 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 		if (!stun_msg_mcookie(msg))
 			break;
 
-		STAT_INC(n_unk_req);
+		STAT_INC(N_UNK_REQ);
 		break;
 	}
 
@@ -77,30 +84,77 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 
 static void print_stat(struct mbuf *mb)
 {
-	(void)mbuf_printf(mb, "binding_req %u\n", stat.n_bind_req);
-	(void)mbuf_printf(mb, "allocate_req %u\n", stat.n_alloc_req);
-	(void)mbuf_printf(mb, "refresh_req %u\n", stat.n_refresh_req);
-	(void)mbuf_printf(mb, "createperm_req %u\n", stat.n_createperm_req);
-	(void)mbuf_printf(mb, "chanbind_req %u\n", stat.n_chanbind_req);
-	(void)mbuf_printf(mb, "unknown_req %u\n", stat.n_unk_req);
+	(void)mbuf_printf(mb, "binding_req %llu\n",
+			  restund_ctr_get(&stat, N_BIND_REQ));
+	(void)mbuf_printf(mb, "allocate_req %llu\n",
+			  restund_ctr_get(&stat, N_ALLOC_REQ));
+	(void)mbuf_printf(mb, "refresh_req %llu\n",
+			  restund_ctr_get(&stat, N_REFRESH_REQ));
+	(void)mbuf_printf(mb, "createperm_req %llu\n",
+			  restund_ctr_get(&stat, N_CREATEPERM_REQ));
+	(void)mbuf_printf(mb, "chanbind_req %llu\n",
+			  restund_ctr_get(&stat, N_CHANBIND_REQ));
+	(void)mbuf_printf(mb, "unknown_req %llu\n",
+			  restund_ctr_get(&stat, N_UNK_REQ));
+}
+
+
+static int stat_json(struct mbuf *mb, struct restund_cmdpage *pg)
+{
+	(void)pg;
+
+	return mbuf_printf(mb, "{\"binding_req\":%llu,\"allocate_req\":%llu,"
+			   "\"refresh_req\":%llu,\"createperm_req\":%llu,"
+			   "\"chanbind_req\":%llu,\"unknown_req\":%llu}",
+			   restund_ctr_get(&stat, N_BIND_REQ),
+			   restund_ctr_get(&stat, N_ALLOC_REQ),
+			   restund_ctr_get(&stat, N_REFRESH_REQ),
+			   restund_ctr_get(&stat, N_CREATEPERM_REQ),
+			   restund_ctr_get(&stat, N_CHANBIND_REQ),
+			   restund_ctr_get(&stat, N_UNK_REQ));
 }
 
 
 static struct restund_stun stun = {
+	.name = "stat",
 	.reqh = request_handler
 };
 
 
 static struct restund_cmdsub cmd_stat = {
-	.cmdh = print_stat,
-	.cmd  = "stat",
+	.cmdh  = print_stat,
+	.cmd   = "stat",
+	.jsonh = stat_json,
+};
+
+
+static struct restund_metric metricv[] = {
+	{ .name = "restund_stun_requests", .labels = "method=\"binding\"",
+	  .help = "STUN requests", .ctr = &stat, .ctri = N_BIND_REQ },
+	{ .name = "restund_stun_requests", .labels = "method=\"allocate\"",
+	  .help = "STUN requests", .ctr = &stat, .ctri = N_ALLOC_REQ },
+	{ .name = "restund_stun_requests", .labels = "method=\"refresh\"",
+	  .help = "STUN requests", .ctr = &stat, .ctri = N_REFRESH_REQ },
+	{ .name = "restund_stun_requests", .labels = "method=\"createperm\"",
+	  .help = "STUN requests", .ctr = &stat, .ctri = N_CREATEPERM_REQ },
+	{ .name = "restund_stun_requests", .labels = "method=\"chanbind\"",
+	  .help = "STUN requests", .ctr = &stat, .ctri = N_CHANBIND_REQ },
+	{ .name = "restund_stun_requests", .labels = "method=\"unknown\"",
+	  .help = "STUN requests", .ctr = &stat, .ctri = N_UNK_REQ },
 };
 
 
 static int module_init(void)
 {
+	int err;
+
+	err = restund_ctr_register(&stat);
+	if (err)
+		return err;
+
 	restund_stun_register_handler(&stun);
 	restund_cmd_subscribe(&cmd_stat);
+	restund_metric_register(metricv, RE_ARRAY_SIZE(metricv));
 
 	restund_debug("stat: module loaded\n");
 
@@ -110,8 +164,10 @@ static int module_init(void)
 
 static int module_close(void)
 {
+	restund_metric_unregister(metricv, RE_ARRAY_SIZE(metricv));
 	restund_cmd_unsubscribe(&cmd_stat);
 	restund_stun_unregister_handler(&stun);
+	restund_ctr_unregister(&stat);
 
 	restund_debug("stat: module closed\n");
 
@@ -4,20 +4,43 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
+#include <string.h>
 #include <re.h>
 #include "httpd.h"
 
 
+/*
+ * Requests are collected in a per-connection buffer until they are
+ * complete, so they may arrive in any number of TCP segments, and
+ * several pipelined requests are answered in order. Connections are
+ * persistent; the buffers of a connection are reused for all of its
+ * requests.
+ */
+
+
 enum {
-	TCP_IDLE_TIMEOUT = 600 * 1000,
+	TCP_IDLE_TIMEOUT    = 600 * 1000,
+	HTTPD_STALL_TIMEOUT = 30 * 1000,  /* streaming without progress */
+	HTTPD_REQ_MAX       = 65536,      /* request head and body */
+	HTTPD_STREAM_TXQ    = 16384,      /* pause streaming above this */
 };
 
 
-struct conn {
+struct httpd_conn {
 	struct le le;
 	struct tmr tmr;
+	struct tmr tmr_stream;
 	struct httpd *httpd;
 	struct tcp_conn *tc;
+	struct mbuf *rx;      /* received, pos is the unparsed data */
+	struct mbuf *tx;      /* response head and chunks */
+	struct mbuf *body;    /* response body */
+	char ver[8];
+	bool keepalive;
+	httpd_chunk_h *chunkh;
+	void *arg;
+	bool chunked;
+	bool closing;         /* ignore further requests */
 };
 
 
@@ -28,60 +51,486 @@ struct httpd {
 };
 
 
+static void process(struct httpd_conn *conn);
+static void stream_handler(void *arg);
+
+
 static void timeout_handler(void *arg)
 {
-	struct conn *conn = arg;
+	struct httpd_conn *conn = arg;
 
 	conn = mem_deref(conn);
 }
 
 
-static void estab_handler(void *arg)
+static const char *reason(uint16_t scode)
 {
-	(void)arg;
+	switch (scode) {
+
+	case 200: return "OK";
+	case 400: return "Bad Request";
+	case 403: return "Forbidden";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 413: return "Payload Too Large";
+	case 503: return "Service Unavailable";
+	default:  return "Internal Server Error";
+	}
 }
 
 
-static void recv_handler(struct mbuf *mbrx, void *arg)
+static int send_response(struct httpd_conn *conn, uint16_t scode,
+			 const char *ctype, const struct mbuf *body)
 {
-	struct mbuf *mb = NULL, *body = NULL;
-	struct conn *conn = arg;
-	struct pl met, url, ver;
+	struct mbuf *mb = conn->tx;
 	int err = 0;
 
-	if (re_regex((char *)mbrx->buf, mbrx->end,
-		     "[^ ]+ [^ ]+ HTTP/[^\r\n]+\r\n", &met, &url, &ver)) {
-		re_printf("invalid http request\n");
-		goto out;
-	}
+	mbuf_rewind(mb);
 
-	mb   = mbuf_alloc(512);
-	body = mbuf_alloc(8192);
-	if (!mb || !body)
-		goto out;
+	err |= mbuf_printf(mb, "HTTP/%s %u %s\r\n", conn->ver, scode,
+			   reason(scode));
+	err |= mbuf_printf(mb, "Content-Type: %s\r\n", ctype);
+	err |= mbuf_printf(mb, "Content-Length: %zu\r\n", body->end);
+	err |= mbuf_printf(mb, "Connection: %s\r\n\r\n",
+			   conn->keepalive ? "keep-alive" : "close");
+	err |= mbuf_write_mem(mb, body->buf, body->end);
+	if (err)
+		return err;
+
+	mb->pos = 0;
 
-	conn->httpd->h(&url, body);
+	return tcp_send(conn->tc, mb);
+}
+
+
+/* an empty chunk ends the response, without chunks the connection */
+static int send_chunk(struct httpd_conn *conn, const struct mbuf *data)
+{
+	struct mbuf *mb = conn->tx;
+	int err = 0;
+
+	mbuf_rewind(mb);
+
+	if (!conn->chunked) {
+		if (!data->end)
+			return 0;
+
+		err = mbuf_write_mem(mb, data->buf, data->end);
+	}
+	else if (data->end) {
+		err |= mbuf_printf(mb, "%x\r\n", (unsigned)data->end);
+		err |= mbuf_write_mem(mb, data->buf, data->end);
+		err |= mbuf_write_str(mb, "\r\n");
+	}
+	else {
+		err |= mbuf_write_str(mb, "0\r\n\r\n");
+	}
 
-	err |= mbuf_printf(mb, "HTTP/%r 200 OK\r\n", &ver);
-	err |= mbuf_write_str(mb, "Content-Type: text/html;charset=UTF-8\r\n");
-	err |= mbuf_printf(mb, "Content-Length: %u\r\n\r\n", body->end);
-	err |= mbuf_write_mem(mb, body->buf, body->end);
 	if (err)
-		goto out;
+		return err;
 
 	mb->pos = 0;
-	tcp_send(conn->tc, mb);
 
-	tmr_start(&conn->tmr, TCP_IDLE_TIMEOUT, timeout_handler, conn);
- out:
-	mem_deref(mb);
-	mem_deref(body);
+	return tcp_send(conn->tc, mb);
+}
+
+
+static void stream_stop(struct httpd_conn *conn)
+{
+	tmr_cancel(&conn->tmr_stream);
+	conn->chunkh = NULL;
+	conn->arg = mem_deref(conn->arg);
+}
+
+
+/*
+ * Called when the send queue is empty, if set: resumes a stream which
+ * waited for the client, or closes a connection after the response.
+ */
+static void send_handler(void *arg)
+{
+	struct httpd_conn *conn = arg;
+
+	(void)tcp_set_send(conn->tc, NULL);
+
+	if (conn->chunkh)
+		tmr_start(&conn->tmr_stream, 0, stream_handler, conn);
+	else if (conn->closing)
+		conn = mem_deref(conn);
+}
+
+
+/* close the connection once the response has been sent */
+static void close_flushed(struct httpd_conn *conn)
+{
+	conn->closing = true;
+
+	tmr_start(&conn->tmr, HTTPD_STALL_TIMEOUT, timeout_handler, conn);
+
+	if (tcp_set_send(conn->tc, send_handler))
+		conn = mem_deref(conn);
+}
+
+
+/*
+ * One chunk is produced per main loop iteration, so a long listing
+ * does not block other work. Streaming pauses while the client does
+ * not read, and the connection is closed if it makes no progress.
+ * HTTP/1.0 responses have no chunks and end with the connection.
+ */
+static void stream_handler(void *arg)
+{
+	struct httpd_conn *conn = arg;
+	struct mbuf *mb = conn->body;
+	bool done;
+	int err = 0;
+
+	if (tcp_conn_txqsz(conn->tc) > HTTPD_STREAM_TXQ) {
+		err = tcp_set_send(conn->tc, send_handler);
+		if (err)
+			conn = mem_deref(conn);
+		return;
+	}
+
+	tmr_start(&conn->tmr, HTTPD_STALL_TIMEOUT, timeout_handler, conn);
+
+	mbuf_rewind(mb);
+
+	done = conn->chunkh(mb, conn->arg);
+
+	if (mb->end)
+		err = send_chunk(conn, mb);
+
+	if (done && !err) {
+		mbuf_rewind(mb);
+		err = send_chunk(conn, mb);
+	}
+
+	if (err) {
+		conn = mem_deref(conn);
+		return;
+	}
+
+	if (!done) {
+		tmr_start(&conn->tmr_stream, 0, stream_handler, conn);
+		return;
+	}
+
+	stream_stop(conn);
+
+	/* pipelined requests, or close */
+	process(conn);
+}
+
+
+/**
+ * Continue the response to the current request incrementally. The
+ * body printed by the request handler is sent first, then chunkh is
+ * called once per main loop iteration until it returns true.
+ *
+ * @param conn   HTTP connection
+ * @param chunkh Chunk handler
+ * @param arg    Handler argument, dereferenced when done
+ */
+void httpd_stream(struct httpd_conn *conn, httpd_chunk_h *chunkh, void *arg)
+{
+	if (!conn || !chunkh) {
+		mem_deref(arg);
+		return;
+	}
+
+	stream_stop(conn);
+
+	conn->chunkh = chunkh;
+	conn->arg    = arg;
+}
+
+
+static const char *find_eoh(const char *p, size_t n)
+{
+	size_t i;
+
+	for (i=3; i<n; i++) {
+
+		if (p[i] == '\n' && p[i-1] == '\r' &&
+		    p[i-2] == '\n' && p[i-3] == '\r')
+			return p + i + 1;
+	}
+
+	return NULL;
+}
+
+
+/* next field of a header block */
+static bool hdr_next(struct pl *hdrs, struct pl *name, struct pl *val)
+{
+	while (hdrs->l > 2) {
+
+		struct pl line;
+		const char *eol;
+
+		eol = memchr(hdrs->p, '\n', hdrs->l);
+		if (!eol)
+			break;
+
+		line.p = hdrs->p;
+		line.l = eol - hdrs->p;
+		pl_advance(hdrs, line.l + 1);
+
+		if (!re_regex(line.p, line.l, "[^:]+:[ \t]*[^\r]*",
+			      name, val))
+			return true;
+	}
+
+	return false;
+}
+
+
+/**
+ * Find a header field of a request
+ *
+ * @param req  HTTP request
+ * @param name Field name, case insensitive
+ * @param val  Returned field value
+ *
+ * @return 0 if found, otherwise ENOENT
+ */
+int httpd_req_hdr(const struct httpd_req *req, const char *name,
+		  struct pl *val)
+{
+	struct pl hdrs, n;
+
+	if (!req || !name || !val)
+		return EINVAL;
+
+	hdrs = req->hdrs;
+
+	while (hdr_next(&hdrs, &n, val)) {
+
+		if (!pl_strcasecmp(&n, name))
+			return 0;
+	}
+
+	return ENOENT;
+}
+
+
+/* returns ENODATA until the whole request has been received */
+static int request_parse(struct httpd_conn *conn, struct httpd_req *req,
+			 size_t *lenp)
+{
+	const char *p = (const char *)mbuf_buf(conn->rx);
+	const size_t n = mbuf_get_left(conn->rx);
+	struct pl uri, ver, hdrs, name, val;
+	const char *eoh, *eol;
+	uint32_t clen = 0;
+	size_t hlen;
+
+	eoh = find_eoh(p, n);
+	if (!eoh)
+		return n > HTTPD_REQ_MAX ? EOVERFLOW : ENODATA;
+
+	hlen = eoh - p;
+
+	if (re_regex(p, hlen, "[^ \r\n]+ [^ ]+ HTTP/[0-9.]+\r\n",
+		     &req->met, &uri, &ver) || req->met.p != p)
+		return EBADMSG;
+
+	(void)pl_strcpy(&ver, conn->ver, sizeof(conn->ver));
+	conn->keepalive = !pl_strcmp(&ver, "1.1");
+
+	/* path and query */
+	req->path = uri;
+	req->query.p = uri.p + uri.l;
+	req->query.l = 0;
+
+	eol = memchr(uri.p, '?', uri.l);
+	if (eol) {
+		req->path.l  = eol - uri.p;
+		req->query.p = eol + 1;
+		req->query.l = uri.l - req->path.l - 1;
+	}
+
+	/* header fields */
+	hdrs.p = ver.p + ver.l + 2;
+	hdrs.l = eoh - hdrs.p;
+
+	req->hdrs = hdrs;
+
+	while (hdr_next(&hdrs, &name, &val)) {
+
+		if (!pl_strcasecmp(&name, "Content-Length"))
+			clen = pl_u32(&val);
+		else if (!pl_strcasecmp(&name, "Connection") &&
+			 !pl_strcasecmp(&val, "close"))
+			conn->keepalive = false;
+		else if (!pl_strcasecmp(&name, "Connection") &&
+			 !pl_strcasecmp(&val, "keep-alive"))
+			conn->keepalive = true;
+	}
+
+	if (hlen + clen > HTTPD_REQ_MAX)
+		return EOVERFLOW;
+
+	if (n < hlen + clen)
+		return ENODATA;
+
+	req->body.p = eoh;
+	req->body.l = clen;
+
+	*lenp = hlen + clen;
+
+	return 0;
+}
+
+
+static int request_handle(struct httpd_conn *conn,
+			  const struct httpd_req *req)
+{
+	const char *ctype = NULL;
+	uint16_t scode;
+	int err = 0;
+
+	mbuf_rewind(conn->body);
+
+	scode = conn->httpd->h(conn, req, conn->body, &ctype);
+	if (!ctype)
+		ctype = "text/html;charset=UTF-8";
+
+	if (!conn->chunkh)
+		return send_response(conn, scode, ctype, conn->body);
+
+	conn->chunked = !strcmp(conn->ver, "1.1");
+
+	/* without chunks the end of the body is the end of the connection */
+	if (!conn->chunked)
+		conn->keepalive = false;
+
+	mbuf_rewind(conn->tx);
+
+	err |= mbuf_printf(conn->tx, "HTTP/%s 200 OK\r\n", conn->ver);
+	err |= mbuf_printf(conn->tx, "Content-Type: %s\r\n", ctype);
+	if (conn->chunked)
+		err |= mbuf_printf(conn->tx, "Transfer-Encoding: chunked\r\n");
+	err |= mbuf_printf(conn->tx, "Connection: %s\r\n\r\n",
+			   conn->keepalive ? "keep-alive" : "close");
+	if (err)
+		return err;
+
+	conn->tx->pos = 0;
+	err = tcp_send(conn->tc, conn->tx);
+
+	if (!err && conn->body->end)
+		err = send_chunk(conn, conn->body);
+	if (err)
+		return err;
+
+	tmr_start(&conn->tmr, HTTPD_STALL_TIMEOUT, timeout_handler, conn);
+	tmr_start(&conn->tmr_stream, 0, stream_handler, conn);
+
+	return 0;
+}
+
+
+static void process(struct httpd_conn *conn)
+{
+	struct mbuf *rx = conn->rx;
+	struct httpd_req req;
+	size_t len;
+	int err;
+
+	while (!conn->chunkh && mbuf_get_left(rx)) {
+
+		err = request_parse(conn, &req, &len);
+		if (err == ENODATA)
+			break;
+
+		if (err) {
+			mbuf_rewind(conn->body);
+			conn->keepalive = false;
+			err = send_response(conn, err == EOVERFLOW ? 413 : 400,
+					    "text/plain", conn->body);
+			if (err)
+				goto error;
+		}
+		else {
+			err = request_handle(conn, &req);
+			if (err)
+				goto error;
+
+			rx->pos += len;
+		}
+
+		/* no further requests, close after the response */
+		if (!conn->keepalive) {
+			conn->closing = true;
+			rx->pos = rx->end;
+		}
+	}
+
+	/* move the unparsed data to the start of the buffer */
+	if (!mbuf_get_left(rx)) {
+		mbuf_rewind(rx);
+	}
+	else if (rx->pos) {
+		memmove(rx->buf, mbuf_buf(rx), mbuf_get_left(rx));
+		rx->end -= rx->pos;
+		rx->pos  = 0;
+	}
+
+	/* the stall timer runs while streaming */
+	if (conn->chunkh)
+		return;
+
+	if (conn->closing)
+		close_flushed(conn);
+	else
+		tmr_start(&conn->tmr, TCP_IDLE_TIMEOUT, timeout_handler, conn);
+
+	return;
+
+ error:
+	conn = mem_deref(conn);
+}
+
+
+static void estab_handler(void *arg)
+{
+	(void)arg;
+}
+
+
+static void recv_handler(struct mbuf *mbrx, void *arg)
+{
+	struct httpd_conn *conn = arg;
+	struct mbuf *rx = conn->rx;
+	const size_t pos = rx->pos;
+	int err;
+
+	if (conn->closing)
+		return;
+
+	if (rx->end + mbuf_get_left(mbrx) > 2 * HTTPD_REQ_MAX) {
+		conn = mem_deref(conn);
+		return;
+	}
+
+	rx->pos = rx->end;
+	err = mbuf_write_mem(rx, mbuf_buf(mbrx), mbuf_get_left(mbrx));
+	rx->pos = pos;
+
+	if (err) {
+		conn = mem_deref(conn);
+		return;
+	}
+
+	process(conn);
 }
 
 
 static void close_handler(int err, void *arg)
 {
-	struct conn *conn = arg;
+	struct httpd_conn *conn = arg;
 	(void)err;
 
 	conn = mem_deref(conn);
@@ -90,28 +539,39 @@ static void close_handler(int err, void *arg)
 
 static void conn_destructor(void *arg)
 {
-	struct conn *conn = arg;
+	struct httpd_conn *conn = arg;
 
 	tmr_cancel(&conn->tmr);
+	stream_stop(conn);
 	list_unlink(&conn->le);
 	conn->tc = mem_deref(conn->tc);
+	mem_deref(conn->rx);
+	mem_deref(conn->tx);
+	mem_deref(conn->body);
 }
 
 
 static void connect_handler(const struct sa *peer, void *arg)
 {
 	struct httpd *httpd = arg;
-	struct conn *conn = NULL;
+	struct httpd_conn *conn = NULL;
 	int err = ENOMEM;
 
 	(void)peer;
 
-	conn = mem_zalloc(sizeof(struct conn), conn_destructor);
+	conn = mem_zalloc(sizeof(struct httpd_conn), conn_destructor);
 	if (!conn)
 		goto out;
 
 	conn->httpd = httpd;
 	list_append(&httpd->connl, &conn->le, conn);
+	str_ncpy(conn->ver, "1.1", sizeof(conn->ver));
+
+	conn->rx   = mbuf_alloc(1024);
+	conn->tx   = mbuf_alloc(1024);
+	conn->body = mbuf_alloc(8192);
+	if (!conn->rx || !conn->tx || !conn->body)
+		goto out;
 
 	err = tcp_accept(&conn->tc, httpd->ts, estab_handler,
 			 recv_handler, close_handler, conn);
@@ -4,8 +4,29 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
-typedef void(httpd_h)(const struct pl *uri, struct mbuf *mb);
-
 struct httpd;
+struct httpd_conn;
+
+struct httpd_req {
+	struct pl met;
+	struct pl path;     /* e.g. "/turn" */
+	struct pl query;    /* without '?' */
+	struct pl hdrs;     /* header fields */
+	struct pl body;
+};
+
+/*
+ * Prints the response body and returns the status code. The content
+ * type is HTML unless the handler sets *ctypep.
+ */
+typedef uint16_t (httpd_h)(struct httpd_conn *conn,
+			   const struct httpd_req *req, struct mbuf *mb,
+			   const char **ctypep);
+
+/* returns true when the response is complete */
+typedef bool (httpd_chunk_h)(struct mbuf *mb, void *arg);
 
-int httpd_alloc(struct httpd **httpd, struct sa *laddr, httpd_h *h);
+int  httpd_alloc(struct httpd **httpd, struct sa *laddr, httpd_h *h);
+void httpd_stream(struct httpd_conn *conn, httpd_chunk_h *chunkh, void *arg);
+int  httpd_req_hdr(const struct httpd_req *req, const char *name,
+		   struct pl *val);
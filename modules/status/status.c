@@ -12,7 +12,16 @@
 
 
 enum {
-	CHUNK_SIZE = 1024,
+	CHUNK_SIZE   = 1024,
+	STREAM_LIMIT = 256,    /* entries per main loop iteration */
+	API_LIMIT    = 100,    /* default entries per JSON page */
+};
+
+
+struct stream {
+	char *cmd;
+	char *params;
+	struct restund_cmdpage pg;
 };
 
 
@@ -20,6 +29,8 @@ static struct {
 	struct udp_sock *us;
 	struct httpd *httpd;
 	time_t start;
+	char api_token[256];
+	char api_host[256];
 } stg;
 
 
@@ -39,15 +50,242 @@ static void server_info(struct mbuf *mb)
 }
 
 
-static void httpd_handler(const struct pl *uri, struct mbuf *mb)
+static void stream_destructor(void *arg)
+{
+	struct stream *st = arg;
+
+	mem_deref(st->cmd);
+	mem_deref(st->params);
+}
+
+
+static bool stream_handler(struct mbuf *mb, void *arg)
+{
+	struct stream *st = arg;
+	struct pl cmd;
+
+	pl_set_str(&cmd, st->cmd);
+
+	if (!restund_cmd_page(&cmd, mb, &st->pg) && !st->pg.done)
+		return false;
+
+	mbuf_write_str(mb, "</pre>\n</body>\n</html>\n");
+
+	return true;
+}
+
+
+/* stream all pages of a paginated command to the client */
+static int stream_start(struct httpd_conn *conn, const struct pl *cmd,
+			const struct pl *params)
+{
+	struct stream *st;
+	struct pl val;
+	int err;
+
+	st = mem_zalloc(sizeof(*st), stream_destructor);
+	if (!st)
+		return ENOMEM;
+
+	err  = pl_strdup(&st->cmd, cmd);
+	err |= pl_strdup(&st->params, params);
+	if (err) {
+		mem_deref(st);
+		return err;
+	}
+
+	pl_set_str(&st->pg.params, st->params);
+	st->pg.limit = STREAM_LIMIT;
+
+	if (!restund_cmd_param(&st->pg.params, "cursor", &val))
+		st->pg.cursor = pl_u32(&val);
+
+	httpd_stream(conn, stream_handler, st);
+
+	return 0;
+}
+
+
+static uint16_t api_error(struct mbuf *mb, int err)
 {
-	struct pl cmd, params, r;
+	mbuf_rewind(mb);
+	(void)mbuf_printf(mb, "{\"error\":\"%m\"}", err);
+
+	switch (err) {
+
+	case EINVAL: return 400;
+	case ENOENT: return 404;
+	default:     return 500;
+	}
+}
+
+
+static bool token_equal(const struct pl *tok, const char *str)
+{
+	const size_t len = strlen(str);
+	uint8_t diff = 0;
+	size_t i;
+
+	if (tok->l != len)
+		return false;
+
+	/* constant time */
+	for (i=0; i<len; i++)
+		diff |= (uint8_t)tok->p[i] ^ (uint8_t)str[i];
+
+	return diff == 0;
+}
+
+
+/* an IP address, localhost or status_api_host, with or without port */
+static bool host_allowed(const struct pl *host)
+{
+	struct pl name;
+	struct sa sa;
+
+	if (!sa_decode(&sa, host->p, host->l) || !sa_set(&sa, host, 0))
+		return true;
+
+	if (re_regex(host->p, host->l, "[^:]+:[0-9]+", &name, NULL))
+		name = *host;
+
+	if (!pl_strcasecmp(&name, "localhost"))
+		return true;
+
+	return stg.api_host[0] && !pl_strcasecmp(&name, stg.api_host);
+}
+
+
+/*
+ * A web page must not be able to use the API through the browser of
+ * an administrator: the Host header must not be a name which another
+ * site may resolve to this server (DNS rebinding), and POST requests
+ * need a header which a cross-site form cannot send, either the
+ * Authorization with status_api_token or X-Requested-With.
+ */
+static uint16_t api_check(const struct httpd_req *req, struct mbuf *mb)
+{
+	struct pl val, tok;
+
+	if (httpd_req_hdr(req, "Host", &val) || !host_allowed(&val))
+		goto forbidden;
+
+	if (stg.api_token[0]) {
+
+		if (httpd_req_hdr(req, "Authorization", &val) ||
+		    re_regex(val.p, val.l, "Bearer[ ]+[^ ]+", NULL, &tok) ||
+		    !token_equal(&tok, stg.api_token))
+			goto forbidden;
+	}
+	else if (!pl_strcmp(&req->met, "POST") &&
+		 httpd_req_hdr(req, "X-Requested-With", &val)) {
+		goto forbidden;
+	}
+
+	return 0;
+
+ forbidden:
+	(void)api_error(mb, EACCES);
+	return 403;
+}
+
+
+/*
+ * JSON admin API:
+ *
+ *   GET  /api/<cmd>[?params]   result of a command
+ *   POST /api/<cmd>[?params]   command which changes server state,
+ *                              params in the query or as a form body
+ *
+ * GET results are wrapped as {"result":...,"next":<cursor>}, where
+ * next is null on the last page.
+ */
+static uint16_t api_handler(const struct httpd_req *req,
+			    const struct pl *cmd, struct mbuf *mb)
+{
+	struct restund_cmdpage pg;
+	struct pl val;
+	uint16_t scode;
+	int err;
+
+	scode = api_check(req, mb);
+	if (scode)
+		return scode;
+
+	if (!pl_strcmp(&req->met, "POST")) {
+
+		if (req->query.l)
+			err = restund_cmd_post(cmd, mb, &req->query);
+		else
+			err = restund_cmd_post(cmd, mb, &req->body);
+
+		return err ? api_error(mb, err) : 200;
+	}
+
+	if (pl_strcmp(&req->met, "GET")) {
+		(void)api_error(mb, ENOTSUP);
+		return 405;
+	}
+
+	memset(&pg, 0, sizeof(pg));
+	pg.params = req->query;
+
+	if (!restund_cmd_param(&pg.params, "cursor", &val))
+		pg.cursor = pl_u32(&val);
+	pg.limit = API_LIMIT;
+	if (!restund_cmd_param(&pg.params, "limit", &val))
+		pg.limit = MAX(pl_u32(&val), 1);
+
+	err = mbuf_write_str(mb, "{\"result\":");
+	if (err)
+		return api_error(mb, err);
+
+	err = restund_cmd_json(cmd, mb, &pg);
+	if (err)
+		return api_error(mb, err);
+
+	if (pg.done)
+		err = mbuf_write_str(mb, ",\"next\":null}");
+	else
+		err = mbuf_printf(mb, ",\"next\":%u}", pg.cursor);
+
+	return err ? api_error(mb, err) : 200;
+}
+
+
+static uint16_t httpd_handler(struct httpd_conn *conn,
+			      const struct httpd_req *req, struct mbuf *mb,
+			      const char **ctypep)
+{
+	struct pl cmd, params, line, r;
 	uint32_t refresh = 0;
 
-	if (re_regex(uri->p, uri->l, "/[^?]*[^]*", &cmd, &params))
-		return;
+	if (re_regex(req->path.p, req->path.l, "/[^]*", &cmd))
+		return 404;
+
+	if (cmd.l > 4 && !memcmp(cmd.p, "api/", 4)) {
+		r.p = cmd.p + 4;
+		r.l = cmd.l - 4;
+		*ctypep = "application/json";
+		return api_handler(req, &r, mb);
+	}
+
+	if (pl_strcmp(&req->met, "GET"))
+		return 405;
+
+	/* command name followed by its parameters */
+	params = req->query;
+	line.p = cmd.p;
+	line.l = params.l ? (size_t)(params.p + params.l - cmd.p) : cmd.l;
 
-	if (!re_regex(params.p, params.l, "[?&]1r=[0-9]+", NULL, &r))
+	if (!pl_strcmp(&cmd, "metrics")) {
+		(void)restund_metrics_encode(mb);
+		*ctypep = "application/openmetrics-text;version=1.0.0;"
+			"charset=utf-8";
+		return 200;
+	}
+
+	if (!restund_cmd_param(&params, "r", &r))
 		refresh = pl_u32(&r);
 
 	mbuf_write_str(mb, "<html>\n<head>\n");
@@ -62,15 +300,26 @@ static void httpd_handler(const struct pl *uri, struct mbuf *mb)
 	mbuf_write_str(mb, "<h2>Restund Server Status</h2>\n");
 	server_info(mb);
 	mbuf_write_str(mb, "<hr size=\"1\"/>\n<pre>\n");
-	restund_cmd(&cmd, mb);
+
+	/* without an explicit limit, long listings are streamed */
+	if (restund_cmd_paged(&cmd) &&
+	    restund_cmd_param(&params, "limit", &r)) {
+
+		if (!stream_start(conn, &cmd, &params))
+			return 200;
+	}
+
+	restund_cmd(&line, mb);
 	mbuf_write_str(mb, "</pre>\n</body>\n</html>\n");
+
+	return 200;
 }
 
 
 static void udp_recv(const struct sa *src, struct mbuf *mbrx, void *arg)
 {
 	static struct pl cmd = PL("");
-	static char buf[32];
+	static char buf[256];
 	bool done = false;
 	struct mbuf *mb;
 
@@ -112,6 +361,40 @@ static void udp_recv(const struct sa *src, struct mbuf *mbrx, void *arg)
 }
 
 
+static void metrics_handler(struct mbuf *mb)
+{
+	(void)restund_metrics_encode(mb);
+}
+
+
+static int metrics_json(struct mbuf *mb, struct restund_cmdpage *pg)
+{
+	(void)pg;
+
+	return restund_metrics_encode_json(mb);
+}
+
+
+static uint64_t uptime(void)
+{
+	return (uint64_t)(time(NULL) - stg.start);
+}
+
+
+static struct restund_cmdsub cmd_metrics = {
+	.cmdh  = metrics_handler,
+	.cmd   = "metrics",
+	.jsonh = metrics_json,
+};
+
+
+static struct restund_metric metricv[] = {
+	{ .name = "restund_uptime_seconds",
+	  .help = "Time since the status module was loaded",
+	  .type = RESTUND_METRIC_GAUGE, .valh = uptime },
+};
+
+
 static int module_init(void)
 {
 	struct sa laddr_udp, laddr_http;
@@ -153,6 +436,11 @@ static int module_init(void)
 		goto out;
 	}
 
+	conf_get_str(restund_conf(), "status_api_token",
+		     stg.api_token, sizeof(stg.api_token));
+	conf_get_str(restund_conf(), "status_api_host",
+		     stg.api_host, sizeof(stg.api_host));
+
 	err = httpd_alloc(&stg.httpd, &laddr_http, httpd_handler);
 	if (err) {
 		restund_warning("status: httpd: %m\n", err);
@@ -161,6 +449,9 @@ static int module_init(void)
 
 	stg.start = time(NULL);
 
+	restund_cmd_subscribe(&cmd_metrics);
+	restund_metric_register(metricv, RE_ARRAY_SIZE(metricv));
+
 	restund_debug("status: module loaded (udp=%J http=%J)\n",
 		      &laddr_udp, &laddr_http);
 
@@ -176,6 +467,9 @@ static int module_init(void)
 
 static int module_close(void)
 {
+	restund_metric_unregister(metricv, RE_ARRAY_SIZE(metricv));
+	restund_cmd_unsubscribe(&cmd_metrics);
+
 	stg.us = mem_deref(stg.us);
 	stg.httpd = mem_deref(stg.httpd);
 
@@ -0,0 +1,433 @@
+/**
+ * @file acct.c Turn Server Traffic Accounting
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <string.h>
+#include <time.h>
+#include <re.h>
+#include <restund.h>
+#include "turn.h"
+
+
+/*
+ * Permissions report their traffic through acct_report(). Depending on
+ * turn_accounting the report is either logged as is (perm), or summed
+ * into one record per allocation (alloc) or per username (user).
+ *
+ * Aggregated records are written when their time bucket ends, or for
+ * allocation records when the allocation is destroyed. Optionally the
+ * per-peer totals of each record are kept in a small array, which can
+ * be inspected with the "turnacct" command.
+ */
+
+
+enum {
+	ACCT_HASH_SIZE = 256,
+	ACCT_PEER_MIN  = 4,
+};
+
+enum acct_mode {
+	ACCT_PERM = 0,
+	ACCT_ALLOC,
+	ACCT_USER,
+};
+
+struct acct_peer {
+	struct sa peer;
+	struct restund_trafstat ts;
+};
+
+struct acct {
+	struct le he;
+	struct le le;
+	const struct allocation *al;  /* NULL when allocation is gone */
+	char *username;
+	struct sa cli;
+	struct sa relay;
+	struct restund_trafstat ts;
+	struct acct_peer *peerv;
+	uint32_t peerc;
+	uint32_t peersz;
+	time_t start;
+	time_t expires;
+};
+
+
+static struct {
+	struct hash *ht;
+	struct list expl;    /* sorted by expiry, 0 (never) last */
+	struct tmr tmr;
+	enum acct_mode mode;
+	uint32_t bucket;
+	bool peers;
+	uint64_t recc;
+	uint64_t repc;
+} acct;
+
+
+static void destructor(void *arg)
+{
+	struct acct *a = arg;
+
+	hash_unlink(&a->he);
+	list_unlink(&a->le);
+	mem_deref(a->username);
+	mem_deref(a->peerv);
+}
+
+
+static uint32_t acct_hash(const struct allocation *al)
+{
+	if (acct.mode == ACCT_USER)
+		return hash_joaat_str(al->username ? al->username : "");
+
+	return hash_fast((const char *)&al, sizeof(al));
+}
+
+
+static bool hash_cmp_handler(struct le *le, void *arg)
+{
+	const struct acct *a = le->data;
+	const struct allocation *al = arg;
+
+	if (acct.mode == ACCT_USER)
+		return 0 == str_cmp(a->username,
+				    al->username ? al->username : "");
+
+	return a->al == al;
+}
+
+
+/* end of the current time bucket, 0 if records never expire */
+static time_t bucket_end(time_t now)
+{
+	if (!acct.bucket)
+		return 0;
+
+	return now - now % acct.bucket + acct.bucket;
+}
+
+
+static struct acct *acct_get(const struct allocation *al, time_t now)
+{
+	struct acct *a;
+	const uint32_t h = acct_hash(al);
+
+	a = list_ledata(hash_lookup(acct.ht, h, hash_cmp_handler,
+				    (void *)al));
+	if (a)
+		return a;
+
+	a = mem_zalloc(sizeof(*a), destructor);
+	if (!a)
+		return NULL;
+
+	if (str_dup(&a->username, al->username ? al->username : "")) {
+		mem_deref(a);
+		return NULL;
+	}
+
+	if (acct.mode == ACCT_ALLOC) {
+		a->al    = al;
+		a->cli   = al->cli_addr;
+		a->relay = al->rel_addr;
+	}
+	else {
+		sa_init(&a->cli, AF_UNSPEC);
+		sa_init(&a->relay, AF_UNSPEC);
+	}
+
+	a->start   = now;
+	a->expires = bucket_end(now);
+
+	hash_append(acct.ht, h, &a->he, a);
+	list_append(&acct.expl, &a->le, a);
+
+	return a;
+}
+
+
+static void trafstat_add(struct restund_trafstat *dst,
+			 const struct restund_trafstat *src)
+{
+	dst->pktc_tx += src->pktc_tx;
+	dst->pktc_rx += src->pktc_rx;
+	dst->bytc_tx += src->bytc_tx;
+	dst->bytc_rx += src->bytc_rx;
+}
+
+
+static int peer_add(struct acct *a, const struct sa *peer,
+		    const struct restund_trafstat *ts)
+{
+	struct acct_peer *p;
+	uint32_t i;
+
+	for (i=0; i<a->peerc; i++) {
+
+		if (sa_cmp(&a->peerv[i].peer, peer, SA_ADDR)) {
+			trafstat_add(&a->peerv[i].ts, ts);
+			return 0;
+		}
+	}
+
+	if (a->peerc == a->peersz) {
+
+		const uint32_t sz = MAX(2 * a->peersz, ACCT_PEER_MIN);
+
+		p = mem_realloc(a->peerv, sz * sizeof(*p));
+		if (!p)
+			return ENOMEM;
+
+		a->peerv  = p;
+		a->peersz = sz;
+	}
+
+	p = &a->peerv[a->peerc++];
+
+	p->peer = *peer;
+	memset(&p->ts, 0, sizeof(p->ts));
+	trafstat_add(&p->ts, ts);
+
+	return 0;
+}
+
+
+static int acct_flush(struct acct *a, time_t now)
+{
+	struct sa peer;
+	int err;
+
+	if (a->ts.pktc_tx || a->ts.pktc_rx) {
+
+		sa_init(&peer, AF_UNSPEC);
+
+		err = restund_log_traffic(a->username, &a->cli, &a->relay,
+					  &peer, a->start, now, &a->ts);
+		if (err)
+			return err;
+
+		++acct.recc;
+	}
+
+	memset(&a->ts, 0, sizeof(a->ts));
+	a->peerc = 0;
+	a->start = now;
+
+	return 0;
+}
+
+
+static void timeout(void *arg)
+{
+	const time_t now = restund_time();
+	struct le *le;
+	(void)arg;
+
+	tmr_start(&acct.tmr, 1000, timeout, NULL);
+
+	while ((le = acct.expl.head)) {
+
+		struct acct *a = le->data;
+
+		if (!a->expires || a->expires > now)
+			break;
+
+		if (acct_flush(a, now))
+			break;
+
+		if (!a->al) {
+			mem_deref(a);
+			continue;
+		}
+
+		a->expires = bucket_end(now);
+
+		list_unlink(&a->le);
+		list_append(&acct.expl, &a->le, a);
+	}
+}
+
+
+/**
+ * Report traffic of a permission
+ *
+ * @param al    Allocation of the permission
+ * @param peer  Peer address of the permission
+ * @param ts    Traffic since the previous report
+ * @param start Time of the previous report
+ * @param now   Current time
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int acct_report(const struct allocation *al, const struct sa *peer,
+		const struct restund_trafstat *ts, time_t start, time_t now)
+{
+	struct acct *a;
+
+	if (!al || !peer || !ts)
+		return EINVAL;
+
+	if (acct.mode == ACCT_PERM) {
+		return restund_log_traffic(al->username, &al->cli_addr,
+					   &al->rel_addr, peer, start, now,
+					   ts);
+	}
+
+	a = acct_get(al, now);
+	if (!a)
+		return ENOMEM;
+
+	trafstat_add(&a->ts, ts);
+	++acct.repc;
+
+	if (acct.peers && peer_add(a, peer, ts))
+		restund_debug("turn: acct: per-peer detail dropped\n");
+
+	return 0;
+}
+
+
+/**
+ * Release the aggregated record of an allocation. The record is written
+ * on the next timer tick; it no longer refers to the allocation.
+ *
+ * @param al Allocation
+ */
+void acct_alloc_close(const struct allocation *al)
+{
+	struct acct *a;
+
+	if (!al || acct.mode != ACCT_ALLOC)
+		return;
+
+	a = list_ledata(hash_lookup(acct.ht, acct_hash(al),
+				    hash_cmp_handler, (void *)al));
+	if (!a)
+		return;
+
+	hash_unlink(&a->he);
+	a->al = NULL;
+
+	/* due now, move ahead of the records which are still open */
+	a->expires = restund_time();
+
+	list_unlink(&a->le);
+	list_prepend(&acct.expl, &a->le, a);
+}
+
+
+static void status_handler(struct mbuf *mb)
+{
+	static const char *modev[] = {"perm", "alloc", "user"};
+	const time_t now = restund_time();
+	struct le *le;
+	uint32_t i;
+
+	(void)mbuf_printf(mb, "mode %s bucket %us records %llu"
+			  " reports %llu\n", modev[acct.mode], acct.bucket,
+			  acct.recc, acct.repc);
+
+	for (le = acct.expl.head; le; le = le->next) {
+
+		const struct acct *a = le->data;
+
+		(void)mbuf_printf(mb, "%s %J %llis %llu/%llu %llu/%llu\n",
+				  a->username, &a->cli,
+				  (long long)(now - a->start),
+				  a->ts.pktc_tx, a->ts.pktc_rx,
+				  a->ts.bytc_tx, a->ts.bytc_rx);
+
+		for (i=0; i<a->peerc; i++) {
+
+			const struct acct_peer *p = &a->peerv[i];
+
+			(void)mbuf_printf(mb, "    %j %llu/%llu %llu/%llu\n",
+					  &p->peer,
+					  p->ts.pktc_tx, p->ts.pktc_rx,
+					  p->ts.bytc_tx, p->ts.bytc_rx);
+		}
+	}
+}
+
+
+static struct restund_cmdsub cmd_acct = {
+	.cmdh = status_handler,
+	.cmd  = "turnacct",
+};
+
+
+int acct_init(void)
+{
+	struct pl opt;
+	int err;
+
+	acct.mode   = ACCT_PERM;
+	acct.bucket = 0;
+
+	if (!conf_get(restund_conf(), "turn_accounting", &opt)) {
+
+		if (!pl_strcasecmp(&opt, "alloc")) {
+			acct.mode = ACCT_ALLOC;
+		}
+		else if (!pl_strcasecmp(&opt, "user")) {
+			acct.mode   = ACCT_USER;
+			acct.bucket = 300;
+		}
+		else if (pl_strcasecmp(&opt, "perm")) {
+			restund_error("turn: bad turn_accounting: '%r'\n",
+				      &opt);
+			return EINVAL;
+		}
+	}
+
+	if (acct.mode == ACCT_PERM)
+		return 0;
+
+	conf_get_u32(restund_conf(), "turn_accounting_bucket", &acct.bucket);
+	if (!conf_get(restund_conf(), "turn_accounting_peers", &opt))
+		acct.peers = !pl_strcasecmp(&opt, "yes");
+
+	if (acct.mode == ACCT_USER && !acct.bucket) {
+		restund_error("turn: turn_accounting_bucket must be set\n");
+		return EINVAL;
+	}
+
+	err = hash_alloc(&acct.ht, ACCT_HASH_SIZE);
+	if (err)
+		return err;
+
+	list_init(&acct.expl);
+	tmr_start(&acct.tmr, 1000, timeout, NULL);
+	restund_cmd_subscribe(&cmd_acct);
+
+	return 0;
+}
+
+
+/* must be called after all allocations have been destroyed */
+void acct_close(void)
+{
+	const time_t now = restund_time();
+	struct le *le;
+
+	if (acct.mode == ACCT_PERM)
+		return;
+
+	restund_cmd_unsubscribe(&cmd_acct);
+	tmr_cancel(&acct.tmr);
+
+	while ((le = acct.expl.head)) {
+
+		struct acct *a = le->data;
+
+		if (acct_flush(a, now))
+			restund_warning("turn: acct: record lost\n");
+
+		mem_deref(a);
+	}
+
+	acct.ht = mem_deref(acct.ht);
+}
@@ -4,7 +4,11 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <string.h>
+#include <time.h>
 #include <re.h>
 #include <restund.h>
 #include "turn.h"
@@ -54,9 +58,12 @@ static void destructor(void *arg)
 
 	hash_flush(al->perms);
 	mem_deref(al->perms);
+	acct_alloc_close(al);
 	mem_deref(al->chans);
 	restund_debug("turn: allocation %p destroyed\n", al);
 	hash_unlink(&al->he);
+	hash_unlink(&al->uhe);
+	hash_unlink(&al->phe);
 	tmr_cancel(&al->tmr);
 	mem_deref(al->username);
 	mem_deref(al->cli_sock);
@@ -75,16 +82,54 @@ static void timeout(void *arg)
 }
 
 
+static uint64_t rt_clock(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+/*
+ * Start of the relay latency measurement [ns]. With turn_relay_timestamps
+ * the kernel receive time of the packet is used (one extra system call
+ * per packet), otherwise the time the packet reached the handler.
+ */
+static uint64_t relay_start(const struct allocation *al)
+{
+#ifdef SIOCGSTAMPNS
+	if (turndp()->relay_ts) {
+
+		struct timespec ts;
+		int fd;
+
+		fd = restund_udp_fd(al->rel_us, sa_af(&al->rel_addr));
+		if (fd >= 0 && !ioctl(fd, SIOCGSTAMPNS, &ts))
+			return (uint64_t)ts.tv_sec * 1000000000
+				+ (uint64_t)ts.tv_nsec;
+	}
+#else
+	(void)al;
+#endif
+
+	return rt_clock();
+}
+
+
 static void udp_recv(const struct sa *src, struct mbuf *mb, void *arg)
 {
 	struct allocation *al = arg;
+	const uint64_t rxtime = relay_start(al);
 	struct perm *perm;
 	struct chan *chan;
+	uint64_t end;
 	int err;
 
 	if (al->proto == IPPROTO_TCP) {
 
-		if (tcp_conn_txqsz(al->cli_sock) > TCP_MAX_TXQSZ) {
+		if (restund_txqsz(al->proto, al->cli_sock) > TCP_MAX_TXQSZ) {
 			++al->dropc_rx;
 			return;
 		}
@@ -120,25 +165,30 @@ static void udp_recv(const struct sa *src, struct mbuf *mb, void *arg)
 		}
 
 		mb->pos = start;
-		err = stun_send(al->proto, al->cli_sock, &al->cli_addr, mb);
+		err = restund_send(al->proto, al->cli_sock, &al->cli_addr, mb);
 		mb->pos += 4;
 	}
 	else {
-		err = stun_indication(al->proto, al->cli_sock,
-				      &al->cli_addr, 0, STUN_METHOD_DATA,
-				      NULL, 0, false, 2,
-				      STUN_ATTR_XOR_PEER_ADDR, src,
-				      STUN_ATTR_DATA, mb);
+		err = restund_stun_indication(al->proto, al->cli_sock,
+					      &al->cli_addr, 0,
+					      STUN_METHOD_DATA,
+					      NULL, 0, false, 2,
+					      STUN_ATTR_XOR_PEER_ADDR, src,
+					      STUN_ATTR_DATA, mb);
 	}
 
  out:
 	if (err)
-		turndp()->errc_rx++;
+		TURN_INC(TURN_ERR_RX);
 	else {
 		const size_t bytes = mbuf_get_left(mb);
 
 		perm_rx_stat(perm, bytes);
-		turndp()->bytec_rx += bytes;
+		TURN_ADD(TURN_BYTES_RX, bytes);
+
+		end = rt_clock();
+		if (end >= rxtime)
+			restund_hist_add(&turndp()->relay_hist, end - rxtime);
 	}
 }
 
@@ -151,15 +201,13 @@ static int relay_listen(const struct sa *rel_addr, struct allocation *al,
 
 	for (i=0; i<PORT_TRY_MAX; i++) {
 
-		err = udp_listen(&al->rel_us, rel_addr, udp_recv, al);
-		if (err)
-			break;
+		al->rel_addr = *rel_addr;
 
-		err = udp_local_get(al->rel_us, &al->rel_addr);
-		if (err) {
-			al->rel_us = mem_deref(al->rel_us);
+		err = restund_udp_listen(&al->rel_us, &al->rel_addr,
+					 turndp()->udp_sockbuf_size,
+					 udp_recv, al);
+		if (err)
 			break;
-		}
 
 		if (!even)
 			break;
@@ -177,7 +225,9 @@ static int relay_listen(const struct sa *rel_addr, struct allocation *al,
 		al->rsv_addr = al->rel_addr;
 		sa_set_port(&al->rsv_addr, sa_port(&al->rel_addr) + 1);
 
-		err = udp_listen(&al->rsv_us, &al->rsv_addr, NULL, NULL);
+		err = restund_udp_listen(&al->rsv_us, &al->rsv_addr,
+					 turndp()->udp_sockbuf_size,
+					 NULL, NULL);
 		if (err) {
 			al->rel_us = mem_deref(al->rel_us);
 			continue;
@@ -215,7 +265,7 @@ static int rsvt_listen(const struct hash *ht, struct allocation *al,
 		return ENOENT;
 
 	al->rel_us = alr->rsv_us;
-	udp_handler_set(al->rel_us, udp_recv, al);
+	restund_udp_handler_set(al->rel_us, udp_recv, al);
 	alr->rsv_us = NULL;
 	al->rel_addr = alr->rsv_addr;
 	sa_init(&alr->rsv_addr, AF_UNSPEC);
@@ -248,11 +298,12 @@ void allocate_request(struct turnd *turnd, struct allocation *alx,
 		}
 
 		restund_debug("turn: allocation already exists (%J)\n", src);
-		++turnd->reply.scode_437;
-		rerr = stun_ereply(proto, sock, src, 0, msg,
-				   437, "Allocation TID Mismatch",
-				   ctx->key, ctx->keylen, ctx->fp, 1,
-				   STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_437);
+		rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+					   437, "Allocation TID Mismatch",
+					   ctx->key, ctx->keylen, ctx->fp, 1,
+					   STUN_ATTR_SOFTWARE,
+					   restund_software);
 		goto out;
 	}
 
@@ -263,11 +314,12 @@ void allocate_request(struct turnd *turnd, struct allocation *alx,
 	rel_addr = relay_addr(turnd, af);
 	if (!sa_isset(rel_addr, SA_ADDR)) {
 		restund_info("turn: unsupported address family: %u\n", af);
-		++turnd->reply.scode_440;
-		rerr = stun_ereply(proto, sock, src, 0, msg,
-				   440, "Address Family not Supported",
-				   ctx->key, ctx->keylen, ctx->fp, 1,
-				   STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_440);
+		rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+					   440, "Address Family not Supported",
+					   ctx->key, ctx->keylen, ctx->fp, 1,
+					   STUN_ATTR_SOFTWARE,
+					   restund_software);
 		goto out;
 	}
 
@@ -275,21 +327,24 @@ void allocate_request(struct turnd *turnd, struct allocation *alx,
 	attr = stun_msg_attr(msg, STUN_ATTR_REQ_TRANSPORT);
 	if (!attr) {
 		restund_info("turn: requested transport missing\n");
-		++turnd->reply.scode_400;
-		rerr = stun_ereply(proto, sock, src, 0, msg,
-				   400, "Requested Transport Missing",
-				   ctx->key, ctx->keylen, ctx->fp, 1,
-				   STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_400);
+		rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+					   400, "Requested Transport Missing",
+					   ctx->key, ctx->keylen, ctx->fp, 1,
+					   STUN_ATTR_SOFTWARE,
+					   restund_software);
 		goto out;
 	}
 	else if (attr->v.req_transport != IPPROTO_UDP) {
 		restund_info("turn: unsupported transport protocol: %u\n",
 			     attr->v.req_transport);
-		++turnd->reply.scode_442;
-		rerr = stun_ereply(proto, sock, src, 0, msg,
-				   442, "Unsupported Transport Protocol",
-				   ctx->key, ctx->keylen, ctx->fp, 1,
-				   STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_442);
+		rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+					   442,
+					   "Unsupported Transport Protocol",
+					   ctx->key, ctx->keylen, ctx->fp, 1,
+					   STUN_ATTR_SOFTWARE,
+					   restund_software);
 		goto out;
 	}
 
@@ -302,12 +357,13 @@ void allocate_request(struct turnd *turnd, struct allocation *alx,
 		ua.typec = 1;
 
 		restund_info("turn: requested don't fragment\n");
-		++turnd->reply.scode_420;
-		rerr = stun_ereply(proto, sock, src, 0, msg,
-				   420, "Unknown Attribute",
-				   ctx->key, ctx->keylen, ctx->fp, 2,
-				   STUN_ATTR_UNKNOWN_ATTR, &ua,
-				   STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_420);
+		rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+					   420, "Unknown Attribute",
+					   ctx->key, ctx->keylen, ctx->fp, 2,
+					   STUN_ATTR_UNKNOWN_ATTR, &ua,
+					   STUN_ATTR_SOFTWARE,
+					   restund_software);
 		goto out;
 	}
 
@@ -316,11 +372,12 @@ void allocate_request(struct turnd *turnd, struct allocation *alx,
 	rsvt = stun_msg_attr(msg, STUN_ATTR_RSV_TOKEN);
 	if ((even && rsvt) || (reqaf && rsvt)) {
 		restund_info("turn: even-port/req-af + rsv-token requested\n");
-		++turnd->reply.scode_400;
-		rerr = stun_ereply(proto, sock, src, 0, msg,
-				   400, "Bad Request",
-				   ctx->key, ctx->keylen, ctx->fp, 1,
-				   STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_400);
+		rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+					   400, "Bad Request",
+					   ctx->key, ctx->keylen, ctx->fp, 1,
+					   STUN_ATTR_SOFTWARE,
+					   restund_software);
 		goto out;
 	}
 
@@ -334,11 +391,12 @@ void allocate_request(struct turnd *turnd, struct allocation *alx,
 	al = mem_zalloc(sizeof(*al), destructor);
 	if (!al) {
 		restund_warning("turn: no memory for allocation\n");
-		++turnd->reply.scode_500;
-		rerr = stun_ereply(proto, sock, src, 0, msg,
-				   500, "Server Error",
-				   ctx->key, ctx->keylen, ctx->fp, 1,
-				   STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_500);
+		rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+					   500, "Server Error",
+					   ctx->key, ctx->keylen, ctx->fp, 1,
+					   STUN_ATTR_SOFTWARE,
+					   restund_software);
 		goto out;
 	}
 
@@ -352,18 +410,19 @@ void allocate_request(struct turnd *turnd, struct allocation *alx,
 	al->srv_addr = *dst;
 	al->proto = proto;
 	sa_init(&al->rsv_addr, AF_UNSPEC);
-	turndp()->allocc_tot++;
+	TURN_INC(TURN_ALLOCS);
 	turndp()->allocc_cur++;
 
 	/* Permissions */
 	err = perm_hash_alloc(&al->perms, PERM_HASH_SIZE);
 	if (err) {
 		restund_warning("turn: perm list alloc: %m\n", err);
-		++turnd->reply.scode_500;
-		rerr = stun_ereply(proto, sock, src, 0, msg,
-				   500, "Server Error",
-				   ctx->key, ctx->keylen, ctx->fp, 1,
-				   STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_500);
+		rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+					   500, "Server Error",
+					   ctx->key, ctx->keylen, ctx->fp, 1,
+					   STUN_ATTR_SOFTWARE,
+					   restund_software);
 		goto out;
 	}
 
@@ -371,11 +430,12 @@ void allocate_request(struct turnd *turnd, struct allocation *alx,
 	err = chanlist_alloc(&al->chans, CHAN_HASH_SIZE);
 	if (err) {
 		restund_warning("turn: chan list alloc: %m\n", err);
-		++turnd->reply.scode_500;
-		rerr = stun_ereply(proto, sock, src, 0, msg,
-				   500, "Server Error",
-				   ctx->key, ctx->keylen, ctx->fp, 1,
-				   STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_500);
+		rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+					   500, "Server Error",
+					   ctx->key, ctx->keylen, ctx->fp, 1,
+					   STUN_ATTR_SOFTWARE,
+					   restund_software);
 		goto out;
 	}
 
@@ -388,17 +448,19 @@ void allocate_request(struct turnd *turnd, struct allocation *alx,
 
 	if (err) {
 		restund_warning("turn: relay listen: %m\n", err);
-		++turnd->reply.scode_508;
-		rerr = stun_ereply(proto, sock, src, 0, msg,
-				   508, "Insufficient Port Capacity",
-				   ctx->key, ctx->keylen, ctx->fp, 1,
-				   STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_508);
+		rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+					   508, "Insufficient Port Capacity",
+					   ctx->key, ctx->keylen, ctx->fp, 1,
+					   STUN_ATTR_SOFTWARE,
+					   restund_software);
 		goto out;
 	}
 
-	udp_rxbuf_presz_set(al->rel_us, 4);
-	if (turndp()->udp_sockbuf_size > 0)
-		(void)udp_sockbuf_set(al->rel_us, turndp()->udp_sockbuf_size);
+	hash_append(turnd->ht_user,
+		    hash_joaat_str(al->username ? al->username : ""),
+		    &al->uhe, al);
+	hash_append(turnd->ht_port, sa_port(&al->rel_addr), &al->phe, al);
 
 	restund_debug("turn: allocation %p created %s/%J/%J - %J (%us)\n",
 		      al, stun_transp_name(al->proto), &al->cli_addr,
@@ -424,14 +486,15 @@ void allocate_request(struct turnd *turnd, struct allocation *alx,
 			     &alx->rel_addr, &public_addr);
 	}
 
-	err = rerr = stun_reply(proto, sock, src, 0, msg,
-				ctx->key, ctx->keylen, ctx->fp, 5,
-				STUN_ATTR_XOR_RELAY_ADDR,
-				public ? &public_addr : &alx->rel_addr,
-				STUN_ATTR_LIFETIME, &lifetime,
-				STUN_ATTR_RSV_TOKEN, alx->rsv_us ? &rsv : NULL,
-				STUN_ATTR_XOR_MAPPED_ADDR, src,
-				STUN_ATTR_SOFTWARE, restund_software);
+	err = rerr = restund_stun_reply(proto, sock, src, 0, msg,
+					ctx->key, ctx->keylen, ctx->fp, 5,
+					STUN_ATTR_XOR_RELAY_ADDR,
+					public ? &public_addr : &alx->rel_addr,
+					STUN_ATTR_LIFETIME, &lifetime,
+					STUN_ATTR_RSV_TOKEN,
+					alx->rsv_us ? &rsv : NULL,
+					STUN_ATTR_XOR_MAPPED_ADDR, src,
+					STUN_ATTR_SOFTWARE, restund_software);
  out:
 	if (rerr)
 		restund_warning("turn: allocate reply: %m\n", rerr);
@@ -453,11 +516,12 @@ void refresh_request(struct turnd *turnd, struct allocation *al,
 	attr = stun_msg_attr(msg, STUN_ATTR_REQ_ADDR_FAMILY);
 	if (attr && attr->v.req_addr_family != sa_stunaf(&al->rel_addr)) {
 		restund_info("turn: refresh address family mismatch\n");
-		++turnd->reply.scode_443;
-		err = stun_ereply(proto, sock, src, 0, msg,
-				  443, "Peer Address Family Mismatch",
-				  ctx->key, ctx->keylen, ctx->fp, 1,
-				  STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_443);
+		err = restund_stun_ereply(proto, sock, src, 0, msg,
+					  443, "Peer Address Family Mismatch",
+					  ctx->key, ctx->keylen, ctx->fp, 1,
+					  STUN_ATTR_SOFTWARE,
+					  restund_software);
 		goto out;
 	}
 
@@ -470,10 +534,10 @@ void refresh_request(struct turnd *turnd, struct allocation *al,
 
 	restund_debug("turn: allocation %p refresh (%us)\n", al, lifetime);
 
-	err = stun_reply(proto, sock, src, 0, msg,
-			 ctx->key, ctx->keylen, ctx->fp, 2,
-			 STUN_ATTR_LIFETIME, &lifetime,
-			 STUN_ATTR_SOFTWARE, restund_software);
+	err = restund_stun_reply(proto, sock, src, 0, msg,
+				 ctx->key, ctx->keylen, ctx->fp, 2,
+				 STUN_ATTR_LIFETIME, &lifetime,
+				 STUN_ATTR_SOFTWARE, restund_software);
 
  out:
 	if (err) {
@@ -32,6 +32,11 @@ struct chan {
 	uint16_t numb;
 };
 
+struct json {
+	struct mbuf *mb;
+	uint32_t n;      /* elements printed */
+};
+
 
 static void chanlist_destructor(void *arg)
 {
@@ -84,7 +89,7 @@ struct chan *chan_numb_find(const struct chanlist *cl, uint16_t numb)
 	if (!chan)
 		return NULL;
 
-	if (chan->expires < time(NULL)) {
+	if (chan->expires < restund_time()) {
 		restund_debug("turn: allocation %p channel 0x%x %J expired\n",
 			      chan->al, chan->numb, &chan->peer);
 		mem_deref(chan);
@@ -107,7 +112,7 @@ struct chan *chan_peer_find(const struct chanlist *cl, const struct sa *peer)
 	if (!chan)
 		return NULL;
 
-	if (chan->expires < time(NULL)) {
+	if (chan->expires < restund_time()) {
 		restund_debug("turn: allocation %p channel 0x%x %J expired\n",
 			      chan->al, chan->numb, &chan->peer);
 		mem_deref(chan);
@@ -166,7 +171,7 @@ static bool status_handler(struct le *le, void *arg)
 	struct mbuf *mb = arg;
 
 	(void)mbuf_printf(mb, " (0x%x %J %is)", chan->numb, &chan->peer,
-			  chan->expires - time(NULL));
+			  chan->expires - restund_time());
 
 	return false;
 }
@@ -183,6 +188,35 @@ void chan_status(const struct chanlist *cl, struct mbuf *mb)
 }
 
 
+static bool json_handler(struct le *le, void *arg)
+{
+	const struct chan *chan = le->data;
+	struct json *js = arg;
+
+	return 0 != mbuf_printf(js->mb, "%s{\"number\":%u,\"peer\":\"%J\","
+				"\"expires\":%lli}",
+				js->n++ ? "," : "", chan->numb, &chan->peer,
+				(int64_t)(chan->expires - restund_time()));
+}
+
+
+int chan_json(const struct chanlist *cl, struct mbuf *mb)
+{
+	struct json js = {mb, 0};
+	int err;
+
+	if (!cl || !mb)
+		return EINVAL;
+
+	err = mbuf_write_str(mb, "[");
+	if (hash_apply(cl->ht_numb, json_handler, &js))
+		err = ENOMEM;
+	err |= mbuf_write_str(mb, "]");
+
+	return err;
+}
+
+
 static struct chan *chan_create(struct chanlist *cl, uint16_t numb,
 				const struct sa *peer,
 				const struct allocation *al)
@@ -202,7 +236,7 @@ static struct chan *chan_create(struct chanlist *cl, uint16_t numb,
 	chan->peer = *peer;
 	chan->numb = numb;
 	chan->al = al;
-	chan->expires = time(NULL) + CHAN_LIFETIME;
+	chan->expires = restund_time() + CHAN_LIFETIME;
 
 	restund_debug("turn: allocation %p channel 0x%x %J created\n",
 		      chan->al, chan->numb, &chan->peer);
@@ -216,7 +250,7 @@ static void chan_refresh(struct chan *chan)
 	if (!chan)
 		return;
 
-	chan->expires = time(NULL) + CHAN_LIFETIME;
+	chan->expires = restund_time() + CHAN_LIFETIME;
 
 	restund_debug("turn: allocation %p channel 0x%x %J refreshed\n",
 		      chan->al, chan->numb, &chan->peer);
@@ -243,31 +277,34 @@ void chanbind_request(struct allocation *al, struct restund_msgctx *ctx,
 
 	if (!chnr || !chan_numb_valid(chnr->v.channel_number) || !peer) {
 		restund_info("turn: bad chanbind attributes\n");
-		++turndp()->reply.scode_400;
-		rerr = stun_ereply(proto, sock, src, 0, msg,
-				   400, "Bad Attributes",
-				   ctx->key, ctx->keylen, ctx->fp, 1,
-				   STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_400);
+		rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+					   400, "Bad Attributes",
+					   ctx->key, ctx->keylen, ctx->fp, 1,
+					   STUN_ATTR_SOFTWARE,
+					   restund_software);
 		goto out;
 	}
 
 	if (restund_addr_is_blocked(&peer->v.xor_peer_addr)) {
 		restund_info("turn: blocked address\n");
-		++turndp()->reply.scode_400;
-		rerr = stun_ereply(proto, sock, src, 0, msg,
-				   403, "Forbidden",
-				   ctx->key, ctx->keylen, ctx->fp, 1,
-				   STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_400);
+		rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+					   403, "Forbidden",
+					   ctx->key, ctx->keylen, ctx->fp, 1,
+					   STUN_ATTR_SOFTWARE,
+					   restund_software);
 		goto out;
 	}
 
 	if (sa_af(&peer->v.xor_peer_addr) != sa_af(&al->rel_addr)) {
 		restund_info("turn: chanbind peer address family mismatch\n");
-		++turndp()->reply.scode_443;
-		rerr = stun_ereply(proto, sock, src, 0, msg,
-				   443, "Peer Address Family Mismatch",
-				   ctx->key, ctx->keylen, ctx->fp, 1,
-				   STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_443);
+		rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+					   443, "Peer Address Family Mismatch",
+					   ctx->key, ctx->keylen, ctx->fp, 1,
+					   STUN_ATTR_SOFTWARE,
+					   restund_software);
 		goto out;
 	}
 
@@ -277,11 +314,12 @@ void chanbind_request(struct allocation *al, struct restund_msgctx *ctx,
 	if (ch_numb != ch_peer) {
 		restund_info("turn: channel %p/peer %p already bound\n",
 			     ch_numb, ch_peer);
-		++turndp()->reply.scode_400;
-		rerr = stun_ereply(proto, sock, src, 0, msg,
-				   400, "Channel/Peer Already Bound",
-				   ctx->key, ctx->keylen, ctx->fp, 1,
-				   STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_400);
+		rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+					   400, "Channel/Peer Already Bound",
+					   ctx->key, ctx->keylen, ctx->fp, 1,
+					   STUN_ATTR_SOFTWARE,
+					   restund_software);
 		goto out;
 	}
 
@@ -290,11 +328,13 @@ void chanbind_request(struct allocation *al, struct restund_msgctx *ctx,
 				   &peer->v.xor_peer_addr, al);
 		if (!chan) {
 			restund_info("turn: unable to create channel\n");
-			++turndp()->reply.scode_500;
-			rerr = stun_ereply(proto, sock, src, 0, msg,
-					  500, "Server Error",
-					  ctx->key, ctx->keylen, ctx->fp, 1,
-					  STUN_ATTR_SOFTWARE,restund_software);
+			TURN_INC(TURN_SCODE_500);
+			rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+						   500, "Server Error",
+						   ctx->key, ctx->keylen,
+						   ctx->fp, 1,
+						   STUN_ATTR_SOFTWARE,
+						   restund_software);
 			goto out;
 		}
 	}
@@ -304,18 +344,20 @@ void chanbind_request(struct allocation *al, struct restund_msgctx *ctx,
 		perm = perm_create(al->perms, &peer->v.xor_peer_addr, al);
 		if (!perm) {
 			restund_info("turn: unable to create permission\n");
-			++turndp()->reply.scode_500;
-			rerr = stun_ereply(proto, sock, src, 0, msg,
-					  500, "Server Error",
-					  ctx->key, ctx->keylen, ctx->fp, 1,
-					  STUN_ATTR_SOFTWARE,restund_software);
+			TURN_INC(TURN_SCODE_500);
+			rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+						   500, "Server Error",
+						   ctx->key, ctx->keylen,
+						   ctx->fp, 1,
+						   STUN_ATTR_SOFTWARE,
+						   restund_software);
 			goto out;
 		}
 	}
 
-	err = rerr = stun_reply(proto, sock, src, 0, msg,
-				ctx->key, ctx->keylen, ctx->fp, 1,
-				STUN_ATTR_SOFTWARE, restund_software);
+	err = rerr = restund_stun_reply(proto, sock, src, 0, msg,
+					ctx->key, ctx->keylen, ctx->fp, 1,
+					STUN_ATTR_SOFTWARE, restund_software);
  out:
 	if (rerr)
 		restund_warning("turn: chanbind reply: %m\n", rerr);
@@ -17,14 +17,36 @@ enum {
 
 struct perm {
 	struct le he;
+	struct le ile;
 	struct sa peer;
 	struct restund_trafstat ts;
+	struct restund_trafstat rep;  /* already reported */
 	const struct allocation *al;
 	time_t expires;
-	time_t start;
+	time_t start;                 /* start of unreported interval */
 	bool new;
 };
 
+struct json {
+	struct mbuf *mb;
+	uint32_t n;      /* elements printed */
+};
+
+
+/*
+ * Interim accounting: every permission is placed in one of `slotc'
+ * slots, one slot is visited per second. A permission thus reports its
+ * traffic once per interval, and the reports of many permissions are
+ * spread evenly over the interval.
+ */
+static struct {
+	struct tmr tmr;
+	struct list *slotv;
+	uint32_t slotc;
+	uint32_t tick;
+	uint32_t next;
+} interim;
+
 
 struct createperm {
 	struct list perml;
@@ -33,12 +55,37 @@ struct createperm {
 };
 
 
+static int perm_report(struct perm *perm, time_t now)
+{
+	struct restund_trafstat ts;
+	int err;
+
+	ts.pktc_tx = perm->ts.pktc_tx - perm->rep.pktc_tx;
+	ts.pktc_rx = perm->ts.pktc_rx - perm->rep.pktc_rx;
+	ts.bytc_tx = perm->ts.bytc_tx - perm->rep.bytc_tx;
+	ts.bytc_rx = perm->ts.bytc_rx - perm->rep.bytc_rx;
+
+	if (!ts.pktc_tx && !ts.pktc_rx)
+		return 0;
+
+	err = acct_report(perm->al, &perm->peer, &ts, perm->start, now);
+	if (err)
+		return err;
+
+	perm->rep   = perm->ts;
+	perm->start = now;
+
+	return 0;
+}
+
+
 static void destructor(void *arg)
 {
 	struct perm *perm = arg;
 	int err;
 
 	hash_unlink(&perm->he);
+	list_unlink(&perm->ile);
 
 	restund_debug("turn: allocation %p permission %j destroyed "
 		      "(%llu/%llu %llu/%llu)\n",
@@ -46,12 +93,7 @@ static void destructor(void *arg)
 		      perm->ts.pktc_tx, perm->ts.pktc_rx,
 		      perm->ts.bytc_tx, perm->ts.bytc_rx);
 
-	if (!perm->ts.pktc_tx && !perm->ts.pktc_rx)
-		return;
-
-	err = restund_log_traffic(perm->al->username, &perm->al->cli_addr,
-				  &perm->al->rel_addr, &perm->peer,
-				  perm->start, time(NULL), &perm->ts);
+	err = perm_report(perm, restund_time());
 	if (err) {
 		restund_warning("traffic log error: %m\n", err);
 	}
@@ -78,7 +120,7 @@ struct perm *perm_find(const struct hash *ht, const struct sa *peer)
 	if (!perm)
 		return NULL;
 
-	if (perm->expires < time(NULL)) {
+	if (perm->expires < restund_time()) {
 		restund_debug("turn: allocation %p permission %j expired\n",
 			      perm->al, &perm->peer);
 		mem_deref(perm);
@@ -92,7 +134,7 @@ struct perm *perm_find(const struct hash *ht, const struct sa *peer)
 struct perm *perm_create(struct hash *ht, const struct sa *peer,
 			 const struct allocation *al)
 {
-	const time_t now = time(NULL);
+	const time_t now = restund_time();
 	struct perm *perm;
 
 	if (!ht || !peer || !al)
@@ -109,6 +151,11 @@ struct perm *perm_create(struct hash *ht, const struct sa *peer,
 	perm->expires = now + PERM_LIFETIME;
 	perm->start = now;
 
+	if (interim.slotv) {
+		list_append(&interim.slotv[interim.next], &perm->ile, perm);
+		interim.next = (interim.next + 1) % interim.slotc;
+	}
+
 	restund_debug("turn: allocation %p permission %j created\n", al, peer);
 
 	return perm;
@@ -120,7 +167,7 @@ void perm_refresh(struct perm *perm)
 	if (!perm)
 		return;
 
-	perm->expires = time(NULL) + PERM_LIFETIME;
+	perm->expires = restund_time() + PERM_LIFETIME;
 	restund_debug("turn: allocation %p permission %j refreshed\n",
 		      perm->al, &perm->peer);
 }
@@ -152,13 +199,83 @@ int perm_hash_alloc(struct hash **ht, uint32_t bsize)
 }
 
 
+static bool interim_handler(struct le *le, void *arg)
+{
+	struct perm *perm = le->data;
+	const time_t *now = arg;
+	int err;
+
+	err = perm_report(perm, *now);
+	if (err) {
+		/* the delta is carried over to the next report */
+		restund_debug("turn: interim traffic log: %m\n", err);
+	}
+
+	return false;
+}
+
+
+static void interim_timeout(void *arg)
+{
+	time_t now = restund_time();
+	(void)arg;
+
+	tmr_start(&interim.tmr, 1000, interim_timeout, NULL);
+
+	(void)list_apply(&interim.slotv[interim.tick], true,
+			 interim_handler, &now);
+
+	interim.tick = (interim.tick + 1) % interim.slotc;
+}
+
+
+/**
+ * Enable interim traffic accounting for permissions
+ *
+ * @param interval Reporting interval in seconds
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int perm_interim_init(uint32_t interval)
+{
+	uint32_t i;
+
+	if (!interval)
+		return EINVAL;
+
+	interim.slotv = mem_zalloc(interval * sizeof(*interim.slotv), NULL);
+	if (!interim.slotv)
+		return ENOMEM;
+
+	for (i=0; i<interval; i++)
+		list_init(&interim.slotv[i]);
+
+	interim.slotc = interval;
+	interim.tick  = 0;
+	interim.next  = 0;
+
+	tmr_start(&interim.tmr, 1000, interim_timeout, NULL);
+
+	return 0;
+}
+
+
+/* must be called after all permissions have been destroyed */
+void perm_interim_close(void)
+{
+	tmr_cancel(&interim.tmr);
+	interim.slotv = mem_deref(interim.slotv);
+	interim.slotc = 0;
+}
+
+
 static bool status_handler(struct le *le, void *arg)
 {
 	struct perm *perm = le->data;
 	struct mbuf *mb = arg;
 
 	(void)mbuf_printf(mb, " (%j %is relay %llu/%llu)", &perm->peer,
-			  perm->expires - time(NULL),
+			  perm->expires - restund_time(),
 			  perm->ts.pktc_tx, perm->ts.pktc_rx);
 
 	return false;
@@ -176,6 +293,60 @@ void perm_status(struct hash *ht, struct mbuf *mb)
 }
 
 
+static bool json_handler(struct le *le, void *arg)
+{
+	const struct perm *perm = le->data;
+	struct json *js = arg;
+
+	return 0 != mbuf_printf(js->mb, "%s{\"peer\":\"%J\",\"expires\":%lli,"
+				"\"pkts_tx\":%llu,\"pkts_rx\":%llu,"
+				"\"bytes_tx\":%llu,\"bytes_rx\":%llu}",
+				js->n++ ? "," : "", &perm->peer,
+				(int64_t)(perm->expires - restund_time()),
+				perm->ts.pktc_tx, perm->ts.pktc_rx,
+				perm->ts.bytc_tx, perm->ts.bytc_rx);
+}
+
+
+int perm_json(const struct hash *ht, struct mbuf *mb)
+{
+	struct json js = {mb, 0};
+	int err;
+
+	if (!ht || !mb)
+		return EINVAL;
+
+	err = mbuf_write_str(mb, "[");
+	if (hash_apply(ht, json_handler, &js))
+		err = ENOMEM;
+	err |= mbuf_write_str(mb, "]");
+
+	return err;
+}
+
+
+static bool traffic_handler(struct le *le, void *arg)
+{
+	const struct perm *perm = le->data;
+	uint64_t *bytc = arg;
+
+	*bytc += perm->ts.bytc_tx + perm->ts.bytc_rx;
+
+	return false;
+}
+
+
+/* bytes relayed in both directions by all permissions */
+uint64_t perm_traffic(const struct hash *ht)
+{
+	uint64_t bytc = 0;
+
+	(void)hash_apply(ht, traffic_handler, &bytc);
+
+	return bytc;
+}
+
+
 static bool attrib_handler(const struct stun_attr *attr, void *arg)
 {
 	struct createperm *cp = arg;
@@ -255,36 +426,39 @@ void createperm_request(struct allocation *al, struct restund_msgctx *ctx,
 	hfail = (NULL != stun_msg_attr_apply(msg, attrib_handler, &cp));
 	if (cp.af_mismatch) {
 		restund_info("turn: creatperm peer address family mismatch\n");
-		++turndp()->reply.scode_443;
-		rerr = stun_ereply(proto, sock, src, 0, msg,
-				   443, "Peer Address Family Mismatch",
-				   ctx->key, ctx->keylen, ctx->fp, 1,
-				   STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_443);
+		rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+					   443, "Peer Address Family Mismatch",
+					   ctx->key, ctx->keylen, ctx->fp, 1,
+					   STUN_ATTR_SOFTWARE,
+					   restund_software);
 		goto out;
 	}
 	else if (hfail) {
 		restund_info("turn: unable to create permission\n");
-		++turndp()->reply.scode_500;
-		rerr = stun_ereply(proto, sock, src, 0, msg,
-				   500, "Server Error",
-				   ctx->key, ctx->keylen, ctx->fp, 1,
-				   STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_500);
+		rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+					   500, "Server Error",
+					   ctx->key, ctx->keylen, ctx->fp, 1,
+					   STUN_ATTR_SOFTWARE,
+					   restund_software);
 		goto out;
 	}
 
 	if (!cp.perml.head) {
 		restund_info("turn: no peer-addr attributes\n");
-		++turndp()->reply.scode_400;
-		rerr = stun_ereply(proto, sock, src, 0, msg,
-				   400, "No Peer Attributes",
-				   ctx->key, ctx->keylen, ctx->fp, 1,
-				   STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_400);
+		rerr = restund_stun_ereply(proto, sock, src, 0, msg,
+					   400, "No Peer Attributes",
+					   ctx->key, ctx->keylen, ctx->fp, 1,
+					   STUN_ATTR_SOFTWARE,
+					   restund_software);
 		goto out;
 	}
 
-	err = rerr = stun_reply(proto, sock, src, 0, msg,
-				ctx->key, ctx->keylen, ctx->fp, 1,
-				STUN_ATTR_SOFTWARE, restund_software);
+	err = rerr = restund_stun_reply(proto, sock, src, 0, msg,
+					ctx->key, ctx->keylen, ctx->fp, 1,
+					STUN_ATTR_SOFTWARE, restund_software);
  out:
 	if (rerr)
 		restund_warning("turn: createperm reply: %m\n", rerr);
@@ -12,6 +12,7 @@
 
 enum {
 	ALLOC_DEFAULT_BSIZE = 512,
+	STATUS_SCAN_MAX     = 4096,  /* hash buckets visited per page */
 };
 
 
@@ -21,6 +22,14 @@ struct tuple {
 	int proto;
 };
 
+struct alloc_filter {
+	struct pl user;
+	struct sa cli;
+	int cli_flags;
+	uint32_t port;
+	uint64_t minbytes;
+};
+
 
 static struct turnd turnd;
 
@@ -84,12 +93,13 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 	}
 
 	if (ctx->ua.typec > 0) {
-		++turnd.reply.scode_420;
-		err = stun_ereply(proto, sock, src, 0, msg,
-				  420, "Unknown Attribute",
-				  ctx->key, ctx->keylen, ctx->fp, 2,
-				  STUN_ATTR_UNKNOWN_ATTR, &ctx->ua,
-				  STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_420);
+		err = restund_stun_ereply(proto, sock, src, 0, msg,
+					  420, "Unknown Attribute",
+					  ctx->key, ctx->keylen, ctx->fp, 2,
+					  STUN_ATTR_UNKNOWN_ATTR, &ctx->ua,
+					  STUN_ATTR_SOFTWARE,
+					  restund_software);
 		goto out;
 	}
 
@@ -97,12 +107,13 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 
 	if (!al && met != STUN_METHOD_ALLOCATE) {
 		restund_debug("turn: allocation does not exist\n");
-		++turnd.reply.scode_437;
-		err = stun_ereply(proto, sock, src, 0, msg,
-				  437,
-				  "Allocation Mismatch (no such allocation)",
-				  ctx->key, ctx->keylen, ctx->fp, 1,
-				  STUN_ATTR_SOFTWARE, restund_software);
+		TURN_INC(TURN_SCODE_437);
+		err = restund_stun_ereply(proto, sock, src, 0, msg,
+					  437, "Allocation Mismatch"
+					  " (no such allocation)",
+					  ctx->key, ctx->keylen, ctx->fp, 1,
+					  STUN_ATTR_SOFTWARE,
+					  restund_software);
 		goto out;
 	}
 
@@ -112,11 +123,13 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 
 		if (!usr || strcmp(usr->v.username, al->username)) {
 			restund_debug("turn: wrong credetials\n");
-			++turnd.reply.scode_441;
-			err = stun_ereply(proto, sock, src, 0, msg,
-					  441, "Wrong Credentials",
-					  ctx->key, ctx->keylen, ctx->fp, 1,
-					  STUN_ATTR_SOFTWARE,restund_software);
+			TURN_INC(TURN_SCODE_441);
+			err = restund_stun_ereply(proto, sock, src, 0, msg,
+						  441, "Wrong Credentials",
+						  ctx->key, ctx->keylen,
+						  ctx->fp, 1,
+						  STUN_ATTR_SOFTWARE,
+						  restund_software);
 			goto out;
 		}
 	}
@@ -188,14 +201,15 @@ static bool indication_handler(struct restund_msgctx *ctx, int proto,
 	if (restund_addr_is_blocked(psa))
 		err = EPERM;
 	else
-		err = udp_send(al->rel_us, psa, &data->v.data);
+		err = restund_send(IPPROTO_UDP, al->rel_us, psa,
+				   &data->v.data);
 	if (err)
-		turnd.errc_tx++;
+		TURN_INC(TURN_ERR_TX);
 	else {
 		const size_t bytes = mbuf_get_left(&data->v.data);
 
 		perm_tx_stat(perm, bytes);
-		turnd.bytec_tx += bytes;
+		TURN_ADD(TURN_BYTES_TX, bytes);
 	}
 
 	return true;
@@ -241,14 +255,14 @@ static bool raw_handler(int proto, const struct sa *src,
 	if (restund_addr_is_blocked(psa))
 		err = EPERM;
 	else
-		err = udp_send(al->rel_us, psa, mb);
+		err = restund_send(IPPROTO_UDP, al->rel_us, psa, mb);
 	if (err)
-		turnd.errc_tx++;
+		TURN_INC(TURN_ERR_TX);
 	else {
 		const size_t bytes = mbuf_get_left(mb);
 
 		perm_tx_stat(perm, bytes);
-		turnd.bytec_tx += bytes;
+		TURN_ADD(TURN_BYTES_TX, bytes);
 	}
 
 	return true;
@@ -276,41 +290,286 @@ static bool allocation_status(struct le *le, void *arg)
 }
 
 
-static void status_handler(struct mbuf *mb)
+static int filter_decode(struct alloc_filter *f, const struct pl *params)
+{
+	struct pl v;
+	int err = 0;
+
+	memset(f, 0, sizeof(*f));
+	sa_init(&f->cli, AF_UNSPEC);
+
+	if (!restund_cmd_param(params, "user", &v))
+		f->user = v;
+
+	/* client address, with or without port */
+	if (!restund_cmd_param(params, "cli", &v)) {
+
+		if (!sa_decode(&f->cli, v.p, v.l)) {
+			f->cli_flags = SA_ALL;
+		}
+		else {
+			err = sa_set(&f->cli, &v, 0);
+			f->cli_flags = SA_ADDR;
+		}
+	}
+
+	if (!restund_cmd_param(params, "port", &v))
+		f->port = pl_u32(&v);
+
+	if (!restund_cmd_param(params, "minbytes", &v))
+		f->minbytes = pl_u64(&v);
+
+	return err;
+}
+
+
+static bool filter_match(const struct alloc_filter *f,
+			 const struct allocation *al)
+{
+	if (pl_isset(&f->user) && pl_strcmp(&f->user, al->username))
+		return false;
+
+	if (f->cli_flags && !sa_cmp(&f->cli, &al->cli_addr, f->cli_flags))
+		return false;
+
+	if (f->port && sa_port(&al->rel_addr) != f->port)
+		return false;
+
+	if (f->minbytes && perm_traffic(al->perms) < f->minbytes)
+		return false;
+
+	return true;
+}
+
+
+/*
+ * The cursor is the index of the next hash bucket. Allocations which
+ * are created or destroyed while a listing is in progress may or may
+ * not be shown, but no other allocation is skipped or repeated.
+ */
+static void status_handler(struct mbuf *mb, struct restund_cmdpage *pg)
+{
+	const uint32_t bsize = hash_bsize(turnd.ht_alloc);
+	struct alloc_filter f;
+	uint32_t n = 0, scan = 0;
+	struct le *le;
+
+	if (filter_decode(&f, &pg->params)) {
+		(void)mbuf_printf(mb, "turn: bad filter '%r'\n", &pg->params);
+		pg->done = true;
+		return;
+	}
+
+	if (!pg->cursor) {
+		(void)mbuf_printf(mb, "TURN relay=%j relay6=%j"
+				  " (err %llu/%llu)\n",
+				  &turnd.rel_addr, &turnd.rel_addr6,
+				  restund_ctr_get(&turnd.ctr, TURN_ERR_TX),
+				  restund_ctr_get(&turnd.ctr, TURN_ERR_RX));
+	}
+
+	while (pg->cursor < bsize && n < pg->limit &&
+	       scan++ < STATUS_SCAN_MAX) {
+
+		le = list_head(hash_list(turnd.ht_alloc, pg->cursor++));
+
+		for (; le; le = le->next) {
+
+			if (!filter_match(&f, le->data))
+				continue;
+
+			(void)allocation_status(le, mb);
+			++n;
+		}
+	}
+
+	pg->done = pg->cursor >= bsize;
+}
+
+
+static int allocation_json(const struct allocation *al, struct mbuf *mb)
+{
+	int err = 0;
+
+	err |= mbuf_printf(mb, "{\"transport\":\"%s\",\"client\":\"%J\","
+			   "\"server\":\"%J\",\"relay\":\"%J\",",
+			   stun_transp_name(al->proto), &al->cli_addr,
+			   &al->srv_addr, &al->rel_addr);
+	if (al->username)
+		err |= mbuf_printf(mb, "\"username\":\"%H\",",
+				   utf8_encode, al->username);
+	err |= mbuf_printf(mb, "\"expires\":%u,\"drops_tx\":%llu,"
+			   "\"drops_rx\":%llu,\"bytes\":%llu,"
+			   "\"permissions\":",
+			   (uint32_t)tmr_get_expire(&al->tmr) / 1000,
+			   al->dropc_tx, al->dropc_rx,
+			   perm_traffic(al->perms));
+	err |= perm_json(al->perms, mb);
+	err |= mbuf_write_str(mb, ",\"channels\":");
+	err |= chan_json(al->chans, mb);
+	err |= mbuf_write_str(mb, "}");
+
+	return err;
+}
+
+
+/* same paging and filters as status_handler */
+static int status_json(struct mbuf *mb, struct restund_cmdpage *pg)
+{
+	const uint32_t bsize = hash_bsize(turnd.ht_alloc);
+	struct alloc_filter f;
+	uint32_t n = 0, scan = 0;
+	struct le *le;
+	int err;
+
+	err = filter_decode(&f, &pg->params);
+	if (err)
+		return EINVAL;
+
+	err = mbuf_write_str(mb, "[");
+
+	while (!err && pg->cursor < bsize && n < pg->limit &&
+	       scan++ < STATUS_SCAN_MAX) {
+
+		le = list_head(hash_list(turnd.ht_alloc, pg->cursor++));
+
+		for (; le && !err; le = le->next) {
+
+			if (!filter_match(&f, le->data))
+				continue;
+
+			if (n++)
+				err |= mbuf_write_str(mb, ",");
+			err |= allocation_json(le->data, mb);
+		}
+	}
+
+	err |= mbuf_write_str(mb, "]");
+
+	pg->done = pg->cursor >= bsize;
+
+	return err;
+}
+
+
+static bool user_cmp_handler(struct le *le, void *arg)
 {
-	(void)mbuf_printf(mb, "TURN relay=%j relay6=%j (err %llu/%llu)\n",
-			  &turnd.rel_addr, &turnd.rel_addr6,
-			  turnd.errc_tx, turnd.errc_rx);
-	(void)hash_apply(turnd.ht_alloc, allocation_status, mb);
+	const struct allocation *al = le->data;
+
+	return 0 == pl_strcmp(arg, al->username ? al->username : "");
+}
+
+
+static bool port_cmp_handler(struct le *le, void *arg)
+{
+	const struct allocation *al = le->data;
+
+	return sa_port(&al->rel_addr) == *(uint32_t *)arg;
+}
+
+
+/*
+ * Terminate all allocations of a username or the allocation on a
+ * relay port. The secondary indexes are used so that no table scan
+ * is needed.
+ */
+static int close_handler(struct mbuf *mb, const struct pl *params)
+{
+	struct pl user, val;
+	uint32_t port = 0, n = 0;
+	struct le *le;
+
+	if (!restund_cmd_param(params, "user", &user)) {
+
+		const uint32_t key = hash_joaat((const uint8_t *)user.p,
+						user.l);
+
+		/* would match all allocations without a username */
+		if (!user.l)
+			return EINVAL;
+
+		while ((le = hash_lookup(turnd.ht_user, key,
+					 user_cmp_handler, &user))) {
+			mem_deref(le->data);
+			++n;
+		}
+	}
+	else if (!restund_cmd_param(params, "port", &val)) {
+
+		port = pl_u32(&val);
+		if (!port || port > 65535)
+			return EINVAL;
+
+		while ((le = hash_lookup(turnd.ht_port, port,
+					 port_cmp_handler, &port))) {
+			mem_deref(le->data);
+			++n;
+		}
+	}
+	else
+		return EINVAL;
+
+	return mbuf_printf(mb, "{\"closed\":%u}", n);
+}
+
+
+static int stats_json(struct mbuf *mb, struct restund_cmdpage *pg)
+{
+	const uint64_t tx = restund_ctr_get(&turnd.ctr, TURN_BYTES_TX);
+	const uint64_t rx = restund_ctr_get(&turnd.ctr, TURN_BYTES_RX);
+	(void)pg;
+
+	return mbuf_printf(mb, "{\"allocs_cur\":%u,\"allocs_tot\":%llu,"
+			   "\"bytes_tx\":%llu,\"bytes_rx\":%llu,"
+			   "\"bytes_tot\":%llu,\"errors_tx\":%llu,"
+			   "\"errors_rx\":%llu}",
+			   turnd.allocc_cur,
+			   restund_ctr_get(&turnd.ctr, TURN_ALLOCS),
+			   tx, rx, tx + rx,
+			   restund_ctr_get(&turnd.ctr, TURN_ERR_TX),
+			   restund_ctr_get(&turnd.ctr, TURN_ERR_RX));
 }
 
 
 static void stats_handler(struct mbuf *mb)
 {
+	const uint64_t tx = restund_ctr_get(&turnd.ctr, TURN_BYTES_TX);
+	const uint64_t rx = restund_ctr_get(&turnd.ctr, TURN_BYTES_RX);
+
 	(void)mbuf_printf(mb, "allocs_cur %u\n", turnd.allocc_cur);
-	(void)mbuf_printf(mb, "allocs_tot %llu\n", turnd.allocc_tot);
-	(void)mbuf_printf(mb, "bytes_tx %llu\n", turnd.bytec_tx);
-	(void)mbuf_printf(mb, "bytes_rx %llu\n", turnd.bytec_rx);
-	(void)mbuf_printf(mb, "bytes_tot %llu\n",
-			  turnd.bytec_tx + turnd.bytec_rx);
+	(void)mbuf_printf(mb, "allocs_tot %llu\n",
+			  restund_ctr_get(&turnd.ctr, TURN_ALLOCS));
+	(void)mbuf_printf(mb, "bytes_tx %llu\n", tx);
+	(void)mbuf_printf(mb, "bytes_rx %llu\n", rx);
+	(void)mbuf_printf(mb, "bytes_tot %llu\n", tx + rx);
 }
 
 
 static void reply_handler(struct mbuf *mb)
 {
-	(void)mbuf_printf(mb, "scode_400 %u\n", turnd.reply.scode_400);
-	(void)mbuf_printf(mb, "scode_420 %u\n", turnd.reply.scode_420);
-	(void)mbuf_printf(mb, "scode_437 %u\n", turnd.reply.scode_437);
-	(void)mbuf_printf(mb, "scode_440 %u\n", turnd.reply.scode_440);
-	(void)mbuf_printf(mb, "scode_441 %u\n", turnd.reply.scode_441);
-	(void)mbuf_printf(mb, "scode_442 %u\n", turnd.reply.scode_442);
-	(void)mbuf_printf(mb, "scode_443 %u\n", turnd.reply.scode_443);
-	(void)mbuf_printf(mb, "scode_500 %u\n", turnd.reply.scode_500);
-	(void)mbuf_printf(mb, "scode_508 %u\n", turnd.reply.scode_508);
+	(void)mbuf_printf(mb, "scode_400 %llu\n",
+			  restund_ctr_get(&turnd.ctr, TURN_SCODE_400));
+	(void)mbuf_printf(mb, "scode_420 %llu\n",
+			  restund_ctr_get(&turnd.ctr, TURN_SCODE_420));
+	(void)mbuf_printf(mb, "scode_437 %llu\n",
+			  restund_ctr_get(&turnd.ctr, TURN_SCODE_437));
+	(void)mbuf_printf(mb, "scode_440 %llu\n",
+			  restund_ctr_get(&turnd.ctr, TURN_SCODE_440));
+	(void)mbuf_printf(mb, "scode_441 %llu\n",
+			  restund_ctr_get(&turnd.ctr, TURN_SCODE_441));
+	(void)mbuf_printf(mb, "scode_442 %llu\n",
+			  restund_ctr_get(&turnd.ctr, TURN_SCODE_442));
+	(void)mbuf_printf(mb, "scode_443 %llu\n",
+			  restund_ctr_get(&turnd.ctr, TURN_SCODE_443));
+	(void)mbuf_printf(mb, "scode_500 %llu\n",
+			  restund_ctr_get(&turnd.ctr, TURN_SCODE_500));
+	(void)mbuf_printf(mb, "scode_508 %llu\n",
+			  restund_ctr_get(&turnd.ctr, TURN_SCODE_508));
 }
 
 
 static struct restund_stun stun = {
+	.name = "turn",
 	.reqh = request_handler,
 	.indh = indication_handler,
 	.rawh = raw_handler,
@@ -318,14 +577,22 @@ static struct restund_stun stun = {
 
 
 static struct restund_cmdsub cmd_turn = {
-	.cmdh = status_handler,
-	.cmd  = "turn",
+	.pageh = status_handler,
+	.cmd   = "turn",
+	.jsonh = status_json,
 };
 
 
 static struct restund_cmdsub cmd_turnstats = {
-	.cmdh = stats_handler,
-	.cmd  = "turnstats",
+	.cmdh  = stats_handler,
+	.cmd   = "turnstats",
+	.jsonh = stats_json,
+};
+
+
+static struct restund_cmdsub cmd_turnclose = {
+	.cmd   = "turn_close",
+	.posth = close_handler,
 };
 
 
@@ -335,16 +602,98 @@ static struct restund_cmdsub cmd_turnreply = {
 };
 
 
+static struct restund_metric metricv[] = {
+	{ .name = "restund_turn_allocations_current",
+	  .help = "Current TURN allocations",
+	  .type = RESTUND_METRIC_GAUGE, .u32 = &turnd.allocc_cur },
+	{ .name = "restund_turn_allocations",
+	  .help = "TURN allocations created",
+	  .ctr = &turnd.ctr, .ctri = TURN_ALLOCS },
+	{ .name = "restund_turn_bytes", .labels = "direction=\"tx\"",
+	  .help = "Relayed bytes",
+	  .ctr = &turnd.ctr, .ctri = TURN_BYTES_TX },
+	{ .name = "restund_turn_bytes", .labels = "direction=\"rx\"",
+	  .help = "Relayed bytes",
+	  .ctr = &turnd.ctr, .ctri = TURN_BYTES_RX },
+	{ .name = "restund_turn_errors", .labels = "direction=\"tx\"",
+	  .help = "Relay errors",
+	  .ctr = &turnd.ctr, .ctri = TURN_ERR_TX },
+	{ .name = "restund_turn_errors", .labels = "direction=\"rx\"",
+	  .help = "Relay errors",
+	  .ctr = &turnd.ctr, .ctri = TURN_ERR_RX },
+	{ .name = "restund_turn_replies", .labels = "code=\"400\"",
+	  .help = "TURN error replies",
+	  .ctr = &turnd.ctr, .ctri = TURN_SCODE_400 },
+	{ .name = "restund_turn_replies", .labels = "code=\"420\"",
+	  .help = "TURN error replies",
+	  .ctr = &turnd.ctr, .ctri = TURN_SCODE_420 },
+	{ .name = "restund_turn_replies", .labels = "code=\"437\"",
+	  .help = "TURN error replies",
+	  .ctr = &turnd.ctr, .ctri = TURN_SCODE_437 },
+	{ .name = "restund_turn_replies", .labels = "code=\"440\"",
+	  .help = "TURN error replies",
+	  .ctr = &turnd.ctr, .ctri = TURN_SCODE_440 },
+	{ .name = "restund_turn_replies", .labels = "code=\"441\"",
+	  .help = "TURN error replies",
+	  .ctr = &turnd.ctr, .ctri = TURN_SCODE_441 },
+	{ .name = "restund_turn_replies", .labels = "code=\"442\"",
+	  .help = "TURN error replies",
+	  .ctr = &turnd.ctr, .ctri = TURN_SCODE_442 },
+	{ .name = "restund_turn_replies", .labels = "code=\"443\"",
+	  .help = "TURN error replies",
+	  .ctr = &turnd.ctr, .ctri = TURN_SCODE_443 },
+	{ .name = "restund_turn_replies", .labels = "code=\"500\"",
+	  .help = "TURN error replies",
+	  .ctr = &turnd.ctr, .ctri = TURN_SCODE_500 },
+	{ .name = "restund_turn_replies", .labels = "code=\"508\"",
+	  .help = "TURN error replies",
+	  .ctr = &turnd.ctr, .ctri = TURN_SCODE_508 },
+};
+
+
+static int module_close(void)
+{
+	hash_flush(turnd.ht_alloc);
+	turnd.ht_alloc = mem_deref(turnd.ht_alloc);
+	turnd.ht_user  = mem_deref(turnd.ht_user);
+	turnd.ht_port  = mem_deref(turnd.ht_port);
+	perm_interim_close();
+	acct_close();
+	restund_hist_unregister(&turnd.relay_hist);
+	restund_metric_unregister(metricv, RE_ARRAY_SIZE(metricv));
+	restund_cmd_unsubscribe(&cmd_turnclose);
+	restund_cmd_unsubscribe(&cmd_turnreply);
+	restund_cmd_unsubscribe(&cmd_turnstats);
+	restund_cmd_unsubscribe(&cmd_turn);
+	restund_stun_unregister_handler(&stun);
+	restund_ctr_unregister(&turnd.ctr);
+
+	restund_debug("turn: module closed\n");
+
+	return 0;
+}
+
+
 static int module_init(void)
 {
-	uint32_t x, bsize = ALLOC_DEFAULT_BSIZE;
+	uint32_t x, bsize = ALLOC_DEFAULT_BSIZE, interim = 0;
 	struct pl opt;
 	int err = 0;
 
+	turnd.ctr.name = "turn";
+	turnd.ctr.n    = TURN_CTR_MAX;
+
+	err = restund_ctr_register(&turnd.ctr);
+	if (err)
+		return err;
+
 	restund_stun_register_handler(&stun);
 	restund_cmd_subscribe(&cmd_turn);
 	restund_cmd_subscribe(&cmd_turnstats);
 	restund_cmd_subscribe(&cmd_turnreply);
+	restund_cmd_subscribe(&cmd_turnclose);
+	restund_metric_register(metricv, RE_ARRAY_SIZE(metricv));
+	restund_hist_register(&turnd.relay_hist, "turn_relay");
 
 	/* turn_external_addr */
 	if (!conf_get(restund_conf(), "turn_relay_addr", &opt))
@@ -401,32 +750,42 @@ static int module_init(void)
 	bsize = 1<<x;
 
 	err = hash_alloc(&turnd.ht_alloc, bsize);
+	if (!err)
+		err = hash_alloc(&turnd.ht_user, bsize);
+	if (!err)
+		err = hash_alloc(&turnd.ht_port, bsize);
 	if (err) {
 		restund_error("turnd hash alloc error: %m\n", err);
 		goto out;
 	}
 
-	restund_debug("turn: lifetime=%u ext=%j ext6=%j bsz=%u\n",
-		      turnd.lifetime_max, &turnd.rel_addr, &turnd.rel_addr6,
-		      bsize);
+	err = acct_init();
+	if (err)
+		goto out;
 
- out:
-	return err;
-}
+	/* turn_relay_timestamps */
+	if (!conf_get(restund_conf(), "turn_relay_timestamps", &opt))
+		turnd.relay_ts = !pl_strcasecmp(&opt, "yes");
 
+	/* turn_interim_interval */
+	conf_get_u32(restund_conf(), "turn_interim_interval", &interim);
+	if (interim) {
+		err = perm_interim_init(interim);
+		if (err) {
+			restund_error("turn: interim accounting: %m\n", err);
+			goto out;
+		}
+	}
 
-static int module_close(void)
-{
-	hash_flush(turnd.ht_alloc);
-	turnd.ht_alloc = mem_deref(turnd.ht_alloc);
-	restund_cmd_unsubscribe(&cmd_turnreply);
-	restund_cmd_unsubscribe(&cmd_turnstats);
-	restund_cmd_unsubscribe(&cmd_turn);
-	restund_stun_unregister_handler(&stun);
+	restund_debug("turn: lifetime=%u ext=%j ext6=%j bsz=%u interim=%u\n",
+		      turnd.lifetime_max, &turnd.rel_addr, &turnd.rel_addr6,
+		      bsize, interim);
 
-	restund_debug("turn: module closed\n");
+ out:
+	if (err)
+		(void)module_close();
 
-	return 0;
+	return err;
 }
 
 
@@ -4,37 +4,48 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
+enum turn_ctr {
+	TURN_BYTES_TX = 0,
+	TURN_BYTES_RX,
+	TURN_ERR_TX,
+	TURN_ERR_RX,
+	TURN_ALLOCS,
+	TURN_SCODE_400,
+	TURN_SCODE_420,
+	TURN_SCODE_437,
+	TURN_SCODE_440,
+	TURN_SCODE_441,
+	TURN_SCODE_442,
+	TURN_SCODE_443,
+	TURN_SCODE_500,
+	TURN_SCODE_508,
+	TURN_CTR_MAX
+};
+
+#define TURN_ADD(i, v)  restund_ctr_add(&turndp()->ctr, (i), (v))
+#define TURN_INC(i)     TURN_ADD(i, 1)
+
 struct turnd {
 	struct sa rel_addr;
 	struct sa rel_addr6;
 	struct sa public_addr;
 	struct hash *ht_alloc;
-	uint64_t bytec_tx;
-	uint64_t bytec_rx;
-	uint64_t errc_tx;
-	uint64_t errc_rx;
-	uint64_t allocc_tot;
+	struct hash *ht_user;   /* allocations by username */
+	struct hash *ht_port;   /* allocations by relay port */
+	struct restund_ctr ctr;
 	uint32_t allocc_cur;
 	uint32_t lifetime_max;
 	uint32_t udp_sockbuf_size;
-
-	struct {
-		uint64_t scode_400;
-		uint64_t scode_420;
-		uint64_t scode_437;
-		uint64_t scode_440;
-		uint64_t scode_441;
-		uint64_t scode_442;
-		uint64_t scode_443;
-		uint64_t scode_500;
-		uint64_t scode_508;
-	} reply;
+	bool relay_ts;
+	struct restund_hist relay_hist;
 };
 
 struct chanlist;
 
 struct allocation {
 	struct le he;
+	struct le uhe;
+	struct le phe;
 	struct tmr tmr;
 	uint8_t tid[STUN_TID_SIZE];
 	struct sa cli_addr;
@@ -42,8 +53,8 @@ struct allocation {
 	struct sa rel_addr;
 	struct sa rsv_addr;
 	void *cli_sock;
-	struct udp_sock *rel_us;
-	struct udp_sock *rsv_us;
+	void *rel_us;           /* see restund_udp_listen() */
+	void *rsv_us;
 	char *username;
 	struct hash *perms;
 	struct chanlist *chans;
@@ -79,6 +90,17 @@ void perm_tx_stat(struct perm *perm, size_t bytc);
 void perm_rx_stat(struct perm *perm, size_t bytc);
 int  perm_hash_alloc(struct hash **ht, uint32_t bsize);
 void perm_status(struct hash *ht, struct mbuf *mb);
+int  perm_json(const struct hash *ht, struct mbuf *mb);
+uint64_t perm_traffic(const struct hash *ht);
+int  perm_interim_init(uint32_t interval);
+void perm_interim_close(void);
+
+
+int  acct_init(void);
+void acct_close(void);
+int  acct_report(const struct allocation *al, const struct sa *peer,
+		 const struct restund_trafstat *ts, time_t start, time_t now);
+void acct_alloc_close(const struct allocation *al);
 
 
 struct chan;
@@ -89,3 +111,4 @@ uint16_t chan_numb(const struct chan *chan);
 const struct sa *chan_peer(const struct chan *chan);
 int  chanlist_alloc(struct chanlist **clp, uint32_t bsize);
 void chan_status(const struct chanlist *cl, struct mbuf *mb);
+int  chan_json(const struct chanlist *cl, struct mbuf *mb);
@@ -116,9 +116,9 @@ static int auth_handler(const char *user, uint8_t *ha1)
 	}
 
 	expi = (time_t)pl_u64(&expires);
-	if (expi < time(NULL)) {
+	if (expi < restund_time()) {
 		restund_debug("zrest: username expired %lli seconds ago\n",
-			      time(NULL) - pl_u64(&expires));
+			      restund_time() - pl_u64(&expires));
 		return ETIMEDOUT;
 	}
 
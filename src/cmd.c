@@ -6,21 +6,108 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <string.h>
 #include <re.h>
 #include <restund.h>
+#include "stund.h"
+
+
+enum {
+	PAGE_LIMIT = 100,
+};
 
 
 static struct list csl;
 
 
+static void cmd_call(struct restund_cmdsub *cs, struct mbuf *mb,
+		     struct restund_cmdpage *pg)
+{
+	uint64_t t = 0;
+
+	if (restund_prof_enabled())
+		t = restund_hist_clock();
+
+	if (pg)
+		cs->pageh(mb, pg);
+	else
+		cs->cmdh(mb);
+
+	if (t)
+		restund_prof_add("cmd", cs->cmd, RESTUND_PROF_CMD,
+				 restund_hist_clock() - t);
+}
+
+
+/* "name params", "name?params" */
+static void cmd_split(const struct pl *line, struct pl *name,
+		      struct pl *params)
+{
+	size_t i;
+
+	*name = *line;
+	params->p = line->p + line->l;
+	params->l = 0;
+
+	for (i=0; i<line->l; i++) {
+
+		if (line->p[i] != ' ' && line->p[i] != '?')
+			continue;
+
+		name->l   = i;
+		params->p = line->p + i + 1;
+		params->l = line->l - i - 1;
+		break;
+	}
+}
+
+
+static struct restund_cmdsub *page_find(const struct pl *name)
+{
+	struct le *le;
+
+	for (le = csl.head; le; le = le->next) {
+
+		struct restund_cmdsub *cs = le->data;
+
+		if (cs->pageh && !pl_strcmp(name, cs->cmd))
+			return cs;
+	}
+
+	return NULL;
+}
+
+
+static struct restund_cmdsub *cmd_find(const struct pl *name, bool post)
+{
+	struct le *le;
+
+	for (le = csl.head; le; le = le->next) {
+
+		struct restund_cmdsub *cs = le->data;
+
+		if (!(post ? cs->posth != NULL : cs->jsonh != NULL))
+			continue;
+
+		if (!pl_strcmp(name, cs->cmd))
+			return cs;
+	}
+
+	return NULL;
+}
+
+
 void restund_cmd(const struct pl *cmd, struct mbuf *mb)
 {
+	struct pl name, params, val;
 	bool found = false;
 	struct le *le;
 
 	if (!cmd || !mb)
 		return;
 
+	cmd_split(cmd, &name, &params);
+
 	le = csl.head;
 
 	while (le) {
@@ -28,18 +115,188 @@ void restund_cmd(const struct pl *cmd, struct mbuf *mb)
 		struct restund_cmdsub *cs = le->data;
 		le = le->next;
 
-		if (!cs->cmdh)
+		if (pl_strcmp(&name, cs->cmd))
 			continue;
 
-		if (pl_strcmp(cmd, cs->cmd))
+		if (cs->pageh) {
+			struct restund_cmdpage pg;
+
+			memset(&pg, 0, sizeof(pg));
+			pg.params = params;
+			pg.limit  = PAGE_LIMIT;
+
+			if (!restund_cmd_param(&params, "cursor", &val))
+				pg.cursor = pl_u32(&val);
+			if (!restund_cmd_param(&params, "limit", &val))
+				pg.limit = MAX(pl_u32(&val), 1);
+
+			cmd_call(cs, mb, &pg);
+
+			if (!pg.done)
+				(void)mbuf_printf(mb, "-- more: cursor=%u\n",
+						  pg.cursor);
+		}
+		else if (cs->cmdh) {
+			cmd_call(cs, mb, NULL);
+		}
+		else
 			continue;
 
-		cs->cmdh(mb);
 		found = true;
 	}
 
 	if (!found)
-		(void)mbuf_printf(mb, "%r: command not found\n", cmd);
+		(void)mbuf_printf(mb, "%r: command not found\n", &name);
+}
+
+
+/**
+ * Print one page of a paginated command. The handler advances the
+ * cursor in pg, and sets done when there is nothing more to print.
+ *
+ * @param cmd Command name
+ * @param mb  Buffer to print into
+ * @param pg  Page state
+ *
+ * @return 0 if success, ENOENT if the command is not paginated
+ */
+int restund_cmd_page(const struct pl *cmd, struct mbuf *mb,
+		     struct restund_cmdpage *pg)
+{
+	struct restund_cmdsub *cs;
+
+	if (!cmd || !mb || !pg)
+		return EINVAL;
+
+	cs = page_find(cmd);
+	if (!cs)
+		return ENOENT;
+
+	cmd_call(cs, mb, pg);
+
+	return 0;
+}
+
+
+/**
+ * Print the result of a command as one JSON value. Paginated commands
+ * advance the cursor in pg and set done; others set done right away.
+ *
+ * @param cmd Command name
+ * @param mb  Buffer to print into
+ * @param pg  Page state
+ *
+ * @return 0 if success, ENOENT if the command has no JSON output,
+ *         otherwise errorcode from the command
+ */
+int restund_cmd_json(const struct pl *cmd, struct mbuf *mb,
+		     struct restund_cmdpage *pg)
+{
+	struct restund_cmdsub *cs;
+
+	if (!cmd || !mb || !pg)
+		return EINVAL;
+
+	cs = cmd_find(cmd, false);
+	if (!cs)
+		return ENOENT;
+
+	pg->done = true;
+
+	return cs->jsonh(mb, pg);
+}
+
+
+/**
+ * Run a command which changes server state. The command prints its
+ * result as one JSON value.
+ *
+ * @param cmd    Command name
+ * @param mb     Buffer to print into
+ * @param params Command parameters
+ *
+ * @return 0 if success, ENOENT if there is no such command,
+ *         otherwise errorcode from the command
+ */
+int restund_cmd_post(const struct pl *cmd, struct mbuf *mb,
+		     const struct pl *params)
+{
+	struct restund_cmdsub *cs;
+	int err;
+
+	if (!cmd || !mb || !params)
+		return EINVAL;
+
+	cs = cmd_find(cmd, true);
+	if (!cs)
+		return ENOENT;
+
+	err = cs->posth(mb, params);
+
+	restund_info("cmd: %s %r: %m\n", cs->cmd, params, err);
+
+	return err;
+}
+
+
+/**
+ * Check if a command supports pagination
+ *
+ * @param cmd Command name
+ *
+ * @return True if paginated, otherwise false
+ */
+bool restund_cmd_paged(const struct pl *cmd)
+{
+	return cmd && page_find(cmd) != NULL;
+}
+
+
+/**
+ * Get the value of a command parameter
+ *
+ * @param params Parameters, "key=value" pairs separated by '&' or ' '
+ * @param name   Parameter name
+ * @param val    Returned value
+ *
+ * @return 0 if found, otherwise errorcode
+ */
+int restund_cmd_param(const struct pl *params, const char *name,
+		      struct pl *val)
+{
+	struct pl key;
+	const char *p, *end, *eq;
+
+	if (!params || !name || !val)
+		return EINVAL;
+
+	p   = params->p;
+	end = params->p + params->l;
+
+	while (p < end) {
+
+		key.p = p;
+		eq = NULL;
+
+		while (p < end && *p != '&' && *p != ' ') {
+			if (!eq && *p == '=')
+				eq = p;
+			++p;
+		}
+
+		if (eq) {
+			key.l  = eq - key.p;
+			val->p = eq + 1;
+			val->l = p - val->p;
+
+			if (key.l && !pl_strcmp(&key, name))
+				return 0;
+		}
+
+		++p;
+	}
+
+	return ENOENT;
 }
 
 
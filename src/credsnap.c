@@ -0,0 +1,442 @@
+/**
+ * @file credsnap.c Persistent Credential Snapshot
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+
+
+/*
+ * The snapshot file is a read-only image of the credential table which
+ * is mapped into memory at startup and searched in place:
+ *
+ *     header | bucket table | entry table | string pool
+ *
+ * All integers are stored in host byte order, a snapshot written on a
+ * host with a different byte order is rejected by the magic check.
+ */
+
+
+enum {
+	CREDSNAP_MAGIC   = 0x52534353,  /* "RSCS" */
+	CREDSNAP_VERSION = 1,
+	CREDSNAP_REALM_SIZE = 256,
+};
+
+
+struct credsnap_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t entryc;
+	uint32_t bucketc;
+	uint32_t poolsz;
+	uint32_t reserved;
+	uint64_t created;
+	char realm[CREDSNAP_REALM_SIZE];
+};
+
+struct credsnap_entry {
+	uint32_t hash;
+	uint32_t next;      /* entry index + 1, 0 terminates the chain */
+	uint32_t name;      /* offset into the string pool */
+	uint32_t namelen;
+	uint8_t ha1[MD5_SIZE];
+};
+
+struct credsnap {
+	const uint8_t *map;
+	size_t mapsz;
+	const struct credsnap_hdr *hdr;
+	const uint32_t *bucketv;
+	const struct credsnap_entry *entryv;
+	const char *pool;
+};
+
+struct credsnap_enc {
+	struct credsnap_entry *entryv;
+	uint32_t entryc;
+	uint32_t entrysz;
+	struct mbuf *pool;
+};
+
+
+static void credsnap_destructor(void *arg)
+{
+	struct credsnap *cs = arg;
+
+	if (cs->map)
+		(void)munmap((void *)cs->map, cs->mapsz);
+}
+
+
+static int credsnap_validate(const struct credsnap *cs)
+{
+	const struct credsnap_hdr *hdr = cs->hdr;
+	uint32_t i;
+
+	if (!hdr->bucketc || (hdr->bucketc & (hdr->bucketc - 1)))
+		return EBADMSG;
+
+	for (i=0; i<hdr->bucketc; i++) {
+
+		if (cs->bucketv[i] > hdr->entryc)
+			return EBADMSG;
+	}
+
+	for (i=0; i<hdr->entryc; i++) {
+
+		const struct credsnap_entry *ent = &cs->entryv[i];
+
+		if (ent->next > hdr->entryc)
+			return EBADMSG;
+
+		if (ent->name >= hdr->poolsz ||
+		    ent->namelen >= hdr->poolsz - ent->name)
+			return EBADMSG;
+
+		if (cs->pool[ent->name + ent->namelen] != '\0')
+			return EBADMSG;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Map a credential snapshot file into memory
+ *
+ * @param csp   Pointer to allocated snapshot
+ * @param path  Snapshot file path
+ * @param realm Expected realm
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int credsnap_load(struct credsnap **csp, const char *path, const char *realm)
+{
+	struct credsnap *cs;
+	struct stat st;
+	size_t need;
+	void *map;
+	int fd, err = 0;
+
+	if (!csp || !path || !realm)
+		return EINVAL;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return errno;
+
+	if (fstat(fd, &st) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	if ((size_t)st.st_size < sizeof(struct credsnap_hdr)) {
+		err = EBADMSG;
+		goto out;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		err = errno;
+		goto out;
+	}
+
+	cs = mem_zalloc(sizeof(*cs), credsnap_destructor);
+	if (!cs) {
+		(void)munmap(map, st.st_size);
+		err = ENOMEM;
+		goto out;
+	}
+
+	cs->map   = map;
+	cs->mapsz = st.st_size;
+	cs->hdr   = map;
+
+	if (cs->hdr->magic != CREDSNAP_MAGIC ||
+	    cs->hdr->version != CREDSNAP_VERSION) {
+		err = EPROTO;
+		goto fail;
+	}
+
+	if (strncmp(cs->hdr->realm, realm, sizeof(cs->hdr->realm))) {
+		err = EINVAL;
+		goto fail;
+	}
+
+	need = sizeof(struct credsnap_hdr)
+		+ (size_t)cs->hdr->bucketc * sizeof(uint32_t)
+		+ (size_t)cs->hdr->entryc * sizeof(struct credsnap_entry)
+		+ cs->hdr->poolsz;
+
+	if (need != cs->mapsz) {
+		err = EBADMSG;
+		goto fail;
+	}
+
+	cs->bucketv = (const uint32_t *)(cs->map + sizeof(*cs->hdr));
+	cs->entryv  = (const struct credsnap_entry *)
+		(void *)(cs->bucketv + cs->hdr->bucketc);
+	cs->pool    = (const char *)(cs->entryv + cs->hdr->entryc);
+
+	err = credsnap_validate(cs);
+	if (err)
+		goto fail;
+
+	*csp = cs;
+
+ out:
+	(void)close(fd);
+
+	return err;
+
+ fail:
+	mem_deref(cs);
+	goto out;
+}
+
+
+/**
+ * Look up the HA1 of a user in a mapped credential snapshot
+ *
+ * @param cs       Credential snapshot
+ * @param username Username
+ * @param ha1      Buffer for HA1 (MD5_SIZE bytes)
+ *
+ * @return 0 if found, otherwise errorcode
+ */
+int credsnap_lookup(const struct credsnap *cs, const char *username,
+		    uint8_t *ha1)
+{
+	uint32_t hash, idx, n;
+	size_t len;
+
+	if (!cs || !username || !ha1)
+		return EINVAL;
+
+	hash = hash_joaat_str(username);
+	len  = strlen(username);
+	idx = cs->bucketv[hash & (cs->hdr->bucketc - 1)];
+
+	/* chain length bounded by the entry count */
+	for (n=0; idx && n < cs->hdr->entryc; n++) {
+
+		const struct credsnap_entry *ent = &cs->entryv[idx - 1];
+
+		if (ent->hash == hash && ent->namelen == len &&
+		    !memcmp(cs->pool + ent->name, username, len)) {
+
+			memcpy(ha1, ent->ha1, MD5_SIZE);
+			return 0;
+		}
+
+		idx = ent->next;
+	}
+
+	return ENOENT;
+}
+
+
+uint32_t credsnap_count(const struct credsnap *cs)
+{
+	return cs ? cs->hdr->entryc : 0;
+}
+
+
+static void enc_destructor(void *arg)
+{
+	struct credsnap_enc *enc = arg;
+
+	mem_deref(enc->entryv);
+	mem_deref(enc->pool);
+}
+
+
+int credsnap_enc_alloc(struct credsnap_enc **encp, uint32_t hint)
+{
+	struct credsnap_enc *enc;
+	int err = 0;
+
+	if (!encp)
+		return EINVAL;
+
+	enc = mem_zalloc(sizeof(*enc), enc_destructor);
+	if (!enc)
+		return ENOMEM;
+
+	enc->entrysz = MAX(hint, 16);
+
+	enc->entryv = mem_alloc(enc->entrysz * sizeof(*enc->entryv), NULL);
+	enc->pool   = mbuf_alloc(enc->entrysz * 16);
+	if (!enc->entryv || !enc->pool) {
+		err = ENOMEM;
+		goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(enc);
+	else
+		*encp = enc;
+
+	return err;
+}
+
+
+int credsnap_enc_add(struct credsnap_enc *enc, const char *username,
+		     const uint8_t *ha1)
+{
+	struct credsnap_entry *ent;
+	size_t len;
+	int err;
+
+	if (!enc || !username || !ha1)
+		return EINVAL;
+
+	if (enc->entryc == enc->entrysz) {
+
+		struct credsnap_entry *entryv;
+
+		entryv = mem_realloc(enc->entryv,
+				     2 * enc->entrysz * sizeof(*entryv));
+		if (!entryv)
+			return ENOMEM;
+
+		enc->entryv = entryv;
+		enc->entrysz *= 2;
+	}
+
+	len = strlen(username);
+
+	ent = &enc->entryv[enc->entryc];
+	ent->hash    = hash_joaat_str(username);
+	ent->next    = 0;
+	ent->name    = (uint32_t)enc->pool->end;
+	ent->namelen = (uint32_t)len;
+	memcpy(ent->ha1, ha1, MD5_SIZE);
+
+	err  = mbuf_write_mem(enc->pool, (const uint8_t *)username, len);
+	err |= mbuf_write_u8(enc->pool, 0x00);
+	if (err)
+		return err;
+
+	++enc->entryc;
+
+	return 0;
+}
+
+
+static int write_all(int fd, const void *p, size_t n)
+{
+	const uint8_t *b = p;
+
+	while (n > 0) {
+
+		ssize_t w = write(fd, b, n);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+
+		b += w;
+		n -= w;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Write the encoded credentials to a snapshot file. The file is written
+ * to a temporary path first and renamed in place, so that a concurrent
+ * reader never observes a partial snapshot.
+ *
+ * @param enc   Snapshot encoder
+ * @param path  Snapshot file path
+ * @param realm Realm of the credentials
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int credsnap_enc_save(struct credsnap_enc *enc, const char *path,
+		      const char *realm)
+{
+	struct credsnap_hdr hdr;
+	uint32_t *bucketv = NULL;
+	char tmppath[512];
+	uint32_t x, i;
+	int fd, err;
+
+	if (!enc || !path || !realm)
+		return EINVAL;
+
+	if (re_snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) < 0)
+		return ENAMETOOLONG;
+
+	memset(&hdr, 0, sizeof(hdr));
+
+	for (x=2; (uint32_t)1<<x<enc->entryc; x++);
+
+	hdr.magic   = CREDSNAP_MAGIC;
+	hdr.version = CREDSNAP_VERSION;
+	hdr.entryc  = enc->entryc;
+	hdr.bucketc = 1<<x;
+	hdr.poolsz  = (uint32_t)enc->pool->end;
+	hdr.created = (uint64_t)time(NULL);
+	str_ncpy(hdr.realm, realm, sizeof(hdr.realm));
+
+	bucketv = mem_zalloc(hdr.bucketc * sizeof(*bucketv), NULL);
+	if (!bucketv)
+		return ENOMEM;
+
+	for (i=0; i<enc->entryc; i++) {
+
+		struct credsnap_entry *ent = &enc->entryv[i];
+		const uint32_t b = ent->hash & (hdr.bucketc - 1);
+
+		ent->next  = bucketv[b];
+		bucketv[b] = i + 1;
+	}
+
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		err = errno;
+		goto out;
+	}
+
+	err = write_all(fd, &hdr, sizeof(hdr));
+	if (!err)
+		err = write_all(fd, bucketv, hdr.bucketc * sizeof(*bucketv));
+	if (!err)
+		err = write_all(fd, enc->entryv,
+				enc->entryc * sizeof(*enc->entryv));
+	if (!err)
+		err = write_all(fd, enc->pool->buf, enc->pool->end);
+	if (!err && fsync(fd) < 0)
+		err = errno;
+
+	if (close(fd) < 0 && !err)
+		err = errno;
+
+	if (!err && rename(tmppath, path) < 0)
+		err = errno;
+
+	if (err)
+		(void)unlink(tmppath);
+
+ out:
+	mem_deref(bucketv);
+
+	return err;
+}
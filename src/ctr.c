@@ -0,0 +1,236 @@
+/**
+ * @file ctr.c Sharded Counters
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <stdatomic.h>
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+
+
+/*
+ * Every counter set keeps one copy of its counters per thread, and each
+ * copy starts on its own cache line, so writers never share a line.
+ * The first CTR_SHARDS - 1 threads which touch a counter get a private
+ * shard and update it with a plain load and store; any further threads
+ * share the last shard and use atomic additions.
+ *
+ * Readers sum all shards. A reset does not touch the shards, it only
+ * remembers the current sums, so it cannot lose concurrent updates.
+ * restund_ctr_get() returns the value since the last reset, while
+ * restund_ctr_total() is monotonic and used for metrics.
+ */
+
+
+enum {
+	CTR_SHARDS = 16,
+	CTR_LINE   = 64,
+	CTR_WORDS  = CTR_LINE / sizeof(uint64_t),
+};
+
+
+static struct {
+	struct list ctrl;
+	atomic_uint threadc;
+} ctrs;
+
+static _Thread_local int shard = -1;
+
+
+static unsigned shard_index(void)
+{
+	unsigned n;
+
+	if (shard < 0) {
+		n = atomic_fetch_add_explicit(&ctrs.threadc, 1,
+					      memory_order_relaxed);
+		shard = (int)MIN(n, CTR_SHARDS - 1);
+	}
+
+	return (unsigned)shard;
+}
+
+
+static _Atomic uint64_t *ctr_word(const struct restund_ctr *ctr,
+				  unsigned s, uint32_t i)
+{
+	return (_Atomic uint64_t *)ctr->shardv + (size_t)s * ctr->stride + i;
+}
+
+
+/**
+ * Register a set of counters. All counters start at zero.
+ *
+ * @param ctr Counter set with name and n filled in
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int restund_ctr_register(struct restund_ctr *ctr)
+{
+	size_t sz;
+	uintptr_t p;
+
+	if (!ctr || !ctr->n)
+		return EINVAL;
+
+	ctr->stride = (ctr->n + CTR_WORDS - 1) / CTR_WORDS * CTR_WORDS;
+	sz = (size_t)CTR_SHARDS * ctr->stride * sizeof(uint64_t);
+
+	ctr->mem = mem_zalloc(sz + CTR_LINE, NULL);
+	ctr->basev = mem_zalloc(ctr->n * sizeof(uint64_t), NULL);
+	if (!ctr->mem || !ctr->basev) {
+		ctr->mem = mem_deref(ctr->mem);
+		ctr->basev = mem_deref(ctr->basev);
+		return ENOMEM;
+	}
+
+	p = ((uintptr_t)ctr->mem + CTR_LINE - 1) & ~(uintptr_t)(CTR_LINE - 1);
+	ctr->shardv = (void *)p;
+
+	list_append(&ctrs.ctrl, &ctr->le, ctr);
+
+	return 0;
+}
+
+
+/**
+ * Unregister a set of counters. No thread may update it any longer.
+ *
+ * @param ctr Counter set
+ */
+void restund_ctr_unregister(struct restund_ctr *ctr)
+{
+	if (!ctr)
+		return;
+
+	list_unlink(&ctr->le);
+
+	ctr->shardv = NULL;
+	ctr->mem = mem_deref(ctr->mem);
+	ctr->basev = mem_deref(ctr->basev);
+}
+
+
+/**
+ * Add to a counter. May be called from any thread.
+ *
+ * @param ctr Counter set
+ * @param i   Counter index
+ * @param v   Value to add
+ */
+void restund_ctr_add(struct restund_ctr *ctr, uint32_t i, uint64_t v)
+{
+	_Atomic uint64_t *w;
+	unsigned s;
+
+	if (!ctr || !ctr->shardv || i >= ctr->n)
+		return;
+
+	s = shard_index();
+	w = ctr_word(ctr, s, i);
+
+	if (s < CTR_SHARDS - 1) {
+		const uint64_t cur = atomic_load_explicit(w,
+						memory_order_relaxed);
+
+		atomic_store_explicit(w, cur + v, memory_order_relaxed);
+	}
+	else {
+		atomic_fetch_add_explicit(w, v, memory_order_relaxed);
+	}
+}
+
+
+/**
+ * Get the total of a counter since it was registered
+ *
+ * @param ctr Counter set
+ * @param i   Counter index
+ *
+ * @return Counter value
+ */
+uint64_t restund_ctr_total(const struct restund_ctr *ctr, uint32_t i)
+{
+	uint64_t sum = 0;
+	unsigned s;
+
+	if (!ctr || !ctr->shardv || i >= ctr->n)
+		return 0;
+
+	for (s=0; s<CTR_SHARDS; s++)
+		sum += atomic_load_explicit(ctr_word(ctr, s, i),
+					    memory_order_relaxed);
+
+	return sum;
+}
+
+
+/**
+ * Get the value of a counter since the last reset
+ *
+ * @param ctr Counter set
+ * @param i   Counter index
+ *
+ * @return Counter value
+ */
+uint64_t restund_ctr_get(const struct restund_ctr *ctr, uint32_t i)
+{
+	if (!ctr || !ctr->basev || i >= ctr->n)
+		return 0;
+
+	return restund_ctr_total(ctr, i) - ctr->basev[i];
+}
+
+
+/**
+ * Reset all counters of a set, as seen by restund_ctr_get()
+ *
+ * @param ctr Counter set
+ */
+void restund_ctr_reset(struct restund_ctr *ctr)
+{
+	uint32_t i;
+
+	if (!ctr || !ctr->basev)
+		return;
+
+	for (i=0; i<ctr->n; i++)
+		ctr->basev[i] = restund_ctr_total(ctr, i);
+}
+
+
+static void reset_handler(struct mbuf *mb)
+{
+	struct le *le;
+
+	for (le = ctrs.ctrl.head; le; le = le->next) {
+
+		struct restund_ctr *ctr = le->data;
+
+		restund_ctr_reset(ctr);
+		(void)mbuf_printf(mb, "%s: %u counters reset\n",
+				  ctr->name, ctr->n);
+	}
+}
+
+
+static struct restund_cmdsub cmd_reset = {
+	.cmdh = reset_handler,
+	.cmd  = "resetstats",
+};
+
+
+int restund_ctr_init(void)
+{
+	restund_cmd_subscribe(&cmd_reset);
+
+	return 0;
+}
+
+
+void restund_ctr_close(void)
+{
+	restund_cmd_unsubscribe(&cmd_reset);
+}
@@ -7,6 +7,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <sys/time.h>
 #include <re.h>
 #include <restund.h>
@@ -20,15 +21,11 @@ struct account {
 };
 
 
-struct traffic {
-	struct le le;
-	struct restund_trafstat ts;
-	struct sa cli;
-	struct sa relay;
-	struct sa peer;
-	char *username;
-	time_t start;
-	time_t end;
+enum {
+	TRAFFIC_QUEUE_SIZE = 4096,
+	TRAFFIC_BATCH_SIZE = 256,
+	TRAFFIC_FLUSH_INTERVAL = 1,
+	TRAFFIC_SPOOL_MAX  = 256 * 1024 * 1024,
 };
 
 
@@ -36,10 +33,27 @@ static struct {
 	struct {
 		pthread_mutex_t mutex;
 		struct hash *ht;
+		struct credsnap *snap;
+		char snappath[256];
 		uint32_t syncint;
 	} cred;
 	struct {
-		struct list fifo;
+		/* single producer (main) / single consumer (db thread) */
+		struct restund_traffic *ring;
+		uint32_t size;
+		uint32_t batch;
+		_Atomic uint32_t head;
+		_Atomic uint32_t tail;
+		_Atomic uint64_t enqc;
+		_Atomic uint64_t savec;
+		_Atomic uint64_t dropc;
+		_Atomic uint64_t longc;
+		_Atomic uint64_t errc;
+		_Atomic uint64_t spoolc;
+		_Atomic uint64_t spoollen;
+		struct spool *spool;
+		char spoolpath[256];
+		uint32_t spoolmax;
 		pthread_mutex_t mutex;
 		pthread_cond_t cond;
 	} traffic;
@@ -53,9 +67,15 @@ static struct {
 	.cred = {
 		  .mutex   = PTHREAD_MUTEX_INITIALIZER,
 		  .ht      = NULL,
+		  .snap    = NULL,
 		  .syncint = 3600,
 	},
 	.traffic = {
+		  .ring  = NULL,
+		  .size  = TRAFFIC_QUEUE_SIZE,
+		  .batch = TRAFFIC_BATCH_SIZE,
+		  .spool = NULL,
+		  .spoolmax = TRAFFIC_SPOOL_MAX,
 		  .mutex = PTHREAD_MUTEX_INITIALIZER,
 		  .cond  = PTHREAD_COND_INITIALIZER,
 	},
@@ -120,9 +140,48 @@ static int account_handler(const char *username, const char *ha1, void *arg)
 }
 
 
+static bool snapshot_handler(struct le *le, void *arg)
+{
+	const struct account *acc = le->data;
+	struct credsnap_enc *enc = arg;
+
+	return 0 != credsnap_enc_add(enc, acc->username, acc->ha1);
+}
+
+
+static void save_snapshot(uint32_t n)
+{
+	struct credsnap_enc *enc = NULL;
+	int err;
+
+	if (!database.cred.snappath[0])
+		return;
+
+	err = credsnap_enc_alloc(&enc, n);
+	if (err)
+		goto out;
+
+	/* only the database thread replaces the table, no lock needed */
+	if (hash_apply(database.cred.ht, snapshot_handler, enc)) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err = credsnap_enc_save(enc, database.cred.snappath, database.realm);
+
+ out:
+	if (err)
+		restund_warning("database: unable to save snapshot %s: %m\n",
+				database.cred.snappath, err);
+
+	mem_deref(enc);
+}
+
+
 static int sync_credentials(void)
 {
 	struct hash *ht = NULL, *ht_old;
+	struct credsnap *snap;
 	uint32_t n, x, sz;
 	int err = 0;
 
@@ -154,13 +213,18 @@ static int sync_credentials(void)
 	pthread_mutex_lock(&database.cred.mutex);
 	ht_old = database.cred.ht;
 	database.cred.ht = ht;
+	snap = database.cred.snap;
+	database.cred.snap = NULL;
 	pthread_mutex_unlock(&database.cred.mutex);
 
 	ht = ht_old;
+	mem_deref(snap);
 
 	restund_debug("database successfully synced (n=%u hashsize=%u)\n",
 		      n, sz);
 
+	save_snapshot(n);
+
  out:
 	hash_flush(ht);
 	mem_deref(ht);
@@ -169,44 +233,149 @@ static int sync_credentials(void)
 }
 
 
+static inline void counter_add(_Atomic uint64_t *cnt, uint64_t n)
+{
+	atomic_fetch_add_explicit(cnt, n, memory_order_relaxed);
+}
+
+
+static int save_traffic_batch(const struct restund_traffic *trfv,
+			      uint32_t n, uint32_t *savedp)
+{
+	uint32_t i;
+	int err = 0;
+
+	if (database.db->tlogbh) {
+		err = database.db->tlogbh(trfv, n, database.realm);
+		*savedp = err ? 0 : n;
+		return err;
+	}
+
+	for (i=0; i<n; i++) {
+
+		const struct restund_traffic *trf = &trfv[i];
+
+		err = database.db->tlogh(trf->username, &trf->cli,
+					 &trf->relay, &trf->peer,
+					 database.realm, trf->start, trf->end,
+					 &trf->ts);
+		if (err)
+			break;
+	}
+
+	*savedp = i;
+
+	return err;
+}
+
+
+static void spool_update(void)
+{
+	atomic_store_explicit(&database.traffic.spoollen,
+			      spool_count(database.traffic.spool),
+			      memory_order_relaxed);
+}
+
+
+static int replay_spool(void)
+{
+	struct spool *sp = database.traffic.spool;
+	const struct restund_traffic *trfv;
+	uint32_t n, saved;
+	int err = 0;
+
+	while (spool_count(sp)) {
+
+		err = spool_peek(sp, &trfv, &n);
+		if (err || !n)
+			break;
+
+		err = save_traffic_batch(trfv, n, &saved);
+
+		counter_add(&database.traffic.savec, saved);
+
+		if (spool_consume(sp, saved))
+			restund_warning("traffic spool: consume error\n");
+
+		if (err)
+			break;
+	}
+
+	spool_update();
+
+	return err;
+}
+
+
 static int save_traffic_records(void)
 {
+	const uint32_t mask = database.traffic.size - 1;
+	struct spool *sp = database.traffic.spool;
 	int err = 0;
 
+	if (!database.traffic.ring)
+		return 0;
+
+	(void)replay_spool();
+
 	for (;;) {
-		struct traffic *trf;
+		uint32_t head, tail, idx, n, saved = 0;
+		const struct restund_traffic *trfv;
 
-		pthread_mutex_lock(&database.traffic.mutex);
+		tail = atomic_load_explicit(&database.traffic.tail,
+					    memory_order_relaxed);
+		head = atomic_load_explicit(&database.traffic.head,
+					    memory_order_acquire);
 
-		trf = list_ledata(list_head(&database.traffic.fifo));
-		if (!trf) {
-			pthread_mutex_unlock(&database.traffic.mutex);
+		n = head - tail;
+		if (!n)
 			break;
+
+		/* records are handed to the backend in place */
+		idx = tail & mask;
+		n = MIN(n, database.traffic.size - idx);
+		n = MIN(n, database.traffic.batch);
+		trfv = &database.traffic.ring[idx];
+
+		/* queue behind spooled records to keep them in order */
+		if (!spool_count(sp)) {
+
+			err = save_traffic_batch(trfv, n, &saved);
+
+			counter_add(&database.traffic.savec, saved);
+
+			if (err) {
+				restund_warning("error writing traffic record;"
+						" %s\n", sp ? "spooling"
+						: "retry later");
+				counter_add(&database.traffic.errc, 1);
+			}
 		}
 
-		list_unlink(&trf->le);
-		pthread_mutex_unlock(&database.traffic.mutex);
+		if (sp && saved < n) {
 
-		/* database insert */
-		if (database.db && database.db->tlogh)
-			err = database.db->tlogh(trf->username, &trf->cli,
-						 &trf->relay, &trf->peer,
-						 database.realm,
-						 trf->start, trf->end,
-						 &trf->ts);
+			const uint32_t rest = n - saved;
 
-		if (err) {
-			restund_warning("error writing traffic record;"
-					" retry later\n");
-			pthread_mutex_lock(&database.traffic.mutex);
-			list_prepend(&database.traffic.fifo, &trf->le, trf);
-			pthread_mutex_unlock(&database.traffic.mutex);
-			break;
+			err = spool_append(sp, trfv + saved, rest);
+			if (err) {
+				restund_warning("traffic spool: append: %m\n",
+						err);
+			}
+			else {
+				counter_add(&database.traffic.spoolc, rest);
+				saved = n;
+			}
 		}
 
-		mem_deref(trf);
+		atomic_store_explicit(&database.traffic.tail, tail + saved,
+				      memory_order_release);
+
+		if (saved < n)
+			break;
 	}
 
+	spool_update();
+
 	return err;
 }
 
@@ -225,18 +394,27 @@ static void gettimespec(struct timespec *ts, uint32_t offset)
 static void *database_thread(void *arg)
 {
 	struct timespec ts;
-	int err = 0;
+	time_t sync = 0;
 	(void)arg;
 
-	gettimespec(&ts, 0);
-
 	for (;;) {
 		bool quit;
 
+		if (time(NULL) >= sync) {
+			(void)sync_credentials();
+			sync = time(NULL) + database.cred.syncint;
+		}
+
+		/*
+		 * The producer never blocks on the mutex, so a wakeup may
+		 * be missed; the flush interval bounds the latency.
+		 */
+		gettimespec(&ts, TRAFFIC_FLUSH_INTERVAL);
+
 		pthread_mutex_lock(&database.traffic.mutex);
 		quit = database.quit;
 		if (!quit) {
-			err = pthread_cond_timedwait(&database.traffic.cond,
+			(void)pthread_cond_timedwait(&database.traffic.cond,
 						     &database.traffic.mutex,
 						     &ts);
 			quit = database.quit;
@@ -247,12 +425,6 @@ static void *database_thread(void *arg)
 
 		if (quit)
 			break;
-
-		if (err != ETIMEDOUT)
-			continue;
-
-		(void)sync_credentials();
-		gettimespec(&ts, database.cred.syncint);
 	}
 
 	restund_debug("database thread exit\n");
@@ -261,36 +433,48 @@ static void *database_thread(void *arg)
 }
 
 
-static void traffic_destructor(void *arg)
-{
-	struct traffic *trf = arg;
-
-	trf->username = mem_deref(trf->username);
-}
-
-
+/**
+ * Queue a traffic record for the database thread. Must be called from
+ * the main thread only, and never blocks.
+ *
+ * @return 0 if success, ENOBUFS if the traffic queue is full
+ */
 int restund_log_traffic(const char *username, const struct sa *cli,
 			const struct sa *relay, const struct sa *peer,
 			time_t start, time_t end,
 			const struct restund_trafstat *ts)
 {
-	struct traffic *trf = NULL;
-	int err = ENOMEM;
+	struct restund_traffic *trf;
+	uint32_t head, tail;
 
 	if (!cli || !relay || !peer || !ts)
 		return EINVAL;
 
-	if (!database.run || !database.db || !database.db->tlogh)
+	if (!database.run || !database.traffic.ring)
 		return 0;
 
-	trf = mem_zalloc(sizeof(struct traffic), traffic_destructor);
-	if (!trf)
-		goto out;
+	if (!username)
+		username = "";
 
-	err = str_dup(&trf->username, username ? username : "");
-	if (err)
-		goto out;
+	/* never account traffic to a truncated username */
+	if (strlen(username) >= sizeof(trf->username)) {
+		counter_add(&database.traffic.longc, 1);
+		return EOVERFLOW;
+	}
 
+	head = atomic_load_explicit(&database.traffic.head,
+				    memory_order_relaxed);
+	tail = atomic_load_explicit(&database.traffic.tail,
+				    memory_order_acquire);
+
+	if (head - tail >= database.traffic.size) {
+		counter_add(&database.traffic.dropc, 1);
+		return ENOBUFS;
+	}
+
+	trf = &database.traffic.ring[head & (database.traffic.size - 1)];
+
+	str_ncpy(trf->username, username, sizeof(trf->username));
 	trf->cli   = *cli;
 	trf->relay = *relay;
 	trf->peer  = *peer;
@@ -298,17 +482,17 @@ int restund_log_traffic(const char *username, const struct sa *cli,
 	trf->end   = end;
 	trf->ts    = *ts;
 
-	pthread_mutex_lock(&database.traffic.mutex);
-	list_append(&database.traffic.fifo, &trf->le, trf);
-	pthread_cond_signal(&database.traffic.cond);
-	pthread_mutex_unlock(&database.traffic.mutex);
+	atomic_store_explicit(&database.traffic.head, head + 1,
+			      memory_order_release);
+	counter_add(&database.traffic.enqc, 1);
 
-	err = 0;
-out:
-	if (err)
-		mem_deref(trf);
+	/* wake the database thread, unless it is busy anyway */
+	if (!pthread_mutex_trylock(&database.traffic.mutex)) {
+		pthread_cond_signal(&database.traffic.cond);
+		pthread_mutex_unlock(&database.traffic.mutex);
+	}
 
-	return err;
+	return 0;
 }
 
 
@@ -328,6 +512,13 @@ int restund_get_ha1(const char *username, uint8_t *ha1)
 
 	pthread_mutex_lock(&database.cred.mutex);
 
+	/* serve from the snapshot until the first sync has completed */
+	if (!database.cred.ht) {
+		if (!credsnap_lookup(database.cred.snap, username, ha1))
+			err = 0;
+		goto out;
+	}
+
 	acc = list_ledata(hash_lookup(database.cred.ht,
 				      hash_joaat_str(username),
 				      hash_cmp_handler, (void *)username));
@@ -362,8 +553,53 @@ void restund_db_set_auth_handler(restund_db_auth_h *authh)
 }
 
 
+static void stats_handler(struct mbuf *mb)
+{
+	const uint32_t head = atomic_load_explicit(&database.traffic.head,
+						   memory_order_relaxed);
+	const uint32_t tail = atomic_load_explicit(&database.traffic.tail,
+						   memory_order_relaxed);
+
+	(void)mbuf_printf(mb, "traffic_queue_size %u\n",
+			  database.traffic.ring ? database.traffic.size : 0);
+	(void)mbuf_printf(mb, "traffic_queue_bytes %zu\n",
+			  database.traffic.ring ? database.traffic.size *
+			  sizeof(struct restund_traffic) : 0);
+	(void)mbuf_printf(mb, "traffic_queue_len %u\n", head - tail);
+	(void)mbuf_printf(mb, "traffic_enqueued %llu\n",
+			  atomic_load_explicit(&database.traffic.enqc,
+					       memory_order_relaxed));
+	(void)mbuf_printf(mb, "traffic_saved %llu\n",
+			  atomic_load_explicit(&database.traffic.savec,
+					       memory_order_relaxed));
+	(void)mbuf_printf(mb, "traffic_dropped %llu\n",
+			  atomic_load_explicit(&database.traffic.dropc,
+					       memory_order_relaxed));
+	(void)mbuf_printf(mb, "traffic_rejected %llu\n",
+			  atomic_load_explicit(&database.traffic.longc,
+					       memory_order_relaxed));
+	(void)mbuf_printf(mb, "traffic_errors %llu\n",
+			  atomic_load_explicit(&database.traffic.errc,
+					       memory_order_relaxed));
+	(void)mbuf_printf(mb, "traffic_spooled %llu\n",
+			  atomic_load_explicit(&database.traffic.spoolc,
+					       memory_order_relaxed));
+	(void)mbuf_printf(mb, "traffic_spool_len %llu\n",
+			  atomic_load_explicit(&database.traffic.spoollen,
+					       memory_order_relaxed));
+}
+
+
+static struct restund_cmdsub cmd_dbstats = {
+	.cmdh = stats_handler,
+	.cmd  = "dbstats",
+};
+
+
 int restund_db_init(void)
 {
+	uint32_t x;
+	size_t sz = 0;
 	int err;
 
 	/* realm config */
@@ -374,9 +610,77 @@ int restund_db_init(void)
 	(void)conf_get_u32(restund_conf(), "syncinterval",
 			   &database.cred.syncint);
 
+	/* credential snapshot config */
+	(void)conf_get_str(restund_conf(), "cred_snapshot",
+			   database.cred.snappath,
+			   sizeof(database.cred.snappath));
+
+	/* traffic queue config */
+	(void)conf_get_u32(restund_conf(), "traffic_queue_size",
+			   &database.traffic.size);
+	(void)conf_get_u32(restund_conf(), "traffic_batch",
+			   &database.traffic.batch);
+	(void)conf_get_str(restund_conf(), "traffic_spool",
+			   database.traffic.spoolpath,
+			   sizeof(database.traffic.spoolpath));
+	(void)conf_get_u32(restund_conf(), "traffic_spool_max",
+			   &database.traffic.spoolmax);
+
 	if (!database.db)
 		return 0;
 
+	restund_cmd_subscribe(&cmd_dbstats);
+
+	if (database.db->tlogh || database.db->tlogbh) {
+
+		for (x=2; (uint32_t)1<<x<database.traffic.size; x++);
+		database.traffic.size  = 1<<x;
+		database.traffic.batch = MAX(database.traffic.batch, 1);
+
+		sz = database.traffic.size * sizeof(struct restund_traffic);
+
+		database.traffic.ring = mem_alloc(sz, NULL);
+		if (!database.traffic.ring) {
+			restund_warning("database: unable to allocate"
+					" traffic queue\n");
+			return ENOMEM;
+		}
+	}
+
+	if (database.traffic.ring && database.traffic.spoolpath[0]) {
+
+		err = spool_open(&database.traffic.spool,
+				 database.traffic.spoolpath,
+				 database.traffic.spoolmax,
+				 database.traffic.batch);
+		if (err) {
+			restund_warning("database: traffic spool %s: %m\n",
+					database.traffic.spoolpath, err);
+			return err;
+		}
+
+		spool_update();
+
+		restund_debug("database: traffic spool %s (%llu records)\n",
+			      database.traffic.spoolpath,
+			      spool_count(database.traffic.spool));
+	}
+
+	if (database.cred.snappath[0]) {
+		err = credsnap_load(&database.cred.snap,
+				    database.cred.snappath, database.realm);
+		if (err && err != ENOENT)
+			restund_warning("database: ignoring snapshot %s: %m\n",
+					database.cred.snappath, err);
+		else if (!err)
+			restund_info("database: %u credentials loaded from"
+				     " snapshot %s\n",
+				     credsnap_count(database.cred.snap),
+				     database.cred.snappath);
+	}
+
+	database.quit = false;
+
 	err = pthread_create(&database.thread, NULL, database_thread, NULL);
 	if (err) {
 		restund_warning("database thread error: %m\n", err);
@@ -388,6 +692,12 @@ int restund_db_init(void)
 	restund_debug("database: realm is '%s', sync interval is %u secs\n",
 		      database.realm, database.cred.syncint);
 
+	if (database.traffic.ring)
+		restund_debug("database: traffic queue %u records"
+			      " (%zu bytes), batch %u\n",
+			      database.traffic.size, sz,
+			      database.traffic.batch);
+
 	return 0;
 }
 
@@ -406,14 +716,19 @@ void restund_db_close(void)
 		database.run = false;
 	}
 
-	pthread_mutex_lock(&database.traffic.mutex);
-	list_flush(&database.traffic.fifo);
-	list_init(&database.traffic.fifo);
-	pthread_mutex_unlock(&database.traffic.mutex);
+	restund_cmd_unsubscribe(&cmd_dbstats);
+
+	database.traffic.ring  = mem_deref(database.traffic.ring);
+	database.traffic.spool = mem_deref(database.traffic.spool);
+	atomic_store_explicit(&database.traffic.head, 0,
+			      memory_order_relaxed);
+	atomic_store_explicit(&database.traffic.tail, 0,
+			      memory_order_relaxed);
 
 	pthread_mutex_lock(&database.cred.mutex);
 	ht = database.cred.ht;
 	database.cred.ht = NULL;
+	database.cred.snap = mem_deref(database.cred.snap);
 	pthread_mutex_unlock(&database.cred.mutex);
 
 	if (!ht)
@@ -97,7 +97,7 @@ static void dtls_close_handler(int err, void *arg)
 
 static void dtls_conn_handler(const struct sa *peer, void *arg)
 {
-	const time_t now = time(NULL);
+	const time_t now = restund_time();
 	struct dtls_lstnr *dl = arg;
 	struct conn *conn;
 	int err;
@@ -132,7 +132,7 @@ static void dtls_conn_handler(const struct sa *peer, void *arg)
 
 static void status_handler(struct mbuf *mb)
 {
-	const time_t now = time(NULL);
+	const time_t now = restund_time();
 	struct le *le;
 
 	for (le=connl.head; le; le=le->next) {
@@ -143,6 +143,8 @@ static void status_handler(struct mbuf *mb)
                                   &conn->laddr, &conn->paddr,
                                   now - conn->created);
 	}
+
+	(void)restund_tlsres_print(mb, true);
 }
 
 
@@ -186,6 +188,12 @@ static int dtls_listen_handler(const struct pl *val, void *arg)
 		goto out;
 	}
 
+	err = restund_tlsres_enable(dl->tls);
+	if (err) {
+		restund_warning("dtls session resumption: %m\n", err);
+		goto out;
+	}
+
 	err = sa_decode(&dl->bnd_addr, ap.p, ap.l);
 	if (err || sa_is_any(&dl->bnd_addr) || !sa_port(&dl->bnd_addr)) {
 		restund_warning("bad dtls_listen address directive: '%r'\n",
@@ -221,6 +229,19 @@ static struct restund_cmdsub cmd_dtls = {
 };
 
 
+static uint64_t conn_count(void)
+{
+	return list_count(&connl);
+}
+
+
+static struct restund_metric metricv[] = {
+	{ .name = "restund_dtls_connections",
+	  .help = "Open DTLS client connections",
+	  .type = RESTUND_METRIC_GAUGE, .valh = conn_count },
+};
+
+
 int restund_dtls_init(void)
 {
 	struct dtls_param prm;
@@ -230,6 +251,7 @@ int restund_dtls_init(void)
 	list_init(&connl);
 
 	restund_cmd_subscribe(&cmd_dtls);
+	restund_metric_register(metricv, RE_ARRAY_SIZE(metricv));
 
 	prm.sockbuf_size = 0;
 	prm.hash_size = DTLS_HASH_SIZE;
@@ -254,6 +276,7 @@ int restund_dtls_init(void)
 void restund_dtls_close(void)
 {
 	restund_cmd_unsubscribe(&cmd_dtls);
+	restund_metric_unregister(metricv, RE_ARRAY_SIZE(metricv));
 
 	list_flush(&lstnrl);
 	list_flush(&connl);
@@ -0,0 +1,214 @@
+/**
+ * @file hist.c Latency Histograms
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <time.h>
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+
+
+/*
+ * Log-linear histograms in the style of HdrHistogram: every power of
+ * two is split into RESTUND_HIST_SUB buckets, which bounds the relative
+ * error to about 6%. Recording a value is a few shifts and increments.
+ * Histograms are only updated and read from the main thread.
+ *
+ * Values are in nanoseconds. The "latency" command prints percentiles
+ * for all registered histograms in microseconds.
+ */
+
+
+enum {
+	LAG_INTERVAL = 100,  /* [ms] */
+};
+
+
+static struct {
+	struct list histl;
+	struct restund_hist lag;
+	struct tmr tmr;
+	uint64_t expires;
+} hst;
+
+
+static unsigned msb(uint64_t v)
+{
+	return 63 - (unsigned)__builtin_clzll(v);
+}
+
+
+static uint32_t bucket_index(uint64_t val)
+{
+	unsigned e;
+
+	if (val < RESTUND_HIST_SUB)
+		return (uint32_t)val;
+
+	e = msb(val);
+	if (e >= RESTUND_HIST_BITS)
+		return RESTUND_HIST_SIZE - 1;
+
+	/* the top 5 bits of the value select the sub-bucket */
+	return RESTUND_HIST_SUB * (e - 3)
+		+ (uint32_t)((val >> (e - 4)) - RESTUND_HIST_SUB);
+}
+
+
+/* highest value which maps to the bucket */
+static uint64_t bucket_value(uint32_t idx)
+{
+	uint32_t e, sub;
+
+	if (idx < RESTUND_HIST_SUB)
+		return idx;
+
+	e   = idx / RESTUND_HIST_SUB + 3;
+	sub = idx % RESTUND_HIST_SUB;
+
+	return (((uint64_t)RESTUND_HIST_SUB + sub + 1) << (e - 4)) - 1;
+}
+
+
+void restund_hist_register(struct restund_hist *h, const char *name)
+{
+	if (!h)
+		return;
+
+	h->name = name;
+	list_append(&hst.histl, &h->le, h);
+}
+
+
+void restund_hist_unregister(struct restund_hist *h)
+{
+	if (!h)
+		return;
+
+	list_unlink(&h->le);
+}
+
+
+void restund_hist_add(struct restund_hist *h, uint64_t val)
+{
+	if (!h)
+		return;
+
+	++h->bucketv[bucket_index(val)];
+	++h->count;
+	h->sum += val;
+
+	if (val > h->max)
+		h->max = val;
+}
+
+
+/**
+ * Get a quantile of the recorded values
+ *
+ * @param h Histogram
+ * @param q Quantile between 0.0 and 1.0
+ *
+ * @return Upper bound of the quantile
+ */
+uint64_t restund_hist_quantile(const struct restund_hist *h, double q)
+{
+	uint64_t n, rank;
+	uint32_t i;
+
+	if (!h || !h->count)
+		return 0;
+
+	rank = (uint64_t)(q * (double)h->count + 0.5);
+	rank = MAX(rank, 1);
+
+	for (i=0, n=0; i<RESTUND_HIST_SIZE; i++) {
+
+		n += h->bucketv[i];
+		if (n >= rank)
+			return MIN(bucket_value(i), h->max);
+	}
+
+	return h->max;
+}
+
+
+/* monotonic clock in nanoseconds */
+uint64_t restund_hist_clock(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+static void latency_handler(struct mbuf *mb)
+{
+	struct le *le;
+
+	(void)mbuf_printf(mb, "%-16s %10s %8s %8s %8s %8s %8s %8s"
+			  "  [us]\n", "name", "count", "mean",
+			  "p50", "p90", "p99", "p99.9", "max");
+
+	for (le = hst.histl.head; le; le = le->next) {
+
+		const struct restund_hist *h = le->data;
+
+		(void)mbuf_printf(mb, "%-16s %10llu %8llu %8llu %8llu %8llu"
+				  " %8llu %8llu\n", h->name, h->count,
+				  h->count ? h->sum / h->count / 1000 : 0,
+				  restund_hist_quantile(h, 0.5) / 1000,
+				  restund_hist_quantile(h, 0.9) / 1000,
+				  restund_hist_quantile(h, 0.99) / 1000,
+				  restund_hist_quantile(h, 0.999) / 1000,
+				  h->max / 1000);
+	}
+}
+
+
+static struct restund_cmdsub cmd_latency = {
+	.cmdh = latency_handler,
+	.cmd  = "latency",
+};
+
+
+/*
+ * The event loop does not expose its iterations, so a periodic timer
+ * samples how late it fires. A long running handler delays the timer
+ * by the same amount.
+ */
+static void lag_handler(void *arg)
+{
+	const uint64_t now = restund_hist_clock();
+	(void)arg;
+
+	if (now > hst.expires)
+		restund_hist_add(&hst.lag, now - hst.expires);
+
+	hst.expires = now + LAG_INTERVAL * 1000000ULL;
+	tmr_start(&hst.tmr, LAG_INTERVAL, lag_handler, NULL);
+}
+
+
+int restund_hist_init(void)
+{
+	restund_hist_register(&hst.lag, "loop_lag");
+	restund_cmd_subscribe(&cmd_latency);
+
+	hst.expires = restund_hist_clock() + LAG_INTERVAL * 1000000ULL;
+	tmr_start(&hst.tmr, LAG_INTERVAL, lag_handler, NULL);
+
+	return 0;
+}
+
+
+void restund_hist_close(void)
+{
+	tmr_cancel(&hst.tmr);
+	restund_cmd_unsubscribe(&cmd_latency);
+	restund_hist_unregister(&hst.lag);
+}
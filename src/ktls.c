@@ -0,0 +1,531 @@
+/**
+ * @file ktls.c Kernel TLS
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+
+#if defined(USE_OPENSSL) && defined(__linux__)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/crypto.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && defined(TCP_ULP) && \
+	defined(SOL_TLS)
+#include <openssl/core_names.h>
+#define HAVE_KTLS 1
+#endif
+#endif
+
+
+/*
+ * Once the handshake of a tls_listen connection is done, the record
+ * keys are derived from the session and installed on the socket with
+ * the "tls" upper layer protocol, so that the kernel encrypts what is
+ * sent and decrypts what is received, and the connection sends and
+ * receives plain STUN and ChannelData. Only AES-GCM with TLS 1.2 and
+ * TLS 1.3 is offloaded; other ciphers stay in userspace.
+ *
+ * TLS 1.3 traffic secrets are only available from the keylog callback,
+ * so they are kept with the SSL until the handshake is done.
+ */
+
+
+enum {
+	KTLS_TX = 0,
+	KTLS_RX,
+	KTLS_FALLBACK,
+	KTLS_CTR_MAX
+};
+
+
+static struct {
+	struct restund_ctr ctr;
+	bool enabled;
+	int ex_idx;
+} kt = {
+	.ctr = {
+		.name = "ktls",
+		.n    = KTLS_CTR_MAX,
+	},
+	.ex_idx = -1,
+};
+
+
+#ifdef HAVE_KTLS
+
+enum {
+	SECRET_MAX  = EVP_MAX_MD_SIZE,
+	GCM_IV_SIZE = 12,
+};
+
+struct secrets {
+	uint8_t client[SECRET_MAX];
+	uint8_t server[SECRET_MAX];
+	size_t len;
+};
+
+union crypto_info {
+	struct tls_crypto_info info;
+	struct tls12_crypto_info_aes_gcm_128 gcm128;
+	struct tls12_crypto_info_aes_gcm_256 gcm256;
+};
+
+
+static void secrets_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+			 int idx, long argl, void *argp)
+{
+	(void)parent;
+	(void)ad;
+	(void)idx;
+	(void)argl;
+	(void)argp;
+
+	if (ptr)
+		OPENSSL_clear_free(ptr, sizeof(struct secrets));
+}
+
+
+/* may run on a handshake worker */
+static void keylog_handler(const SSL *ssl, const char *line)
+{
+	struct secrets *s = SSL_get_ex_data(ssl, kt.ex_idx);
+	const char *hex;
+	uint8_t *dst;
+	size_t len;
+
+	if (!s)
+		return;
+
+	if (!strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ", 24))
+		dst = s->client;
+	else if (!strncmp(line, "SERVER_TRAFFIC_SECRET_0 ", 24))
+		dst = s->server;
+	else
+		return;
+
+	hex = strrchr(line, ' ');
+	if (!hex)
+		return;
+
+	len = strlen(++hex) / 2;
+	if (!len || len > SECRET_MAX || str_hex(dst, len, hex))
+		return;
+
+	s->len = len;
+}
+
+
+/* HKDF-Expand-Label of RFC 8446 with an empty context */
+static int expand_label(uint8_t *out, size_t outlen, const EVP_MD *md,
+			const uint8_t *secret, size_t slen, const char *label)
+{
+	const size_t llen = 6 + strlen(label);
+	uint8_t info[2 + 1 + 255 + 1];
+	OSSL_PARAM params[5], *p = params;
+	EVP_KDF_CTX *kctx;
+	EVP_KDF *kdf;
+	int mode = EVP_KDF_HKDF_MODE_EXPAND_ONLY;
+	int err = 0;
+
+	info[0] = (uint8_t)(outlen >> 8);
+	info[1] = (uint8_t)outlen;
+	info[2] = (uint8_t)llen;
+	memcpy(&info[3], "tls13 ", 6);
+	memcpy(&info[9], label, llen - 6);
+	info[3 + llen] = 0;
+
+	kdf = EVP_KDF_fetch(NULL, "HKDF", NULL);
+	kctx = EVP_KDF_CTX_new(kdf);
+	EVP_KDF_free(kdf);
+	if (!kctx)
+		return ENOMEM;
+
+	*p++ = OSSL_PARAM_construct_int(OSSL_KDF_PARAM_MODE, &mode);
+	*p++ = OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST,
+						(char *)EVP_MD_get0_name(md),
+						0);
+	*p++ = OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY,
+						 (void *)secret, slen);
+	*p++ = OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO,
+						 info, 4 + llen);
+	*p   = OSSL_PARAM_construct_end();
+
+	if (EVP_KDF_derive(kctx, out, outlen, params) <= 0)
+		err = EPROTO;
+
+	EVP_KDF_CTX_free(kctx);
+
+	return err;
+}
+
+
+/* the key block of RFC 5246, section 6.3 */
+static int key_block(uint8_t *out, size_t outlen, const EVP_MD *md,
+		     const SSL *ssl)
+{
+	uint8_t master[SSL_MAX_MASTER_KEY_LENGTH];
+	uint8_t seed[13 + 2 * SSL3_RANDOM_SIZE];
+	OSSL_PARAM params[4], *p = params;
+	EVP_KDF_CTX *kctx;
+	EVP_KDF *kdf;
+	size_t mlen;
+	int err = 0;
+
+	mlen = SSL_SESSION_get_master_key(SSL_get_session(ssl), master,
+					  sizeof(master));
+
+	memcpy(seed, "key expansion", 13);
+	(void)SSL_get_server_random(ssl, seed + 13, SSL3_RANDOM_SIZE);
+	(void)SSL_get_client_random(ssl, seed + 13 + SSL3_RANDOM_SIZE,
+				    SSL3_RANDOM_SIZE);
+
+	kdf = EVP_KDF_fetch(NULL, "TLS1-PRF", NULL);
+	kctx = EVP_KDF_CTX_new(kdf);
+	EVP_KDF_free(kdf);
+	if (!kctx) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	*p++ = OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST,
+						(char *)EVP_MD_get0_name(md),
+						0);
+	*p++ = OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SECRET,
+						 master, mlen);
+	*p++ = OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SEED,
+						 seed, sizeof(seed));
+	*p   = OSSL_PARAM_construct_end();
+
+	if (EVP_KDF_derive(kctx, out, outlen, params) <= 0)
+		err = EPROTO;
+
+	EVP_KDF_CTX_free(kctx);
+
+ out:
+	OPENSSL_cleanse(master, sizeof(master));
+
+	return err;
+}
+
+
+static void put_seq(uint8_t *p, uint64_t seq)
+{
+	int i;
+
+	for (i=7; i>=0; i--) {
+		p[i] = seq & 0xff;
+		seq >>= 8;
+	}
+}
+
+
+/* fills in one direction; iv is the 4 byte salt and 8 byte nonce */
+static size_t crypto_info(union crypto_info *ci, bool tls13, size_t klen,
+			  const uint8_t *key, const uint8_t *iv, uint64_t seq)
+{
+	memset(ci, 0, sizeof(*ci));
+
+	ci->info.version = tls13 ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+
+	if (klen == TLS_CIPHER_AES_GCM_128_KEY_SIZE) {
+		ci->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		memcpy(ci->gcm128.key, key, klen);
+		memcpy(ci->gcm128.salt, iv, 4);
+		memcpy(ci->gcm128.iv, iv + 4, 8);
+		put_seq(ci->gcm128.rec_seq, seq);
+		return sizeof(ci->gcm128);
+	}
+
+	ci->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+	memcpy(ci->gcm256.key, key, klen);
+	memcpy(ci->gcm256.salt, iv, 4);
+	memcpy(ci->gcm256.iv, iv + 4, 8);
+	put_seq(ci->gcm256.rec_seq, seq);
+
+	return sizeof(ci->gcm256);
+}
+
+
+static int derive(const SSL *ssl, bool tls13, size_t klen,
+		  uint8_t *txkey, uint8_t *txiv, uint8_t *rxkey, uint8_t *rxiv)
+{
+	const EVP_MD *md;
+	uint8_t kb[2 * 32 + 2 * 4];
+	int err;
+
+	md = SSL_CIPHER_get_handshake_digest(SSL_get_current_cipher(ssl));
+	if (!md)
+		return ENOTSUP;
+
+	if (tls13) {
+		const struct secrets *s = SSL_get_ex_data(ssl, kt.ex_idx);
+
+		if (!s || !s->len)
+			return ENOENT;
+
+		err  = expand_label(txkey, klen, md, s->server, s->len,
+				    "key");
+		err |= expand_label(txiv, GCM_IV_SIZE, md, s->server, s->len,
+				    "iv");
+		err |= expand_label(rxkey, klen, md, s->client, s->len,
+				    "key");
+		err |= expand_label(rxiv, GCM_IV_SIZE, md, s->client, s->len,
+				    "iv");
+
+		return err ? EPROTO : 0;
+	}
+
+	/* client key, server key, client salt, server salt */
+	err = key_block(kb, 2 * klen + 8, md, ssl);
+	if (err)
+		goto out;
+
+	memcpy(rxkey, kb, klen);
+	memcpy(txkey, kb + klen, klen);
+	memcpy(rxiv, kb + 2 * klen, 4);
+	memcpy(txiv, kb + 2 * klen + 4, 4);
+
+ out:
+	OPENSSL_cleanse(kb, sizeof(kb));
+
+	return err;
+}
+
+
+static int install(const SSL *ssl, int fd, uint64_t txseq, uint64_t rxseq,
+		   bool rx, bool *rxp)
+{
+	const bool tls13 = SSL_version(ssl) == TLS1_3_VERSION;
+	uint8_t txkey[32], txiv[GCM_IV_SIZE], rxkey[32], rxiv[GCM_IV_SIZE];
+	union crypto_info ci;
+	size_t klen, len;
+	int err;
+
+	if (!tls13 && SSL_version(ssl) != TLS1_2_VERSION)
+		return ENOTSUP;
+
+	switch (SSL_CIPHER_get_cipher_nid(SSL_get_current_cipher(ssl))) {
+
+	case NID_aes_128_gcm:
+		klen = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+		break;
+
+	case NID_aes_256_gcm:
+		klen = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+		break;
+
+	default:
+		return ENOTSUP;
+	}
+
+	err = derive(ssl, tls13, klen, txkey, txiv, rxkey, rxiv);
+	if (err)
+		goto out;
+
+	/* TLS 1.2 sends the explicit nonce, which is the sequence number */
+	if (!tls13) {
+		put_seq(txiv + 4, txseq);
+		put_seq(rxiv + 4, rxseq);
+	}
+
+	if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	len = crypto_info(&ci, tls13, klen, txkey, txiv, txseq);
+	if (setsockopt(fd, SOL_TLS, TLS_TX, &ci, (socklen_t)len) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	if (rx) {
+		len = crypto_info(&ci, tls13, klen, rxkey, rxiv, rxseq);
+		*rxp = setsockopt(fd, SOL_TLS, TLS_RX, &ci,
+				  (socklen_t)len) == 0;
+	}
+
+ out:
+	OPENSSL_cleanse(&ci, sizeof(ci));
+	OPENSSL_cleanse(txkey, sizeof(txkey));
+	OPENSSL_cleanse(rxkey, sizeof(rxkey));
+
+	return err;
+}
+
+
+#endif
+
+
+/* true if tls_listen connections should try kernel TLS */
+bool restund_ktls_enabled(void)
+{
+	return kt.enabled;
+}
+
+
+/**
+ * Prepare an SSL for kernel TLS, before its handshake
+ *
+ * @param ssl Server SSL object
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int restund_ktls_setup(struct ssl_st *ssl)
+{
+#ifdef HAVE_KTLS
+	SSL_CTX *ctx;
+	struct secrets *s;
+
+	if (!ssl)
+		return EINVAL;
+
+	if (!kt.enabled)
+		return ENOSYS;
+
+	/* no SSL of this context exists before the first one is set up */
+	ctx = SSL_get_SSL_CTX(ssl);
+	if (SSL_CTX_get_keylog_callback(ctx) != keylog_handler)
+		SSL_CTX_set_keylog_callback(ctx, keylog_handler);
+
+	s = OPENSSL_zalloc(sizeof(*s));
+	if (!s)
+		return ENOMEM;
+
+	if (!SSL_set_ex_data(ssl, kt.ex_idx, s)) {
+		OPENSSL_free(s);
+		return ENOMEM;
+	}
+
+	return 0;
+#else
+	(void)ssl;
+
+	return ENOSYS;
+#endif
+}
+
+
+/**
+ * Move the record layer of an established connection to the kernel
+ *
+ * @param ssl   SSL object, with the handshake done
+ * @param fd    Socket of the connection
+ * @param txseq Sequence number of the next record sent
+ * @param rxseq Sequence number of the next record received
+ * @param rx    Also offload receiving
+ * @param rxp   Returns true if receiving was offloaded
+ *
+ * @return 0 if sending was offloaded, otherwise errorcode
+ */
+int restund_ktls_start(struct ssl_st *ssl, int fd, uint64_t txseq,
+		       uint64_t rxseq, bool rx, bool *rxp)
+{
+	int err;
+
+	if (!ssl || fd < 0 || !rxp)
+		return EINVAL;
+
+	*rxp = false;
+
+#ifdef HAVE_KTLS
+	err = install(ssl, fd, txseq, rxseq, rx, rxp);
+
+	/* the secrets are not needed any more */
+	secrets_free(NULL, SSL_get_ex_data(ssl, kt.ex_idx), NULL, 0, 0,
+		     NULL);
+	(void)SSL_set_ex_data(ssl, kt.ex_idx, NULL);
+#else
+	(void)txseq;
+	(void)rxseq;
+	(void)rx;
+	err = ENOSYS;
+#endif
+
+	if (err) {
+		restund_debug("ktls: fallback to userspace: %m\n", err);
+		restund_ctr_add(&kt.ctr, KTLS_FALLBACK, 1);
+		return err;
+	}
+
+	restund_ctr_add(&kt.ctr, KTLS_TX, 1);
+	if (*rxp)
+		restund_ctr_add(&kt.ctr, KTLS_RX, 1);
+
+	return 0;
+}
+
+
+void restund_ktls_print(struct mbuf *mb)
+{
+	if (!kt.enabled)
+		return;
+
+	(void)mbuf_printf(mb, "ktls_tx %llu\n",
+			  restund_ctr_total(&kt.ctr, KTLS_TX));
+	(void)mbuf_printf(mb, "ktls_rx %llu\n",
+			  restund_ctr_total(&kt.ctr, KTLS_RX));
+	(void)mbuf_printf(mb, "ktls_fallback %llu\n",
+			  restund_ctr_total(&kt.ctr, KTLS_FALLBACK));
+}
+
+
+static struct restund_metric metricv[] = {
+	{ .name = "restund_ktls_connections", .labels = "dir=\"tx\"",
+	  .help = "TLS connections with records offloaded to the kernel",
+	  .ctr = &kt.ctr, .ctri = KTLS_TX },
+	{ .name = "restund_ktls_connections", .labels = "dir=\"rx\"",
+	  .help = "TLS connections with records offloaded to the kernel",
+	  .ctr = &kt.ctr, .ctri = KTLS_RX },
+	{ .name = "restund_ktls_fallback",
+	  .help = "TLS connections left in userspace",
+	  .ctr = &kt.ctr, .ctri = KTLS_FALLBACK },
+};
+
+
+int restund_ktls_init(void)
+{
+	int err;
+
+	kt.enabled = false;
+
+	(void)conf_get_bool(restund_conf(), "tls_ktls", &kt.enabled);
+
+	if (!kt.enabled)
+		return 0;
+
+#ifdef HAVE_KTLS
+	kt.ex_idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, secrets_free);
+	if (kt.ex_idx < 0)
+		return ENOMEM;
+
+	err = restund_ctr_register(&kt.ctr);
+	if (err)
+		return err;
+
+	restund_metric_register(metricv, RE_ARRAY_SIZE(metricv));
+#else
+	(void)err;
+	restund_warning("ktls: not supported on this platform\n");
+	kt.enabled = false;
+#endif
+
+	return 0;
+}
+
+
+void restund_ktls_close(void)
+{
+	restund_metric_unregister(metricv, RE_ARRAY_SIZE(metricv));
+	restund_ctr_unregister(&kt.ctr);
+	kt.enabled = false;
+}
@@ -4,18 +4,101 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
 #include <re.h>
 #include <restund.h>
+#include "stund.h"
+
+
+/*
+ * Log messages are formatted by the caller and queued in a bounded
+ * lock-free ring (one slot per message). A writer thread drains the
+ * ring and writes to stderr and the registered handlers, so a slow
+ * handler (e.g. syslog) never blocks the caller. When the ring is full
+ * the message is dropped and counted.
+ *
+ * Before restund_log_init() and after restund_log_close(), or if
+ * log_queue_size is 0, messages are written synchronously.
+ *
+ * Each call site (identified by its format string) is limited by a
+ * token bucket of log_rate messages per second with a burst of
+ * log_burst. A suppressed message costs one table lookup and is never
+ * formatted; the number of suppressed messages is logged with the next
+ * message from the same site, at most once per second. The writer
+ * thread also collapses identical consecutive messages into "last
+ * message repeated N times", which is written at least once per second
+ * while the repeats go on.
+ */
+
+
+enum {
+	LOG_QUEUE_SIZE = 512,
+	LOG_MSG_SIZE   = 1024,
+	LOG_FLUSH_MS   = 100,
+	LOG_REPEAT_MS  = 1000,
+	LOG_RATE       = 10,
+	LOG_BURST      = 20,
+	LOG_SITE_SIZE  = 1024,
+	LOG_SITE_PROBE = 8,
+};
+
+
+struct log_rec {
+	_Atomic uint32_t seq;
+	uint32_t level;
+	char msg[LOG_MSG_SIZE];
+};
+
+struct log_site {
+	const char *_Atomic fmt;
+	_Atomic uint64_t tat;       /* theoretical arrival time [us] */
+	_Atomic uint64_t supc;      /* suppressed since last report */
+	_Atomic uint64_t totc;      /* suppressed in total */
+	_Atomic uint64_t supt;      /* time of last report [us] */
+};
 
 
 static struct {
 	struct list logl;
+	pthread_mutex_t mutex;  /* protects logl and output */
 	bool debug;
 	bool stder;
+
+	struct {
+		struct log_rec *ring;
+		uint32_t size;
+		_Atomic uint32_t head;
+		uint32_t tail;          /* writer thread only */
+		_Atomic uint64_t enqc;
+		_Atomic uint64_t dropc;
+		_Atomic uint64_t truncc;
+		pthread_t thread;
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+		bool quit;
+		char prev[LOG_MSG_SIZE];  /* writer thread only */
+		uint32_t prevlevel;
+		uint32_t repc;
+		uint64_t reptime;         /* start of repeat run [us] */
+	} q;
+
+	struct {
+		struct log_site sitev[LOG_SITE_SIZE];
+		uint64_t interval;  /* [us] per message, 0 to disable */
+		uint64_t burst;     /* [us] */
+	} rl;
 } lg = {
 	.logl  = LIST_INIT,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
 	.debug = false,
-	.stder = true
+	.stder = true,
+	.q = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.cond  = PTHREAD_COND_INITIALIZER,
+	},
 };
 
 
@@ -24,7 +107,9 @@ void restund_log_register_handler(struct restund_log *log)
 	if (!log)
 		return;
 
+	pthread_mutex_lock(&lg.mutex);
 	list_append(&lg.logl, &log->le, log);
+	pthread_mutex_unlock(&lg.mutex);
 }
 
 
@@ -33,7 +118,9 @@ void restund_log_unregister_handler(struct restund_log *log)
 	if (!log)
 		return;
 
+	pthread_mutex_lock(&lg.mutex);
 	list_unlink(&log->le);
+	pthread_mutex_unlock(&lg.mutex);
 }
 
 
@@ -49,16 +136,14 @@ void restund_log_enable_stderr(bool enable)
 }
 
 
-void restund_vlog(uint32_t level, const char *fmt, va_list ap)
+static void log_write(uint32_t level, const char *msg)
 {
-	char buf[4096];
 	struct le *le;
 
-	if (re_vsnprintf(buf, sizeof(buf), fmt, ap) < 0)
-		return;
+	pthread_mutex_lock(&lg.mutex);
 
 	if (lg.stder)
-		(void)re_fprintf(stderr, "%s", buf);
+		(void)re_fprintf(stderr, "%s", msg);
 
 	le = lg.logl.head;
 
@@ -68,8 +153,299 @@ void restund_vlog(uint32_t level, const char *fmt, va_list ap)
 		le = le->next;
 
 		if (log->h)
-			log->h(level, buf);
+			log->h(level, msg);
+	}
+
+	pthread_mutex_unlock(&lg.mutex);
+}
+
+
+static void counter_add(_Atomic uint64_t *cnt, uint64_t n)
+{
+	atomic_fetch_add_explicit(cnt, n, memory_order_relaxed);
+}
+
+
+/* multi-producer enqueue, never blocks */
+static void log_enqueue(uint32_t level, const char *msg, size_t len)
+{
+	const uint32_t mask = lg.q.size - 1;
+	struct log_rec *rec;
+	uint32_t pos, seq;
+
+	pos = atomic_load_explicit(&lg.q.head, memory_order_relaxed);
+
+	for (;;) {
+		int32_t diff;
+
+		rec = &lg.q.ring[pos & mask];
+		seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+		diff = (int32_t)(seq - pos);
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&lg.q.head,
+					&pos, pos + 1, memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0) {
+			counter_add(&lg.q.dropc, 1);
+			return;
+		}
+		else {
+			pos = atomic_load_explicit(&lg.q.head,
+						   memory_order_relaxed);
+		}
+	}
+
+	if (len >= sizeof(rec->msg)) {
+		/* keep the line terminated */
+		len = sizeof(rec->msg) - 2;
+		memcpy(rec->msg, msg, len);
+		rec->msg[len++] = '\n';
+		counter_add(&lg.q.truncc, 1);
+	}
+	else {
+		memcpy(rec->msg, msg, len);
+	}
+
+	rec->msg[len] = '\0';
+	rec->level = level;
+
+	atomic_store_explicit(&rec->seq, pos + 1, memory_order_release);
+	counter_add(&lg.q.enqc, 1);
+
+	/* see database thread for why this may miss a wakeup */
+	if (!pthread_mutex_trylock(&lg.q.mutex)) {
+		pthread_cond_signal(&lg.q.cond);
+		pthread_mutex_unlock(&lg.q.mutex);
+	}
+}
+
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+
+static void log_repeat_flush(void)
+{
+	char buf[64];
+
+	if (!lg.q.repc)
+		return;
+
+	(void)re_snprintf(buf, sizeof(buf),
+			  "last message repeated %u times\n", lg.q.repc);
+	log_write(lg.q.prevlevel, buf);
+
+	lg.q.repc = 0;
+}
+
+
+static uint32_t log_drain(void)
+{
+	const uint32_t mask = lg.q.size - 1;
+	uint32_t n = 0;
+
+	for (;;) {
+		struct log_rec *rec = &lg.q.ring[lg.q.tail & mask];
+		const uint32_t seq = atomic_load_explicit(&rec->seq,
+						memory_order_acquire);
+
+		if (seq != lg.q.tail + 1)
+			break;
+
+		if (rec->level == lg.q.prevlevel &&
+		    !strcmp(rec->msg, lg.q.prev)) {
+
+			const uint64_t now = now_usec();
+
+			if (!lg.q.repc++)
+				lg.q.reptime = now;
+			else if (now >= lg.q.reptime + LOG_REPEAT_MS * 1000)
+				log_repeat_flush();
+		}
+		else {
+			log_repeat_flush();
+			log_write(rec->level, rec->msg);
+
+			str_ncpy(lg.q.prev, rec->msg, sizeof(lg.q.prev));
+			lg.q.prevlevel = rec->level;
+		}
+
+		atomic_store_explicit(&rec->seq, lg.q.tail + lg.q.size,
+				      memory_order_release);
+		++lg.q.tail;
+		++n;
+	}
+
+	return n;
+}
+
+
+static void *log_thread(void *arg)
+{
+	uint64_t dropc = 0;
+	(void)arg;
+
+	for (;;) {
+		struct timespec ts;
+		uint64_t d;
+		uint32_t n;
+		bool quit;
+
+		n = log_drain();
+
+		/* report repeats at least once per interval */
+		if (lg.q.repc &&
+		    now_usec() >= lg.q.reptime + LOG_REPEAT_MS * 1000)
+			log_repeat_flush();
+
+		d = atomic_load_explicit(&lg.q.dropc, memory_order_relaxed);
+		if (d != dropc) {
+			char buf[64];
+
+			(void)re_snprintf(buf, sizeof(buf),
+					  "log: %llu messages dropped\n",
+					  d - dropc);
+			log_write(RESTUND_WARNING, buf);
+			dropc = d;
+		}
+
+		(void)clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += LOG_FLUSH_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec  += 1;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		pthread_mutex_lock(&lg.q.mutex);
+		quit = lg.q.quit;
+		if (!quit && !n) {
+			(void)pthread_cond_timedwait(&lg.q.cond, &lg.q.mutex,
+						     &ts);
+		}
+		pthread_mutex_unlock(&lg.q.mutex);
+
+		if (quit)
+			break;
+	}
+
+	(void)log_drain();
+	log_repeat_flush();
+
+	return NULL;
+}
+
+
+static struct log_site *site_get(const char *fmt)
+{
+	const uint32_t h = (uint32_t)((uintptr_t)fmt >> 3) * 2654435761u;
+	uint32_t i;
+
+	for (i=0; i<LOG_SITE_PROBE; i++) {
+
+		struct log_site *site;
+		const char *f;
+
+		site = &lg.rl.sitev[(h + i) & (LOG_SITE_SIZE - 1)];
+		f = atomic_load_explicit(&site->fmt, memory_order_acquire);
+
+		if (!f && atomic_compare_exchange_strong_explicit(&site->fmt,
+				&f, fmt, memory_order_acq_rel,
+				memory_order_acquire))
+			return site;
+
+		if (f == fmt)
+			return site;
 	}
+
+	/* table full, not limited */
+	return NULL;
+}
+
+
+/* generic cell rate algorithm, one CAS per allowed message */
+static bool log_allow(const char *fmt, uint64_t *supcp)
+{
+	struct log_site *site;
+	uint64_t now, tat, ntat, supt;
+
+	if (!lg.rl.interval)
+		return true;
+
+	site = site_get(fmt);
+	if (!site)
+		return true;
+
+	now = now_usec();
+	tat = atomic_load_explicit(&site->tat, memory_order_relaxed);
+
+	do {
+		if (tat > now + lg.rl.burst) {
+			counter_add(&site->supc, 1);
+			counter_add(&site->totc, 1);
+			return false;
+		}
+
+		ntat = MAX(tat, now) + lg.rl.interval;
+
+	} while (!atomic_compare_exchange_weak_explicit(&site->tat, &tat,
+			ntat, memory_order_relaxed, memory_order_relaxed));
+
+	/* report suppressed messages once per interval */
+	supt = atomic_load_explicit(&site->supt, memory_order_relaxed);
+
+	if (now >= supt + LOG_REPEAT_MS * 1000 &&
+	    atomic_load_explicit(&site->supc, memory_order_relaxed) &&
+	    atomic_compare_exchange_strong_explicit(&site->supt, &supt,
+			now, memory_order_relaxed, memory_order_relaxed)) {
+
+		*supcp = atomic_exchange_explicit(&site->supc, 0,
+						  memory_order_relaxed);
+	}
+
+	return true;
+}
+
+
+static void log_emit(uint32_t level, const char *msg, size_t len)
+{
+	if (lg.q.ring)
+		log_enqueue(level, msg, len);
+	else
+		log_write(level, msg);
+}
+
+
+void restund_vlog(uint32_t level, const char *fmt, va_list ap)
+{
+	char buf[4096];
+	uint64_t supc = 0;
+	int len;
+
+	if (!log_allow(fmt, &supc))
+		return;
+
+	if (supc) {
+		len = re_snprintf(buf, sizeof(buf),
+				  "log: %llu similar messages suppressed\n",
+				  supc);
+		if (len > 0)
+			log_emit(level, buf, (size_t)len);
+	}
+
+	len = re_vsnprintf(buf, sizeof(buf), fmt, ap);
+	if (len < 0)
+		return;
+
+	log_emit(level, buf, (size_t)len);
 }
 
 
@@ -127,3 +503,147 @@ void restund_error(const char *fmt, ...)
 	restund_vlog(RESTUND_ERROR, fmt, ap);
 	va_end(ap);
 }
+
+
+static void stats_handler(struct mbuf *mb)
+{
+	(void)mbuf_printf(mb, "log_queue_size %u\n", lg.q.size);
+	(void)mbuf_printf(mb, "log_queue_bytes %zu\n",
+			  lg.q.size * sizeof(struct log_rec));
+	(void)mbuf_printf(mb, "log_enqueued %llu\n",
+			  atomic_load_explicit(&lg.q.enqc,
+					       memory_order_relaxed));
+	(void)mbuf_printf(mb, "log_dropped %llu\n",
+			  atomic_load_explicit(&lg.q.dropc,
+					       memory_order_relaxed));
+	(void)mbuf_printf(mb, "log_truncated %llu\n",
+			  atomic_load_explicit(&lg.q.truncc,
+					       memory_order_relaxed));
+}
+
+
+static struct restund_cmdsub cmd_logstats = {
+	.cmdh = stats_handler,
+	.cmd  = "logstats",
+};
+
+
+static void supp_handler(struct mbuf *mb)
+{
+	uint32_t i;
+
+	(void)mbuf_printf(mb, "rate %llu/s burst %llu\n",
+			  lg.rl.interval ? 1000000 / lg.rl.interval : 0,
+			  lg.rl.interval ? lg.rl.burst / lg.rl.interval : 0);
+
+	for (i=0; i<LOG_SITE_SIZE; i++) {
+
+		struct log_site *site = &lg.rl.sitev[i];
+		const char *fmt;
+		uint64_t totc;
+		size_t len;
+
+		fmt = atomic_load_explicit(&site->fmt, memory_order_acquire);
+		if (!fmt)
+			continue;
+
+		totc = atomic_load_explicit(&site->totc, memory_order_relaxed);
+		if (!totc)
+			continue;
+
+		len = strlen(fmt);
+		if (len && fmt[len-1] == '\n')
+			--len;
+
+		(void)mbuf_printf(mb, "%10llu %10llu  %b\n", totc,
+				  atomic_load_explicit(&site->supc,
+						       memory_order_relaxed),
+				  fmt, len);
+	}
+}
+
+
+static struct restund_cmdsub cmd_logsupp = {
+	.cmdh = supp_handler,
+	.cmd  = "logsupp",
+};
+
+
+/**
+ * Start the log writer thread. Must be called after daemonizing.
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int restund_log_init(void)
+{
+	uint32_t i, x, size = LOG_QUEUE_SIZE;
+	uint32_t rate = LOG_RATE, burst = LOG_BURST;
+	int err;
+
+	(void)conf_get_u32(restund_conf(), "log_rate", &rate);
+	(void)conf_get_u32(restund_conf(), "log_burst", &burst);
+
+	lg.rl.interval = rate ? 1000000 / MIN(rate, 1000000) : 0;
+	lg.rl.burst    = lg.rl.interval * burst;
+
+	restund_cmd_subscribe(&cmd_logsupp);
+
+	(void)conf_get_u32(restund_conf(), "log_queue_size", &size);
+	if (!size)
+		return 0;
+
+	for (x=2; (uint32_t)1<<x<size; x++);
+	size = 1<<x;
+
+	lg.q.ring = mem_zalloc(size * sizeof(*lg.q.ring), NULL);
+	if (!lg.q.ring)
+		return ENOMEM;
+
+	for (i=0; i<size; i++)
+		atomic_init(&lg.q.ring[i].seq, i);
+
+	lg.q.size = size;
+	lg.q.tail = 0;
+	lg.q.quit = false;
+	atomic_store_explicit(&lg.q.head, 0, memory_order_relaxed);
+
+	err = pthread_create(&lg.q.thread, NULL, log_thread, NULL);
+	if (err) {
+		lg.q.ring = mem_deref(lg.q.ring);
+		return err;
+	}
+
+	restund_cmd_subscribe(&cmd_logstats);
+
+	restund_debug("log: queue of %u messages (%zu bytes)\n",
+		      size, size * sizeof(*lg.q.ring));
+
+	return 0;
+}
+
+
+/**
+ * Flush queued messages and stop the log writer thread. Other threads
+ * must not log while this is called.
+ */
+void restund_log_close(void)
+{
+	struct log_rec *ring = lg.q.ring;
+
+	restund_cmd_unsubscribe(&cmd_logsupp);
+
+	if (!ring)
+		return;
+
+	restund_cmd_unsubscribe(&cmd_logstats);
+
+	pthread_mutex_lock(&lg.q.mutex);
+	lg.q.quit = true;
+	pthread_cond_signal(&lg.q.cond);
+	pthread_mutex_unlock(&lg.q.mutex);
+
+	pthread_join(lg.q.thread, NULL);
+
+	lg.q.ring = NULL;
+	mem_deref(ring);
+}
@@ -227,11 +227,46 @@ int main(int argc, char *argv[])
 	if (!conf_get(conf, "debug", &opt) && !pl_strcasecmp(&opt, "yes"))
 		restund_log_enable_debug(true);
 
+	/* sharded counters */
+	err = restund_ctr_init();
+	if (err)
+		goto out;
+
+	/* handler profiling */
+	err = restund_prof_init();
+	if (err)
+		goto out;
+
+	/* latency histograms */
+	err = restund_hist_init();
+	if (err)
+		goto out;
+
+	/* stun */
+	err = restund_stun_init();
+	if (err)
+		goto out;
+
 	/* udp */
 	err = restund_udp_init();
 	if (err)
 		goto out;
 
+	/* tls session resumption */
+	err = restund_tlsres_init();
+	if (err)
+		goto out;
+
+	/* kernel tls */
+	err = restund_ktls_init();
+	if (err)
+		goto out;
+
+	/* tls handshake workers */
+	err = restund_tlspool_init();
+	if (err)
+		goto out;
+
 	/* tcp */
 	err = restund_tcp_init();
 	if (err)
@@ -265,6 +300,18 @@ int main(int argc, char *argv[])
 		restund_log_enable_stderr(false);
 	}
 
+	/* log writer thread */
+	err = restund_log_init();
+	if (err) {
+		restund_error("log init error: %m\n", err);
+		goto out;
+	}
+
+	/* shared memory statistics */
+	err = restund_statshm_init();
+	if (err)
+		goto out;
+
 	/* database */
 	err = restund_db_init();
 	if (err) {
@@ -278,11 +325,20 @@ int main(int argc, char *argv[])
 	err = re_main(signal_handler);
 
  out:
+	restund_statshm_close();
 	restund_db_close();
+	restund_log_close();
 	mod_close();
 	restund_udp_close();
 	restund_tcp_close();
 	restund_dtls_close();
+	restund_tlspool_close();
+	restund_ktls_close();
+	restund_tlsres_close();
+	restund_stun_close();
+	restund_hist_close();
+	restund_prof_close();
+	restund_ctr_close();
 	conf = mem_deref(conf);
 
 	/* check for open timers */
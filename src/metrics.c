@@ -0,0 +1,194 @@
+/**
+ * @file metrics.c Metrics Registry
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+
+
+/*
+ * Modules register their counters and gauges here, and the registry is
+ * encoded in OpenMetrics text format on request. Metrics with the same
+ * name form one family and must have the same type and help text.
+ */
+
+
+static struct list metricl;
+
+
+void restund_metric_register(struct restund_metric *mv, size_t n)
+{
+	size_t i;
+
+	if (!mv)
+		return;
+
+	for (i=0; i<n; i++)
+		list_append(&metricl, &mv[i].le, &mv[i]);
+}
+
+
+void restund_metric_unregister(struct restund_metric *mv, size_t n)
+{
+	size_t i;
+
+	if (!mv)
+		return;
+
+	for (i=0; i<n; i++)
+		list_unlink(&mv[i].le);
+}
+
+
+static uint64_t metric_value(const struct restund_metric *m)
+{
+	if (m->u64)
+		return *m->u64;
+	else if (m->u32)
+		return *m->u32;
+	else if (m->ctr)
+		return restund_ctr_total(m->ctr, m->ctri);
+	else if (m->valh)
+		return m->valh();
+
+	return 0;
+}
+
+
+static int sample_encode(struct mbuf *mb, const struct restund_metric *m)
+{
+	const char *suffix = (m->type == RESTUND_METRIC_COUNTER)
+		? "_total" : "";
+
+	if (m->labels)
+		return mbuf_printf(mb, "%s%s{%s} %llu\n", m->name, suffix,
+				   m->labels, metric_value(m));
+
+	return mbuf_printf(mb, "%s%s %llu\n", m->name, suffix,
+			   metric_value(m));
+}
+
+
+/**
+ * Apply a handler to all registered metrics, with their current values
+ *
+ * @param h   Handler called for each metric
+ * @param arg Handler argument
+ */
+void restund_metrics_apply(restund_metric_apply_h *h, void *arg)
+{
+	struct le *le;
+
+	if (!h)
+		return;
+
+	for (le = metricl.head; le; le = le->next) {
+
+		const struct restund_metric *m = le->data;
+
+		h(m, metric_value(m), arg);
+	}
+}
+
+
+/* true if an earlier metric has the same name */
+static bool family_seen(const struct le *le)
+{
+	const struct restund_metric *m = le->data;
+
+	for (le = le->prev; le; le = le->prev) {
+
+		const struct restund_metric *p = le->data;
+
+		if (!strcmp(p->name, m->name))
+			return true;
+	}
+
+	return false;
+}
+
+
+/**
+ * Encode all registered metrics in OpenMetrics text format
+ *
+ * @param mb Buffer to encode into
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int restund_metrics_encode(struct mbuf *mb)
+{
+	struct le *le, *fle;
+	int err = 0;
+
+	if (!mb)
+		return EINVAL;
+
+	for (le = metricl.head; le && !err; le = le->next) {
+
+		const struct restund_metric *m = le->data;
+
+		if (family_seen(le))
+			continue;
+
+		err |= mbuf_printf(mb, "# TYPE %s %s\n", m->name,
+				   m->type == RESTUND_METRIC_COUNTER
+				   ? "counter" : "gauge");
+		if (m->help)
+			err |= mbuf_printf(mb, "# HELP %s %s\n",
+					   m->name, m->help);
+
+		for (fle = le; fle; fle = fle->next) {
+
+			const struct restund_metric *f = fle->data;
+
+			if (!strcmp(f->name, m->name))
+				err |= sample_encode(mb, f);
+		}
+	}
+
+	err |= mbuf_write_str(mb, "# EOF\n");
+
+	return err;
+}
+
+
+/**
+ * Encode all registered metrics as a JSON array
+ *
+ * @param mb Buffer to encode into
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int restund_metrics_encode_json(struct mbuf *mb)
+{
+	struct le *le;
+	int err = 0;
+
+	if (!mb)
+		return EINVAL;
+
+	err |= mbuf_write_str(mb, "[");
+
+	for (le = metricl.head; le && !err; le = le->next) {
+
+		const struct restund_metric *m = le->data;
+
+		err |= mbuf_printf(mb, "%s{\"name\":\"%s\",\"type\":\"%s\"",
+				   le == metricl.head ? "" : ",", m->name,
+				   m->type == RESTUND_METRIC_COUNTER
+				   ? "counter" : "gauge");
+		if (m->labels)
+			err |= mbuf_printf(mb, ",\"labels\":\"%H\"",
+					   utf8_encode, m->labels);
+
+		err |= mbuf_printf(mb, ",\"value\":%llu}", metric_value(m));
+	}
+
+	err |= mbuf_write_str(mb, "]");
+
+	return err;
+}
@@ -0,0 +1,201 @@
+/**
+ * @file prof.c Handler Profiling
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+
+
+/*
+ * When profile_sample is set to n, one in n STUN messages is timed
+ * through every handler it visits. Command handlers are rare and are
+ * always timed. The "profile" command shows the accumulated time per
+ * module and method, scaled up by the sampling rate.
+ *
+ * Entries are keyed by the name pointers given by the callers, which
+ * are string literals or live as long as the module.
+ */
+
+
+struct prof {
+	struct le le;
+	const char *mod;
+	const char *what;
+	enum restund_prof_kind kind;
+	uint64_t calls;
+	uint64_t ns;
+	uint64_t max;
+};
+
+
+static struct {
+	struct list profl;
+	uint32_t rate;
+	uint32_t cnt;
+	uint64_t samplec;
+} prf;
+
+
+static void destructor(void *arg)
+{
+	struct prof *p = arg;
+
+	list_unlink(&p->le);
+}
+
+
+static struct prof *prof_get(const char *mod, const char *what,
+			     enum restund_prof_kind kind)
+{
+	struct prof *p;
+	struct le *le;
+
+	for (le = prf.profl.head; le; le = le->next) {
+
+		p = le->data;
+
+		if (p->mod == mod && p->what == what && p->kind == kind)
+			return p;
+	}
+
+	p = mem_zalloc(sizeof(*p), destructor);
+	if (!p)
+		return NULL;
+
+	p->mod  = mod;
+	p->what = what;
+	p->kind = kind;
+
+	list_append(&prf.profl, &p->le, p);
+
+	return p;
+}
+
+
+/**
+ * Decide if the current message should be profiled
+ *
+ * @return True if sampled, otherwise false
+ */
+bool restund_prof_sample(void)
+{
+	if (!prf.rate)
+		return false;
+
+	if (++prf.cnt < prf.rate)
+		return false;
+
+	prf.cnt = 0;
+	++prf.samplec;
+
+	return true;
+}
+
+
+/**
+ * Account the time spent in one handler call
+ *
+ * @param mod  Module name
+ * @param what Method or command name
+ * @param kind Handler kind
+ * @param ns   Time spent in nanoseconds
+ */
+void restund_prof_add(const char *mod, const char *what,
+		      enum restund_prof_kind kind, uint64_t ns)
+{
+	struct prof *p;
+
+	p = prof_get(mod, what, kind);
+	if (!p)
+		return;
+
+	++p->calls;
+	p->ns += ns;
+	p->max = MAX(p->max, ns);
+}
+
+
+/**
+ * Check if handler profiling is enabled
+ *
+ * @return True if enabled, otherwise false
+ */
+bool restund_prof_enabled(void)
+{
+	return prf.rate != 0;
+}
+
+
+static bool sort_handler(struct le *le1, struct le *le2, void *arg)
+{
+	const struct prof *p1 = le1->data;
+	const struct prof *p2 = le2->data;
+	(void)arg;
+
+	return p1->ns >= p2->ns;
+}
+
+
+static void profile_handler(struct mbuf *mb)
+{
+	static const char *kindv[] = {"req", "ind", "raw", "cmd"};
+	struct le *le;
+
+	if (!prf.rate) {
+		(void)mbuf_printf(mb, "profiling disabled"
+				  " (profile_sample 0)\n");
+		return;
+	}
+
+	(void)mbuf_printf(mb, "sampling 1/%u, %llu messages sampled\n",
+			  prf.rate, prf.samplec);
+
+	list_sort(&prf.profl, sort_handler, NULL);
+
+	(void)mbuf_printf(mb, "%-10s %-4s %-18s %10s %12s %8s %8s\n",
+			  "module", "kind", "method", "calls", "total[ms]",
+			  "mean[us]", "max[us]");
+
+	for (le = prf.profl.head; le; le = le->next) {
+
+		const struct prof *p = le->data;
+		const uint64_t scale = p->kind == RESTUND_PROF_CMD
+			? 1 : prf.rate;
+
+		(void)mbuf_printf(mb, "%-10s %-4s %-18s %10llu %12llu"
+				  " %8llu %8llu\n",
+				  p->mod ? p->mod : "?", kindv[p->kind],
+				  p->what ? p->what : "-",
+				  p->calls * scale,
+				  p->ns * scale / 1000000,
+				  p->calls ? p->ns / p->calls / 1000 : 0,
+				  p->max / 1000);
+	}
+}
+
+
+static struct restund_cmdsub cmd_profile = {
+	.cmdh = profile_handler,
+	.cmd  = "profile",
+};
+
+
+int restund_prof_init(void)
+{
+	prf.rate = 0;
+	conf_get_u32(restund_conf(), "profile_sample", &prf.rate);
+
+	restund_cmd_subscribe(&cmd_profile);
+
+	return 0;
+}
+
+
+void restund_prof_close(void)
+{
+	restund_cmd_unsubscribe(&cmd_profile);
+	list_flush(&prf.profl);
+}
@@ -0,0 +1,539 @@
+/**
+ * @file spool.c Traffic Record Spool
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+
+
+/*
+ * Append-only file of traffic records which could not be written to the
+ * database backend. The file starts with a header holding the offset of
+ * the oldest record not yet replayed, followed by fixed-size frames:
+ *
+ *     header | len crc record | len crc record | ...
+ *
+ * A torn frame at the end of the file (crash during append) is detected
+ * by its checksum and truncated when the spool is opened. Once more
+ * than half of the file has been replayed, the remaining records are
+ * copied to a new file which is renamed over the spool. The spool is
+ * only accessed from the database thread.
+ */
+
+
+enum {
+	SPOOL_MAGIC   = 0x5253504c,  /* "RSPL" */
+	SPOOL_VERSION = 1,
+};
+
+struct spool_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t recsz;
+	uint32_t reserved;
+	uint64_t rdoff;
+};
+
+struct frame_hdr {
+	uint32_t len;
+	uint32_t crc;
+};
+
+struct spool {
+	struct restund_traffic *bufv;
+	char *path;
+	uint32_t bufsz;
+	uint64_t rdoff;
+	uint64_t wroff;
+	uint64_t maxsz;
+	int fd;
+};
+
+
+static const size_t frame_size = sizeof(struct frame_hdr) +
+	sizeof(struct restund_traffic);
+
+
+static uint32_t crc32_calc(const void *buf, size_t len)
+{
+	static uint32_t table[256];
+	const uint8_t *p = buf;
+	uint32_t crc = 0xffffffff;
+
+	if (!table[1]) {
+		uint32_t i, j, c;
+
+		for (i=0; i<256; i++) {
+			c = i;
+			for (j=0; j<8; j++)
+				c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : c >> 1;
+			table[i] = c;
+		}
+	}
+
+	while (len--)
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc ^ 0xffffffff;
+}
+
+
+static int pread_all(int fd, void *p, size_t n, uint64_t off)
+{
+	uint8_t *b = p;
+
+	while (n > 0) {
+
+		ssize_t r = pread(fd, b, n, (off_t)off);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		else if (r == 0)
+			return ENODATA;
+
+		b   += r;
+		off += r;
+		n   -= r;
+	}
+
+	return 0;
+}
+
+
+static int pwrite_all(int fd, const void *p, size_t n, uint64_t off)
+{
+	const uint8_t *b = p;
+
+	while (n > 0) {
+
+		ssize_t w = pwrite(fd, b, n, (off_t)off);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+
+		b   += w;
+		off += w;
+		n   -= w;
+	}
+
+	return 0;
+}
+
+
+static int hdr_write(struct spool *sp)
+{
+	struct spool_hdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+
+	hdr.magic   = SPOOL_MAGIC;
+	hdr.version = SPOOL_VERSION;
+	hdr.recsz   = sizeof(struct restund_traffic);
+	hdr.rdoff   = sp->rdoff;
+
+	return pwrite_all(sp->fd, &hdr, sizeof(hdr), 0);
+}
+
+
+static int reset(struct spool *sp)
+{
+	sp->rdoff = sizeof(struct spool_hdr);
+	sp->wroff = sizeof(struct spool_hdr);
+
+	if (ftruncate(sp->fd, (off_t)sp->wroff) < 0)
+		return errno;
+
+	return hdr_write(sp);
+}
+
+
+/* copy the records not yet replayed to a new file replacing the spool */
+static int compact(struct spool *sp)
+{
+	const size_t bufsz = sp->bufsz * sizeof(*sp->bufv);
+	struct spool tmp;
+	char *path = NULL;
+	uint64_t off, dst;
+	int err;
+
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.rdoff = sizeof(struct spool_hdr);
+
+	err = re_sdprintf(&path, "%s.tmp", sp->path);
+	if (err)
+		return err;
+
+	tmp.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (tmp.fd < 0) {
+		err = errno;
+		goto out;
+	}
+
+	err = hdr_write(&tmp);
+	if (err)
+		goto out;
+
+	for (off = sp->rdoff, dst = tmp.rdoff; off < sp->wroff; ) {
+
+		const size_t n = (size_t)MIN(bufsz, sp->wroff - off);
+
+		err = pread_all(sp->fd, sp->bufv, n, off);
+		if (err)
+			goto out;
+
+		err = pwrite_all(tmp.fd, sp->bufv, n, dst);
+		if (err)
+			goto out;
+
+		off += n;
+		dst += n;
+	}
+
+	if (fdatasync(tmp.fd) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	if (rename(path, sp->path) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	(void)close(sp->fd);
+
+	sp->fd    = tmp.fd;
+	sp->rdoff = tmp.rdoff;
+	sp->wroff = dst;
+
+	tmp.fd = -1;
+
+ out:
+	if (tmp.fd >= 0) {
+		(void)close(tmp.fd);
+		(void)unlink(path);
+	}
+
+	mem_deref(path);
+
+	return err;
+}
+
+
+/* find the end of the last intact frame */
+static int recover(struct spool *sp, uint64_t size)
+{
+	struct frame_hdr fh;
+	uint64_t off;
+	int err;
+
+	for (off = sp->rdoff; off + frame_size <= size; off += frame_size) {
+
+		err = pread_all(sp->fd, &fh, sizeof(fh), off);
+		if (err)
+			return err;
+
+		if (fh.len != sizeof(struct restund_traffic))
+			break;
+
+		err = pread_all(sp->fd, sp->bufv, fh.len, off + sizeof(fh));
+		if (err)
+			return err;
+
+		if (fh.crc != crc32_calc(sp->bufv, fh.len))
+			break;
+	}
+
+	if (off < size) {
+		restund_warning("spool: truncating %llu bytes of damaged"
+				" records\n", size - off);
+
+		if (ftruncate(sp->fd, (off_t)off) < 0)
+			return errno;
+	}
+
+	sp->wroff = off;
+
+	return 0;
+}
+
+
+static void destructor(void *arg)
+{
+	struct spool *sp = arg;
+
+	if (sp->fd >= 0)
+		(void)close(sp->fd);
+
+	mem_deref(sp->bufv);
+	mem_deref(sp->path);
+}
+
+
+/**
+ * Open (or create) a traffic record spool
+ *
+ * @param spp   Pointer to allocated spool
+ * @param path  Spool file path
+ * @param maxsz Maximum size of the spool file in bytes, 0 for no limit
+ * @param batch Maximum number of records returned by spool_peek()
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int spool_open(struct spool **spp, const char *path, uint64_t maxsz,
+	       uint32_t batch)
+{
+	struct spool_hdr hdr;
+	struct spool *sp;
+	struct stat st;
+	int err = 0;
+
+	if (!spp || !path || !batch)
+		return EINVAL;
+
+	sp = mem_zalloc(sizeof(*sp), destructor);
+	if (!sp)
+		return ENOMEM;
+
+	sp->fd    = -1;
+	sp->maxsz = maxsz;
+
+	err = str_dup(&sp->path, path);
+	if (err)
+		goto out;
+
+	sp->bufsz = batch;
+	sp->bufv  = mem_alloc(batch * sizeof(*sp->bufv), NULL);
+	if (!sp->bufv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	sp->fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (sp->fd < 0) {
+		err = errno;
+		goto out;
+	}
+
+	if (fstat(sp->fd, &st) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	if ((size_t)st.st_size < sizeof(hdr)) {
+		err = reset(sp);
+		goto out;
+	}
+
+	err = pread_all(sp->fd, &hdr, sizeof(hdr), 0);
+	if (err)
+		goto out;
+
+	if (hdr.magic != SPOOL_MAGIC || hdr.version != SPOOL_VERSION ||
+	    hdr.recsz != sizeof(struct restund_traffic) ||
+	    hdr.rdoff < sizeof(hdr) || hdr.rdoff > (uint64_t)st.st_size ||
+	    (hdr.rdoff - sizeof(hdr)) % frame_size) {
+
+		restund_warning("spool: %s: bad header, discarding\n", path);
+		err = reset(sp);
+		goto out;
+	}
+
+	sp->rdoff = hdr.rdoff;
+
+	err = recover(sp, st.st_size);
+	if (err)
+		goto out;
+
+	if (sp->rdoff == sp->wroff)
+		err = reset(sp);
+
+ out:
+	if (err)
+		mem_deref(sp);
+	else
+		*spp = sp;
+
+	return err;
+}
+
+
+/**
+ * Append traffic records to the end of the spool
+ *
+ * @param sp   Traffic record spool
+ * @param trfv Array of traffic records
+ * @param n    Number of records
+ *
+ * @return 0 if success, ENOSPC if the size limit is reached
+ */
+int spool_append(struct spool *sp, const struct restund_traffic *trfv,
+		 uint32_t n)
+{
+	struct frame_hdr fh;
+	uint64_t off;
+	uint32_t i;
+	int err = 0;
+
+	if (!sp || !trfv)
+		return EINVAL;
+
+	/* reclaim the replayed records before giving up */
+	if (sp->maxsz && sp->wroff + n * frame_size > sp->maxsz &&
+	    sp->rdoff > sizeof(struct spool_hdr)) {
+
+		err = compact(sp);
+		if (err)
+			restund_warning("spool: compact: %m\n", err);
+	}
+
+	if (sp->maxsz && sp->wroff + n * frame_size > sp->maxsz)
+		return ENOSPC;
+
+	off = sp->wroff;
+
+	for (i=0; i<n; i++) {
+
+		fh.len = sizeof(trfv[i]);
+		fh.crc = crc32_calc(&trfv[i], sizeof(trfv[i]));
+
+		err = pwrite_all(sp->fd, &fh, sizeof(fh), off);
+		if (err)
+			break;
+
+		err = pwrite_all(sp->fd, &trfv[i], sizeof(trfv[i]),
+				 off + sizeof(fh));
+		if (err)
+			break;
+
+		off += frame_size;
+	}
+
+	if (!err && fdatasync(sp->fd) < 0)
+		err = errno;
+
+	if (err) {
+		/* drop the partial append */
+		if (ftruncate(sp->fd, (off_t)sp->wroff) < 0)
+			restund_warning("spool: truncate: %m\n", errno);
+		return err;
+	}
+
+	sp->wroff = off;
+
+	return 0;
+}
+
+
+/**
+ * Read the oldest records from the spool without consuming them
+ *
+ * @param sp    Traffic record spool
+ * @param trfvp Pointer to returned records, valid until the next call
+ * @param np    Pointer to returned number of records
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int spool_peek(struct spool *sp, const struct restund_traffic **trfvp,
+	       uint32_t *np)
+{
+	struct frame_hdr fh;
+	uint64_t off;
+	uint32_t n;
+	int err;
+
+	if (!sp || !trfvp || !np)
+		return EINVAL;
+
+	off = sp->rdoff;
+	n   = 0;
+
+	while (n < sp->bufsz && off < sp->wroff) {
+
+		err = pread_all(sp->fd, &fh, sizeof(fh), off);
+		if (err)
+			return err;
+
+		if (fh.len == sizeof(sp->bufv[n])) {
+			err = pread_all(sp->fd, &sp->bufv[n], fh.len,
+					off + sizeof(fh));
+			if (err)
+				return err;
+		}
+
+		off += frame_size;
+
+		if (fh.len == sizeof(sp->bufv[n]) &&
+		    fh.crc == crc32_calc(&sp->bufv[n], fh.len)) {
+			++n;
+			continue;
+		}
+
+		/* skip damaged records at the head of the spool */
+		restund_warning("spool: skipping damaged record\n");
+
+		if (n)
+			break;
+
+		sp->rdoff = off;
+	}
+
+	*trfvp = sp->bufv;
+	*np    = n;
+
+	return 0;
+}
+
+
+/**
+ * Mark the oldest records of the spool as replayed
+ *
+ * @param sp Traffic record spool
+ * @param n  Number of records
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int spool_consume(struct spool *sp, uint32_t n)
+{
+	int err;
+
+	if (!sp)
+		return EINVAL;
+
+	if (!n)
+		return 0;
+
+	sp->rdoff = MIN(sp->rdoff + n * frame_size, sp->wroff);
+
+	if (sp->rdoff == sp->wroff)
+		return reset(sp);
+
+	if (sp->rdoff - sizeof(struct spool_hdr) > sp->wroff - sp->rdoff) {
+
+		err = compact(sp);
+		if (!err)
+			return 0;
+
+		restund_warning("spool: compact: %m\n", err);
+	}
+
+	return hdr_write(sp);
+}
+
+
+uint64_t spool_count(const struct spool *sp)
+{
+	return sp ? (sp->wroff - sp->rdoff) / frame_size : 0;
+}
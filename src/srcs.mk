@@ -5,12 +5,23 @@
 #
 
 SRCS	+= cmd.c
+SRCS	+= credsnap.c
+SRCS	+= ctr.c
 SRCS	+= db.c
+SRCS	+= hist.c
+SRCS	+= ktls.c
 SRCS	+= log.c
 SRCS	+= main.c
+SRCS	+= metrics.c
+SRCS	+= prof.c
+SRCS	+= spool.c
+SRCS	+= statshm.c
 SRCS	+= stun.c
 SRCS	+= udp.c
 SRCS	+= tcp.c
+SRCS	+= tlspool.c
+SRCS	+= tlsres.c
+SRCS	+= transp.c
 SRCS	+= dtls.c
 
 ifneq ($(STATIC),)
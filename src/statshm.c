@@ -0,0 +1,226 @@
+/**
+ * @file statshm.c Shared Memory Statistics
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+#include "statshm.h"
+
+
+/*
+ * All registered metrics are copied into a memory mapped file at a
+ * fixed interval. Collectors map the file and read it without any
+ * request to the server; see statshm.h for the layout and the
+ * reader protocol, and util/restund-stats.c for a reader.
+ *
+ * The file is created anew on startup and removed on shutdown, so a
+ * reader which still maps an old file never sees it truncated.
+ */
+
+
+enum {
+	STATSHM_INTERVAL = 1000,  /* [ms] */
+};
+
+
+static struct {
+	struct tmr tmr;
+	struct statshm_hdr *hdr;
+	struct statshm_ent *entv;
+	size_t size;
+	uint32_t interval;
+	uint32_t entc;
+	bool full;
+	char path[256];
+} shm;
+
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+
+static void ent_handler(const struct restund_metric *m, uint64_t val,
+			void *arg)
+{
+	const bool counter = (m->type == RESTUND_METRIC_COUNTER);
+	char name[STATSHM_NAME_LEN];
+	struct statshm_ent *ent;
+	(void)arg;
+
+	if (shm.entc >= STATSHM_ENT_MAX) {
+		shm.full = true;
+		return;
+	}
+
+	ent = &shm.entv[shm.entc++];
+
+	if (m->labels)
+		(void)re_snprintf(name, sizeof(name), "%s%s{%s}", m->name,
+				  counter ? "_total" : "", m->labels);
+	else
+		(void)re_snprintf(name, sizeof(name), "%s%s", m->name,
+				  counter ? "_total" : "");
+
+	/* names only change when metrics are (un)registered */
+	if (strncmp(ent->name, name, sizeof(ent->name)))
+		str_ncpy(ent->name, name, sizeof(ent->name));
+
+	ent->type = counter ? STATSHM_COUNTER : STATSHM_GAUGE;
+	atomic_store_explicit(&ent->value, val, memory_order_relaxed);
+}
+
+
+static void update(void)
+{
+	struct statshm_hdr *hdr = shm.hdr;
+	const uint64_t seq = atomic_load_explicit(&hdr->seq,
+						  memory_order_relaxed);
+	const bool full = shm.full;
+
+	atomic_store_explicit(&hdr->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	shm.entc = 0;
+	shm.full = false;
+	restund_metrics_apply(ent_handler, NULL);
+
+	atomic_store_explicit(&hdr->entc, shm.entc, memory_order_relaxed);
+	atomic_store_explicit(&hdr->updated, now_ms(), memory_order_relaxed);
+
+	atomic_store_explicit(&hdr->seq, seq + 2, memory_order_release);
+
+	if (shm.full && !full)
+		restund_warning("statshm: more than %u metrics\n",
+				STATSHM_ENT_MAX);
+}
+
+
+static void timeout(void *arg)
+{
+	(void)arg;
+
+	tmr_start(&shm.tmr, shm.interval, timeout, NULL);
+
+	update();
+}
+
+
+static void status_handler(struct mbuf *mb)
+{
+	(void)mbuf_printf(mb, "file %s, %u metrics, every %u ms, seq %llu\n",
+			  shm.path, shm.entc, shm.interval,
+			  atomic_load_explicit(&shm.hdr->seq,
+					       memory_order_relaxed));
+}
+
+
+static struct restund_cmdsub cmd_statshm = {
+	.cmdh = status_handler,
+	.cmd  = "statshm",
+};
+
+
+int restund_statshm_init(void)
+{
+	struct statshm_hdr *hdr;
+	struct pl path;
+	void *p;
+	int fd, err;
+
+	if (conf_get(restund_conf(), "stats_shm", &path))
+		return 0;
+
+	shm.interval = STATSHM_INTERVAL;
+	conf_get_u32(restund_conf(), "stats_shm_interval", &shm.interval);
+	shm.interval = MAX(shm.interval, 10);
+
+	(void)pl_strcpy(&path, shm.path, sizeof(shm.path));
+
+	shm.size = sizeof(*hdr) + STATSHM_ENT_MAX * sizeof(*shm.entv);
+
+	(void)unlink(shm.path);
+
+	fd = open(shm.path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		err = errno;
+		restund_error("statshm: %s: %m\n", shm.path, err);
+		return err;
+	}
+
+	if (ftruncate(fd, (off_t)shm.size)) {
+		err = errno;
+		restund_error("statshm: %s: ftruncate: %m\n", shm.path, err);
+		(void)close(fd);
+		(void)unlink(shm.path);
+		return err;
+	}
+
+	p = mmap(NULL, shm.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	err = (p == MAP_FAILED) ? errno : 0;
+	(void)close(fd);
+
+	if (err) {
+		restund_error("statshm: %s: mmap: %m\n", shm.path, err);
+		(void)unlink(shm.path);
+		return err;
+	}
+
+	hdr = p;
+
+	hdr->version  = STATSHM_VERSION;
+	hdr->hdrsize  = sizeof(*hdr);
+	hdr->entsize  = sizeof(*shm.entv);
+	hdr->entmax   = STATSHM_ENT_MAX;
+	hdr->interval = shm.interval;
+	hdr->pid      = (uint64_t)getpid();
+	hdr->started  = (uint64_t)time(NULL);
+
+	shm.hdr  = hdr;
+	shm.entv = (struct statshm_ent *)(hdr + 1);
+
+	update();
+
+	/* readers check the magic first */
+	atomic_thread_fence(memory_order_release);
+	hdr->magic = STATSHM_MAGIC;
+
+	tmr_start(&shm.tmr, shm.interval, timeout, NULL);
+	restund_cmd_subscribe(&cmd_statshm);
+
+	restund_debug("statshm: %s (%zu bytes, every %u ms)\n",
+		      shm.path, shm.size, shm.interval);
+
+	return 0;
+}
+
+
+void restund_statshm_close(void)
+{
+	if (!shm.hdr)
+		return;
+
+	restund_cmd_unsubscribe(&cmd_statshm);
+	tmr_cancel(&shm.tmr);
+
+	(void)unlink(shm.path);
+	(void)munmap(shm.hdr, shm.size);
+
+	shm.hdr  = NULL;
+	shm.entv = NULL;
+}
@@ -0,0 +1,51 @@
+/**
+ * @file statshm.h Shared memory statistics segment layout
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+/*
+ * The segment is a header followed by entmax entries, of which the
+ * first entc are in use. The server is the only writer. It makes seq
+ * odd before it updates the entries and even again afterwards, so a
+ * reader copies the entries and retries if seq was odd or changed.
+ *
+ * Readers must check magic and version, and should compare pid and
+ * started to notice that the server was restarted.
+ */
+
+#define STATSHM_MAGIC 0x52535453  /* "RSTS" */
+
+enum {
+	STATSHM_VERSION  = 1,
+	STATSHM_NAME_LEN = 112,
+	STATSHM_ENT_MAX  = 1024,
+};
+
+enum statshm_type {
+	STATSHM_COUNTER = 0,
+	STATSHM_GAUGE,
+};
+
+struct statshm_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t hdrsize;
+	uint32_t entsize;
+	uint32_t entmax;
+	uint32_t interval;           /* update interval [ms] */
+	uint64_t pid;
+	uint64_t started;            /* server start [s since epoch] */
+	_Atomic uint64_t seq;
+	_Atomic uint64_t updated;    /* last update [ms since epoch] */
+	_Atomic uint32_t entc;
+	uint32_t pad;
+};
+
+/* sample name in OpenMetrics style, e.g. restund_turn_bytes_total{...} */
+struct statshm_ent {
+	char name[STATSHM_NAME_LEN];
+	uint32_t type;
+	uint32_t pad;
+	_Atomic uint64_t value;
+};
@@ -14,9 +14,29 @@ const char *restund_software = "zt v" VERSION " (" ARCH "/" OS ")";
 
 static struct {
 	struct list stunl;
+	struct restund_hist req_bind;
+	struct restund_hist req_alloc;
+	struct restund_hist req_refresh;
+	struct restund_hist req_createperm;
+	struct restund_hist req_chanbind;
+	struct restund_hist req_other;
 } stn;
 
 
+static struct restund_hist *req_hist(uint16_t method)
+{
+	switch (method) {
+
+	case STUN_METHOD_BINDING:    return &stn.req_bind;
+	case STUN_METHOD_ALLOCATE:   return &stn.req_alloc;
+	case STUN_METHOD_REFRESH:    return &stn.req_refresh;
+	case STUN_METHOD_CREATEPERM: return &stn.req_createperm;
+	case STUN_METHOD_CHANBIND:   return &stn.req_chanbind;
+	default:                     return &stn.req_other;
+	}
+}
+
+
 void restund_process_msg(int proto, void *sock,
 			 const struct sa *src, const struct sa *dst,
 			 struct mbuf *mb)
@@ -24,19 +44,35 @@ void restund_process_msg(int proto, void *sock,
 	struct le *le = stn.stunl.head;
 	struct restund_msgctx ctx;
 	struct stun_msg *msg;
+	const char *what;
+	uint64_t start, t;
+	bool prof;
 	int err;
 
 	if (!sock || !src || !dst || !mb)
 		return;
 
+	start = restund_hist_clock();
+	prof  = restund_prof_sample();
+
 	err = stun_msg_decode(&msg, mb, &ctx.ua);
 	if (err) {
 		while (le) {
 			struct restund_stun *st = le->data;
+			bool done;
 
 			le = le->next;
 
-			if (st->rawh && st->rawh(proto, src, dst, mb))
+			if (!st->rawh)
+				continue;
+
+			t = prof ? restund_hist_clock() : 0;
+			done = st->rawh(proto, src, dst, mb);
+			if (prof)
+				restund_prof_add(st->name, NULL,
+						 RESTUND_PROF_RAW,
+						 restund_hist_clock() - t);
+			if (done)
 				break;
 		}
 
@@ -46,6 +82,7 @@ void restund_process_msg(int proto, void *sock,
 	ctx.key = NULL;
 	ctx.keylen = 0;
 	ctx.fp = false;
+	what = prof ? stun_method_name(stun_msg_method(msg)) : NULL;
 
 #if 0
 	stun_msg_dump(msg);
@@ -56,23 +93,44 @@ void restund_process_msg(int proto, void *sock,
 	case STUN_CLASS_REQUEST:
 		while (le) {
 			struct restund_stun *st = le->data;
+			bool done;
 
 			le = le->next;
 
-			if (st->reqh &&
-			    st->reqh(&ctx, proto, sock, src, dst, msg))
+			if (!st->reqh)
+				continue;
+
+			t = prof ? restund_hist_clock() : 0;
+			done = st->reqh(&ctx, proto, sock, src, dst, msg);
+			if (prof)
+				restund_prof_add(st->name, what,
+						 RESTUND_PROF_REQ,
+						 restund_hist_clock() - t);
+			if (done)
 				break;
 		}
+
+		restund_hist_add(req_hist(stun_msg_method(msg)),
+				 restund_hist_clock() - start);
 		break;
 
 	case STUN_CLASS_INDICATION:
 		while (le) {
 			struct restund_stun *st = le->data;
+			bool done;
 
 			le = le->next;
 
-			if (st->indh &&
-			    st->indh(&ctx, proto, sock, src, dst, msg))
+			if (!st->indh)
+				continue;
+
+			t = prof ? restund_hist_clock() : 0;
+			done = st->indh(&ctx, proto, sock, src, dst, msg);
+			if (prof)
+				restund_prof_add(st->name, what,
+						 RESTUND_PROF_IND,
+						 restund_hist_clock() - t);
+			if (done)
 				break;
 		}
 		break;
@@ -88,6 +146,30 @@ void restund_process_msg(int proto, void *sock,
 }
 
 
+int restund_stun_init(void)
+{
+	restund_hist_register(&stn.req_bind,       "req_binding");
+	restund_hist_register(&stn.req_alloc,      "req_allocate");
+	restund_hist_register(&stn.req_refresh,    "req_refresh");
+	restund_hist_register(&stn.req_createperm, "req_createperm");
+	restund_hist_register(&stn.req_chanbind,   "req_chanbind");
+	restund_hist_register(&stn.req_other,      "req_other");
+
+	return 0;
+}
+
+
+void restund_stun_close(void)
+{
+	restund_hist_unregister(&stn.req_other);
+	restund_hist_unregister(&stn.req_chanbind);
+	restund_hist_unregister(&stn.req_createperm);
+	restund_hist_unregister(&stn.req_refresh);
+	restund_hist_unregister(&stn.req_alloc);
+	restund_hist_unregister(&stn.req_bind);
+}
+
+
 void restund_stun_register_handler(struct restund_stun *stun)
 {
 	if (!stun)
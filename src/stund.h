@@ -16,11 +16,104 @@ void restund_tcp_close(void);
 int  restund_dtls_init(void);
 void restund_dtls_close(void);
 
+/* tlsres */
+int  restund_tlsres_init(void);
+void restund_tlsres_close(void);
+int  restund_tlsres_enable(struct tls *tls);
+int  restund_tlsres_print(struct mbuf *mb, bool dtls);
+
+/* tlspool */
+struct tlspool_conn;
+int  restund_tlspool_init(void);
+void restund_tlspool_close(void);
+bool restund_tlspool_enabled(void);
+int  restund_tlspool_accept(struct tlspool_conn **tpcp, struct tls *tls,
+			    struct tcp_conn *tc, tcp_recv_h *recvh,
+			    tcp_close_h *closeh, void *arg);
+void restund_tlspool_print(struct mbuf *mb);
+const char *restund_tlspool_state(const struct tlspool_conn *tpc);
+
+/* ktls */
+struct ssl_st;
+int  restund_ktls_init(void);
+void restund_ktls_close(void);
+bool restund_ktls_enabled(void);
+int  restund_ktls_setup(struct ssl_st *ssl);
+int  restund_ktls_start(struct ssl_st *ssl, int fd, uint64_t txseq,
+			uint64_t rxseq, bool rx, bool *rxp);
+void restund_ktls_print(struct mbuf *mb);
+
 /* stun */
+int  restund_stun_init(void);
+void restund_stun_close(void);
 void restund_process_msg(int proto, void *sock,
 			 const struct sa *src, const struct sa *dst,
 			 struct mbuf *mb);
 
+/* counters */
+int  restund_ctr_init(void);
+void restund_ctr_close(void);
+
+/* metrics */
+typedef void (restund_metric_apply_h)(const struct restund_metric *m,
+				      uint64_t val, void *arg);
+
+void restund_metrics_apply(restund_metric_apply_h *h, void *arg);
+
+/* shared memory statistics */
+int  restund_statshm_init(void);
+void restund_statshm_close(void);
+
+/* profiling */
+enum restund_prof_kind {
+	RESTUND_PROF_REQ = 0,
+	RESTUND_PROF_IND,
+	RESTUND_PROF_RAW,
+	RESTUND_PROF_CMD,
+};
+
+int  restund_prof_init(void);
+void restund_prof_close(void);
+bool restund_prof_enabled(void);
+bool restund_prof_sample(void);
+void restund_prof_add(const char *mod, const char *what,
+		      enum restund_prof_kind kind, uint64_t ns);
+
+/* histogram */
+int  restund_hist_init(void);
+void restund_hist_close(void);
+
+/* log */
+int  restund_log_init(void);
+void restund_log_close(void);
+
 /* database */
 int  restund_db_init(void);
 void restund_db_close(void);
+
+/* credential snapshot */
+struct credsnap;
+struct credsnap_enc;
+
+int  credsnap_load(struct credsnap **csp, const char *path,
+		   const char *realm);
+int  credsnap_lookup(const struct credsnap *cs, const char *username,
+		     uint8_t *ha1);
+uint32_t credsnap_count(const struct credsnap *cs);
+int  credsnap_enc_alloc(struct credsnap_enc **encp, uint32_t hint);
+int  credsnap_enc_add(struct credsnap_enc *enc, const char *username,
+		      const uint8_t *ha1);
+int  credsnap_enc_save(struct credsnap_enc *enc, const char *path,
+		       const char *realm);
+
+/* traffic record spool */
+struct spool;
+
+int  spool_open(struct spool **spp, const char *path, uint64_t maxsz,
+		uint32_t batch);
+int  spool_append(struct spool *sp, const struct restund_traffic *trfv,
+		  uint32_t n);
+int  spool_peek(struct spool *sp, const struct restund_traffic **trfvp,
+		uint32_t *np);
+int  spool_consume(struct spool *sp, uint32_t n);
+uint64_t spool_count(const struct spool *sp);
@@ -4,6 +4,7 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
+#include <string.h>
 #include <time.h>
 #include <re.h>
 #include <restund.h>
@@ -13,10 +14,20 @@
 enum {
 	TCP_IDLE_TIMEOUT   = 600 * 1000,
 	TCP_MAX_LENGTH = 2048,
+	TCP_RXBUF_SIZE = 4096,
 	TCP_MAX_TXQSZ  = 16384,
 };
 
 
+/*
+ * Frames are parsed in place from the received segment. Only the
+ * partial frame at the end of a segment is kept, in a fixed-size ring
+ * per connection, and a frame that wraps around the end of the ring is
+ * gathered into a scratch buffer shared by all connections. The ring
+ * holds at least one frame of the maximum length.
+ */
+
+
 struct tcp_lstnr {
 	struct le le;
 	struct sa bnd_addr;
@@ -31,7 +42,11 @@ struct conn {
 	struct sa paddr;
 	struct tcp_conn *tc;
 	struct tls_conn *tlsc;
-	struct mbuf *mb;
+	struct tlspool_conn *tpc;
+	struct mbuf *rb;        /* receive ring, allocated on demand */
+	size_t rhead;
+	size_t rlen;
+	size_t pad;             /* padding still to be skipped */
 	time_t created;
 	uint64_t prev_rxc;
 	uint64_t rxc;
@@ -40,6 +55,9 @@ struct conn {
 
 static struct list lstnrl;
 static struct list tcl;
+static struct mbuf *scratch;
+static uint32_t max_length;
+static uint32_t rxbuf_size;
 
 
 static void conn_destructor(void *arg)
@@ -50,8 +68,9 @@ static void conn_destructor(void *arg)
 	tmr_cancel(&conn->tmr);
 	tcp_set_handlers(conn->tc, NULL, NULL, NULL, NULL);
 	mem_deref(conn->tlsc);
+	mem_deref(conn->tpc);
 	mem_deref(conn->tc);
-	mem_deref(conn->mb);
+	mem_deref(conn->rb);
 }
 
 
@@ -72,88 +91,199 @@ static void tmr_handler(void *arg)
 }
 
 
-static void tcp_recv(struct mbuf *mb, void *arg)
+/* frame length from the first 4 bytes, without padding */
+static int frame_len(const uint8_t *hdr, size_t *lenp)
 {
-	struct conn *conn = arg;
-	int err = 0;
+	const uint16_t typ = hdr[0] << 8 | hdr[1];
+	size_t len = hdr[2] << 8 | hdr[3];
+
+	if (len > max_length) {
+		restund_debug("tcp: bad length: %zu\n", len);
+		return EBADMSG;
+	}
 
-	if (conn->mb) {
-		size_t pos;
+	if (typ < 0x4000)
+		len += STUN_HEADER_SIZE;
+	else if (typ < 0x8000)
+		len += 4;
+	else {
+		restund_debug("tcp: bad type: 0x%04x\n", typ);
+		return EBADMSG;
+	}
 
-		pos = conn->mb->pos;
+	*lenp = len;
 
-		conn->mb->pos = conn->mb->end;
+	return 0;
+}
+
+
+static void frame_process(struct conn *conn, struct mbuf *mb, size_t len)
+{
+	const size_t pos = mb->pos;
+	const size_t end = mb->end;
+
+	mb->end = pos + len;
+
+	restund_process_msg(IPPROTO_TCP, conn->tc, &conn->paddr,
+			    &conn->laddr, mb);
+
+	++conn->rxc;
+
+	mb->pos = pos + len;
+	mb->end = end;
+
+	/* 4 byte alignment */
+	conn->pad = (4 - (len & 0x03)) & 0x03;
+}
+
+
+static void skip_pad(struct conn *conn, struct mbuf *mb)
+{
+	const size_t n = MIN(conn->pad, mbuf_get_left(mb));
+
+	mb->pos += n;
+	conn->pad -= n;
+}
 
-		err = mbuf_write_mem(conn->mb, mbuf_buf(mb),mbuf_get_left(mb));
-		if (err) {
-			restund_warning("tcp: buffer write error: %m\n", err);
-			goto out;
-		}
 
-		conn->mb->pos = pos;
+/* whole frames straight from the segment */
+static int frames_linear(struct conn *conn, struct mbuf *mb)
+{
+	for (;;) {
+		size_t len;
+		int err;
+
+		skip_pad(conn, mb);
+
+		if (mbuf_get_left(mb) < 4)
+			return 0;
+
+		err = frame_len(mbuf_buf(mb), &len);
+		if (err)
+			return err;
+
+		if (mbuf_get_left(mb) < len)
+			return 0;
+
+		frame_process(conn, mb, len);
 	}
-	else {
-		conn->mb = mem_ref(mb);
+}
+
+
+static size_t ring_write(struct conn *conn, struct mbuf *mb)
+{
+	size_t cap, tail, n, n1;
+
+	if (!conn->rb) {
+		conn->rb = mbuf_alloc(rxbuf_size);
+		if (!conn->rb)
+			return 0;
 	}
 
-	for (;;) {
+	cap  = conn->rb->size;
+	tail = (conn->rhead + conn->rlen) % cap;
+	n    = MIN(cap - conn->rlen, mbuf_get_left(mb));
+	n1   = MIN(n, cap - tail);
 
-		size_t len, pos, end;
-		uint16_t typ;
+	memcpy(conn->rb->buf + tail, mbuf_buf(mb), n1);
+	memcpy(conn->rb->buf, mbuf_buf(mb) + n1, n - n1);
 
-		if (mbuf_get_left(conn->mb) < 4)
-			break;
+	mb->pos += n;
+	conn->rlen += n;
 
-		typ = ntohs(mbuf_read_u16(conn->mb));
-		len = ntohs(mbuf_read_u16(conn->mb));
+	return n;
+}
 
-		if (len > TCP_MAX_LENGTH) {
-			restund_debug("tcp: bad length: %zu\n", len);
-			err = EBADMSG;
-			goto out;
-		}
 
-		if (typ < 0x4000)
-			len += STUN_HEADER_SIZE;
-		else if (typ < 0x8000)
-			len += 4;
-		else {
-			restund_debug("tcp: bad type: 0x%04x\n", typ);
-			err = EBADMSG;
-			goto out;
-		}
+static void ring_read(const struct conn *conn, uint8_t *p, size_t n)
+{
+	const size_t cap = conn->rb->size;
+	const size_t n1 = MIN(n, cap - conn->rhead);
 
-		conn->mb->pos -= 4;
+	memcpy(p, conn->rb->buf + conn->rhead, n1);
+	memcpy(p + n1, conn->rb->buf, n - n1);
+}
 
-		if (mbuf_get_left(conn->mb) < len)
-			break;
 
-		pos = conn->mb->pos;
-		end = conn->mb->end;
+static void ring_skip(struct conn *conn, size_t n)
+{
+	conn->rhead = (conn->rhead + n) % conn->rb->size;
+	conn->rlen -= n;
 
-		conn->mb->end = pos + len;
+	if (!conn->rlen)
+		conn->rhead = 0;
+}
 
-		restund_process_msg(IPPROTO_TCP, conn->tc, &conn->paddr,
-				    &conn->laddr, conn->mb);
 
-		++conn->rxc;
+/* whole frames from the ring */
+static int frames_ring(struct conn *conn)
+{
+	for (;;) {
+		uint8_t hdr[4];
+		size_t len, n;
+		int err;
+
+		n = MIN(conn->pad, conn->rlen);
+		ring_skip(conn, n);
+		conn->pad -= n;
+
+		if (conn->rlen < 4)
+			return 0;
+
+		ring_read(conn, hdr, sizeof(hdr));
+
+		err = frame_len(hdr, &len);
+		if (err)
+			return err;
 
-		/* 4 byte alignment */
-		while (len & 0x03)
-			++len;
+		if (conn->rlen < len)
+			return 0;
+
+		if (conn->rhead + len <= conn->rb->size) {
+			conn->rb->pos = conn->rhead;
+			frame_process(conn, conn->rb, len);
+		}
+		else {
+			/* the frame wraps, gather it */
+			ring_read(conn, scratch->buf, len);
+			scratch->pos = 0;
+			scratch->end = len;
+			frame_process(conn, scratch, len);
+		}
+
+		ring_skip(conn, len);
+	}
+}
 
-		conn->mb->pos = pos + len;
-		conn->mb->end = end;
 
-		if (conn->mb->pos >= conn->mb->end) {
-			conn->mb = mem_deref(conn->mb);
+static void tcp_recv(struct mbuf *mb, void *arg)
+{
+	struct conn *conn = arg;
+	int err = 0;
+
+	while (mbuf_get_left(mb)) {
+
+		if (!conn->rlen) {
+			err = frames_linear(conn, mb);
+			if (err || !mbuf_get_left(mb))
+				break;
+		}
+
+		if (!ring_write(conn, mb)) {
+			err = ENOMEM;
 			break;
 		}
+
+		err = frames_ring(conn);
+		if (err)
+			break;
 	}
 
- out:
 	if (err) {
-		conn->mb = mem_deref(conn->mb);
+		restund_debug("tcp: framing error: %m\n", err);
+		conn->rhead = 0;
+		conn->rlen  = 0;
+		conn->pad   = 0;
 	}
 }
 
@@ -170,7 +300,7 @@ static void tcp_close(int err, void *arg)
 
 static void tcp_conn_handler(const struct sa *peer, void *arg)
 {
-	const time_t now = time(NULL);
+	const time_t now = restund_time();
 	struct tcp_lstnr *tl = arg;
 	struct conn *conn;
 	int err;
@@ -198,7 +328,13 @@ static void tcp_conn_handler(const struct sa *peer, void *arg)
 		goto out;
 
 #ifdef USE_TLS
-	if (tl->tls) {
+	if (tl->tls && restund_tlspool_enabled()) {
+		err = restund_tlspool_accept(&conn->tpc, tl->tls, conn->tc,
+					     tcp_recv, tcp_close, conn);
+		if (err)
+			goto out;
+	}
+	else if (tl->tls) {
 		err = tls_start_tcp(&conn->tlsc, tl->tls, conn->tc, 0);
 		if (err)
 			goto out;
@@ -218,16 +354,18 @@ static void tcp_conn_handler(const struct sa *peer, void *arg)
 
 static void status_handler(struct mbuf *mb)
 {
-	const time_t now = time(NULL);
+	const time_t now = restund_time();
 	struct le *le;
 
 	for (le=tcl.head; le; le=le->next) {
 
 		const struct conn *conn = le->data;
 
-		(void)mbuf_printf(mb, "%J - %J %llis\n",
+		(void)mbuf_printf(mb, "%J - %J %llis %s\n",
 				  &conn->laddr, &conn->paddr,
-				  now - conn->created);
+				  now - conn->created,
+				  conn->tlsc ? "tls" :
+				  restund_tlspool_state(conn->tpc));
 	}
 }
 
@@ -276,6 +414,12 @@ static int listen_handler(const struct pl *val, void *arg)
 			restund_warning("tls error: %m\n", err);
 			goto out;
 		}
+
+		err = restund_tlsres_enable(tl->tls);
+		if (err) {
+			restund_warning("tls session resumption: %m\n", err);
+			goto out;
+		}
 #else
 		restund_warning("tls not supported\n");
 		err = EPROTONOSUPPORT;
@@ -317,23 +461,42 @@ static struct restund_cmdsub cmd_tcp = {
 };
 
 
-static void stats_handler(struct mbuf *mb)
+static uint64_t conn_count(bool tls)
 {
-	uint64_t n_tcp = 0, n_tls = 0;
+	uint64_t n = 0;
 	struct le *le;
 
 	for (le = tcl.head; le; le = le->next) {
 
 		struct conn *conn = le->data;
 
-		if (conn->tlsc)
-			++n_tls;
-		else
-			++n_tcp;
+		if (tls == (conn->tlsc || conn->tpc))
+			++n;
 	}
 
-	(void)mbuf_printf(mb, "tcp_connections %llu\n", n_tcp);
-	(void)mbuf_printf(mb, "tls_connections %llu\n", n_tls);
+	return n;
+}
+
+
+static uint64_t tcp_count(void)
+{
+	return conn_count(false);
+}
+
+
+static uint64_t tls_count(void)
+{
+	return conn_count(true);
+}
+
+
+static void stats_handler(struct mbuf *mb)
+{
+	(void)mbuf_printf(mb, "tcp_connections %llu\n", tcp_count());
+	(void)mbuf_printf(mb, "tls_connections %llu\n", tls_count());
+	(void)restund_tlsres_print(mb, false);
+	restund_tlspool_print(mb);
+	restund_ktls_print(mb);
 }
 
 
@@ -343,6 +506,16 @@ static struct restund_cmdsub cmd_tcpstats = {
 };
 
 
+static struct restund_metric metricv[] = {
+	{ .name = "restund_tcp_connections", .labels = "transport=\"tcp\"",
+	  .help = "Open client connections",
+	  .type = RESTUND_METRIC_GAUGE, .valh = tcp_count },
+	{ .name = "restund_tcp_connections", .labels = "transport=\"tls\"",
+	  .help = "Open client connections",
+	  .type = RESTUND_METRIC_GAUGE, .valh = tls_count },
+};
+
+
 int restund_tcp_init(void)
 {
 	bool tls;
@@ -351,8 +524,23 @@ int restund_tcp_init(void)
 	list_init(&lstnrl);
 	list_init(&tcl);
 
+	max_length = TCP_MAX_LENGTH;
+	rxbuf_size = TCP_RXBUF_SIZE;
+
+	(void)conf_get_u32(restund_conf(), "tcp_max_frame", &max_length);
+	(void)conf_get_u32(restund_conf(), "tcp_rxbuf_size", &rxbuf_size);
+
+	/* one frame of the maximum length with its padding must fit */
+	max_length = MIN(max_length, 0xffff);
+	rxbuf_size = MAX(rxbuf_size, max_length + STUN_HEADER_SIZE + 4);
+
+	scratch = mbuf_alloc(max_length + STUN_HEADER_SIZE);
+	if (!scratch)
+		return ENOMEM;
+
 	restund_cmd_subscribe(&cmd_tcp);
 	restund_cmd_subscribe(&cmd_tcpstats);
+	restund_metric_register(metricv, RE_ARRAY_SIZE(metricv));
 
 	/* tcp config */
 	tls = false;
@@ -379,8 +567,10 @@ void restund_tcp_close(void)
 {
 	restund_cmd_unsubscribe(&cmd_tcp);
 	restund_cmd_unsubscribe(&cmd_tcpstats);
+	restund_metric_unregister(metricv, RE_ARRAY_SIZE(metricv));
 	list_flush(&lstnrl);
 	list_flush(&tcl);
+	scratch = mem_deref(scratch);
 }
 
 
@@ -0,0 +1,812 @@
+/**
+ * @file tlspool.c TLS Handshake Worker Pool
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+
+#ifdef USE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+
+/*
+ * With tls_handshake_workers set, a tls_listen connection runs its own
+ * TLS layer as a TCP helper, with the SSL object between two memory
+ * BIOs. Every handshake flight is queued to a worker thread, which runs
+ * SSL_do_handshake() and hands the SSL back through a mqueue. Input
+ * arriving meanwhile is held back until the SSL is back on the main
+ * loop. Once established, records are encrypted and decrypted on the
+ * main loop, which only costs symmetric crypto.
+ *
+ * The SSL belongs to whichever thread holds its job. A connection that
+ * is closed while its job is out leaves the SSL to the job.
+ *
+ * With tls_ktls the same layer is used without workers, handshaking on
+ * the main loop, so that the record keys can be handed to the kernel
+ * once the connection is established (see ktls.c). From then on the
+ * helper passes plain data through.
+ */
+
+
+enum {
+	QUEUE_MAX  = 1024,
+	RX_SIZE    = 4096,
+};
+
+enum {
+	TLSPOOL_JOBS = 0,
+	TLSPOOL_FAILED,
+	TLSPOOL_OVERFLOW,
+	TLSPOOL_ESTAB,
+	TLSPOOL_CTR_MAX
+};
+
+
+#ifdef USE_OPENSSL
+
+struct job {
+	struct le le;
+	struct tlspool_conn *tpc;  /* NULL if the connection is gone */
+	SSL *ssl;
+	int ssl_err;
+	bool done;
+};
+
+struct tlspool_conn {
+	struct tcp_helper *th;
+	struct tcp_conn *tc;
+	SSL *ssl;
+	BIO *rbio;
+	BIO *wbio;
+	struct mbuf *pend;       /* input while the job is out */
+	struct job *job;
+	tcp_recv_h *recvh;
+	tcp_close_h *closeh;
+	void *arg;
+	bool up;
+	bool ktls;               /* try kernel TLS when established */
+	bool ktls_tx;
+	bool ktls_rx;
+};
+
+#endif
+
+
+static struct {
+	struct restund_ctr ctr;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t *threadv;
+	uint32_t workers;
+	uint32_t started;
+	uint32_t queue_max;
+	uint32_t pending;         /* connections in the handshake */
+	atomic_uint queued;
+	atomic_uint active;
+	struct list jobl;
+	struct list donel;
+	struct mqueue *mq;
+	bool quit;
+} pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond  = PTHREAD_COND_INITIALIZER,
+	.ctr = {
+		.name = "tlspool",
+		.n    = TLSPOOL_CTR_MAX,
+	},
+};
+
+
+#ifdef USE_OPENSSL
+
+
+static void *worker_thread(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&pool.mutex);
+
+	for (;;) {
+		struct job *job;
+		int r;
+
+		while (!pool.quit && list_isempty(&pool.jobl))
+			pthread_cond_wait(&pool.cond, &pool.mutex);
+
+		if (pool.quit)
+			break;
+
+		job = list_ledata(list_head(&pool.jobl));
+		list_unlink(&job->le);
+		atomic_fetch_sub(&pool.queued, 1);
+		atomic_fetch_add(&pool.active, 1);
+
+		pthread_mutex_unlock(&pool.mutex);
+
+		ERR_clear_error();
+		r = SSL_do_handshake(job->ssl);
+		job->ssl_err = r == 1 ? SSL_ERROR_NONE :
+			SSL_get_error(job->ssl, r);
+		job->done = SSL_is_init_finished(job->ssl);
+		ERR_clear_error();
+
+		pthread_mutex_lock(&pool.mutex);
+
+		atomic_fetch_sub(&pool.active, 1);
+		list_append(&pool.donel, &job->le, job);
+
+		/* the main loop drains donel on every message */
+		(void)mqueue_push(pool.mq, 0, NULL);
+	}
+
+	pthread_mutex_unlock(&pool.mutex);
+
+	return NULL;
+}
+
+
+static int submit(struct tlspool_conn *tpc)
+{
+	struct job *job;
+
+	if (atomic_load(&pool.queued) >= pool.queue_max) {
+		restund_ctr_add(&pool.ctr, TLSPOOL_OVERFLOW, 1);
+		return ENOBUFS;
+	}
+
+	job = mem_zalloc(sizeof(*job), NULL);
+	if (!job)
+		return ENOMEM;
+
+	job->tpc = tpc;
+	job->ssl = tpc->ssl;
+	tpc->job = job;
+
+	pthread_mutex_lock(&pool.mutex);
+	list_append(&pool.jobl, &job->le, job);
+	atomic_fetch_add(&pool.queued, 1);
+	pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.mutex);
+
+	restund_ctr_add(&pool.ctr, TLSPOOL_JOBS, 1);
+
+	return 0;
+}
+
+
+/* number of TLS records in a buffer, false if the last one is partial */
+static bool records(const uint8_t *p, size_t n, unsigned *recc)
+{
+	size_t pos = 0;
+
+	*recc = 0;
+
+	while (pos + 5 <= n) {
+		pos += 5 + (p[pos + 3] << 8 | p[pos + 4]);
+		++*recc;
+	}
+
+	return pos == n;
+}
+
+
+static int flush(struct tlspool_conn *tpc, unsigned *recc)
+{
+	const size_t n = BIO_ctrl_pending(tpc->wbio);
+	struct mbuf *mb;
+	int err;
+
+	if (recc)
+		*recc = 0;
+
+	if (!n)
+		return 0;
+
+	/* the kernel has the send keys, OpenSSL's are out of date */
+	if (tpc->ktls_tx)
+		return EPROTO;
+
+	mb = mbuf_alloc(n);
+	if (!mb)
+		return ENOMEM;
+
+	if (BIO_read(tpc->wbio, mbuf_buf(mb), (int)n) != (int)n) {
+		err = EPROTO;
+		goto out;
+	}
+
+	mbuf_set_end(mb, n);
+
+	if (recc)
+		(void)records(mb->buf, n, recc);
+
+	err = tcp_send_helper(tpc->tc, mb, tpc->th);
+
+ out:
+	mem_deref(mb);
+
+	return err;
+}
+
+
+/* the connection may be gone when this returns */
+static int read_app(struct tlspool_conn *tpc)
+{
+	struct mbuf *mb;
+	int err = 0;
+
+	mb = mbuf_alloc(RX_SIZE);
+	if (!mb)
+		return ENOMEM;
+
+	for (;;) {
+		int n;
+
+		if (mbuf_get_space(mb) < RX_SIZE) {
+			err = mbuf_resize(mb, mb->size + 2 * RX_SIZE);
+			if (err)
+				goto out;
+		}
+
+		ERR_clear_error();
+		n = SSL_read(tpc->ssl, mbuf_buf(mb), (int)mbuf_get_space(mb));
+		if (n <= 0) {
+			const int ssl_err = SSL_get_error(tpc->ssl, n);
+
+			ERR_clear_error();
+
+			if (ssl_err == SSL_ERROR_WANT_READ)
+				break;
+
+			err = ssl_err == SSL_ERROR_ZERO_RETURN ?
+				ECONNRESET : EPROTO;
+			goto out;
+		}
+
+		mb->pos += n;
+	}
+
+	/* post-handshake messages, e.g. KeyUpdate */
+	err = flush(tpc, NULL);
+	if (err)
+		goto out;
+
+	mbuf_set_end(mb, mb->pos);
+	mbuf_set_pos(mb, 0);
+
+	if (mbuf_get_left(mb))
+		tpc->recvh(mb, tpc->arg);
+
+ out:
+	mem_deref(mb);
+
+	return err;
+}
+
+
+/*
+ * The sequence numbers follow from the records of the last flight:
+ * with TLS 1.3 the server's last flight is its session tickets, under
+ * the application keys, while the Finished messages of TLS 1.2 are
+ * the first records under the new keys. Received records that OpenSSL
+ * has not read yet are decrypted in userspace and counted.
+ */
+static void ktls_start(struct tlspool_conn *tpc, unsigned txrecc)
+{
+	const bool tls13 = SSL_version(tpc->ssl) == TLS1_3_VERSION;
+	unsigned rxrecc;
+	uint8_t *p;
+	long n;
+	bool rx;
+
+	/* ciphertext queued in libre would be encrypted again */
+	if (tcp_conn_txqsz(tpc->tc))
+		return;
+
+	n  = BIO_get_mem_data(tpc->rbio, (char **)&p);
+	rx = records(p, n > 0 ? (size_t)n : 0, &rxrecc);
+
+	if (restund_ktls_start(tpc->ssl, tcp_conn_fd(tpc->tc),
+			       tls13 ? txrecc : 1,
+			       (tls13 ? 0 : 1) + rxrecc, rx, &tpc->ktls_rx))
+		return;
+
+	tpc->ktls_tx = true;
+}
+
+
+/* the connection may be gone when this returns */
+static int established(struct tlspool_conn *tpc, unsigned txrecc)
+{
+	tpc->up = true;
+	--pool.pending;
+	restund_ctr_add(&pool.ctr, TLSPOOL_ESTAB, 1);
+
+	if (tpc->ktls)
+		ktls_start(tpc, txrecc);
+
+	return read_app(tpc);
+}
+
+
+/* handshake on the main loop, without workers */
+static int handshake(struct tlspool_conn *tpc)
+{
+	unsigned recc;
+	int r, err;
+
+	ERR_clear_error();
+	r = SSL_do_handshake(tpc->ssl);
+	if (r != 1) {
+		const int ssl_err = SSL_get_error(tpc->ssl, r);
+
+		ERR_clear_error();
+
+		err = flush(tpc, NULL);
+		if (!err && ssl_err != SSL_ERROR_WANT_READ) {
+			restund_ctr_add(&pool.ctr, TLSPOOL_FAILED, 1);
+			err = EPROTO;
+		}
+
+		return err;
+	}
+
+	err = flush(tpc, &recc);
+	if (err)
+		return err;
+
+	return established(tpc, recc);
+}
+
+
+static void job_done(struct job *job)
+{
+	struct tlspool_conn *tpc = job->tpc;
+	unsigned recc;
+	int err;
+
+	if (!tpc) {
+		SSL_free(job->ssl);
+		mem_deref(job);
+		return;
+	}
+
+	tpc->job = NULL;
+
+	err = flush(tpc, &recc);
+	if (err)
+		goto out;
+
+	if (!job->done && job->ssl_err != SSL_ERROR_WANT_READ) {
+		restund_ctr_add(&pool.ctr, TLSPOOL_FAILED, 1);
+		err = EPROTO;
+		goto out;
+	}
+
+	if (tpc->pend) {
+		const size_t len = mbuf_get_left(tpc->pend);
+
+		if (BIO_write(tpc->rbio, mbuf_buf(tpc->pend), (int)len) <= 0) {
+			err = ENOMEM;
+			goto out;
+		}
+
+		tpc->pend = mem_deref(tpc->pend);
+
+		if (!job->done) {
+			err = submit(tpc);
+			goto out;
+		}
+	}
+
+	if (job->done)
+		err = established(tpc, recc);
+
+ out:
+	mem_deref(job);
+
+	if (err)
+		tpc->closeh(err, tpc->arg);
+}
+
+
+static void mqueue_handler(int id, void *data, void *arg)
+{
+	(void)id;
+	(void)data;
+	(void)arg;
+
+	for (;;) {
+		struct job *job;
+
+		pthread_mutex_lock(&pool.mutex);
+		job = list_ledata(list_head(&pool.donel));
+		if (job)
+			list_unlink(&job->le);
+		pthread_mutex_unlock(&pool.mutex);
+
+		if (!job)
+			break;
+
+		job_done(job);
+	}
+}
+
+
+static bool estab_handler(int *err, bool active, void *arg)
+{
+	(void)err;
+	(void)active;
+	(void)arg;
+
+	return true;
+}
+
+
+static bool send_handler(int *err, struct mbuf *mb, void *arg)
+{
+	struct tlspool_conn *tpc = arg;
+	int r;
+
+	if (!tpc->up) {
+		*err = ENOTCONN;
+		return true;
+	}
+
+	if (tpc->ktls_tx)
+		return false;
+
+	ERR_clear_error();
+	r = SSL_write(tpc->ssl, mbuf_buf(mb), (int)mbuf_get_left(mb));
+	if (r <= 0) {
+		ERR_clear_error();
+		*err = EPROTO;
+		return true;
+	}
+
+	*err = flush(tpc, NULL);
+
+	return true;
+}
+
+
+static bool recv_handler(int *err, struct mbuf *mb, bool *estab, void *arg)
+{
+	struct tlspool_conn *tpc = arg;
+	const size_t len = mbuf_get_left(mb);
+	(void)estab;
+
+	if (tpc->ktls_rx)
+		return false;
+
+	if (tpc->job) {
+		if (!tpc->pend) {
+			tpc->pend = mbuf_alloc(len);
+			if (!tpc->pend) {
+				*err = ENOMEM;
+				return true;
+			}
+		}
+
+		tpc->pend->pos = tpc->pend->end;
+		*err = mbuf_write_mem(tpc->pend, mbuf_buf(mb), len);
+		tpc->pend->pos = 0;
+		return true;
+	}
+
+	if (BIO_write(tpc->rbio, mbuf_buf(mb), (int)len) <= 0) {
+		*err = ENOMEM;
+		return true;
+	}
+
+	if (tpc->up)
+		*err = read_app(tpc);
+	else if (pool.started)
+		*err = submit(tpc);
+	else
+		*err = handshake(tpc);
+
+	return true;
+}
+
+
+static void conn_destructor(void *arg)
+{
+	struct tlspool_conn *tpc = arg;
+
+	if (!tpc->up)
+		--pool.pending;
+
+	/* a job which is out frees the SSL when it comes back */
+	if (tpc->job)
+		tpc->job->tpc = NULL;
+	else if (tpc->ssl)
+		SSL_free(tpc->ssl);
+	else {
+		BIO_free(tpc->rbio);
+		BIO_free(tpc->wbio);
+	}
+
+	mem_deref(tpc->pend);
+	mem_deref(tpc->th);
+	mem_deref(tpc->tc);
+}
+
+
+/**
+ * Accept a TLS connection with the handshake on the worker pool
+ *
+ * @param tpcp   Pointer to allocated connection
+ * @param tls    TLS context of the listener
+ * @param tc     Accepted TCP connection
+ * @param recvh  Receive handler for application data
+ * @param closeh Close handler, for errors after a handshake job
+ * @param arg    Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int restund_tlspool_accept(struct tlspool_conn **tpcp, struct tls *tls,
+			   struct tcp_conn *tc, tcp_recv_h *recvh,
+			   tcp_close_h *closeh, void *arg)
+{
+	struct tlspool_conn *tpc;
+	SSL_CTX *ctx;
+	int err;
+
+	if (!tpcp || !tls || !tc || !recvh || !closeh)
+		return EINVAL;
+
+	if (!restund_tlspool_enabled())
+		return ENOSYS;
+
+	ctx = tls_openssl_context(tls);
+	if (!ctx)
+		return EINVAL;
+
+	tpc = mem_zalloc(sizeof(*tpc), conn_destructor);
+	if (!tpc)
+		return ENOMEM;
+
+	++pool.pending;
+	tpc->tc     = mem_ref(tc);
+	tpc->recvh  = recvh;
+	tpc->closeh = closeh;
+	tpc->arg    = arg;
+
+	tpc->rbio = BIO_new(BIO_s_mem());
+	tpc->wbio = BIO_new(BIO_s_mem());
+	if (!tpc->rbio || !tpc->wbio) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	tpc->ssl = SSL_new(ctx);
+	if (!tpc->ssl) {
+		ERR_clear_error();
+		err = ENOMEM;
+		goto out;
+	}
+
+	/* the SSL owns the BIOs from here */
+	SSL_set_bio(tpc->ssl, tpc->rbio, tpc->wbio);
+	SSL_set_accept_state(tpc->ssl);
+
+	tpc->ktls = restund_ktls_setup(tpc->ssl) == 0;
+
+	err = tcp_register_helper(&tpc->th, tc, 0, estab_handler,
+				  send_handler, recv_handler, tpc);
+
+ out:
+	if (err)
+		mem_deref(tpc);
+	else
+		*tpcp = tpc;
+
+	return err;
+}
+
+
+#else
+
+
+int restund_tlspool_accept(struct tlspool_conn **tpcp, struct tls *tls,
+			   struct tcp_conn *tc, tcp_recv_h *recvh,
+			   tcp_close_h *closeh, void *arg)
+{
+	(void)tpcp;
+	(void)tls;
+	(void)tc;
+	(void)recvh;
+	(void)closeh;
+	(void)arg;
+
+	return ENOSYS;
+}
+
+
+#endif
+
+
+/* true if tls_listen connections use the TLS layer of the pool */
+bool restund_tlspool_enabled(void)
+{
+	return pool.started > 0 || restund_ktls_enabled();
+}
+
+
+#ifdef USE_OPENSSL
+const char *restund_tlspool_state(const struct tlspool_conn *tpc)
+{
+	if (!tpc)
+		return "tcp";
+	else if (!tpc->up)
+		return "handshake";
+	else if (tpc->ktls_rx)
+		return "ktls";
+	else if (tpc->ktls_tx)
+		return "ktls-tx";
+	else
+		return "tls";
+}
+#else
+const char *restund_tlspool_state(const struct tlspool_conn *tpc)
+{
+	(void)tpc;
+
+	return "tcp";
+}
+#endif
+
+
+static uint64_t queue_depth(void)
+{
+	return atomic_load(&pool.queued);
+}
+
+
+static uint64_t active_count(void)
+{
+	return atomic_load(&pool.active);
+}
+
+
+void restund_tlspool_print(struct mbuf *mb)
+{
+	if (!pool.started)
+		return;
+
+	(void)mbuf_printf(mb, "tls_handshake_workers %u\n", pool.started);
+	(void)mbuf_printf(mb, "tls_handshake_pending %u\n", pool.pending);
+	(void)mbuf_printf(mb, "tls_handshake_active %llu\n",
+			  active_count());
+	(void)mbuf_printf(mb, "tls_handshake_queue %llu\n", queue_depth());
+	(void)mbuf_printf(mb, "tls_handshake_overflow %llu\n",
+			  restund_ctr_total(&pool.ctr, TLSPOOL_OVERFLOW));
+}
+
+
+static struct restund_metric metricv[] = {
+	{ .name = "restund_tls_handshake_pending",
+	  .help = "TLS connections in the handshake",
+	  .type = RESTUND_METRIC_GAUGE, .u32 = &pool.pending },
+	{ .name = "restund_tls_handshake_active",
+	  .help = "Handshake flights running on a worker",
+	  .type = RESTUND_METRIC_GAUGE, .valh = active_count },
+	{ .name = "restund_tls_handshake_queue",
+	  .help = "Handshake flights waiting for a worker",
+	  .type = RESTUND_METRIC_GAUGE, .valh = queue_depth },
+	{ .name = "restund_tls_handshake_jobs",
+	  .help = "Handshake flights queued to the workers",
+	  .ctr = &pool.ctr, .ctri = TLSPOOL_JOBS },
+	{ .name = "restund_tls_handshake_failed",
+	  .help = "Handshakes failed on a worker",
+	  .ctr = &pool.ctr, .ctri = TLSPOOL_FAILED },
+	{ .name = "restund_tls_handshake_overflow",
+	  .help = "Connections closed on a full handshake queue",
+	  .ctr = &pool.ctr, .ctri = TLSPOOL_OVERFLOW },
+};
+
+
+int restund_tlspool_init(void)
+{
+	uint32_t i;
+	int err;
+
+	err = restund_ctr_register(&pool.ctr);
+	if (err)
+		return err;
+
+	list_init(&pool.jobl);
+	list_init(&pool.donel);
+	pool.quit = false;
+	pool.workers = 0;
+	pool.queue_max = QUEUE_MAX;
+
+	(void)conf_get_u32(restund_conf(), "tls_handshake_workers",
+			   &pool.workers);
+	(void)conf_get_u32(restund_conf(), "tls_handshake_queue",
+			   &pool.queue_max);
+
+	if (!pool.workers)
+		return 0;
+
+#ifndef USE_OPENSSL
+	(void)i;
+	restund_warning("tlspool: tls_handshake_workers needs OpenSSL\n");
+	return 0;
+#else
+	err = mqueue_alloc(&pool.mq, mqueue_handler, NULL);
+	if (err)
+		goto out;
+
+	pool.threadv = mem_zalloc(pool.workers * sizeof(*pool.threadv),
+				  NULL);
+	if (!pool.threadv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i=0; i<pool.workers; i++) {
+
+		err = pthread_create(&pool.threadv[i], NULL, worker_thread,
+				     NULL);
+		if (err)
+			goto out;
+
+		++pool.started;
+	}
+
+	restund_metric_register(metricv, RE_ARRAY_SIZE(metricv));
+
+	restund_info("tlspool: %u handshake workers\n", pool.started);
+
+ out:
+	if (err)
+		restund_tlspool_close();
+
+	return err;
+#endif
+}
+
+
+/* after restund_tcp_close(), so that only orphaned jobs are left */
+void restund_tlspool_close(void)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&pool.mutex);
+	pool.quit = true;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.mutex);
+
+	for (i=0; i<pool.started; i++)
+		(void)pthread_join(pool.threadv[i], NULL);
+
+#ifdef USE_OPENSSL
+	while (!list_isempty(&pool.jobl)) {
+		struct job *job = list_ledata(list_head(&pool.jobl));
+
+		list_unlink(&job->le);
+		job_done(job);
+	}
+
+	mqueue_handler(0, NULL, NULL);
+#endif
+
+	restund_metric_unregister(metricv, RE_ARRAY_SIZE(metricv));
+
+	pool.started = 0;
+	pool.threadv = mem_deref(pool.threadv);
+	pool.mq = mem_deref(pool.mq);
+	atomic_store(&pool.queued, 0);
+	restund_ctr_unregister(&pool.ctr);
+}
@@ -0,0 +1,478 @@
+/**
+ * @file tlsres.c TLS and DTLS Session Resumption
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+
+#ifdef USE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+#endif
+
+
+/*
+ * Every tls_listen and dtls_listen context keeps a server side session
+ * cache and issues session tickets, so a client which reconnects can
+ * skip the key exchange.
+ *
+ * Tickets are encrypted with AES-256-CBC and authenticated with
+ * HMAC-SHA256. The keys come from tls_ticket_keyfile, one key of 80
+ * bytes in hex per line (16 byte name, 32 byte HMAC key, 32 byte AES
+ * key), e.g. from "openssl rand -hex 80". The first key encrypts new
+ * tickets, all keys decrypt, so a cluster resumes each other's
+ * sessions when all nodes share the file. The file is read again when
+ * it changes: to rotate, prepend a new key and drop the oldest one
+ * after the session timeout.
+ *
+ * Without a key file a random key is made at startup and replaced
+ * every tls_ticket_rotate seconds; the previous keys are kept to
+ * decrypt tickets until they expire.
+ */
+
+
+enum {
+	KEYS_MAX          = 4,
+	KEY_NAME_SIZE     = 16,
+	KEY_SECRET_SIZE   = 32,
+	KEY_SIZE          = KEY_NAME_SIZE + 2 * KEY_SECRET_SIZE,
+	CACHE_SIZE        = 20480,
+	SESSION_TIMEOUT   = 3600,    /* [s] */
+	TICKET_ROTATE     = 3600,    /* [s] */
+	KEYFILE_CHECK     = 60,      /* [s] */
+};
+
+enum {
+	TLSRES_TLS_FULL = 0,
+	TLSRES_TLS_RESUMED,
+	TLSRES_DTLS_FULL,
+	TLSRES_DTLS_RESUMED,
+	TLSRES_TICKET_UNKNOWN,
+	TLSRES_CTR_MAX
+};
+
+struct ticket_key {
+	uint8_t name[KEY_NAME_SIZE];
+	uint8_t hmac[KEY_SECRET_SIZE];
+	uint8_t aes[KEY_SECRET_SIZE];
+};
+
+
+static struct {
+	struct tmr tmr;
+	struct restund_ctr ctr;
+	pthread_mutex_t mutex;  /* keyv, handshakes may run on workers */
+	struct ticket_key keyv[KEYS_MAX];
+	uint32_t keyc;
+	uint32_t cache_size;
+	uint32_t timeout;
+	uint32_t rotate;
+	time_t mtime;
+	bool tickets;
+	char keyfile[256];
+} tr = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.ctr = {
+		.name = "tlsres",
+		.n    = TLSRES_CTR_MAX,
+	},
+};
+
+
+static int keyfile_read(const char *path)
+{
+	struct ticket_key keyv[KEYS_MAX];
+	uint32_t keyc = 0;
+	char line[256];
+	int err = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return errno;
+
+	while (fgets(line, sizeof(line), f)) {
+
+		uint8_t raw[KEY_SIZE];
+		size_t len = strcspn(line, " \t\r\n");
+
+		if (!len || line[0] == '#')
+			continue;
+
+		if (keyc >= KEYS_MAX)
+			break;
+
+		line[len] = '\0';
+
+		if (len != 2 * KEY_SIZE || str_hex(raw, KEY_SIZE, line)) {
+			restund_warning("tlsres: %s: bad key on line %u\n",
+					path, keyc + 1);
+			err = EINVAL;
+			break;
+		}
+
+		memcpy(&keyv[keyc++], raw, sizeof(raw));
+	}
+
+	(void)fclose(f);
+
+	if (!err && !keyc)
+		err = ENOENT;
+
+	if (err)
+		return err;
+
+	pthread_mutex_lock(&tr.mutex);
+	memcpy(tr.keyv, keyv, keyc * sizeof(*keyv));
+	tr.keyc = keyc;
+	pthread_mutex_unlock(&tr.mutex);
+
+	restund_info("tlsres: %u ticket keys from %s\n", keyc, path);
+
+	return 0;
+}
+
+
+static void key_generate(void)
+{
+	struct ticket_key key;
+
+	rand_bytes((uint8_t *)&key, sizeof(key));
+
+	pthread_mutex_lock(&tr.mutex);
+	memmove(&tr.keyv[1], &tr.keyv[0],
+		(KEYS_MAX - 1) * sizeof(tr.keyv[0]));
+	tr.keyv[0] = key;
+	tr.keyc = MIN(tr.keyc + 1, KEYS_MAX);
+	pthread_mutex_unlock(&tr.mutex);
+}
+
+
+static void tmr_handler(void *arg)
+{
+	struct stat st;
+	(void)arg;
+
+	if (!tr.keyfile[0]) {
+		key_generate();
+		restund_debug("tlsres: new ticket key\n");
+		tmr_start(&tr.tmr, tr.rotate * 1000, tmr_handler, NULL);
+		return;
+	}
+
+	tmr_start(&tr.tmr, KEYFILE_CHECK * 1000, tmr_handler, NULL);
+
+	if (stat(tr.keyfile, &st) || st.st_mtime == tr.mtime)
+		return;
+
+	/* on error the current keys stay */
+	if (!keyfile_read(tr.keyfile))
+		tr.mtime = st.st_mtime;
+}
+
+
+#ifdef USE_OPENSSL
+
+
+/* copy the key with the given name, or the current one; returns index */
+static int key_get(struct ticket_key *key, const uint8_t *name)
+{
+	int i, found = -1;
+
+	pthread_mutex_lock(&tr.mutex);
+
+	for (i=0; i<(int)tr.keyc; i++) {
+
+		if (name && memcmp(tr.keyv[i].name, name, KEY_NAME_SIZE))
+			continue;
+
+		*key = tr.keyv[i];
+		found = i;
+		break;
+	}
+
+	pthread_mutex_unlock(&tr.mutex);
+
+	return found;
+}
+
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int hmac_init(EVP_MAC_CTX *hctx, const struct ticket_key *key)
+{
+	OSSL_PARAM params[3];
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+						      (void *)key->hmac,
+						      sizeof(key->hmac));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+						     "SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+
+	return EVP_MAC_CTX_set_params(hctx, params);
+}
+
+
+static int ticket_handler(SSL *ssl, unsigned char *name, unsigned char *iv,
+			  EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc)
+#else
+static int hmac_init(HMAC_CTX *hctx, const struct ticket_key *key)
+{
+	return HMAC_Init_ex(hctx, key->hmac, sizeof(key->hmac),
+			    EVP_sha256(), NULL);
+}
+
+
+static int ticket_handler(SSL *ssl, unsigned char *name, unsigned char *iv,
+			  EVP_CIPHER_CTX *ctx, HMAC_CTX *hctx, int enc)
+#endif
+{
+	struct ticket_key key;
+	int i, ret;
+	(void)ssl;
+
+	if (enc) {
+		if (key_get(&key, NULL) < 0 ||
+		    RAND_bytes(iv, EVP_MAX_IV_LENGTH) <= 0)
+			return -1;
+
+		memcpy(name, key.name, KEY_NAME_SIZE);
+
+		ret = EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL,
+					 key.aes, iv) &&
+			hmac_init(hctx, &key) ? 1 : -1;
+		goto out;
+	}
+
+	i = key_get(&key, name);
+	if (i < 0) {
+		restund_ctr_add(&tr.ctr, TLSRES_TICKET_UNKNOWN, 1);
+		return 0;
+	}
+
+	if (!hmac_init(hctx, &key) ||
+	    !EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key.aes, iv))
+		ret = -1;
+	else /* issue a new ticket under the current key */
+		ret = i ? 2 : 1;
+
+ out:
+	memset(&key, 0, sizeof(key));
+
+	return ret;
+}
+
+
+static void info_handler(const SSL *ssl, int where, int ret)
+{
+	const bool resumed = SSL_session_reused((SSL *)ssl);
+	(void)ret;
+
+	if (!(where & SSL_CB_HANDSHAKE_DONE))
+		return;
+
+	if (SSL_is_dtls(ssl))
+		restund_ctr_add(&tr.ctr, resumed ? TLSRES_DTLS_RESUMED :
+				TLSRES_DTLS_FULL, 1);
+	else
+		restund_ctr_add(&tr.ctr, resumed ? TLSRES_TLS_RESUMED :
+				TLSRES_TLS_FULL, 1);
+}
+
+
+#endif
+
+
+/**
+ * Enable session resumption on a listener context
+ *
+ * @param tls TLS or DTLS context
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int restund_tlsres_enable(struct tls *tls)
+{
+#ifdef USE_OPENSSL
+	static const unsigned char sid_ctx[] = "restund";
+	SSL_CTX *ctx;
+
+	if (!tls)
+		return EINVAL;
+
+	ctx = tls_openssl_context(tls);
+	if (!ctx)
+		return EINVAL;
+
+	SSL_CTX_set_info_callback(ctx, info_handler);
+	SSL_CTX_set_timeout(ctx, tr.timeout);
+
+	if (!SSL_CTX_set_session_id_context(ctx, sid_ctx,
+					    sizeof(sid_ctx) - 1))
+		return ENOMEM;
+
+	if (tr.cache_size) {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(ctx, tr.cache_size);
+	}
+	else {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	}
+
+	if (!tr.tickets) {
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+		return 0;
+	}
+
+	SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	if (!SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_handler))
+		return EINVAL;
+#else
+	if (!SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_handler))
+		return EINVAL;
+#endif
+
+	return 0;
+#else
+	(void)tls;
+
+	return 0;
+#endif
+}
+
+
+/**
+ * Print the handshake counters of one transport
+ *
+ * @param mb   Buffer to print to
+ * @param dtls True for DTLS, false for TLS
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int restund_tlsres_print(struct mbuf *mb, bool dtls)
+{
+	const char *pfx = dtls ? "dtls" : "tls";
+	uint64_t full, res;
+	int err;
+
+	full = restund_ctr_total(&tr.ctr, dtls ? TLSRES_DTLS_FULL :
+				 TLSRES_TLS_FULL);
+	res  = restund_ctr_total(&tr.ctr, dtls ? TLSRES_DTLS_RESUMED :
+				 TLSRES_TLS_RESUMED);
+
+	err  = mbuf_printf(mb, "%s_handshakes_full %llu\n", pfx, full);
+	err |= mbuf_printf(mb, "%s_handshakes_resumed %llu\n", pfx, res);
+	err |= mbuf_printf(mb, "%s_resumption_rate %llu%%\n", pfx,
+			   full + res ? res * 100 / (full + res) : 0);
+
+	if (!dtls)
+		err |= mbuf_printf(mb, "tls_tickets_unknown_key %llu\n",
+				   restund_ctr_total(&tr.ctr,
+						     TLSRES_TICKET_UNKNOWN));
+
+	return err;
+}
+
+
+static struct restund_metric metricv[] = {
+	{ .name = "restund_tls_handshakes",
+	  .labels = "transport=\"tls\",type=\"full\"",
+	  .help = "Completed TLS and DTLS handshakes",
+	  .ctr = &tr.ctr, .ctri = TLSRES_TLS_FULL },
+	{ .name = "restund_tls_handshakes",
+	  .labels = "transport=\"tls\",type=\"resumed\"",
+	  .help = "Completed TLS and DTLS handshakes",
+	  .ctr = &tr.ctr, .ctri = TLSRES_TLS_RESUMED },
+	{ .name = "restund_tls_handshakes",
+	  .labels = "transport=\"dtls\",type=\"full\"",
+	  .help = "Completed TLS and DTLS handshakes",
+	  .ctr = &tr.ctr, .ctri = TLSRES_DTLS_FULL },
+	{ .name = "restund_tls_handshakes",
+	  .labels = "transport=\"dtls\",type=\"resumed\"",
+	  .help = "Completed TLS and DTLS handshakes",
+	  .ctr = &tr.ctr, .ctri = TLSRES_DTLS_RESUMED },
+	{ .name = "restund_tls_tickets_unknown_key",
+	  .help = "Session tickets under a key no longer known",
+	  .ctr = &tr.ctr, .ctri = TLSRES_TICKET_UNKNOWN },
+};
+
+
+int restund_tlsres_init(void)
+{
+	struct stat st;
+	struct pl path;
+	int err;
+
+	tmr_init(&tr.tmr);
+
+	err = restund_ctr_register(&tr.ctr);
+	if (err)
+		return err;
+
+	tr.cache_size = CACHE_SIZE;
+	tr.timeout    = SESSION_TIMEOUT;
+	tr.rotate     = TICKET_ROTATE;
+	tr.tickets    = true;
+
+	(void)conf_get_u32(restund_conf(), "tls_session_cache",
+			   &tr.cache_size);
+	(void)conf_get_u32(restund_conf(), "tls_session_timeout",
+			   &tr.timeout);
+	(void)conf_get_u32(restund_conf(), "tls_ticket_rotate", &tr.rotate);
+	(void)conf_get_bool(restund_conf(), "tls_session_tickets",
+			    &tr.tickets);
+	tr.rotate = MAX(tr.rotate, 60);
+
+	restund_metric_register(metricv, RE_ARRAY_SIZE(metricv));
+
+	if (!conf_get(restund_conf(), "tls_ticket_keyfile", &path)) {
+
+		(void)pl_strcpy(&path, tr.keyfile, sizeof(tr.keyfile));
+
+		err = keyfile_read(tr.keyfile);
+		if (err) {
+			restund_error("tlsres: %s: %m\n", tr.keyfile, err);
+			restund_tlsres_close();
+			return err;
+		}
+
+		if (!stat(tr.keyfile, &st))
+			tr.mtime = st.st_mtime;
+
+		tmr_start(&tr.tmr, KEYFILE_CHECK * 1000, tmr_handler, NULL);
+	}
+	else {
+		key_generate();
+		tmr_start(&tr.tmr, tr.rotate * 1000, tmr_handler, NULL);
+	}
+
+	return 0;
+}
+
+
+void restund_tlsres_close(void)
+{
+	tmr_cancel(&tr.tmr);
+	restund_metric_unregister(metricv, RE_ARRAY_SIZE(metricv));
+	restund_ctr_unregister(&tr.ctr);
+	pthread_mutex_lock(&tr.mutex);
+	memset(tr.keyv, 0, sizeof(tr.keyv));
+	tr.keyc = 0;
+	pthread_mutex_unlock(&tr.mutex);
+}
@@ -0,0 +1,322 @@
+/**
+ * @file transp.c  Transport abstraction
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <stdarg.h>
+#include <time.h>
+#include <re.h>
+#include <restund.h>
+
+
+/*
+ * All packets the server sends, the relay sockets it opens and the
+ * clock it reads go through the current transport. The default one
+ * uses real sockets and the system clock; a simulator or a replay
+ * installs its own with restund_transp_set() before the modules are
+ * loaded.
+ */
+
+
+enum {
+	RELAY_PRESZ = 4,    /* room for a ChannelData header */
+	STUN_BUFSZ  = 256,
+};
+
+
+static int udp_listen_handler(void **sockp, struct sa *local,
+			      uint32_t bufsz, udp_recv_h *recvh, void *arg)
+{
+	struct udp_sock *us;
+	int err;
+
+	err = udp_listen(&us, local, recvh, arg);
+	if (err)
+		return err;
+
+	err = udp_local_get(us, local);
+	if (err) {
+		mem_deref(us);
+		return err;
+	}
+
+	udp_rxbuf_presz_set(us, RELAY_PRESZ);
+	if (bufsz > 0)
+		(void)udp_sockbuf_set(us, bufsz);
+
+	*sockp = us;
+
+	return 0;
+}
+
+
+static void udp_handler(void *sock, udp_recv_h *recvh, void *arg)
+{
+	udp_handler_set(sock, recvh, arg);
+}
+
+
+static int send_handler(int proto, void *sock, const struct sa *dst,
+			struct mbuf *mb)
+{
+	return stun_send(proto, sock, dst, mb);
+}
+
+
+static size_t txqsz_handler(int proto, void *sock)
+{
+	return proto == IPPROTO_TCP ? tcp_conn_txqsz(sock) : 0;
+}
+
+
+static time_t time_handler(void)
+{
+	return time(NULL);
+}
+
+
+static const struct restund_transp sockets = {
+	.name     = "sockets",
+	.listenh  = udp_listen_handler,
+	.handlerh = udp_handler,
+	.sendh    = send_handler,
+	.txqszh   = txqsz_handler,
+	.timeh    = time_handler,
+};
+
+static const struct restund_transp *transp = &sockets;
+
+
+/**
+ * Set the transport, NULL restores real sockets
+ *
+ * @param tp Transport
+ */
+void restund_transp_set(const struct restund_transp *tp)
+{
+	transp = tp ? tp : &sockets;
+}
+
+
+/**
+ * Open a UDP relay socket
+ *
+ * @param sockp Pointer to allocated socket
+ * @param local Local address, updated with the bound address
+ * @param bufsz Socket buffer size, or 0 for the default
+ * @param recvh Receive handler
+ * @param arg   Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int restund_udp_listen(void **sockp, struct sa *local, uint32_t bufsz,
+		       udp_recv_h *recvh, void *arg)
+{
+	if (!sockp || !local)
+		return EINVAL;
+
+	return transp->listenh(sockp, local, bufsz, recvh, arg);
+}
+
+
+void restund_udp_handler_set(void *sock, udp_recv_h *recvh, void *arg)
+{
+	if (!sock)
+		return;
+
+	transp->handlerh(sock, recvh, arg);
+}
+
+
+/* file descriptor of a real relay socket, or -1 */
+int restund_udp_fd(void *sock, int af)
+{
+	if (!sock || transp != &sockets)
+		return -1;
+
+	return udp_sock_fd(sock, af);
+}
+
+
+/**
+ * Send a packet on a client or relay socket
+ *
+ * @param proto Transport protocol of the socket
+ * @param sock  Socket
+ * @param dst   Destination address
+ * @param mb    Packet, from the current position
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int restund_send(int proto, void *sock, const struct sa *dst,
+		 struct mbuf *mb)
+{
+	if (!sock || !dst || !mb)
+		return EINVAL;
+
+	return transp->sendh(proto, sock, dst, mb);
+}
+
+
+/* bytes queued for sending on a stream connection */
+size_t restund_txqsz(int proto, void *sock)
+{
+	return sock ? transp->txqszh(proto, sock) : 0;
+}
+
+
+time_t restund_time(void)
+{
+	return transp->timeh();
+}
+
+
+static int vsend(int proto, void *sock, const struct sa *dst, size_t presz,
+		 uint16_t method, uint8_t cls, const uint8_t *tid,
+		 const struct stun_errcode *ec, const uint8_t *key,
+		 size_t keylen, bool fp, uint32_t attrc, va_list ap)
+{
+	struct mbuf *mb;
+	int err;
+
+	if (!sock || !dst)
+		return EINVAL;
+
+	mb = mbuf_alloc(STUN_BUFSZ);
+	if (!mb)
+		return ENOMEM;
+
+	mb->pos = presz;
+
+	err = stun_msg_vencode(mb, method, cls, tid, ec, key, keylen, fp,
+			       0x00, attrc, ap);
+	if (err)
+		goto out;
+
+	mb->pos = presz;
+
+	err = transp->sendh(proto, sock, dst, mb);
+
+ out:
+	mem_deref(mb);
+
+	return err;
+}
+
+
+/**
+ * Send a STUN success response, like stun_reply()
+ *
+ * @param proto  Transport protocol
+ * @param sock   Socket
+ * @param dst    Destination address
+ * @param presz  Number of bytes in preamble, if sending over TURN
+ * @param req    Matching STUN request
+ * @param key    Authentication key (optional)
+ * @param keylen Number of bytes in authentication key
+ * @param fp     Use STUN Fingerprint attribute
+ * @param attrc  Number of attributes to encode (variable arguments)
+ * @param ...    Variable list of attribute-tuples
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int restund_stun_reply(int proto, void *sock, const struct sa *dst,
+		       size_t presz, const struct stun_msg *req,
+		       const uint8_t *key, size_t keylen, bool fp,
+		       uint32_t attrc, ...)
+{
+	va_list ap;
+	int err;
+
+	if (!req)
+		return EINVAL;
+
+	va_start(ap, attrc);
+	err = vsend(proto, sock, dst, presz, stun_msg_method(req),
+		    STUN_CLASS_SUCCESS_RESP, stun_msg_tid(req), NULL,
+		    key, keylen, fp, attrc, ap);
+	va_end(ap);
+
+	return err;
+}
+
+
+/**
+ * Send a STUN error response, like stun_ereply()
+ *
+ * @param proto  Transport protocol
+ * @param sock   Socket
+ * @param dst    Destination address
+ * @param presz  Number of bytes in preamble, if sending over TURN
+ * @param req    Matching STUN request
+ * @param scode  Status code
+ * @param reason Reason string
+ * @param key    Authentication key (optional)
+ * @param keylen Number of bytes in authentication key
+ * @param fp     Use STUN Fingerprint attribute
+ * @param attrc  Number of attributes to encode (variable arguments)
+ * @param ...    Variable list of attribute-tuples
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int restund_stun_ereply(int proto, void *sock, const struct sa *dst,
+			size_t presz, const struct stun_msg *req,
+			uint16_t scode, const char *reason,
+			const uint8_t *key, size_t keylen, bool fp,
+			uint32_t attrc, ...)
+{
+	struct stun_errcode ec;
+	va_list ap;
+	int err;
+
+	if (!req || !scode || !reason)
+		return EINVAL;
+
+	ec.code   = scode;
+	ec.reason = (char *)reason;
+
+	va_start(ap, attrc);
+	err = vsend(proto, sock, dst, presz, stun_msg_method(req),
+		    STUN_CLASS_ERROR_RESP, stun_msg_tid(req), &ec,
+		    key, keylen, fp, attrc, ap);
+	va_end(ap);
+
+	return err;
+}
+
+
+/**
+ * Send a STUN indication, like stun_indication()
+ *
+ * @param proto  Transport protocol
+ * @param sock   Socket
+ * @param dst    Destination address
+ * @param presz  Number of bytes in preamble, if sending over TURN
+ * @param method STUN method
+ * @param key    Authentication key (optional)
+ * @param keylen Number of bytes in authentication key
+ * @param fp     Use STUN Fingerprint attribute
+ * @param attrc  Number of attributes to encode (variable arguments)
+ * @param ...    Variable list of attribute-tuples
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int restund_stun_indication(int proto, void *sock, const struct sa *dst,
+			    size_t presz, uint16_t method,
+			    const uint8_t *key, size_t keylen, bool fp,
+			    uint32_t attrc, ...)
+{
+	uint8_t tid[STUN_TID_SIZE];
+	va_list ap;
+	int err;
+
+	rand_bytes(tid, sizeof(tid));
+
+	va_start(ap, attrc);
+	err = vsend(proto, sock, dst, presz, method, STUN_CLASS_INDICATION,
+		    tid, NULL, key, keylen, fp, attrc, ap);
+	va_end(ap);
+
+	return err;
+}
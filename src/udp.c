@@ -13,6 +13,8 @@ struct udp_lstnr {
 	struct le le;
 	struct sa bnd_addr;
 	struct udp_sock *us;
+	restund_udp_fast_h *fasth;
+	void *fastarg;
 };
 
 
@@ -23,6 +25,9 @@ static void udp_recv(const struct sa *src, struct mbuf *mb, void *arg)
 {
 	struct udp_lstnr *ul = arg;
 
+	if (ul->fasth && ul->fasth(src, mb, ul->fastarg))
+		return;
+
 	restund_process_msg(IPPROTO_UDP, ul->us, src, &ul->bnd_addr, mb);
 }
 
@@ -125,3 +130,57 @@ struct udp_sock *restund_udp_socket(struct sa *sa, const struct sa *orig,
 
 	return NULL;
 }
+
+
+/**
+ * Apply a function handler to all UDP listeners
+ *
+ * @param ah  Apply handler, returns true to stop
+ * @param arg Handler argument
+ *
+ * @return Socket where the handler stopped, or NULL
+ */
+struct udp_sock *restund_udp_apply(restund_udp_apply_h *ah, void *arg)
+{
+	struct le *le;
+
+	if (!ah)
+		return NULL;
+
+	for (le = list_head(&lstnrl); le; le = le->next) {
+
+		struct udp_lstnr *ul = le->data;
+
+		if (ah(ul->us, &ul->bnd_addr, arg))
+			return ul->us;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Set a handler which sees every packet on a UDP listener before the
+ * STUN decoder, and returns true if it consumed the packet
+ *
+ * @param us    Listener socket
+ * @param fasth Fast path handler, NULL to remove it
+ * @param arg   Handler argument
+ */
+void restund_udp_fast_set(struct udp_sock *us, restund_udp_fast_h *fasth,
+			  void *arg)
+{
+	struct le *le;
+
+	for (le = list_head(&lstnrl); le; le = le->next) {
+
+		struct udp_lstnr *ul = le->data;
+
+		if (ul->us != us)
+			continue;
+
+		ul->fasth   = fasth;
+		ul->fastarg = arg;
+		break;
+	}
+}
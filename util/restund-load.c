@@ -0,0 +1,1168 @@
+/**
+ * @file restund-load.c TURN load generator
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <re.h>
+
+
+/*
+ * Every thread runs its own main loop with a share of the
+ * allocations. A thread first creates its allocations, at most
+ * `window' at a time, together with their permissions and channels.
+ * When all are set up it sends packets through every allocation at
+ * the given rate for the given duration.
+ *
+ * The peers are UDP sockets of the same thread, which echo all
+ * packets back to the relayed address. A packet carries its send
+ * time, so the round trip client - server - peer - server - client is
+ * measured without synchronised clocks.
+ *
+ * The server does not relay to loopback addresses, so the peers are
+ * bound to the default source address, or to the addresses given
+ * with -e.
+ */
+
+
+enum {
+	THREAD_MAX    = 64,
+	PEER_MAX      = 16,
+	PRESZ         = 64,        /* room for TURN framing */
+	PAYLOAD_MIN   = 16,
+	TICK          = 5,         /* send interval [ms] */
+	BURST_MAX     = 100,       /* packets per allocation and tick */
+	DRAIN_TIME    = 1000,      /* wait for echoes [ms] */
+	SETUP_TIMEOUT = 30000,     /* [ms] */
+	FRAME_MAX     = 65535,
+	ERR_PRINT_MAX = 5,         /* errors printed per thread */
+
+	HIST_SUB      = 16,
+	HIST_BITS     = 40,
+	HIST_SIZE     = HIST_SUB * (HIST_BITS - 3),
+};
+
+enum transp {
+	TRANSP_UDP = 0,
+	TRANSP_TCP,
+	TRANSP_TLS,
+	TRANSP_DTLS,
+};
+
+enum state {
+	ST_ALLOC = 0,
+	ST_SETUP,
+	ST_READY,
+	ST_FAILED,
+};
+
+/* log-linear, as in src/hist.c; values in microseconds */
+struct hist {
+	uint64_t bucketv[HIST_SIZE];
+	uint64_t count;
+	uint64_t max;
+};
+
+struct stats {
+	uint64_t allocs;
+	uint64_t alloc_fail;
+	uint64_t reqs;
+	uint64_t tx;
+	uint64_t tx_err;
+	uint64_t rx;
+	uint64_t peer_rx;
+	uint64_t setup_us;
+	uint64_t traffic_us;
+	struct hist alloc_lat;
+	struct hist req_lat;
+	struct hist rtt;
+};
+
+struct peer {
+	struct thread *th;
+	struct udp_sock *us;
+	struct sa addr;
+};
+
+struct thread {
+	pthread_t tid;
+	uint32_t allocc;
+	uint32_t started;
+	uint32_t done;           /* ready or failed */
+	uint32_t errc;
+	struct list clientl;
+	struct peer peerv[PEER_MAX];
+	struct tls *tls;
+	struct tmr tmr;
+	struct tmr tmr_setup;
+	uint64_t t_start;
+	uint64_t t_traffic;
+	uint64_t t_last;
+	bool traffic;
+	struct stats st;
+	int err;
+};
+
+struct client {
+	struct le le;
+	struct thread *th;
+	struct turnc *turnc;
+	struct udp_sock *us;
+	struct tcp_conn *tc;
+	struct tls_conn *sc;     /* TLS on tc, or DTLS */
+	struct dtls_sock *ds;
+	struct mbuf *rx;         /* TCP reassembly */
+	struct mbuf *tx;
+	struct sa relay;
+	enum state state;
+	uint64_t t_req;
+	uint64_t credit;         /* [packets * 1e6] */
+	uint32_t pending;        /* permission and channel requests */
+	uint32_t idx;
+	uint32_t seq;
+	uint32_t peer;
+};
+
+
+static struct {
+	struct sa srv;
+	enum transp transp;
+	const char *user;
+	const char *pass;
+	uint32_t allocc;
+	uint32_t threadc;
+	uint32_t window;
+	uint32_t peerc;
+	uint32_t chanpct;
+	uint32_t rate;           /* packets/s per allocation */
+	uint32_t size;
+	uint32_t duration;       /* [s] */
+	uint32_t lifetime;
+	struct sa peer_ipv[PEER_MAX];
+	uint32_t peer_ipc;
+} cfg = {
+	.transp   = TRANSP_UDP,
+	.user     = "demo",
+	.pass     = "secret",
+	.allocc   = 100,
+	.threadc  = 1,
+	.window   = 64,
+	.peerc    = 1,
+	.chanpct  = 100,
+	.rate     = 50,
+	.size     = 160,
+	.duration = 10,
+	.lifetime = 600,
+};
+
+
+static const char *transp_name[] = {"udp", "tcp", "tls", "dtls"};
+
+
+static void alloc_next(struct thread *th);
+
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+
+static unsigned msb(uint64_t v)
+{
+	return 63 - (unsigned)__builtin_clzll(v);
+}
+
+
+static uint32_t bucket_index(uint64_t val)
+{
+	unsigned e;
+
+	if (val < HIST_SUB)
+		return (uint32_t)val;
+
+	e = msb(val);
+	if (e >= HIST_BITS)
+		return HIST_SIZE - 1;
+
+	return HIST_SUB * (e - 3) + (uint32_t)((val >> (e - 4)) - HIST_SUB);
+}
+
+
+static uint64_t bucket_value(uint32_t idx)
+{
+	uint32_t e, sub;
+
+	if (idx < HIST_SUB)
+		return idx;
+
+	e   = idx / HIST_SUB + 3;
+	sub = idx % HIST_SUB;
+
+	return (((uint64_t)HIST_SUB + sub + 1) << (e - 4)) - 1;
+}
+
+
+static void hist_add(struct hist *h, uint64_t val)
+{
+	++h->bucketv[bucket_index(val)];
+	++h->count;
+	h->max = MAX(h->max, val);
+}
+
+
+static void hist_merge(struct hist *dst, const struct hist *src)
+{
+	uint32_t i;
+
+	for (i=0; i<HIST_SIZE; i++)
+		dst->bucketv[i] += src->bucketv[i];
+
+	dst->count += src->count;
+	dst->max = MAX(dst->max, src->max);
+}
+
+
+static uint64_t hist_pct(const struct hist *h, double pct)
+{
+	const uint64_t rank = (uint64_t)(pct / 100.0 * (double)h->count);
+	uint64_t n = 0;
+	uint32_t i;
+
+	for (i=0; i<HIST_SIZE; i++) {
+
+		n += h->bucketv[i];
+		if (n > rank)
+			return MIN(bucket_value(i), h->max);
+	}
+
+	return h->max;
+}
+
+
+static void hist_print(const char *name, const struct hist *h)
+{
+	if (!h->count) {
+		(void)printf("%-16s -\n", name);
+		return;
+	}
+
+	(void)printf("%-16s p50 %llu  p90 %llu  p99 %llu  p99.9 %llu"
+		     "  max %llu us\n", name,
+		     (unsigned long long)hist_pct(h, 50.0),
+		     (unsigned long long)hist_pct(h, 90.0),
+		     (unsigned long long)hist_pct(h, 99.0),
+		     (unsigned long long)hist_pct(h, 99.9),
+		     (unsigned long long)h->max);
+}
+
+
+static void check_done(struct thread *th);
+
+
+static void client_fail(struct client *cl, int err, uint16_t scode)
+{
+	struct thread *th = cl->th;
+	const enum state state = cl->state;
+
+	if (state == ST_FAILED)
+		return;
+
+	cl->state = ST_FAILED;
+
+	if (th->errc++ < ERR_PRINT_MAX) {
+		if (scode)
+			(void)re_fprintf(stderr, "allocation %u: error %u\n",
+					 cl->idx, scode);
+		else
+			(void)re_fprintf(stderr, "allocation %u: %m\n",
+					 cl->idx, err);
+	}
+
+	if (state == ST_READY)
+		return;
+
+	++th->st.alloc_fail;
+	++th->done;
+
+	check_done(th);
+}
+
+
+static void client_ready(struct client *cl)
+{
+	struct thread *th = cl->th;
+
+	cl->state = ST_READY;
+	++th->done;
+
+	check_done(th);
+}
+
+
+static void req_done(struct client *cl)
+{
+	struct thread *th = cl->th;
+
+	if (cl->state != ST_SETUP)
+		return;
+
+	hist_add(&th->st.req_lat, now_us() - cl->t_req);
+	++th->st.reqs;
+
+	if (--cl->pending == 0)
+		client_ready(cl);
+}
+
+
+static void perm_handler(void *arg)
+{
+	req_done(arg);
+}
+
+
+static void chan_handler(void *arg)
+{
+	req_done(arg);
+}
+
+
+static void turnc_handler(int err, uint16_t scode, const char *reason,
+			  const struct sa *relay_addr,
+			  const struct sa *mapped_addr,
+			  const struct stun_msg *msg, void *arg)
+{
+	struct client *cl = arg;
+	struct thread *th = cl->th;
+	const uint64_t now = now_us();
+	uint32_t i, chanc;
+	(void)reason;
+	(void)mapped_addr;
+	(void)msg;
+
+	if (err || scode) {
+		client_fail(cl, err, scode);
+		return;
+	}
+
+	/* refresh */
+	if (cl->state != ST_ALLOC)
+		return;
+
+	hist_add(&th->st.alloc_lat, now - cl->t_req);
+	hist_add(&th->st.req_lat, now - cl->t_req);
+	++th->st.allocs;
+	++th->st.reqs;
+
+	cl->relay = *relay_addr;
+	cl->state = ST_SETUP;
+	cl->t_req = now;
+
+	/* permissions are per IP address, channels per transport address */
+	for (i=0; i<cfg.peer_ipc; i++) {
+
+		err = turnc_add_perm(cl->turnc, &cfg.peer_ipv[i],
+				     perm_handler, cl);
+		if (err)
+			goto error;
+
+		++cl->pending;
+	}
+
+	chanc = (cfg.peerc * cfg.chanpct + 50) / 100;
+
+	for (i=0; i<chanc; i++) {
+
+		err = turnc_add_chan(cl->turnc, &th->peerv[i].addr,
+				     chan_handler, cl);
+		if (err)
+			goto error;
+
+		++cl->pending;
+	}
+
+	if (!cl->pending)
+		client_ready(cl);
+
+	return;
+
+ error:
+	client_fail(cl, err, 0);
+}
+
+
+static int turnc_start(struct client *cl, int proto, void *sock)
+{
+	return turnc_alloc(&cl->turnc, NULL, proto, sock, 0, &cfg.srv,
+			   cfg.user, cfg.pass, cfg.lifetime,
+			   turnc_handler, cl);
+}
+
+
+static void payload_recv(struct client *cl, struct mbuf *mb)
+{
+	struct thread *th = cl->th;
+	uint64_t ts;
+
+	if (mbuf_get_left(mb) < PAYLOAD_MIN)
+		return;
+
+	mb->pos += 8;
+	(void)mbuf_read_mem(mb, (uint8_t *)&ts, sizeof(ts));
+
+	hist_add(&th->st.rtt, now_us() - ts);
+	++th->st.rx;
+}
+
+
+static void stream_recv(struct client *cl, struct mbuf *mb)
+{
+	struct sa src;
+
+	if (!cl->turnc)
+		return;
+
+	if (turnc_recv(cl->turnc, &src, mb))
+		return;
+
+	if (mbuf_get_left(mb))
+		payload_recv(cl, mb);
+}
+
+
+static void udp_recv_handler(const struct sa *src, struct mbuf *mb,
+			     void *arg)
+{
+	(void)src;
+
+	/* TURN framing was removed by the turnc helper */
+	payload_recv(arg, mb);
+}
+
+
+static void tcp_estab_handler(void *arg)
+{
+	struct client *cl = arg;
+	int err;
+
+	err = turnc_start(cl, IPPROTO_TCP, cl->tc);
+	if (err)
+		client_fail(cl, err, 0);
+}
+
+
+/* split the byte stream into STUN messages and ChannelData */
+static void tcp_recv_handler(struct mbuf *mb, void *arg)
+{
+	struct client *cl = arg;
+	struct mbuf *rx = cl->rx;
+	size_t pos;
+	int err;
+
+	pos = rx->pos;
+	rx->pos = rx->end;
+	err = mbuf_write_mem(rx, mbuf_buf(mb), mbuf_get_left(mb));
+	rx->pos = pos;
+
+	if (err)
+		goto error;
+
+	for (;;) {
+
+		size_t len, end;
+		uint16_t typ;
+
+		if (mbuf_get_left(rx) < 4)
+			break;
+
+		typ = ntohs(mbuf_read_u16(rx));
+		len = ntohs(mbuf_read_u16(rx));
+		rx->pos -= 4;
+
+		if (typ < 0x4000)
+			len += STUN_HEADER_SIZE;
+		else if (typ < 0x8000)
+			len += 4;
+		else {
+			err = EBADMSG;
+			goto error;
+		}
+
+		if (mbuf_get_left(rx) < len)
+			break;
+
+		pos = rx->pos;
+		end = rx->end;
+
+		rx->end = pos + len;
+		stream_recv(cl, rx);
+
+		/* ChannelData is padded to 4 bytes over TCP */
+		if (typ >= 0x4000)
+			len = (len + 3) & ~(size_t)3;
+
+		rx->pos = MIN(pos + len, end);
+		rx->end = end;
+	}
+
+	if (!mbuf_get_left(rx)) {
+		mbuf_rewind(rx);
+	}
+	else if (rx->pos) {
+		memmove(rx->buf, mbuf_buf(rx), mbuf_get_left(rx));
+		rx->end -= rx->pos;
+		rx->pos  = 0;
+	}
+
+	if (rx->end > FRAME_MAX + 4) {
+		err = EOVERFLOW;
+		goto error;
+	}
+
+	return;
+
+ error:
+	client_fail(cl, err, 0);
+}
+
+
+static void tcp_close_handler(int err, void *arg)
+{
+	client_fail(arg, err ? err : ECONNRESET, 0);
+}
+
+
+#ifdef USE_DTLS
+static void dtls_estab_handler(void *arg)
+{
+	struct client *cl = arg;
+	int err;
+
+	err = turnc_start(cl, STUN_TRANSP_DTLS, cl->sc);
+	if (err)
+		client_fail(cl, err, 0);
+}
+
+
+static void dtls_recv_handler(struct mbuf *mb, void *arg)
+{
+	stream_recv(arg, mb);
+}
+
+
+static void dtls_close_handler(int err, void *arg)
+{
+	client_fail(arg, err ? err : ECONNRESET, 0);
+}
+#endif
+
+
+static void client_destructor(void *arg)
+{
+	struct client *cl = arg;
+
+	list_unlink(&cl->le);
+
+	/* deallocates on the server */
+	mem_deref(cl->turnc);
+
+	mem_deref(cl->sc);
+	mem_deref(cl->tc);
+	mem_deref(cl->ds);
+	mem_deref(cl->us);
+	mem_deref(cl->rx);
+	mem_deref(cl->tx);
+}
+
+
+static int client_alloc(struct thread *th, uint32_t idx)
+{
+	struct client *cl;
+	struct sa laddr;
+	int err = 0;
+
+	cl = mem_zalloc(sizeof(*cl), client_destructor);
+	if (!cl)
+		return ENOMEM;
+
+	list_append(&th->clientl, &cl->le, cl);
+
+	cl->th    = th;
+	cl->idx   = idx;
+	cl->state = ST_ALLOC;
+	cl->t_req = now_us();
+
+	cl->tx = mbuf_alloc(PRESZ + cfg.size);
+	if (!cl->tx) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	sa_init(&laddr, sa_af(&cfg.srv));
+
+	switch (cfg.transp) {
+
+	case TRANSP_UDP:
+		err = udp_listen(&cl->us, &laddr, udp_recv_handler, cl);
+		if (!err)
+			err = turnc_start(cl, IPPROTO_UDP, cl->us);
+		break;
+
+	case TRANSP_TCP:
+	case TRANSP_TLS:
+		cl->rx = mbuf_alloc(1024);
+		if (!cl->rx) {
+			err = ENOMEM;
+			break;
+		}
+
+		err = tcp_connect(&cl->tc, &cfg.srv, tcp_estab_handler,
+				  tcp_recv_handler, tcp_close_handler, cl);
+#ifdef USE_TLS
+		if (!err && cfg.transp == TRANSP_TLS)
+			err = tls_start_tcp(&cl->sc, th->tls, cl->tc, 0);
+#endif
+		break;
+
+	case TRANSP_DTLS:
+#ifdef USE_DTLS
+		err = dtls_listen(&cl->ds, &laddr, NULL, 2, 0, NULL, NULL);
+		if (!err)
+			err = dtls_connect(&cl->sc, th->tls, cl->ds, &cfg.srv,
+					   dtls_estab_handler,
+					   dtls_recv_handler,
+					   dtls_close_handler, cl);
+#else
+		err = ENOSYS;
+#endif
+		break;
+	}
+
+ out:
+	if (err)
+		mem_deref(cl);
+
+	return err;
+}
+
+
+static void client_send(struct client *cl)
+{
+	struct thread *th = cl->th;
+	struct mbuf *mb = cl->tx;
+	const uint64_t ts = now_us();
+	const struct sa *peer;
+	int err;
+
+	mb->pos = PRESZ;
+	mb->end = PRESZ;
+
+	err  = mbuf_write_u32(mb, cl->idx);
+	err |= mbuf_write_u32(mb, cl->seq++);
+	err |= mbuf_write_mem(mb, (const uint8_t *)&ts, sizeof(ts));
+	err |= mbuf_fill(mb, 0, cfg.size - PAYLOAD_MIN);
+	if (err)
+		goto out;
+
+	mb->pos = PRESZ;
+
+	peer = &th->peerv[cl->peer++ % cfg.peerc].addr;
+
+	if (cl->us)
+		err = udp_send(cl->us, peer, mb);
+	else
+		err = turnc_send(cl->turnc, peer, mb);
+
+ out:
+	if (err)
+		++th->st.tx_err;
+	else
+		++th->st.tx;
+}
+
+
+static void drain_handler(void *arg)
+{
+	(void)arg;
+
+	re_cancel();
+}
+
+
+static void tick_handler(void *arg)
+{
+	struct thread *th = arg;
+	const uint64_t now = now_us();
+	const uint64_t dt = now - th->t_last;
+	struct le *le;
+
+	if (now - th->t_traffic >= cfg.duration * 1000000ULL) {
+		th->st.traffic_us = now - th->t_traffic;
+		tmr_start(&th->tmr, DRAIN_TIME, drain_handler, th);
+		return;
+	}
+
+	th->t_last = now;
+
+	for (le = th->clientl.head; le; le = le->next) {
+
+		struct client *cl = le->data;
+
+		if (cl->state != ST_READY)
+			continue;
+
+		cl->credit += cfg.rate * dt;
+		cl->credit  = MIN(cl->credit, BURST_MAX * 1000000ULL);
+
+		while (cl->credit >= 1000000) {
+			cl->credit -= 1000000;
+			client_send(cl);
+		}
+	}
+
+	tmr_start(&th->tmr, TICK, tick_handler, th);
+}
+
+
+static void traffic_start(struct thread *th)
+{
+	if (th->traffic)
+		return;
+
+	tmr_cancel(&th->tmr_setup);
+
+	th->traffic     = true;
+	th->t_traffic   = now_us();
+	th->t_last      = th->t_traffic;
+	th->st.setup_us = th->t_traffic - th->t_start;
+
+	if (!cfg.rate || !cfg.duration) {
+		tmr_start(&th->tmr, 0, drain_handler, th);
+		return;
+	}
+
+	tmr_start(&th->tmr, TICK, tick_handler, th);
+}
+
+
+static void setup_timeout(void *arg)
+{
+	struct thread *th = arg;
+
+	(void)re_fprintf(stderr, "setup timeout, %u of %u allocations"
+			 " done\n", th->done, th->allocc);
+
+	traffic_start(th);
+}
+
+
+static void check_done(struct thread *th)
+{
+	if (th->traffic)
+		return;
+
+	alloc_next(th);
+}
+
+
+static void alloc_next(struct thread *th)
+{
+	while (th->started < th->allocc &&
+	       th->started - th->done < cfg.window) {
+
+		const uint32_t idx = th->started++;
+		int err;
+
+		err = client_alloc(th, idx);
+		if (err) {
+			if (th->errc++ < ERR_PRINT_MAX)
+				(void)re_fprintf(stderr, "allocation %u: %m\n",
+						 idx, err);
+			++th->st.alloc_fail;
+			++th->done;
+		}
+	}
+
+	if (th->done >= th->allocc)
+		traffic_start(th);
+}
+
+
+static void peer_recv_handler(const struct sa *src, struct mbuf *mb,
+			      void *arg)
+{
+	struct peer *peer = arg;
+
+	++peer->th->st.peer_rx;
+
+	/* echo to the relayed address */
+	(void)udp_send(peer->us, src, mb);
+}
+
+
+static int thread_setup(struct thread *th)
+{
+	uint32_t i;
+	int err = 0;
+
+	for (i=0; i<cfg.peerc; i++) {
+
+		struct peer *peer = &th->peerv[i];
+
+		peer->th   = th;
+		peer->addr = cfg.peer_ipv[i % cfg.peer_ipc];
+
+		err = udp_listen(&peer->us, &peer->addr, peer_recv_handler,
+				 peer);
+		if (err) {
+			(void)re_fprintf(stderr, "peer %j: %m\n",
+					 &peer->addr, err);
+			return err;
+		}
+
+		err = udp_local_get(peer->us, &peer->addr);
+		if (err)
+			return err;
+	}
+
+	switch (cfg.transp) {
+
+#ifdef USE_TLS
+	case TRANSP_TLS:
+		err = tls_alloc(&th->tls, TLS_METHOD_SSLV23, NULL, NULL);
+		break;
+#endif
+
+#ifdef USE_DTLS
+	case TRANSP_DTLS:
+		err = tls_alloc(&th->tls, TLS_METHOD_DTLSV1, NULL, NULL);
+		break;
+#endif
+
+	default:
+		break;
+	}
+
+	return err;
+}
+
+
+static void thread_close(struct thread *th)
+{
+	uint32_t i;
+
+	tmr_cancel(&th->tmr);
+	tmr_cancel(&th->tmr_setup);
+	list_flush(&th->clientl);
+
+	for (i=0; i<PEER_MAX; i++)
+		th->peerv[i].us = mem_deref(th->peerv[i].us);
+
+	th->tls = mem_deref(th->tls);
+}
+
+
+static void *thread_main(void *arg)
+{
+	struct thread *th = arg;
+
+	th->err = re_thread_init();
+	if (th->err)
+		return NULL;
+
+	th->err = thread_setup(th);
+	if (th->err)
+		goto out;
+
+	th->t_start = now_us();
+
+	tmr_start(&th->tmr_setup, SETUP_TIMEOUT, setup_timeout, th);
+	alloc_next(th);
+
+	th->err = re_main(NULL);
+
+ out:
+	thread_close(th);
+	re_thread_close();
+
+	return NULL;
+}
+
+
+static void report(const struct thread *thv)
+{
+	struct stats *st;
+	uint64_t setup_us = 0, traffic_us = 0;
+	double loss = 0.0, setup, traffic;
+	uint32_t i;
+
+	st = mem_zalloc(sizeof(*st), NULL);
+	if (!st)
+		return;
+
+	for (i=0; i<cfg.threadc; i++) {
+
+		const struct stats *ts = &thv[i].st;
+
+		st->allocs     += ts->allocs;
+		st->alloc_fail += ts->alloc_fail;
+		st->reqs       += ts->reqs;
+		st->tx         += ts->tx;
+		st->tx_err     += ts->tx_err;
+		st->rx         += ts->rx;
+		st->peer_rx    += ts->peer_rx;
+
+		hist_merge(&st->alloc_lat, &ts->alloc_lat);
+		hist_merge(&st->req_lat, &ts->req_lat);
+		hist_merge(&st->rtt, &ts->rtt);
+
+		setup_us   = MAX(setup_us, ts->setup_us);
+		traffic_us = MAX(traffic_us, ts->traffic_us);
+	}
+
+	setup   = setup_us ? (double)setup_us / 1e6 : 1.0;
+	traffic = traffic_us ? (double)traffic_us / 1e6 : 1.0;
+
+	if (st->tx)
+		loss = 100.0 * (double)(st->tx - MIN(st->rx, st->tx))
+			/ (double)st->tx;
+
+	(void)re_printf("%s %J, %u threads, %u peers (%u%% channels),"
+			" %u bytes\n",
+			transp_name[cfg.transp], &cfg.srv, cfg.threadc,
+			cfg.peerc, cfg.chanpct, cfg.size);
+
+	(void)printf("allocations      %llu ok, %llu failed in %.3f s,"
+		     " %.1f/s\n",
+		     (unsigned long long)st->allocs,
+		     (unsigned long long)st->alloc_fail,
+		     (double)setup_us / 1e6, (double)st->allocs / setup);
+	(void)printf("requests         %llu, %.1f/s\n",
+		     (unsigned long long)st->reqs, (double)st->reqs / setup);
+	hist_print("alloc latency", &st->alloc_lat);
+	hist_print("request latency", &st->req_lat);
+
+	(void)printf("relay            tx %llu (%llu errors), peer %llu,"
+		     " rx %llu, loss %.3f%%\n",
+		     (unsigned long long)st->tx,
+		     (unsigned long long)st->tx_err,
+		     (unsigned long long)st->peer_rx,
+		     (unsigned long long)st->rx, loss);
+	(void)printf("                 %.1f pps, %.2f Mbit/s each way\n",
+		     (double)st->tx / traffic,
+		     (double)st->tx * cfg.size * 8 / traffic / 1e6);
+	hist_print("round trip", &st->rtt);
+
+	mem_deref(st);
+}
+
+
+static void usage(void)
+{
+	(void)fprintf(stderr,
+		      "usage: restund-load [-h] [options] <server>[:port]\n"
+		      "\t-t <transport>  udp, tcp, tls or dtls (udp)\n"
+		      "\t-u <username>   Username (demo)\n"
+		      "\t-p <password>   Password (secret)\n"
+		      "\t-n <count>      Allocations (100)\n"
+		      "\t-j <threads>    Threads (1)\n"
+		      "\t-w <count>      Allocations in progress per thread"
+		      " (64)\n"
+		      "\t-P <count>      Peers per allocation (1)\n"
+		      "\t-C <percent>    Peers reached through channels"
+		      " (100)\n"
+		      "\t-e <address>    Peer IP address, repeatable"
+		      " (default source)\n"
+		      "\t-r <pps>        Packets per second per allocation"
+		      " (50)\n"
+		      "\t-s <bytes>      Packet size (160)\n"
+		      "\t-d <secs>       Traffic duration (10)\n"
+		      "\t-l <secs>       Allocation lifetime (600)\n");
+}
+
+
+static int transp_decode(const char *name)
+{
+	int i;
+
+	for (i=0; i<(int)RE_ARRAY_SIZE(transp_name); i++) {
+		if (!str_casecmp(name, transp_name[i]))
+			return i;
+	}
+
+	return -1;
+}
+
+
+int main(int argc, char *argv[])
+{
+	static const char *opts = "ht:u:p:n:j:w:P:C:e:r:s:d:l:";
+	static const uint16_t portv[] = {3478, 3478, 5349, 5349};
+	struct thread *thv = NULL;
+	uint32_t i;
+	int t, err;
+
+	for (;;) {
+
+		const int c = getopt(argc, argv, opts);
+		if (0 > c)
+			break;
+
+		switch (c) {
+
+		case 't':
+			t = transp_decode(optarg);
+			if (t < 0) {
+				usage();
+				return -2;
+			}
+			cfg.transp = (enum transp)t;
+			break;
+
+		case 'u':
+			cfg.user = optarg;
+			break;
+
+		case 'p':
+			cfg.pass = optarg;
+			break;
+
+		case 'n':
+			cfg.allocc = (uint32_t)atoi(optarg);
+			break;
+
+		case 'j':
+			cfg.threadc = (uint32_t)atoi(optarg);
+			break;
+
+		case 'w':
+			cfg.window = (uint32_t)atoi(optarg);
+			break;
+
+		case 'P':
+			cfg.peerc = (uint32_t)atoi(optarg);
+			break;
+
+		case 'C':
+			cfg.chanpct = (uint32_t)atoi(optarg);
+			break;
+
+		case 'e':
+			if (cfg.peer_ipc >= PEER_MAX ||
+			    sa_set_str(&cfg.peer_ipv[cfg.peer_ipc], optarg,
+				       0)) {
+				usage();
+				return -2;
+			}
+			++cfg.peer_ipc;
+			break;
+
+		case 'r':
+			cfg.rate = (uint32_t)atoi(optarg);
+			break;
+
+		case 's':
+			cfg.size = (uint32_t)atoi(optarg);
+			break;
+
+		case 'd':
+			cfg.duration = (uint32_t)atoi(optarg);
+			break;
+
+		case 'l':
+			cfg.lifetime = (uint32_t)atoi(optarg);
+			break;
+
+		case '?':
+		case 'h':
+		default:
+			usage();
+			return -2;
+		}
+	}
+
+	if (optind >= argc || !cfg.threadc || cfg.threadc > THREAD_MAX ||
+	    !cfg.window || !cfg.peerc || cfg.peerc > PEER_MAX ||
+	    cfg.chanpct > 100 || cfg.size < PAYLOAD_MIN ||
+	    cfg.size > FRAME_MAX - PRESZ) {
+		usage();
+		return -2;
+	}
+
+	if (sa_decode(&cfg.srv, argv[optind], strlen(argv[optind])) &&
+	    sa_set_str(&cfg.srv, argv[optind], portv[cfg.transp])) {
+		(void)fprintf(stderr, "restund-load: bad server address:"
+			      " %s\n", argv[optind]);
+		return EINVAL;
+	}
+
+	err = libre_init();
+	if (err) {
+		(void)re_fprintf(stderr, "restund-load: libre_init: %m\n",
+				 err);
+		return err;
+	}
+
+	if (!cfg.peer_ipc) {
+		err = net_default_source_addr_get(sa_af(&cfg.srv),
+						  &cfg.peer_ipv[0]);
+		if (err) {
+			(void)re_fprintf(stderr, "restund-load: no default"
+					 " source address, use -e: %m\n",
+					 err);
+			goto out;
+		}
+
+		cfg.peer_ipc = 1;
+	}
+
+	thv = mem_zalloc(cfg.threadc * sizeof(*thv), NULL);
+	if (!thv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i=0; i<cfg.threadc; i++) {
+
+		thv[i].allocc = cfg.allocc / cfg.threadc
+			+ (i < cfg.allocc % cfg.threadc);
+
+		err = pthread_create(&thv[i].tid, NULL, thread_main, &thv[i]);
+		if (err) {
+			(void)re_fprintf(stderr, "restund-load: thread: %m\n",
+					 err);
+			cfg.threadc = i;
+			break;
+		}
+	}
+
+	for (i=0; i<cfg.threadc; i++) {
+
+		(void)pthread_join(thv[i].tid, NULL);
+
+		if (thv[i].err && !err) {
+			err = thv[i].err;
+			(void)re_fprintf(stderr, "restund-load: thread %u:"
+					 " %m\n", i, err);
+		}
+	}
+
+	if (!err)
+		report(thv);
+
+ out:
+	mem_deref(thv);
+	libre_close();
+
+	return err;
+}
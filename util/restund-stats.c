@@ -0,0 +1,212 @@
+/**
+ * @file restund-stats.c Read the shared memory statistics segment
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include "statshm.h"
+
+
+enum {
+	RETRY_MAX = 1000,
+};
+
+
+static struct statshm_ent snapv[STATSHM_ENT_MAX];
+
+
+static void usage(void)
+{
+	(void)fprintf(stderr,
+		      "usage: restund-stats [-h] [-f file] [-w secs]"
+		      " [prefix]\n"
+		      "\t-f <file>  Statistics file (see stats_shm)\n"
+		      "\t-w <secs>  Print every secs seconds\n");
+}
+
+
+/* copy a consistent snapshot of the entries, returns the count */
+static int snapshot(const struct statshm_hdr *hdr,
+		    const struct statshm_ent *entv, uint64_t *updated)
+{
+	uint64_t seq1, seq2;
+	uint32_t i, n;
+	int retry;
+
+	for (retry=0; retry<RETRY_MAX; retry++) {
+
+		seq1 = atomic_load_explicit(&hdr->seq, memory_order_acquire);
+		if (seq1 & 1) {
+			(void)usleep(100);
+			continue;
+		}
+
+		n = atomic_load_explicit(&hdr->entc, memory_order_relaxed);
+		if (n > STATSHM_ENT_MAX || n > hdr->entmax)
+			return -1;
+
+		*updated = atomic_load_explicit(&hdr->updated,
+						memory_order_relaxed);
+
+		for (i=0; i<n; i++) {
+			memcpy(snapv[i].name, entv[i].name,
+			       sizeof(snapv[i].name));
+			snapv[i].type = entv[i].type;
+			atomic_store_explicit(&snapv[i].value,
+				atomic_load_explicit(&entv[i].value,
+						     memory_order_relaxed),
+				memory_order_relaxed);
+		}
+
+		atomic_thread_fence(memory_order_acquire);
+		seq2 = atomic_load_explicit(&hdr->seq, memory_order_relaxed);
+
+		if (seq1 == seq2)
+			return (int)n;
+	}
+
+	return -1;
+}
+
+
+static int print_stats(const struct statshm_hdr *hdr,
+		       const struct statshm_ent *entv, const char *prefix)
+{
+	const size_t plen = prefix ? strlen(prefix) : 0;
+	uint64_t updated = 0;
+	int i, n;
+
+	n = snapshot(hdr, entv, &updated);
+	if (n < 0) {
+		(void)fprintf(stderr, "restund-stats: no consistent"
+			      " snapshot\n");
+		return EAGAIN;
+	}
+
+	(void)printf("# pid %llu started %llu updated %llu.%03llu\n",
+		     (unsigned long long)hdr->pid,
+		     (unsigned long long)hdr->started,
+		     (unsigned long long)(updated / 1000),
+		     (unsigned long long)(updated % 1000));
+
+	for (i=0; i<n; i++) {
+
+		const struct statshm_ent *ent = &snapv[i];
+
+		if (plen && strncmp(ent->name, prefix, plen))
+			continue;
+
+		(void)printf("%.*s %llu\n", (int)sizeof(ent->name),
+			     ent->name,
+			     (unsigned long long)atomic_load_explicit(
+				     &ent->value, memory_order_relaxed));
+	}
+
+	(void)fflush(stdout);
+
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *file = "/var/run/restund.stats";
+	const struct statshm_hdr *hdr;
+	const char *prefix = NULL;
+	unsigned wait = 0;
+	struct stat st;
+	void *p;
+	int fd, err;
+
+	for (;;) {
+
+		const int c = getopt(argc, argv, "hf:w:");
+		if (0 > c)
+			break;
+
+		switch (c) {
+
+		case 'f':
+			file = optarg;
+			break;
+
+		case 'w':
+			wait = (unsigned)atoi(optarg);
+			break;
+
+		case '?':
+		case 'h':
+		default:
+			usage();
+			return -2;
+		}
+	}
+
+	if (optind < argc)
+		prefix = argv[optind];
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		err = errno;
+		(void)fprintf(stderr, "restund-stats: %s: %s\n", file,
+			      strerror(err));
+		return err;
+	}
+
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		(void)fprintf(stderr, "restund-stats: %s: too short\n", file);
+		(void)close(fd);
+		return EINVAL;
+	}
+
+	p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	(void)close(fd);
+	if (p == MAP_FAILED) {
+		err = errno;
+		(void)fprintf(stderr, "restund-stats: mmap: %s\n",
+			      strerror(err));
+		return err;
+	}
+
+	hdr = p;
+
+	if (hdr->magic != STATSHM_MAGIC || hdr->version != STATSHM_VERSION ||
+	    hdr->hdrsize != sizeof(*hdr) ||
+	    hdr->entsize != sizeof(struct statshm_ent) ||
+	    (size_t)st.st_size < hdr->hdrsize +
+	    (size_t)hdr->entmax * hdr->entsize) {
+		(void)fprintf(stderr, "restund-stats: %s: unsupported"
+			      " format\n", file);
+		err = EPROTO;
+		goto out;
+	}
+
+	do {
+		err = print_stats(hdr, (const struct statshm_ent *)(hdr + 1),
+				  prefix);
+		if (err)
+			break;
+
+		if (wait)
+			(void)sleep(wait);
+
+	} while (wait);
+
+ out:
+	(void)munmap(p, (size_t)st.st_size);
+
+	return err;
+}